@@ -0,0 +1,34 @@
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+#include <stdlib.h>
+
+/*
+ * Where a container gets its memory from. Every call passes ctx back,
+ * and realloc and free get the size the block was asked with, so an
+ * allocator needs no header per block. Blocks must be aligned to 8 at
+ * least. alloc and realloc return NULL when out of memory.
+ */
+typedef struct allocator_s {
+        void *(*alloc)(void *ctx, size_t size);
+        void *(*realloc)(void *ctx, void *p, size_t old_size, size_t new_size);
+        void (*free)(void *ctx, void *p, size_t size);
+        void *ctx;
+}allocator_t;
+
+// malloc, realloc and free, what a NULL allocator stands for
+extern const allocator_t al_libc;
+
+// al itself if not NULL, &al_libc otherwise
+static inline const allocator_t *al_or_libc(const allocator_t *al)
+{
+        return al ? al : &al_libc;
+}
+
+// exit on failure like the rest of the library does
+void *al_alloc(const allocator_t *al, size_t size);
+void *al_calloc(const allocator_t *al, size_t size);
+void *al_realloc(const allocator_t *al, void *p, size_t old_size, size_t new_size);
+void al_free(const allocator_t *al, void *p, size_t size);
+
+#endif
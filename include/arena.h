@@ -0,0 +1,49 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdlib.h>
+
+#include "alloc.h"
+
+// byte arena, allocations are bumped out of large chunks and only
+// released all at once
+typedef struct arena_s {
+        size_t chunk_size;
+
+        // chunks, linked through their header
+        void *chunks;
+        // untouched part of the current chunk
+        char *bump;
+        char *bump_end;
+
+        size_t nchunks;
+        // bytes of all chunks
+        size_t size;
+        // bytes handed out, alignment padding included
+        size_t allocated;
+}arena_t;
+
+void ar_init(arena_t *a, size_t chunk_size);
+
+// return n bytes aligned to 8, a request bigger than a quarter of a
+// chunk gets a chunk of its own
+void *ar_alloc(arena_t *a, size_t n);
+
+// grow or shrink an allocation of old_size bytes, in place when it is
+// the last one of the current chunk and the chunk has room, copied to a
+// new one otherwise
+void *ar_realloc(arena_t *a, void *p, size_t old_size, size_t new_size);
+
+// drop every allocation but keep the current chunk for the next ones,
+// all allocations become invalid
+void ar_reset(arena_t *a);
+
+// release every chunk, all allocations become invalid
+void ar_deinit(arena_t *a);
+
+// an allocator bumping out of a, see alloc.h. Frees are ignored, so the
+// containers made with it are torn down at once by ar_reset or
+// ar_deinit, without their delete calls. Not thread-safe.
+void ar_allocator(arena_t *a, allocator_t *al);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef _BLOCKFILE_H
+#define _BLOCKFILE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// payload of a full block, and the alignment of the block buffers
+#define BF_BLOCK_SIZE (1 << 20)
+#define BF_ALIGN 4096
+
+// bf_next results besides a payload length
+#define BF_TRUNCATED (-1)
+#define BF_CORRUPT (-2)
+
+/*
+ * A stream of checksummed blocks. Every block is a bf_block_header_t
+ * followed by len bytes of payload, crc is the CRC-32C of len and the
+ * payload chained from the block index, so a block that is damaged, lost
+ * or moved does not verify. A block with len 0 ends the stream, a stream
+ * without it was cut short.
+ */
+typedef struct bf_block_header_s {
+        uint32_t len;
+        uint32_t crc;
+}bf_block_header_t;
+
+typedef struct bf_writer_s {
+        int fd;
+        size_t block_size;
+        uint32_t index;
+        // errno of the first failed write, 0 if none
+        int err;
+
+        // block being filled, the header is set when it is handed off
+        char *buf;
+        size_t len;
+
+        // background mode: a writer thread drains one block while the
+        // caller fills the other
+        bool background;
+        char *spare;
+        char *inflight;
+        bool done;
+        pthread_t thread;
+        pthread_mutex_t mu;
+        pthread_cond_t cond;
+}bf_writer_t;
+
+typedef struct bf_reader_s {
+        FILE *fp;
+        long start;
+        long size;
+        uint32_t index;
+        char *buf;
+        size_t cap;
+}bf_reader_t;
+
+// the stream starts at the current offset of fd, blocks hold up to
+// block_size bytes of payload (BF_BLOCK_SIZE if 0)
+bf_writer_t *bf_writer_new(int fd, size_t block_size, bool background);
+
+// return room for len bytes in the current block, starting a new block
+// if needed, so that what is written there is never split, NULL if len
+// is bigger than a block. A writer whose block_size covers its largest
+// record always gets room.
+void *bf_reserve(bf_writer_t *w, size_t len);
+
+// end the current block, the next bf_reserve starts a new one
+void bf_flush(bf_writer_t *w);
+
+// end the stream and free the writer, fd stays open, return 0 on
+// success, -1 with errno set if any write failed
+int bf_writer_close(bf_writer_t *w);
+
+// the stream starts at the current offset of fp
+bf_reader_t *bf_reader_new(FILE *fp);
+void bf_reader_delete(bf_reader_t *r);
+
+// read and check the next block, return its payload length, 0 at the end
+// of the stream, BF_TRUNCATED or BF_CORRUPT
+long bf_next(bf_reader_t *r, void **payload);
+
+// go back to the first block
+void bf_rewind(bf_reader_t *r);
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "map.h"
+
+// a block is one cache line of 8 64-bit lanes, a key sets one bit in
+// every lane of one block
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_LANES 8
+
+// bits per key when make_bloom is given 0, about 0.5% false positives
+#define BLOOM_DEFAULT_BITS 12
+
+/*
+ * A blocked Bloom filter over the k2int hash of fixed-size keys. One
+ * hash picks the block, a second one the bit of each lane, so a lookup
+ * reads a single cache line and tests the 8 bits at once (two 256-bit
+ * compares with AVX2, the lanes one by one otherwise). Keys cannot be
+ * removed, bloom_rebuild drops the bits of the keys deleted since.
+ */
+typedef struct bloom_s {
+        uint64_t *blocks;
+        size_t nblocks;
+        size_t key_size;
+        key2int_t k2int;
+        // keys added since the last clear, deleted ones included
+        size_t added;
+}bloom_t;
+
+// room for capacity keys at bits_per_key bits each (BLOOM_DEFAULT_BITS
+// if 0), k2int defaults to the built-in hash for key_size as in make_map
+bloom_t *make_bloom(size_t key_size, key2int_t k2int, size_t capacity, unsigned bits_per_key);
+void delete_bloom(bloom_t *b);
+
+static inline uint64_t bloom_mix(uint64_t h)
+{
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
+
+static inline uint64_t *bloom_block(bloom_t *b, uint64_t h1)
+{
+        // the high bits of h1 scaled to nblocks, no power of two needed
+        size_t i = (size_t)(((__uint128_t)h1 * b->nblocks) >> 64);
+        return b->blocks + i * BLOOM_LANES;
+}
+
+// hash is the k2int result of the key
+static inline void bloom_add_hash(bloom_t *b, uint64_t hash)
+{
+        uint64_t h1 = bloom_mix(hash), h2 = bloom_mix(h1 + 0x9e3779b97f4a7c15ULL);
+        uint64_t *block = bloom_block(b, h1);
+        for (int i = 0; i < BLOOM_LANES; i++) {
+                block[i] |= 1ULL << ((h2 >> (6 * i)) & 63);
+        }
+        b->added++;
+}
+
+// false if the key is surely not there
+static inline bool bloom_may_contain_hash(bloom_t *b, uint64_t hash)
+{
+        uint64_t h1 = bloom_mix(hash), h2 = bloom_mix(h1 + 0x9e3779b97f4a7c15ULL);
+        const uint64_t *block = bloom_block(b, h1);
+#if defined(__AVX2__)
+        __m256i h = _mm256_set1_epi64x(h2), low6 = _mm256_set1_epi64x(63), one = _mm256_set1_epi64x(1);
+        __m256i lo = _mm256_sllv_epi64(one, _mm256_and_si256(
+                _mm256_srlv_epi64(h, _mm256_setr_epi64x(0, 6, 12, 18)), low6));
+        __m256i hi = _mm256_sllv_epi64(one, _mm256_and_si256(
+                _mm256_srlv_epi64(h, _mm256_setr_epi64x(24, 30, 36, 42)), low6));
+        return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block), lo)
+                & _mm256_testc_si256(_mm256_load_si256((const __m256i *)block + 1), hi);
+#else
+        // no early exit, the line is loaded either way and the loop
+        // vectorizes
+        uint64_t missing = 0;
+        for (int i = 0; i < BLOOM_LANES; i++) {
+                uint64_t bit = 1ULL << ((h2 >> (6 * i)) & 63);
+                missing |= bit & ~block[i];
+        }
+        return missing == 0;
+#endif
+}
+
+void bloom_add(bloom_t *b, const void *key);
+bool bloom_may_contain(bloom_t *b, const void *key);
+void bloom_clear(bloom_t *b);
+
+// clear the filter and add the keys of mm_keyset(m), return -1 if the
+// map has variable-length keys or keys of another size
+int bloom_rebuild(bloom_t *b, map_t *m);
+
+/*
+ * Check the filter before any lookup of mm_get, mm_haskey and
+ * mm_get_batch, so most misses end after one cache line instead of a
+ * chain walk, and add the keys that mm_put and mm_put_batch insert.
+ * The filter must hold every key of the map already, from bloom_rebuild
+ * or bloom_unmarshal. It stays with the caller, delete_map leaves it
+ * alone, NULL detaches.
+ * Linear maps that are neither concurrent nor variable-length, and
+ * mapped maps. Return -1 if the map is of another kind, or the filter
+ * has another key size or k2int.
+ */
+int mm_attach_bloom(map_t *m, bloom_t *b);
+
+// the file is a versioned header followed by CRC-32C checked blocks
+// (see blockfile.h), kept next to the mm_marshal or mm_marshal_mapped
+// file of the map, say at its path plus ".bloom". Return 0 on success,
+// -1 on a write error.
+int bloom_marshal(const char *path, bloom_t *b);
+
+// k2int must be the hash the filter was built with, NULL picks the
+// default. Return NULL if the file is not a valid filter.
+bloom_t *bloom_unmarshal(const char *path, key2int_t k2int);
+
+#endif
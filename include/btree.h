@@ -0,0 +1,143 @@
+#ifndef _BTREE_H
+#define _BTREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+#include "slab.h"
+#include "slice.h"
+
+// bytes of a node, a few cache lines so a binary search in one touches
+// few of them. Nodes grow past it when it holds fewer than 4 keys.
+#ifdef TESTBTREE
+#define BT_NODE_BYTES 128
+#else
+#define BT_NODE_BYTES 512
+#endif
+
+/*
+ * A node is the header followed by data: the keys back to back, then
+ * the values of a leaf or the children of an inner node. An inner node
+ * has n keys and n + 1 children, child i holds the keys from key i - 1
+ * up to key i. Leaves are chained in key order.
+ */
+typedef struct bt_node_s {
+        uint32_t n;
+        bool leaf;
+        struct bt_node_s *prev;
+        struct bt_node_s *next;
+        char data[];
+}bt_node_t;
+
+/*
+ * An ordered map of fixed-size keys and values, a B+-tree whose entries
+ * all sit in the leaves. kcmp orders the keys like memcmp does, which is
+ * also the default, so little-endian integers need one of the bt_cmp_*
+ * below. Not thread-safe.
+ */
+typedef struct btree_s {
+        size_t key_size;
+        size_t value_size;
+        keycmp_t kcmp;
+
+        bt_node_t *root;
+        // the leaf chain
+        bt_node_t *first;
+        bt_node_t *last;
+        size_t used;
+        // levels, 1 while the root is a leaf
+        unsigned height;
+
+        // entries of a leaf, keys of an inner node, and where the values
+        // and the children start in data
+        size_t leaf_cap;
+        size_t inner_cap;
+        size_t values_offset;
+        size_t children_offset;
+        slab_t leaf_slab;
+        slab_t inner_slab;
+        size_t leaves;
+        size_t inners;
+
+        // two keys of room for splits and checks
+        char *scratch;
+        // bumped whenever entries move or go away, see bt_iter_t
+        uint64_t version;
+}btree_t;
+
+// keycmp_t for native integers
+int bt_cmp_u32(const void *key1, const void *key2, size_t keysize);
+int bt_cmp_u64(const void *key1, const void *key2, size_t keysize);
+int bt_cmp_i32(const void *key1, const void *key2, size_t keysize);
+int bt_cmp_i64(const void *key1, const void *key2, size_t keysize);
+
+// constructor, kcmp defaults to memcmp when NULL
+btree_t *make_btree(size_t key_size, size_t value_size, keycmp_t kcmp);
+void delete_btree(btree_t *t);
+
+// return 0, the value of a key already there is replaced
+int bt_put(btree_t *t, const void *key, const void *value);
+
+// return true if found, the value goes to value unless it is NULL
+bool bt_get(btree_t *t, const void *key, void *value);
+
+bool bt_haskey(btree_t *t, const void *key);
+
+// return true if found, false if not
+bool bt_delete(btree_t *t, const void *key);
+
+size_t bt_len(btree_t *t);
+
+// fill an empty tree from n keys in strictly increasing order and their
+// values, laid out back to back, in O(n). Nodes are left 7/8 full.
+// Return -1 and leave the tree alone if it is not empty or the keys are
+// out of order.
+int bt_bulk_load(btree_t *t, const void *keys, const void *values, size_t n);
+
+// the keys in order, user needs to free the slice returned later
+slice_t *bt_keyset(btree_t *t);
+
+/*
+ * A cursor between two entries, walked either way over the leaf chain
+ * with nothing allocated or copied. The key and value pointers stay
+ * valid until the tree is changed, and so does the cursor: once an
+ * entry is added or removed the walk stops. Replacing a value is fine.
+ */
+typedef struct bt_iter_s {
+        btree_t *t;
+        bt_node_t *leaf;
+        // before entry i of leaf
+        size_t i;
+        uint64_t version;
+}bt_iter_t;
+
+// before the first entry, after the last one
+void bt_begin(btree_t *t, bt_iter_t *it);
+void bt_end(btree_t *t, bt_iter_t *it);
+
+// before the first key >= key (lower) or > key (upper), return false if
+// there is none, the cursor is then at the end
+bool bt_lower_bound(btree_t *t, const void *key, bt_iter_t *it);
+bool bt_upper_bound(btree_t *t, const void *key, bt_iter_t *it);
+
+// return the entry after the cursor and step over it, false at the end
+// or once the tree changed
+bool bt_iter_next(bt_iter_t *it, void **key, void **value);
+
+// return the entry before the cursor and step back over it, false at
+// the beginning or once the tree changed
+bool bt_iter_prev(bt_iter_t *it, void **key, void **value);
+
+// the file is a versioned header followed by CRC-32C checked blocks of
+// records in key order (see blockfile.h), return 0 on success, -1 on a
+// write error
+int bt_marshal(const char *path, btree_t *t);
+
+// every block is checked before the first entry is inserted, return -1
+// and leave the tree alone if the file is truncated, corrupt, out of
+// order or of other sizes. An empty tree is bulk loaded.
+int bt_unmarshal(const char *path, btree_t *t);
+
+#endif
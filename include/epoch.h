@@ -0,0 +1,53 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slice.h"
+
+#ifndef DTOR
+#define DTOR
+typedef void (*dtor_t)(void *);
+#endif
+
+// threads alive at the same time that may use a domain
+#define EB_MAX_THREADS 256
+#define EB_CACHE_LINE 64
+
+/*
+ * Epoch-based reclamation. Readers wrap every access to shared nodes in
+ * eb_enter/eb_exit, which only writes the reader's own slot. Writers hand
+ * unlinked nodes to eb_retire, they are destroyed once every reader that
+ * could still see them has left, i.e. two epochs later.
+ */
+typedef struct eb_slot_s {
+        // (epoch << 1) | 1 inside a critical section, 0 outside
+        uint64_t local;
+
+        // retired items, by the epoch they were retired in, modulo 3
+        slice_t *retired[3];
+        uint64_t retired_epoch[3];
+        size_t pending;
+}__attribute__((aligned(EB_CACHE_LINE))) eb_slot_t;
+
+typedef struct epoch_s {
+        uint64_t global __attribute__((aligned(EB_CACHE_LINE)));
+        eb_slot_t slots[EB_MAX_THREADS];
+}epoch_t;
+
+epoch_t *eb_new();
+
+// destroy every retired item, no thread may be inside the domain
+void eb_delete(epoch_t *e);
+
+void eb_enter(epoch_t *e);
+void eb_exit(epoch_t *e);
+
+// destroy ptr with dtor once no reader can reach it anymore
+void eb_retire(epoch_t *e, void *ptr, dtor_t dtor);
+
+// try to advance the epoch and destroy what is safe, called by eb_retire
+void eb_collect(epoch_t *e);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _FLATMAP_H
+#define _FLATMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "map.h"
+
+// number of control bytes scanned by one probe step
+#if defined(__AVX2__)
+#define FT_GROUP_WIDTH 32
+#else
+#define FT_GROUP_WIDTH 16
+#endif
+
+// control byte states, a full slot stores the low 7 bits of the hash
+#define FT_EMPTY ((uint8_t)0x80)
+#define FT_DELETED ((uint8_t)0xfe)
+
+// open addressing table, entries are stored inline as key || value
+typedef struct flat_table_s {
+        uint8_t *ctrl;
+        void *slots;
+
+        // number of slots, power of two, multiple of FT_GROUP_WIDTH
+        size_t capacity;
+        // inserts left before the table has to be rehashed
+        size_t growth_left;
+        size_t slot_size;
+        // the table and its arrays come from al
+        const allocator_t *al;
+}flat_table_t;
+
+// al must outlive the table, NULL is libc
+flat_table_t *ft_new(size_t slot_size, size_t cap, const allocator_t *al);
+void ft_delete(flat_table_t *ft);
+
+// return the slot holding the key, NULL if not found
+void *ft_find(map_t *m, const void *key);
+
+// ft_find for n keys laid out back to back, any n. The control groups
+// of a few keys at a time are prefetched before the first one is probed.
+void ft_find_batch(map_t *m, const void *keys, size_t n, void **slots);
+
+// return 0 on success, -1 on failure
+int ft_put(map_t *m, const void *key, const void *value);
+
+// same as ft_put, hash is the k2int result of the key
+int ft_put_hash(map_t *m, const void *key, const void *value, uint64_t hash);
+
+// make room for n entries without further rehashing
+int ft_reserve(map_t *m, size_t n);
+
+// return true if found, false if not
+bool ft_remove(map_t *m, const void *key);
+
+// fill in the layout part of the stats, see mm_stats
+void ft_stats(map_t *m, map_stats_t *stats);
+
+static inline bool ft_is_full(flat_table_t *ft, size_t i)
+{
+        return (ft->ctrl[i] & 0x80) == 0;
+}
+
+static inline void *ft_slot(flat_table_t *ft, size_t i)
+{
+        return (char *)ft->slots + i * ft->slot_size;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+// ready-made key2int_t implementations, all of them mix every input bit
+// into the low bits, so the table can pick buckets with a mask
+
+// 4-byte keys (int, uint32_t, float...)
+uint64_t hash_int32(const void *key, size_t key_size);
+
+// 8-byte keys (int64_t, uint64_t, pointers...)
+uint64_t hash_int64(const void *key, size_t key_size);
+
+// arbitrary byte strings of key_size bytes
+uint64_t hash_bytes(const void *key, size_t key_size);
+
+// the hash make_map uses when k2int is NULL
+key2int_t hash_default(size_t key_size);
+
+// CRC-32C (Castagnoli) of len bytes, chained through crc, start with 0,
+// uses the SSE4.2 instruction when the CPU has it
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _HASHSET_H
+#define _HASHSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+#include "slab.h"
+
+// an entry is the chain link, the cached k2int(key) and the key, nothing
+// else
+typedef struct hs_entry_s {
+        struct hs_entry_s *next;
+        uint64_t hash;
+        char key[];
+}hs_entry_t;
+
+/*
+ * A set of fixed-size keys on the linear hashing of the map: a directory
+ * of chained buckets split and merged one at a time with the SPLIT_RATIO
+ * and SHRINK_RATIO of map.h, entries from a slab.
+ *
+ * Every split divides one bucket in two, so the buckets of the set with
+ * the longer directory each fall inside one bucket of the other. The
+ * bulk operations walk the buckets of one set and compare each chain
+ * with the chain it falls in on the other side, by cached hash, and
+ * never call k2int.
+ */
+typedef struct hash_set_s {
+        // buckets below pos are split to the cap * 2 hash space
+        size_t cap;
+        size_t pos;
+        size_t used;
+        size_t key_size;
+        // room for size bucket heads, cap + pos in use
+        hs_entry_t **buckets;
+        size_t size;
+        // split above grow_at entries, merge below shrink_below
+        size_t grow_at;
+        size_t shrink_below;
+
+        key2int_t k2int;
+        keycmp_t kcmp;
+        slab_t slab;
+        uint64_t splits;
+        uint64_t shrinks;
+}hash_set_t;
+
+// constructor, k2int defaults to the built-in hash for key_size (see
+// hash.h) and kcmp to memcmp when NULL
+hash_set_t *make_hash_set(size_t key_size, key2int_t k2int, keycmp_t kcmp);
+void delete_hash_set(hash_set_t *s);
+
+// return true if the key was added, false if it was there already
+bool hs_add(hash_set_t *s, const void *key);
+
+// return true if found, false if not
+bool hs_contains(hash_set_t *s, const void *key);
+
+// return true if found, false if not
+bool hs_remove(hash_set_t *s, const void *key);
+
+size_t hs_len(hash_set_t *s);
+
+// fn is called once for every key, which must not be changed, nor the
+// set during the walk
+typedef void (*hs_visit_t)(const void *key, void *ctx);
+void hs_foreach(hash_set_t *s, hs_visit_t fn, void *ctx);
+
+// new sets of the keys in a or b, in a and b, in a and not in b. The
+// keys come from a when both hold one. a and b must have the same key
+// size, k2int and kcmp, return NULL otherwise.
+hash_set_t *hs_union(hash_set_t *a, hash_set_t *b);
+hash_set_t *hs_intersection(hash_set_t *a, hash_set_t *b);
+hash_set_t *hs_difference(hash_set_t *a, hash_set_t *b);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef _LINK_LIST_H
 #define _LINK_LIST_H
 
+#include "alloc.h"
+
 #ifndef DTOR
 #define DTOR
 typedef void (*dtor_t)(void *);
@@ -18,10 +20,16 @@ typedef struct list_s {
         size_t item_size;
         size_t len;
         dtor_t dtor;
+        // nodes, their items and the list of ll_new_list come from al
+        const allocator_t *al;
 }list_t;
 
 list_t * ll_new_list(size_t item_size, dtor_t dtor); // already inited
 void ll_init_list(list_t *list, size_t item_size, dtor_t dtor);
+// al must outlive the list, NULL is libc. Without a dtor the items are
+// freed through al too.
+list_t *ll_new_list_alloc(size_t item_size, dtor_t dtor, const allocator_t *al);
+void ll_init_list_alloc(list_t *list, size_t item_size, dtor_t dtor, const allocator_t *al);
 
 int ll_append(list_t *list, void *item);
 int ll_append_ref(list_t *list, void *item);
@@ -35,10 +43,14 @@ int ll_pop(list_t *list, void *item);
 
 // only remove the node from the list
 int ll_remove_node(list_t *list, node_t *node);
+// put node in the place of old, old is not freed
+int ll_replace_node(list_t *list, node_t *old, node_t *node);
 
 // remove and free the node
 int ll_free_node(list_t *list, node_t *node);
 int ll_get_node_item(list_t *list, node_t *node, void *item);
+// unlink every node without freeing them, for nodes owned elsewhere
+int ll_reset_list(list_t *list);
 int ll_deinit_list(list_t *list);
 int ll_delete_list(list_t *list);
 
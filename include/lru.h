@@ -0,0 +1,93 @@
+#ifndef _LRU_H
+#define _LRU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "link_list.h"
+#include "map.h"
+#include "slab.h"
+
+typedef enum lru_policy_e {
+        // every hit moves the entry to the front of the list
+        LRU_POLICY_LRU = 0,
+        // a hit only sets the referenced bit of the entry, eviction gives
+        // referenced entries at the tail a second chance at the front
+        LRU_POLICY_CLOCK,
+}lru_policy_t;
+
+typedef void (*lru_evict_t)(const void *key, const void *value, void *ctx);
+
+typedef struct lru_opts_s {
+        // the cache holds at most max_entries entries and max_bytes bytes,
+        // 0 for no bound, one of them must be set
+        size_t max_entries;
+        size_t max_bytes;
+        lru_policy_t policy;
+        // called with every entry evicted to make room, not with those
+        // deleted or replaced
+        lru_evict_t on_evict;
+        void *evict_ctx;
+}lru_opts_t;
+
+// an entry is one slab slot, the node links it into the list and
+// node.item points back to it: lru_entry_t | key | value
+typedef struct lru_entry_s {
+        node_t node;
+        bool referenced;
+}lru_entry_t;
+
+/*
+ * A bounded cache of fixed-size keys and values. A map from the key to
+ * the entry finds it, the list keeps the entries most recently used
+ * first. The entries are linked by their own node, so moving one to the
+ * front allocates nothing, and once the cache is full a put takes the
+ * slot of the entry it evicts. Not thread-safe.
+ */
+typedef struct lru_cache_s {
+        // key -> lru_entry_t *, never shrinks
+        map_t *index;
+        list_t order;
+        slab_t slab;
+        size_t key_size;
+        size_t value_size;
+        // max entries, from max_entries and max_bytes
+        size_t cap;
+        // bytes of one entry, its slot, its index slot and its bucket
+        size_t entry_bytes;
+        lru_policy_t policy;
+        lru_evict_t on_evict;
+        void *evict_ctx;
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+}lru_cache_t;
+
+// constructor, k2int and kcmp as in make_map, return NULL if opts bound
+// neither the entries nor the bytes, or leave no room for one entry
+lru_cache_t *make_lru_cache(size_t key_size, size_t value_size, key2int_t k2int, keycmp_t kcmp,
+                            const lru_opts_t *opts);
+void delete_lru_cache(lru_cache_t *c);
+
+// add or replace, evicting the least recently used entry when the cache
+// is full, return 0
+int lru_put(lru_cache_t *c, const void *key, const void *value);
+
+// return true if found and mark the entry used, the value goes to value
+// unless it is NULL
+bool lru_get(lru_cache_t *c, const void *key, void *value);
+
+// lru_get that leaves the order alone and counts neither hit nor miss
+bool lru_peek(lru_cache_t *c, const void *key, void *value);
+
+// return true if found, false if not
+bool lru_delete(lru_cache_t *c, const void *key);
+
+size_t lru_len(lru_cache_t *c);
+
+// bytes held by the entries, counted as lru_len * entry_bytes
+size_t lru_bytes(lru_cache_t *c);
+
+#endif
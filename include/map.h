@@ -1,20 +1,26 @@
 #ifndef _MAP_H
 #define _MAP_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "alloc.h"
+#include "arena.h"
+#include "slab.h"
 #include "slice.h"
 
 #ifdef TESTMAP
 
 #define SPLIT_RATIO (0.75)
+#define SHRINK_RATIO (0.375)
 #define DEFAULT_INIT_CAP 16
 #define DEFAULT_BUCKET_CAP 1
 
 #else
 
 #define SPLIT_RATIO (0.75)
+#define SHRINK_RATIO (0.375)
 #define DEFAULT_INIT_CAP 1024
 #define DEFAULT_BUCKET_CAP 1
 
@@ -23,11 +29,70 @@
 typedef uint64_t (*key2int_t) (const void *key, size_t keysize);
 typedef int (*keycmp_t) (const void *key1, const void *key2, size_t keysize);
 
+typedef enum map_engine_e {
+        // linear hashing over a directory of chained buckets
+        MAP_ENGINE_LINEAR = 0,
+        // open addressing, entries inline in one table, SIMD tag probing
+        MAP_ENGINE_FLAT,
+        // read-only view of a file, see mm_open_mapped
+        MAP_ENGINE_MAPPED,
+}map_engine_t;
+
+typedef struct map_opts_s {
+        map_engine_t engine;
+        // safe to share between threads, linear engine only
+        bool concurrent;
+        // keys and values of any length, see mm_put_var, linear engine
+        // only. key_size and value_size are then the room kept for them
+        // in every entry, anything longer goes to the arena of the map.
+        bool varlen;
+
+        // resize policy of the linear engine, zeros pick the defaults.
+        // Buckets are split while the load is above split_ratio and merged
+        // while it is at or below shrink_ratio, a load in between never
+        // resizes. shrink_ratio equal to split_ratio resizes on every
+        // crossing, as maps did before.
+        float split_ratio;
+        float shrink_ratio;
+        bool never_shrink;
+        // buckets split or merged per resize, as long as the load stays
+        // between the two ratios
+        unsigned resize_step;
+
+        // where the map, its directory, buckets, entries and flat table
+        // come from, NULL is libc. It must outlive the map. Linear and
+        // flat engines without concurrency or variable-length mode. A
+        // map on an arena (see ar_allocator) can be dropped with the
+        // arena instead of delete_map, as long as it has no log, snapshot
+        // or filter attached.
+        const allocator_t *allocator;
+}map_opts_t;
+
+struct flat_table_s;
+struct map_sync_s;
+struct mapped_file_s;
+struct map_snapshot_s;
+struct map_wal_s;
+struct bloom_s;
+
+// lookup counters of mm_get, mm_haskey and mm_get_batch, only kept up
+// when the library is built with -DMM_STATS_COUNTERS, see mm_stats
+typedef struct map_counters_s {
+        uint64_t hits;
+        uint64_t misses;
+        // entries looked at, control groups for the flat engine
+        uint64_t hit_probes;
+        uint64_t miss_probes;
+}map_counters_t;
+
 typedef struct map_s {
         size_t cap;
         size_t used;
         size_t bucket_cap;
         float split_ratio;
+        float shrink_ratio;
+        bool never_shrink;
+        unsigned resize_step;
 
         uint64_t pos;
 
@@ -37,37 +102,305 @@ typedef struct map_s {
 
         key2int_t k2int;
         keycmp_t kcmp;
+
+        // entry slots of the linear hashing engine
+        slab_t slab;
+        // see map_opts_t, scratch buffers, snapshots and logs use libc
+        const allocator_t *al;
+        // empty buckets left by shrinks, for the next splits
+        slice_t *spare_buckets;
+
+        map_engine_t engine;
+        struct flat_table_s *ft;
+        // bucket locks of a concurrent map, NULL otherwise
+        struct map_sync_s *sync;
+        struct mapped_file_s *mf;
+
+        // bumped whenever entries move or go away, see map_iter_t
+        uint64_t version;
+
+        // variable-length mode: keys and values that do not fit in their
+        // entry, and the arena bytes no entry points to any more
+        bool varlen;
+        arena_t arena;
+        size_t arena_garbage;
+        // longest key plus value ever put, sizes the marshal blocks
+        size_t var_max;
+
+        // buckets split and merged so far, rehashes of the flat engine
+        // count as splits
+        uint64_t splits;
+        uint64_t shrinks;
+        map_counters_t counters;
+
+        // the open snapshot, see mm_snapshot
+        struct map_snapshot_s *snap;
+        // the write-ahead log, see wal.h
+        struct map_wal_s *wal;
+        // checked before lookups, see mm_attach_bloom
+        struct bloom_s *bloom;
 }map_t;
 
+#ifdef MM_STATS_COUNTERS
+static inline void mm_count_lookup(map_t *m, uint64_t probes, bool hit)
+{
+        uint64_t *n = hit ? &m->counters.hits : &m->counters.misses;
+        uint64_t *p = hit ? &m->counters.hit_probes : &m->counters.miss_probes;
+        if (m->sync) {
+                __atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(p, probes, __ATOMIC_RELAXED);
+                return;
+        }
+        (*n)++;
+        *p += probes;
+}
+#define MM_COUNT_LOOKUP(m, probes, hit) mm_count_lookup((m), (probes), (hit))
+#else
+#define MM_COUNT_LOOKUP(m, probes, hit) ((void)(probes))
+#endif
+
 typedef struct kv_pair_s {
         void *key;
         void *value;
+        // k2int(key), cached so lookups and splits need no callback
+        uint64_t hash;
 }kv_pair_t;
 
-// constructor
+// constructor, k2int defaults to the built-in hash for key_size (see
+// hash.h) and kcmp to memcmp when NULL
 map_t *make_map(size_t key_size, size_t value_size, key2int_t k2int, keycmp_t kcmp);
 
+// constructor with explicit options, opts can be NULL for the defaults
+map_t *make_map_opts(size_t key_size, size_t value_size, key2int_t k2int, keycmp_t kcmp,
+                     const map_opts_t *opts);
+
 // return 0 on success, -1 on failure
 int mm_put(map_t *m, void *key, void *value);
 
+// presize the table for n entries, so inserting up to n entries
+// does not split, return 0 on success, -1 on failure
+int mm_reserve(map_t *m, size_t n);
+
+// insert n keys and values laid out back to back in the arrays,
+// later duplicates win, return 0 on success, -1 on failure
+int mm_put_batch(map_t *m, void *keys, void *values, size_t n);
+
 // return true if found, false if not
 bool mm_get(map_t *m, void *key, void *value);
 
+// look up n keys laid out back to back, the value of keys[i] goes to
+// values[i] and found[i] tells if it was there (found can be NULL),
+// values of missing keys are left alone. The memory accesses of many
+// lookups overlap, so this is faster than n mm_get calls. Return the
+// number of keys found.
+size_t mm_get_batch(map_t *m, void *keys, size_t n, void *values, bool *found);
+
 // return true if found, false if not
 bool mm_haskey(map_t *m, void *key);
 
 // return true if found, false if not
 bool mm_delete(map_t *m, void *key);
 
+// close the log of the map if any, return -1 and leave the map alone
+// while it has an unreleased snapshot
 int delete_map(map_t *m);
 
+// the same for a map made with opts->varlen, keys are compared on their
+// length and bytes. The other calls taking keys and values refuse such
+// a map, and these refuse the others.
+int mm_put_var(map_t *m, const void *key, size_t key_len, const void *value, size_t value_len);
+
+// point value at the value in place, valid until the map is changed,
+// value and value_len can be NULL
+bool mm_get_var(map_t *m, const void *key, size_t key_len, void **value, size_t *value_len);
+
+bool mm_delete_var(map_t *m, const void *key, size_t key_len);
+
+// print the statistics below, verbose also dumps the entries as hex
 void mm_print_map(map_t *m, bool verbose);
 
+// chains of MM_CHAIN_HIST - 1 entries or more share the last slot
+#define MM_CHAIN_HIST 16
+
+typedef struct map_stats_s {
+        map_engine_t engine;
+        size_t entries;
+        // directory length, slots of the flat engine, buckets of a file
+        size_t buckets;
+        float load;
+
+        /*
+         * Chains are the buckets of the linear and mapped engines, and
+         * the control groups an entry sits away from its home group, plus
+         * one, for the flat engine. A k2int that does not spread the keys
+         * shows up as long chains and many probes.
+         */
+        size_t chain_hist[MM_CHAIN_HIST];
+        size_t max_chain;
+        // expected probes of a lookup with the current layout, hits
+        // spread over the entries and misses over the hash space
+        double probes_per_hit;
+        double probes_per_miss;
+
+        uint64_t splits;
+        uint64_t shrinks;
+
+        // memory allocated for the map, and the file a mapped map reads
+        size_t heap_bytes;
+        size_t mapped_bytes;
+        double bytes_per_entry;
+
+        // probes measured by the counters, 0 without MM_STATS_COUNTERS
+        map_counters_t counters;
+        double measured_probes_per_hit;
+        double measured_probes_per_miss;
+}map_stats_t;
+
+// walk the whole map, safe with concurrent operations, return 0
+int mm_stats(map_t *m, map_stats_t *stats);
+
+// the file is a versioned header followed by CRC-32C checked blocks of
+// records (see blockfile.h), return 0 on success, -1 on a write error
 int mm_marshal(const char *path, map_t *m);
 
+// also persist the cached hash of every entry, so mm_unmarshal does
+// not call k2int again, the loading map must use the same k2int
+#define MM_MARSHAL_HASH 0x1
+// write the blocks from a second thread, the map is walked into one
+// buffer while the previous one is being written
+#define MM_MARSHAL_BACKGROUND 0x2
+// fsync the file before returning
+#define MM_MARSHAL_FSYNC 0x4
+
+int mm_marshal_flags(const char *path, map_t *m, int flags);
+
+// every block is checked before the first entry is inserted, return -1
+// and leave the map alone if the file is truncated or corrupt. Files
+// written before the checksummed format still load, unchecked.
 int mm_unmarshal(const char *path, map_t *m);
 
-// return the key set of the map, user needs to free the slice returned later
+// write the map in a format that mm_open_mapped queries in place,
+// return 0 on success, -1 on failure
+int mm_marshal_mapped(const char *path, map_t *m);
+
+// map a file written by mm_marshal_mapped read-only, nothing is loaded
+// up front and processes mapping the same file share the page cache.
+// k2int must be the hash the file was written with, NULLs pick the
+// defaults as in make_map. Only mm_get, mm_haskey, mm_keyset, the
+// marshal functions and delete_map work on the result. Return NULL if
+// the file is not a valid mapped map.
+map_t *mm_open_mapped(const char *path, key2int_t k2int, keycmp_t kcmp);
+
+// return the key set of the map, user needs to free the slice returned later,
+// NULL for a variable-length map
 slice_t *mm_keyset(map_t *m);
 
+// whole-map walks split over the threads of tp_default(), see
+// threadpool.h, nthreads 0 uses every online CPU. The bucket directory,
+// the slots or the records are cut into ranges that idle threads steal
+// from busy ones. Concurrent maps are locked for the whole walk, none
+// works on variable-length maps.
+
+// fn is called once for every entry, from several threads at once. It
+// may change the value in place, except in a mapped map, but must not
+// add or remove entries. Return 0, -1 on a variable-length map.
+typedef void (*mm_visit_t)(void *key, void *value, void *ctx);
+int mm_parallel_foreach(map_t *m, mm_visit_t fn, void *ctx, size_t nthreads);
+
+// every thread folds its entries into its own acc_size bytes, which
+// start as a copy of result, then they are combined into result one by
+// one, so result must start as the identity of combine. Return 0, -1 on
+// a variable-length map.
+typedef void (*mm_fold_t)(void *acc, void *key, void *value, void *ctx);
+typedef void (*mm_combine_t)(void *acc, const void *other, void *ctx);
+int mm_parallel_reduce(map_t *m, size_t acc_size, mm_fold_t fold, mm_combine_t combine,
+                       void *result, void *ctx, size_t nthreads);
+
+// mm_keyset with the keys gathered in parallel, in no particular order
+slice_t *mm_parallel_keyset(map_t *m, size_t nthreads);
+
+/*
+ * A point-in-time view of a linear map, taken in O(1). Nothing is copied
+ * up front: the first change of a bucket after the snapshot saves its
+ * entries as they were, so the snapshot reads saved buckets and the map
+ * holds the rest unchanged. A thread can walk or marshal the snapshot
+ * while another keeps changing the map, which only waits on the
+ * snapshot to save a bucket or to grow or shrink the directory.
+ *
+ * One snapshot per map at a time, of a linear map that is neither
+ * concurrent nor variable-length.
+ */
+typedef struct map_snapshot_s {
+        map_t *m;
+        // buckets and entries of the map when it was taken
+        size_t len;
+        size_t used;
+
+        // held by the map while it saves a bucket or changes the
+        // directory, and by a walk while it copies a bucket of the map
+        pthread_mutex_t mu;
+        // the buckets changed since, as they were then, NULL for those
+        // the map still holds
+        struct snap_bucket_s **saved;
+        size_t saved_bytes;
+
+        // set by mm_snapshot_release, the map frees the snapshot when it
+        // is next changed, snapshotted or deleted
+        bool released;
+}map_snapshot_t;
+
+// return NULL if the map cannot be snapshotted or already has a snapshot
+map_snapshot_t *mm_snapshot(map_t *m);
+
+// the snapshot must not be used afterwards, callable from any thread
+void mm_snapshot_release(map_snapshot_t *snap);
+
+// fn is called once for every entry of the snapshot, the pointers are
+// valid during the call only and the value must not be changed. Safe
+// while the map is being changed by another thread. Return 0.
+int mm_snapshot_foreach(map_snapshot_t *snap, mm_visit_t fn, void *ctx);
+
+// mm_marshal_flags of the snapshot, the file loads with mm_unmarshal
+int mm_snapshot_marshal(const char *path, map_snapshot_t *snap, int flags);
+
+/*
+ * Iterator over the entries in place, nothing is allocated or copied.
+ * The key and value pointers stay valid until the map is changed.
+ *
+ * The map may be changed between two mm_iter_next calls, splits and
+ * shrinks included: every entry present during the whole walk is
+ * returned at least once, entries added or removed meanwhile may or
+ * may not be, and an entry may come twice if the map changed. The
+ * linear engine walks the hash space in reverse-bit order of the low
+ * bits, one class of buckets at a time, so growing or shrinking the
+ * table never makes it skip a class. The flat engine starts over when
+ * the table is rehashed. Not available on concurrent maps.
+ */
+typedef struct map_iter_s {
+        map_t *m;
+        uint64_t cursor;
+        // entries of the current class already returned
+        size_t skip;
+        uint64_t version;
+        bool done;
+        // lengths of the last entry returned
+        size_t key_len;
+        size_t value_len;
+}map_iter_t;
+
+void mm_iter_begin(map_t *m, map_iter_t *it);
+
+// return false once every entry has been returned
+bool mm_iter_next(map_iter_t *it, void **key, void **value);
+
+// cursor of a finished walk
+#define MAP_ITER_END UINT64_MAX
+
+// a cursor to continue the walk later with mm_iter_seek, possibly from a
+// new iterator, so a big map can be scanned in bounded chunks. The
+// entries of the class the iterator is in may come again. MAP_ITER_END
+// once the walk is over.
+uint64_t mm_iter_cursor(map_iter_t *it);
+void mm_iter_seek(map_t *m, map_iter_t *it, uint64_t cursor);
+
 #endif
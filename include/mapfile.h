@@ -0,0 +1,85 @@
+#ifndef _MAPFILE_H
+#define _MAPFILE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+
+// first word of a mapped map file
+#define MF_MAGIC 0x44504d4d4c4d4d4dULL
+#define MF_VERSION 1
+
+/*
+ * A file that is queried in place through mmap, native byte order:
+ *
+ *   mf_header_t
+ *   uint64_t offsets[nbuckets + 1]
+ *   records, hash | key | value packed back to back
+ *
+ * Records are grouped by bucket, bucket b holds the records from
+ * offsets[b] to offsets[b + 1] and a key goes to k2int(key) & (nbuckets - 1).
+ */
+typedef struct mf_header_s {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t key_size;
+        uint64_t value_size;
+        // power of two
+        uint64_t nbuckets;
+        uint64_t count;
+        // file offsets of the bucket table and of the first record
+        uint64_t table_off;
+        uint64_t data_off;
+}mf_header_t;
+
+typedef struct mapped_file_s {
+        void *base;
+        size_t size;
+
+        size_t key_size;
+        size_t value_size;
+        size_t record_size;
+        uint64_t nbuckets;
+        uint64_t count;
+
+        const uint64_t *offsets;
+        const char *records;
+}mapped_file_t;
+
+// write n entries, hashes[i] is the k2int result of keys[i],
+// return 0 on success, -1 on failure
+int mf_write(const char *path, size_t key_size, size_t value_size, size_t n,
+             const uint64_t *hashes, const void **keys, const void **values);
+
+// map the file read-only, return NULL if it is not a valid mapped file
+mapped_file_t *mf_open(const char *path);
+void mf_close(mapped_file_t *mf);
+
+// return the record holding the key, NULL if not found
+const char *mf_find(map_t *m, const void *key);
+
+static inline const char *mf_record(mapped_file_t *mf, uint64_t i)
+{
+        return mf->records + i * mf->record_size;
+}
+
+static inline uint64_t mf_record_hash(const char *rec)
+{
+        uint64_t hash;
+        memcpy(&hash, rec, sizeof(hash));
+        return hash;
+}
+
+static inline const char *mf_record_key(const char *rec)
+{
+        return rec + sizeof(uint64_t);
+}
+
+static inline const char *mf_record_value(mapped_file_t *mf, const char *rec)
+{
+        return rec + sizeof(uint64_t) + mf->key_size;
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _SHARDMAP_H
+#define _SHARDMAP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "map.h"
+
+#define SM_CACHE_LINE 64
+#define SM_MAGIC 0x50414d44524853ull  /* "SHRDMAP" */
+#define SM_VERSION 1
+
+/*
+ * A map split into independent shards, each a plain map_t behind its own
+ * mutex. The top bits of k2int(key) pick the shard and the map inside
+ * uses the low ones, so the shards stay evenly loaded with any hash that
+ * spreads all 64 bits. Operations on different shards never touch the
+ * same cache line, and whole-map work (marshal, unmarshal, delete) runs
+ * one thread per shard.
+ */
+typedef struct map_shard_s {
+        pthread_mutex_t mu;
+        map_t *m;
+}__attribute__((aligned(SM_CACHE_LINE))) map_shard_t;
+
+typedef struct shard_map_s {
+        // a power of two, shard i holds the hashes with top bits i
+        size_t nshards;
+        unsigned shift;
+        size_t key_size;
+        size_t value_size;
+        key2int_t k2int;
+        keycmp_t kcmp;
+        map_opts_t opts;
+        map_shard_t *shards;
+}shard_map_t;
+
+// the file at the marshal path, the shards go to path.0, path.1 ...
+typedef struct sm_manifest_s {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t nshards;
+        uint64_t key_size;
+        uint64_t value_size;
+}sm_manifest_t;
+
+// nshards is rounded up to a power of two, opts as in make_map_opts
+// apply to every shard, which are neither concurrent nor variable-length.
+// Return NULL on bad options.
+shard_map_t *make_shard_map(size_t nshards, size_t key_size, size_t value_size,
+                            key2int_t k2int, keycmp_t kcmp, const map_opts_t *opts);
+
+// free every shard, one thread per shard, return 0
+int delete_shard_map(shard_map_t *sm);
+
+int sm_put(shard_map_t *sm, void *key, void *value);
+bool sm_get(shard_map_t *sm, void *key, void *value);
+bool sm_haskey(shard_map_t *sm, void *key);
+bool sm_delete(shard_map_t *sm, void *key);
+
+// entries of all the shards
+size_t sm_len(shard_map_t *sm);
+
+// the keys of every shard, each shard is copied under its lock but the
+// shards are not frozen together
+slice_t *sm_keyset(shard_map_t *sm);
+
+// mm_stats of one shard, return -1 if there is no such shard
+int sm_shard_stats(shard_map_t *sm, size_t shard, map_stats_t *stats);
+
+// write every shard with mm_marshal_flags in parallel, then the
+// manifest, so a snapshot without a manifest is incomplete. Return 0 on
+// success, -1 if any shard failed.
+int sm_marshal(const char *path, shard_map_t *sm, int flags);
+
+// load every shard in parallel, nothing is added unless all of them
+// load. The shard count and sizes must match the manifest. Return 0 on
+// success, -1 on failure.
+int sm_unmarshal(const char *path, shard_map_t *sm);
+
+#endif
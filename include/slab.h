@@ -0,0 +1,37 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stdlib.h>
+
+#include "alloc.h"
+
+// fixed-size slot allocator, slots are carved out of large slabs and
+// recycled through a free list, all slabs are released at once
+typedef struct slab_s {
+        size_t slot_size;
+        size_t slots_per_slab;
+
+        // freed slots, linked through their first word
+        void *free_list;
+        // slabs, linked through their header
+        void *slabs;
+        // untouched part of the newest slab
+        char *bump;
+        char *bump_end;
+
+        size_t nslabs;
+        size_t used;
+        // where the slabs come from
+        const allocator_t *al;
+}slab_t;
+
+void sb_init(slab_t *sb, size_t slot_size, size_t slots_per_slab);
+// al must outlive the slab, NULL is libc
+void sb_init_alloc(slab_t *sb, size_t slot_size, size_t slots_per_slab, const allocator_t *al);
+void *sb_alloc(slab_t *sb);
+void sb_free(slab_t *sb, void *slot);
+
+// release every slab, all slots become invalid
+void sb_deinit(slab_t *sb);
+
+#endif
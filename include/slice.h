@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 
+#include "alloc.h"
+
 #ifndef DTOR
 #define DTOR
 typedef void (*dtor_t)(void *);
@@ -17,10 +19,16 @@ typedef struct slice_s {
         size_t cap;
 
         dtor_t dtor;
+        // the slice and its array come from al
+        const allocator_t *al;
 }slice_t;
 
 slice_t *make_slice(size_t cap, size_t item_size, dtor_t dtor);
+// al must outlive the slice, NULL is libc
+slice_t *make_slice_alloc(size_t cap, size_t item_size, dtor_t dtor, const allocator_t *al);
 size_t ss_append(slice_t *s, void *item);
+// grow the capacity to at least cap in one step
+int ss_reserve(slice_t *s, size_t cap);
 void *ss_getptr(slice_t *s, uint64_t i);
 int ss_get(slice_t *s, uint64_t i, void *item);
 int ss_put(slice_t *s, uint64_t i, void *item);
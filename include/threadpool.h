@@ -0,0 +1,83 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// workers of one tp_for, the calling thread included
+#define TP_MAX_THREADS 64
+#define TP_CACHE_LINE 64
+
+// fn(ctx, lo, hi, worker) handles the indexes [lo, hi), worker is
+// 0 for the calling thread and below nthreads for the others
+typedef void (*tp_range_fn_t)(void *ctx, size_t lo, size_t hi, size_t worker);
+
+/*
+ * A parallel for over [0, n) with work stealing. Every worker starts
+ * with an equal slice and takes grain indexes at a time from its front.
+ * A worker whose slice is empty takes the back half of the biggest one
+ * left, so a few expensive indexes do not leave the others idle.
+ */
+typedef struct tp_range_s {
+        pthread_mutex_t mu;
+        size_t lo;
+        size_t hi;
+}__attribute__((aligned(TP_CACHE_LINE))) tp_range_t;
+
+typedef struct tp_job_s {
+        tp_range_fn_t fn;
+        void *ctx;
+        size_t grain;
+        size_t nworkers;
+        tp_range_t ranges[TP_MAX_THREADS];
+        // helpers still running, under the pool mutex
+        size_t running;
+        size_t steals;
+}tp_job_t;
+
+struct tp_pool_s;
+
+typedef struct tp_thread_s {
+        struct tp_pool_s *pool;
+        size_t id;
+        // last job generation seen
+        uint64_t seen;
+        pthread_t thread;
+}tp_thread_t;
+
+typedef struct tp_pool_s {
+        pthread_mutex_t mu;
+        // new job or stop, and the last helper of a job done
+        pthread_cond_t wake;
+        pthread_cond_t idle;
+        tp_thread_t threads[TP_MAX_THREADS - 1];
+        size_t nthreads;
+        bool stop;
+
+        // the running job, its helpers are threads 1 to job_workers - 1
+        tp_job_t *job;
+        size_t job_workers;
+        uint64_t generation;
+        // one tp_for at a time
+        pthread_mutex_t run_mu;
+}tp_pool_t;
+
+// a pool with nthreads helper threads, more are started when a tp_for
+// asks for them
+tp_pool_t *tp_new(size_t nthreads);
+void tp_delete(tp_pool_t *p);
+
+// the pool shared by the library, started on first use and kept for
+// the life of the process
+tp_pool_t *tp_default();
+
+// run fn over [0, n) on nthreads workers (the online CPUs if 0, at most
+// TP_MAX_THREADS) and return once every index is done. Calls on the
+// same pool run one after another, fn must not call tp_for on it.
+// Return the number of ranges stolen.
+size_t tp_for(tp_pool_t *p, size_t n, size_t grain, size_t nthreads,
+              tp_range_fn_t fn, void *ctx);
+
+#endif
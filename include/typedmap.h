@@ -0,0 +1,275 @@
+#ifndef _TYPEDMAP_H
+#define _TYPEDMAP_H
+
+#include <errno.h>
+#include <error.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+#include "slab.h"
+
+/*
+ * Linear hashing maps specialized at compile time for one key and value
+ * type. MAP_DECLARE(name, K, V, hash, eq) emits name_t and static inline
+ * functions taking K and V by value, so the hash, the key compare and
+ * the copies are inlined into the caller instead of going through
+ * k2int, kcmp and memcpy with a runtime size. hash(key) returns a
+ * uint64_t that spreads every bit into the low ones (see hash.h) and
+ * eq(a, b) tells two keys apart, either can be a function or a macro.
+ *
+ * The table is the one of the linear engine: a directory of chained
+ * buckets, split one at a time while the load is above SPLIT_RATIO and
+ * merged while it is at or below SHRINK_RATIO, never below
+ * DEFAULT_INIT_CAP buckets. Entries come from a slab and cache their
+ * hash. Not thread-safe, no marshal, iterate with name_foreach.
+ */
+
+#define TM_SLAB_BYTES (64 << 10)
+
+// the same mixing as hash_int32 and hash_int64, inlined
+static inline uint64_t tm_mix(uint64_t a, uint64_t b)
+{
+        __uint128_t r = (__uint128_t)a * b;
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t tm_hash_u32(uint32_t key)
+{
+        return tm_mix(key ^ 0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL);
+}
+
+static inline uint64_t tm_hash_u64(uint64_t key)
+{
+        return tm_mix(tm_mix(key ^ 0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL),
+                      0x8ebc6af09c88c6e3ULL);
+}
+
+// eq for keys that compare with ==
+#define TM_EQ(a, b) ((a) == (b))
+
+// the cold paths shared by every instance
+
+// grow a directory of *size bucket heads to twice as many, the new ones
+// NULL
+void **tm_grow_dir(void **dir, size_t *size);
+
+// the most entries len buckets hold before a split, and the fewest they
+// hold before a merge, with the rounding of the load of map.c
+size_t tm_grow_at(size_t len);
+size_t tm_shrink_below(size_t cap, size_t len);
+
+#define MAP_DECLARE(name, K, V, hash, eq)                                       \
+                                                                                \
+typedef struct name##_entry_s {                                                 \
+        struct name##_entry_s *next;                                            \
+        uint64_t hash;                                                          \
+        K key;                                                                  \
+        V value;                                                                \
+}name##_entry_t;                                                                \
+                                                                                \
+typedef struct name##_s {                                                       \
+        /* buckets below pos are split to the cap * 2 hash space */             \
+        size_t cap;                                                             \
+        size_t pos;                                                             \
+        size_t used;                                                            \
+        /* room for size bucket heads, cap + pos in use */                      \
+        name##_entry_t **buckets;                                               \
+        size_t size;                                                            \
+        /* split above grow_at entries, merge below shrink_below */             \
+        size_t grow_at;                                                         \
+        size_t shrink_below;                                                    \
+        slab_t slab;                                                            \
+        uint64_t splits;                                                        \
+        uint64_t shrinks;                                                       \
+}name##_t;                                                                      \
+                                                                                \
+static inline void name##_thresholds(name##_t *m)                               \
+{                                                                               \
+        size_t len = m->cap + m->pos;                                           \
+        m->grow_at = tm_grow_at(len);                                           \
+        m->shrink_below = tm_shrink_below(m->cap, len);                         \
+}                                                                               \
+                                                                                \
+static inline name##_t *make_##name(void)                                       \
+{                                                                               \
+        name##_t *m = calloc(1, sizeof(name##_t));                              \
+        if (!m) {                                                               \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);             \
+        }                                                                       \
+        m->cap = DEFAULT_INIT_CAP;                                              \
+        m->size = DEFAULT_INIT_CAP;                                             \
+        m->buckets = calloc(m->size, sizeof(name##_entry_t *));                 \
+        if (!m->buckets) {                                                      \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);             \
+        }                                                                       \
+        sb_init(&m->slab, sizeof(name##_entry_t),                               \
+                TM_SLAB_BYTES / sizeof(name##_entry_t));                        \
+        name##_thresholds(m);                                                   \
+        return m;                                                               \
+}                                                                               \
+                                                                                \
+static inline void delete_##name(name##_t *m)                                   \
+{                                                                               \
+        sb_deinit(&m->slab);                                                    \
+        free(m->buckets);                                                       \
+        free(m);                                                                \
+}                                                                               \
+                                                                                \
+static inline size_t name##_len(name##_t *m)                                    \
+{                                                                               \
+        return m->used;                                                         \
+}                                                                               \
+                                                                                \
+static inline name##_entry_t **name##_bucket(name##_t *m, uint64_t h)           \
+{                                                                               \
+        uint64_t b = h & (m->cap - 1);                                          \
+        if (b < m->pos) {                                                       \
+                b = h & ((m->cap << 1) - 1);                                    \
+        }                                                                       \
+        return &m->buckets[b];                                                  \
+}                                                                               \
+                                                                                \
+static inline name##_entry_t *name##_lookup(name##_t *m, K key, uint64_t h)     \
+{                                                                               \
+        name##_entry_t *e = *name##_bucket(m, h);                               \
+        while (e && !(e->hash == h && eq(e->key, key))) {                       \
+                e = e->next;                                                    \
+        }                                                                       \
+        return e;                                                               \
+}                                                                               \
+                                                                                \
+static __attribute__((unused, noinline))                                        \
+void name##_split(name##_t *m)                                                  \
+{                                                                               \
+        size_t len = m->cap + m->pos;                                           \
+        if (len == m->size) {                                                   \
+                m->buckets = (name##_entry_t **)tm_grow_dir(                    \
+                        (void **)m->buckets, &m->size);                         \
+        }                                                                       \
+        /* the entries that hash to the new bucket move there */                \
+        name##_entry_t **from = &m->buckets[m->pos], **to = &m->buckets[len];   \
+        uint64_t mask = (m->cap << 1) - 1;                                      \
+        while (*from) {                                                         \
+                name##_entry_t *e = *from;                                      \
+                if ((e->hash & mask) == m->pos) {                               \
+                        from = &e->next;                                        \
+                        continue;                                               \
+                }                                                               \
+                *from = e->next;                                                \
+                e->next = NULL;                                                 \
+                *to = e;                                                        \
+                to = &e->next;                                                  \
+        }                                                                       \
+        if (++m->pos == m->cap) {                                               \
+                m->cap <<= 1;                                                   \
+                m->pos = 0;                                                     \
+        }                                                                       \
+        m->splits++;                                                            \
+        name##_thresholds(m);                                                   \
+}                                                                               \
+                                                                                \
+static __attribute__((unused, noinline))                                        \
+void name##_shrink(name##_t *m)                                                 \
+{                                                                               \
+        if (m->pos == 0) {                                                      \
+                m->cap >>= 1;                                                   \
+                m->pos = m->cap;                                                \
+        }                                                                       \
+        m->pos--;                                                               \
+        /* the last bucket goes back into the one it was split from */          \
+        name##_entry_t **last = &m->buckets[m->cap + m->pos];                   \
+        name##_entry_t **into = &m->buckets[m->pos];                            \
+        while (*into) {                                                         \
+                into = &(*into)->next;                                          \
+        }                                                                       \
+        *into = *last;                                                          \
+        *last = NULL;                                                           \
+        m->shrinks++;                                                           \
+        name##_thresholds(m);                                                   \
+}                                                                               \
+                                                                                \
+/* return 0, the value of a key already there is replaced */                    \
+static inline int name##_put(name##_t *m, K key, V value)                       \
+{                                                                               \
+        uint64_t h = hash(key);                                                 \
+        name##_entry_t *e = name##_lookup(m, key, h);                           \
+        if (e) {                                                                \
+                e->value = value;                                               \
+                return 0;                                                       \
+        }                                                                       \
+        e = sb_alloc(&m->slab);                                                 \
+        name##_entry_t **b = name##_bucket(m, h);                               \
+        e->next = *b;                                                           \
+        e->hash = h;                                                            \
+        e->key = key;                                                           \
+        e->value = value;                                                       \
+        *b = e;                                                                 \
+        /* enough splits to bring the load back down, as map.c */               \
+        m->used++;                                                              \
+        while (m->used > m->grow_at) {                                          \
+                name##_split(m);                                                \
+        }                                                                       \
+        return 0;                                                               \
+}                                                                               \
+                                                                                \
+/* return true if found, the value goes to value unless it is NULL */           \
+static inline bool name##_get(name##_t *m, K key, V *value)                     \
+{                                                                               \
+        name##_entry_t *e = name##_lookup(m, key, hash(key));                   \
+        if (!e) {                                                               \
+                return false;                                                   \
+        }                                                                       \
+        if (value) {                                                            \
+                *value = e->value;                                              \
+        }                                                                       \
+        return true;                                                            \
+}                                                                               \
+                                                                                \
+/* the value in place, NULL if not found, valid until the map changes */        \
+static inline V *name##_find(name##_t *m, K key)                                \
+{                                                                               \
+        name##_entry_t *e = name##_lookup(m, key, hash(key));                   \
+        return e ? &e->value : NULL;                                            \
+}                                                                               \
+                                                                                \
+static inline bool name##_haskey(name##_t *m, K key)                            \
+{                                                                               \
+        return name##_lookup(m, key, hash(key)) != NULL;                        \
+}                                                                               \
+                                                                                \
+/* return true if found, false if not */                                        \
+static inline bool name##_delete(name##_t *m, K key)                            \
+{                                                                               \
+        uint64_t h = hash(key);                                                 \
+        name##_entry_t **p = name##_bucket(m, h);                               \
+        while (*p && !((*p)->hash == h && eq((*p)->key, key))) {                \
+                p = &(*p)->next;                                                \
+        }                                                                       \
+        name##_entry_t *e = *p;                                                 \
+        if (!e) {                                                               \
+                return false;                                                   \
+        }                                                                       \
+        *p = e->next;                                                           \
+        sb_free(&m->slab, e);                                                   \
+        if (--m->used < m->shrink_below) {                                      \
+                name##_shrink(m);                                               \
+        }                                                                       \
+        return true;                                                            \
+}                                                                               \
+                                                                                \
+/* fn is called once for every entry, it may change the value but must */       \
+/* not add or remove entries */                                                 \
+static inline void name##_foreach(name##_t *m,                                  \
+                                  void (*fn)(K *key, V *value, void *ctx),      \
+                                  void *ctx)                                    \
+{                                                                               \
+        for (size_t i = 0; i < m->cap + m->pos; i++) {                          \
+                for (name##_entry_t *e = m->buckets[i]; e; e = e->next) {       \
+                        fn(&e->key, &e->value, ctx);                            \
+                }                                                               \
+        }                                                                       \
+}
+
+#endif
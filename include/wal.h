@@ -0,0 +1,139 @@
+#ifndef _WAL_H
+#define _WAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "map.h"
+
+#define WAL_MAGIC 0x314c41574d4dull  /* "MMWAL1" */
+#define WAL_VERSION 1
+
+#define WAL_DEFAULT_INTERVAL_MS 10
+#define WAL_DEFAULT_GROUP_BYTES (1 << 20)
+
+typedef enum wal_sync_e {
+        // records are written by the group, never fsynced: a crash of
+        // the process loses the last group at most, a crash of the
+        // machine whatever the kernel had not written back
+        WAL_SYNC_NONE = 0,
+        // records are written and fsynced by the group from a background
+        // thread, a crash loses the last group at most
+        WAL_SYNC_GROUP,
+        // every change is written and fsynced before the call returns
+        WAL_SYNC_ALWAYS,
+}wal_sync_t;
+
+typedef struct wal_opts_s {
+        wal_sync_t sync;
+        // a group is written once it is interval_ms old or group_bytes
+        // long, zeros pick the defaults above
+        unsigned interval_ms;
+        size_t group_bytes;
+        // start a background mm_wal_compact once the log grows past
+        // this, 0 leaves compaction to the caller
+        size_t compact_bytes;
+}wal_opts_t;
+
+// first bytes of a log
+typedef struct wal_header_s {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t key_size;
+        uint64_t value_size;
+}wal_header_t;
+
+// a log record is this header, the key, then the value of a WAL_PUT
+#define WAL_PUT 1
+#define WAL_DELETE 2
+
+typedef struct wal_record_s {
+        // CRC-32C of the type, key and value
+        uint32_t crc;
+        uint32_t type;
+}wal_record_t;
+
+/*
+ * A write-ahead log attached to a map. The base image at path is an
+ * mm_marshal file and path.log holds every mm_put, mm_put_batch and
+ * mm_delete since, so a crashed process gets its map back with the
+ * cost of one unmarshal and a replay of the changes only.
+ *
+ * Records go to a buffer and a background thread writes them out by
+ * the group, one write and at most one fsync per group (group commit).
+ *
+ * Compaction renames the log to path.log.old, starts a new one and
+ * takes an mm_snapshot, which a background thread marshals to
+ * path.tmp and renames over the base before removing the old log. A
+ * record is a whole put or delete, so replaying a log over a base that
+ * already holds it leaves the same map, and a crash at any point of a
+ * compaction recovers from the files left.
+ */
+typedef struct map_wal_s {
+        map_t *m;
+        char *path;
+        char *log_path;
+        char *old_path;
+        char *tmp_path;
+        wal_opts_t opts;
+        int fd;
+        // bytes in the current log, records buffered included
+        size_t log_bytes;
+
+        pthread_mutex_t mu;
+        // wakes the flusher, and writers waiting on a flush
+        pthread_cond_t wake;
+        pthread_cond_t flushed;
+        // records not yet taken by a flush, and the buffer a flush writes
+        char *buf;
+        size_t len;
+        size_t cap;
+        char *spare;
+        size_t spare_cap;
+        // a flush is writing the spare buffer outside the mutex
+        bool flushing;
+        bool stop;
+        // first write error, every later call fails
+        int err;
+        bool has_flusher;
+        pthread_t flusher;
+
+        // the background compaction, done is set once it is over
+        bool compacting;
+        int compact_done;
+        int compact_err;
+        map_snapshot_t *snap;
+        pthread_t compactor;
+}map_wal_t;
+
+// load the base image at path and replay the logs into m, then log
+// every change of m from now on. A log with a torn last record is cut
+// back to its last whole one, a compaction a crash left half done is
+// finished first. m must be empty, neither concurrent, variable-length
+// nor mapped, opts can be NULL for group commit with the defaults.
+// Return 0 on success, -1 if the files do not load or are not of a map
+// of this key and value size.
+int mm_wal_open(map_t *m, const char *path, const wal_opts_t *opts);
+
+// write and fsync every change logged so far, return 0, -1 on a write
+// error
+int mm_wal_sync(map_t *m);
+
+// roll the log into a new base image. The snapshot is written in the
+// background unless wait is set, the map is written in place if it
+// cannot be snapshotted. One compaction at a time, a new one waits for
+// the last. Return 0 on success, -1 on a write error, and with wait the
+// result of the compaction.
+int mm_wal_compact(map_t *m, bool wait);
+
+// sync the log, wait for a running compaction and detach the log from
+// m, which delete_map does as well. Return 0, -1 if a write or a
+// compaction failed.
+int mm_wal_close(map_t *m);
+
+// append a record of a change of m, called by the map, return 0, -1 on
+// a write error
+int wal_log(map_wal_t *w, uint32_t type, const void *key, const void *value);
+
+#endif
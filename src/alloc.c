@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+static void *libc_alloc(void *ctx, size_t size)
+{
+        return malloc(size);
+}
+
+static void *libc_realloc(void *ctx, void *p, size_t old_size, size_t new_size)
+{
+        return realloc(p, new_size);
+}
+
+static void libc_free(void *ctx, void *p, size_t size)
+{
+        free(p);
+}
+
+const allocator_t al_libc = {
+        .alloc = libc_alloc,
+        .realloc = libc_realloc,
+        .free = libc_free,
+};
+
+void *al_alloc(const allocator_t *al, size_t size)
+{
+        void *p = al->alloc(al->ctx, size);
+        if (!p) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        return p;
+}
+
+void *al_calloc(const allocator_t *al, size_t size)
+{
+        if (al == &al_libc) {
+                void *p = calloc(1, size);
+                if (!p) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                return p;
+        }
+        return memset(al_alloc(al, size), 0, size);
+}
+
+void *al_realloc(const allocator_t *al, void *p, size_t old_size, size_t new_size)
+{
+        p = al->realloc(al->ctx, p, old_size, new_size);
+        if (!p) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        return p;
+}
+
+void al_free(const allocator_t *al, void *p, size_t size)
+{
+        if (p) {
+                al->free(al->ctx, p, size);
+        }
+}
+
+#ifdef TESTALLOC
+// testing
+#include <assert.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "link_list.h"
+#include "map.h"
+
+#define NKEYS 100000
+
+// keeps the size of every block in front of it, so a free with another
+// size than the block was asked with is caught
+typedef struct counting_s {
+        size_t blocks;
+        size_t bytes;
+}counting_t;
+
+static void *counting_alloc(void *ctx, size_t size)
+{
+        counting_t *c = ctx;
+        size_t *p = malloc(sizeof(size_t) + size);
+        *p = size;
+        c->blocks++;
+        c->bytes += size;
+        return p + 1;
+}
+
+static void counting_free(void *ctx, void *p, size_t size)
+{
+        counting_t *c = ctx;
+        size_t *block = (size_t *)p - 1;
+        assert(*block == size);
+        c->blocks--;
+        c->bytes -= size;
+        free(block);
+}
+
+static void *counting_realloc(void *ctx, void *p, size_t old_size, size_t new_size)
+{
+        void *q = counting_alloc(ctx, new_size);
+        if (p) {
+                memcpy(q, p, old_size < new_size ? old_size : new_size);
+                counting_free(ctx, p, old_size);
+        }
+        return q;
+}
+
+static void churn(map_t *m)
+{
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                uint64_t v = k * 3;
+                mm_put(m, &k, &v);
+        }
+        for (uint64_t k = 0; k < NKEYS; k += 2) {
+                assert(mm_delete(m, &k));
+        }
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                uint64_t v;
+                assert(mm_get(m, &k, &v) == (k % 2 == 1));
+                assert(k % 2 == 0 || v == k * 3);
+        }
+}
+
+int main(int argc, char *argv[])
+{
+        printf("=== RUN Counting Test ===\n");
+        counting_t c = {0};
+        allocator_t counting = {
+                .alloc = counting_alloc,
+                .realloc = counting_realloc,
+                .free = counting_free,
+                .ctx = &c,
+        };
+        slice_t *s = make_slice_alloc(0, sizeof(int), NULL, &counting);
+        for (int i = 0; i < 1000; i++) {
+                ss_append(s, &i);
+        }
+        ss_reserve(s, 5000);
+        assert(c.blocks == 2 && c.bytes == sizeof(slice_t) + 5000 * sizeof(int));
+        delete_slice(s);
+        assert(c.blocks == 0 && c.bytes == 0);
+
+        list_t *l = ll_new_list_alloc(sizeof(int), NULL, &counting);
+        for (int i = 0; i < 100; i++) {
+                ll_append(l, &i);
+                ll_push(l, &i);
+        }
+        int item;
+        ll_pop(l, &item);
+        ll_remove(l, &item);
+        assert(c.blocks == 1 + 2 + 2 * 198);
+        ll_delete_list(l);
+        assert(c.blocks == 0 && c.bytes == 0);
+
+        map_opts_t opts = {
+                .resize_step = 4,
+                .allocator = &counting,
+        };
+        map_t *m = make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+        churn(m);
+        // shrinks left spare buckets
+        assert(m->shrinks > 0 && m->spare_buckets && c.blocks > 0);
+        delete_map(m);
+        assert(c.blocks == 0 && c.bytes == 0);
+
+        opts.engine = MAP_ENGINE_FLAT;
+        m = make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+        churn(m);
+        assert(m->splits > 0);
+        delete_map(m);
+        assert(c.blocks == 0 && c.bytes == 0);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Arena Test ===\n");
+        arena_t a;
+        allocator_t bump;
+        ar_init(&a, 1 << 20);
+        ar_allocator(&a, &bump);
+        opts.engine = MAP_ENGINE_LINEAR;
+        opts.allocator = &bump;
+        for (int round = 0; round < 3; round++) {
+                m = make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+                churn(m);
+                s = make_slice_alloc(0, sizeof(uint64_t), NULL, &bump);
+                for (uint64_t k = 0; k < NKEYS; k++) {
+                        ss_append(s, &k);
+                }
+                assert(a.allocated > NKEYS * 2 * sizeof(uint64_t));
+                // the map and the slice go with the arena
+                ar_reset(&a);
+                assert(a.nchunks == 1 && a.allocated == 0);
+        }
+        ar_deinit(&a);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Refuse Test ===\n");
+        opts.allocator = &counting;
+        opts.concurrent = true;
+        assert(make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts) == NULL);
+        opts.concurrent = false;
+        opts.varlen = true;
+        assert(make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts) == NULL);
+        assert(c.blocks == 0);
+        // the default allocator takes either
+        opts.allocator = NULL;
+        m = make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+        assert(m && m->al == &al_libc);
+        delete_map(m);
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif
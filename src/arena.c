@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 8
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+// a chunk starts with a header so the allocations stay aligned
+typedef struct chunk_header_s {
+        struct chunk_header_s *next;
+}chunk_header_t;
+
+#define CHUNK_HEADER_SIZE ALIGN_UP(sizeof(chunk_header_t), ARENA_ALIGN)
+
+void ar_init(arena_t *a, size_t chunk_size)
+{
+        a->chunk_size = chunk_size > 0 ? ALIGN_UP(chunk_size, ARENA_ALIGN) : ARENA_ALIGN;
+        a->chunks = NULL;
+        a->bump = NULL;
+        a->bump_end = NULL;
+        a->nchunks = 0;
+        a->size = 0;
+        a->allocated = 0;
+}
+
+static char *new_chunk(arena_t *a, size_t size)
+{
+        chunk_header_t *chunk = malloc(CHUNK_HEADER_SIZE + size);
+        if (!chunk) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        a->nchunks++;
+        a->size += size;
+        return (char *)chunk + CHUNK_HEADER_SIZE;
+}
+
+void *ar_alloc(arena_t *a, size_t n)
+{
+        n = ALIGN_UP(n, ARENA_ALIGN);
+        a->allocated += n;
+
+        // big requests would waste most of a shared chunk
+        if (n > a->chunk_size / 4) {
+                return new_chunk(a, n);
+        }
+        if ((size_t)(a->bump_end - a->bump) < n) {
+                a->bump = new_chunk(a, a->chunk_size);
+                a->bump_end = a->bump + a->chunk_size;
+        }
+        void *p = a->bump;
+        a->bump += n;
+        return p;
+}
+
+void *ar_realloc(arena_t *a, void *p, size_t old_size, size_t new_size)
+{
+        old_size = ALIGN_UP(old_size, ARENA_ALIGN);
+        new_size = ALIGN_UP(new_size, ARENA_ALIGN);
+        if (new_size <= old_size) {
+                return p;
+        }
+        // the last allocation can grow into the rest of the chunk
+        if (p && (char *)p + old_size == a->bump && (size_t)(a->bump_end - (char *)p) >= new_size) {
+                a->bump = (char *)p + new_size;
+                a->allocated += new_size - old_size;
+                return p;
+        }
+        void *q = ar_alloc(a, new_size);
+        if (p) {
+                memcpy(q, p, old_size);
+        }
+        return q;
+}
+
+void ar_reset(arena_t *a)
+{
+        if (!a->bump) {
+                ar_deinit(a);
+                return;
+        }
+        chunk_header_t *keep = (chunk_header_t *)(a->bump_end - a->chunk_size - CHUNK_HEADER_SIZE);
+        chunk_header_t *chunk = a->chunks;
+        while (chunk) {
+                chunk_header_t *next = chunk->next;
+                if (chunk != keep) {
+                        free(chunk);
+                }
+                chunk = next;
+        }
+        keep->next = NULL;
+        a->chunks = keep;
+        a->nchunks = 1;
+        a->size = a->chunk_size;
+        a->allocated = 0;
+        a->bump = (char *)keep + CHUNK_HEADER_SIZE;
+}
+
+void ar_deinit(arena_t *a)
+{
+        chunk_header_t *chunk = a->chunks;
+        while (chunk) {
+                chunk_header_t *next = chunk->next;
+                free(chunk);
+                chunk = next;
+        }
+        ar_init(a, a->chunk_size);
+}
+
+static void *arena_alloc(void *ctx, size_t size)
+{
+        return ar_alloc(ctx, size);
+}
+
+static void *arena_realloc(void *ctx, void *p, size_t old_size, size_t new_size)
+{
+        return ar_realloc(ctx, p, old_size, new_size);
+}
+
+static void arena_free(void *ctx, void *p, size_t size)
+{
+}
+
+void ar_allocator(arena_t *a, allocator_t *al)
+{
+        al->alloc = arena_alloc;
+        al->realloc = arena_realloc;
+        al->free = arena_free;
+        al->ctx = a;
+}
+
+#ifdef TESTARENA
+// testing
+#include <assert.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[])
+{
+        arena_t a;
+        char *ptrs[100];
+
+        ar_init(&a, 1000);
+        for (int i = 0; i < 100; i++) {
+                ptrs[i] = ar_alloc(&a, i + 1);
+                assert(((uintptr_t)ptrs[i] & (ARENA_ALIGN - 1)) == 0);
+                memset(ptrs[i], i, i + 1);
+        }
+        printf("allocated %zu, nchunks %zu\n", a.allocated, a.nchunks);
+        for (int i = 0; i < 100; i++) {
+                for (int j = 0; j <= i; j++) {
+                        assert((unsigned char)ptrs[i][j] == i);
+                }
+        }
+
+        // a big request leaves the current chunk alone
+        char *bump = a.bump;
+        size_t nchunks = a.nchunks;
+        char *big = ar_alloc(&a, 5000);
+        memset(big, 0xff, 5000);
+        assert(a.bump == bump && a.nchunks == nchunks + 1);
+        assert(a.size == 1000 * nchunks + 5000);
+
+        // an allocation in the middle is copied
+        char *moved = ar_realloc(&a, ptrs[98], 99, 200);
+        assert(moved != ptrs[98] && moved[98] == 98);
+        assert(ar_realloc(&a, moved, 200, 50) == moved);
+
+        // one chunk stays, and the last allocation grows in place
+        ar_reset(&a);
+        assert(a.allocated == 0 && a.nchunks == 1 && a.size == 1000);
+        char *last = ar_alloc(&a, 10);
+        assert(last == (char *)a.chunks + CHUNK_HEADER_SIZE);
+        assert(ar_realloc(&a, last, 10, 100) == last && a.bump == last + 104);
+        assert(a.allocated == 104);
+
+        ar_deinit(&a);
+        assert(a.allocated == 0 && a.nchunks == 0 && a.size == 0 && a.chunk_size == 1000);
+        return 0;
+}
+
+#endif
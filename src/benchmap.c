@@ -1,17 +1,27 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "bloom.h"
+#include "btree.h"
+#include "hashset.h"
+#include "lru.h"
 #include "map.h"
+#include "shardmap.h"
+#include "typedmap.h"
+#include "wal.h"
 
 static const int limit = 1000000;
 static const int trial = 10;
 
-uint64_t toint(const void *key, size_t key_size)
-{
-        return (uint64_t)*(int *)key;
-}
-
 void shuffle(int s[], int len)
 {
         for (int i = 0; i < len; i++) {
@@ -25,41 +35,1554 @@ void shuffle(int s[], int len)
         }
 }
 
+static double now_sec()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+///////////////////////////////////////////////////
+//           concurrent scaling bench            //
+///////////////////////////////////////////////////
+
+static const int conc_keys = 1000000;
+static const int conc_ops = 2000000;
+
+typedef struct worker_arg_s {
+        map_t *m;
+        // serializes the whole map for the global lock baseline, NULL otherwise
+        pthread_mutex_t *global;
+        unsigned int seed;
+        int ops;
+}worker_arg_t;
+
+// 90% gets, 10% puts over the preloaded keys
+static void *mixed_worker(void *arg)
+{
+        worker_arg_t *w = arg;
+        for (int i = 0; i < w->ops; i++) {
+                int k = rand_r(&w->seed) % conc_keys, v;
+                bool get = rand_r(&w->seed) % 10 != 0;
+                if (w->global) {
+                        pthread_mutex_lock(w->global);
+                }
+                if (get) {
+                        mm_get(w->m, &k, &v);
+                } else {
+                        mm_put(w->m, &k, &k);
+                }
+                if (w->global) {
+                        pthread_mutex_unlock(w->global);
+                }
+        }
+        return NULL;
+}
+
+static double run_mixed(map_t *m, pthread_mutex_t *global, int nthreads)
+{
+        pthread_t threads[nthreads];
+        worker_arg_t args[nthreads];
+
+        double start = now_sec();
+        for (int i = 0; i < nthreads; i++) {
+                args[i].m = m;
+                args[i].global = global;
+                args[i].seed = i + 1;
+                args[i].ops = conc_ops / nthreads;
+                pthread_create(&threads[i], NULL, mixed_worker, &args[i]);
+        }
+        for (int i = 0; i < nthreads; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        return conc_ops / (now_sec() - start);
+}
+
+static void bench_concurrent(int max_threads)
+{
+        map_opts_t opts = {
+                .engine = MAP_ENGINE_LINEAR,
+                .concurrent = true,
+        };
+        map_t *cm = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts);
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+        for (int i = 0; i < conc_keys; i++) {
+                mm_put(cm, &i, &i);
+                mm_put(m, &i, &i);
+        }
+
+        printf("threads  striped-locks(ops/s)  global-mutex(ops/s)\n");
+        for (int t = 1; t <= max_threads; t <<= 1) {
+                double striped = run_mixed(cm, NULL, t);
+                double global_lock = run_mixed(m, &global, t);
+                printf("%7d  %20.0f  %19.0f\n", t, striped, global_lock);
+        }
+        delete_map(cm);
+        delete_map(m);
+}
+
+///////////////////////////////////////////////////
+//        read scaling with a busy writer         //
+///////////////////////////////////////////////////
+
+static const int read_ops = 2000000;
+
+typedef struct writer_arg_s {
+        map_t *m;
+        int stop;
+        long ops;
+}writer_arg_t;
+
+// updates the preloaded keys and churns fresh ones, so the table keeps
+// splitting and shrinking under the readers
+static void *busy_writer(void *arg)
+{
+        writer_arg_t *w = arg;
+        unsigned int seed = 0;
+        int churn = conc_keys;
+        while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+                int k = rand_r(&seed) % conc_keys;
+                mm_put(w->m, &k, &k);
+                mm_put(w->m, &churn, &churn);
+                if (churn - conc_keys >= conc_keys / 10) {
+                        for (int i = conc_keys; i <= churn; i++) {
+                                mm_delete(w->m, &i);
+                        }
+                        churn = conc_keys;
+                } else {
+                        churn++;
+                }
+                w->ops += 2;
+        }
+        return NULL;
+}
+
+static void *read_worker(void *arg)
+{
+        worker_arg_t *w = arg;
+        for (int i = 0; i < w->ops; i++) {
+                int k = rand_r(&w->seed) % conc_keys, v;
+                mm_get(w->m, &k, &v);
+        }
+        return NULL;
+}
+
+static void bench_read_scaling(int max_threads)
+{
+        map_opts_t opts = {
+                .engine = MAP_ENGINE_LINEAR,
+                .concurrent = true,
+        };
+        map_t *m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts);
+        for (int i = 0; i < conc_keys; i++) {
+                mm_put(m, &i, &i);
+        }
+
+        printf("readers  reads/s  writer ops/s\n");
+        for (int t = 1; t <= max_threads; t <<= 1) {
+                pthread_t writer, threads[t];
+                writer_arg_t wa = {
+                        .m = m,
+                };
+                worker_arg_t args[t];
+                pthread_create(&writer, NULL, busy_writer, &wa);
+
+                double start = now_sec();
+                for (int i = 0; i < t; i++) {
+                        args[i].m = m;
+                        args[i].global = NULL;
+                        args[i].seed = i + 1;
+                        args[i].ops = read_ops / t;
+                        pthread_create(&threads[i], NULL, read_worker, &args[i]);
+                }
+                for (int i = 0; i < t; i++) {
+                        pthread_join(threads[i], NULL);
+                }
+                double elapsed = now_sec() - start;
+                __atomic_store_n(&wa.stop, 1, __ATOMIC_RELEASE);
+                pthread_join(writer, NULL);
+                printf("%7d  %7.0f  %12.0f\n", t, read_ops / elapsed, wa.ops / elapsed);
+        }
+        delete_map(m);
+}
+
+///////////////////////////////////////////////////
+//         unmarshal vs mapped file startup      //
+///////////////////////////////////////////////////
+
+static void bench_mapped()
+{
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        for (int i = 0; i < limit; i++) {
+                mm_put(m, &i, &i);
+        }
+        mm_marshal_flags("bench.map", m, MM_MARSHAL_HASH);
+        mm_marshal_mapped("bench.mapped", m);
+        delete_map(m);
+
+        double start = now_sec();
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        mm_unmarshal("bench.map", m);
+        double loaded = now_sec() - start;
+
+        start = now_sec();
+        map_t *mp = mm_open_mapped("bench.mapped", NULL, NULL);
+        double opened = now_sec() - start;
+        assert(mp);
+
+        unsigned int seed = 1;
+        double gets[2];
+        map_t *maps[2] = {m, mp};
+        for (int t = 0; t < 2; t++) {
+                start = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        int k = rand_r(&seed) % limit, v;
+                        mm_get(maps[t], &k, &v);
+                }
+                gets[t] = limit / (now_sec() - start);
+        }
+        printf("%d entries\n", limit);
+        printf("mm_unmarshal:   %10.6fs, then %.0f gets/s\n", loaded, gets[0]);
+        printf("mm_open_mapped: %10.6fs, then %.0f gets/s\n", opened, gets[1]);
+
+        delete_map(m);
+        delete_map(mp);
+        unlink("bench.map");
+        unlink("bench.mapped");
+}
+
+///////////////////////////////////////////////////
+//          batched vs scalar lookups            //
+///////////////////////////////////////////////////
+
+static const int batch_lookups = 4000000;
+
+static void bench_batch(map_opts_t *opts)
+{
+        map_t *m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, opts);
+        for (int i = 0; i < limit; i++) {
+                mm_put(m, &i, &i);
+        }
+        int *keys = malloc(batch_lookups * sizeof(int));
+        int *vals = malloc(batch_lookups * sizeof(int));
+        unsigned int seed = 1;
+        for (int i = 0; i < batch_lookups; i++) {
+                keys[i] = rand_r(&seed) % limit;
+        }
+
+        double start = now_sec();
+        for (int i = 0; i < batch_lookups; i++) {
+                mm_get(m, &keys[i], &vals[i]);
+        }
+        printf("batch     gets/s\n");
+        printf("scalar  %8.0f\n", batch_lookups / (now_sec() - start));
+
+        int sizes[] = {1, 4, 16, 64, 256, 512};
+        for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                start = now_sec();
+                for (int i = 0; i < batch_lookups; i += sizes[s]) {
+                        int n = batch_lookups - i < sizes[s] ? batch_lookups - i : sizes[s];
+                        mm_get_batch(m, &keys[i], n, &vals[i], NULL);
+                }
+                printf("%6d  %8.0f\n", sizes[s], batch_lookups / (now_sec() - start));
+        }
+        for (int i = 0; i < batch_lookups; i++) {
+                assert(vals[i] == keys[i]);
+        }
+        free(keys);
+        free(vals);
+        delete_map(m);
+}
+
+///////////////////////////////////////////////////
+//          foreground vs background dump        //
+///////////////////////////////////////////////////
+
+static void bench_marshal()
+{
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        for (int i = 0; i < limit; i++) {
+                mm_put(m, &i, &i);
+        }
+
+        int modes[] = {0, MM_MARSHAL_BACKGROUND, MM_MARSHAL_FSYNC,
+                       MM_MARSHAL_BACKGROUND | MM_MARSHAL_FSYNC};
+        const char *names[] = {"plain", "background", "fsync", "background+fsync"};
+        for (int i = 0; i < 4; i++) {
+                double start = now_sec();
+                mm_marshal_flags("bench.map", m, modes[i]);
+                printf("%-17s %.6fs\n", names[i], now_sec() - start);
+        }
+
+        double start = now_sec();
+        map_t *loaded = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_unmarshal("bench.map", loaded) == 0);
+        printf("%-17s %.6fs\n", "unmarshal", now_sec() - start);
+
+        delete_map(loaded);
+        delete_map(m);
+        unlink("bench.map");
+}
+
+///////////////////////////////////////////////////
+//        padded vs variable-length strings      //
+///////////////////////////////////////////////////
+
+#define VAR_MAX_KEY 64
+
+// string keys of 8 to VAR_MAX_KEY bytes, most of them short
+static int var_key(char *key, int i)
+{
+        int len = 8 + (i * 2654435761u) % (VAR_MAX_KEY - 7) * (i % 4 == 0);
+        int n = snprintf(key, VAR_MAX_KEY + 1, "%07d-", i);
+        memset(key + n, 'x', len > n ? len - n : 0);
+        return len > n ? len : n;
+}
+
+static size_t entry_bytes(map_t *m)
+{
+        return m->slab.nslabs * m->slab.slots_per_slab * m->slab.slot_size
+                + m->arena.allocated;
+}
+
+static void bench_varlen()
+{
+        map_opts_t opts = {
+                .varlen = true,
+        };
+        map_t *padded = make_map(VAR_MAX_KEY, sizeof(int), NULL, NULL);
+        map_t *var = make_map_opts(16, sizeof(int), NULL, NULL, &opts);
+        char key[VAR_MAX_KEY + 1];
+
+        double start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                memset(key, 0, sizeof(key));
+                var_key(key, i);
+                mm_put(padded, key, &i);
+        }
+        double padded_put = limit / (now_sec() - start);
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                int len = var_key(key, i);
+                mm_put_var(var, key, len, &i, sizeof(i));
+        }
+        double var_put = limit / (now_sec() - start);
+
+        unsigned int seed = 1;
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                int v;
+                memset(key, 0, sizeof(key));
+                var_key(key, rand_r(&seed) % limit);
+                mm_get(padded, key, &v);
+        }
+        double padded_get = limit / (now_sec() - start);
+        seed = 1;
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                void *v;
+                int len = var_key(key, rand_r(&seed) % limit);
+                mm_get_var(var, key, len, &v, NULL);
+        }
+        double var_get = limit / (now_sec() - start);
+
+        printf("%d string keys, %d to %d bytes\n", limit, 8, VAR_MAX_KEY);
+        printf("          entry MB    puts/s    gets/s\n");
+        printf("padded  %10.1f %9.0f %9.0f\n", entry_bytes(padded) / 1e6, padded_put, padded_get);
+        printf("varlen  %10.1f %9.0f %9.0f\n", entry_bytes(var) / 1e6, var_put, var_get);
+        delete_map(padded);
+        delete_map(var);
+}
+
+///////////////////////////////////////////////////
+//           resize policies under churn         //
+///////////////////////////////////////////////////
+
+static const int churn_ops = 2000000;
+
+static void bench_churn()
+{
+        map_opts_t policies[] = {
+                {.split_ratio = SPLIT_RATIO, .shrink_ratio = SPLIT_RATIO},
+                {.split_ratio = SPLIT_RATIO},
+                {.split_ratio = SPLIT_RATIO, .resize_step = 8},
+                {.split_ratio = SPLIT_RATIO, .never_shrink = true},
+        };
+        const char *names[] = {"one ratio", "hysteresis", "hysteresis step 8", "never shrink"};
+
+        printf("%-18s %14s %14s %14s\n", "policy", "threshold ns", "resizes/op", "fill+drain ns");
+        for (int p = 0; p < 4; p++) {
+                map_t *m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &policies[p]);
+
+                // stop right after a split, then delete and put back the same key
+                int k = 0;
+                size_t len = m->s->len;
+                while (k < limit || m->s->len == len) {
+                        len = m->s->len;
+                        mm_put(m, &k, &k);
+                        k++;
+                }
+                k--;
+                long resizes = 0;
+                double start = now_sec();
+                for (int i = 0; i < churn_ops; i++) {
+                        len = m->s->len;
+                        if (i % 2 == 0) {
+                                mm_delete(m, &k);
+                        } else {
+                                mm_put(m, &k, &k);
+                        }
+                        resizes += m->s->len != len;
+                }
+                double threshold = (now_sec() - start) * 1e9 / churn_ops;
+                delete_map(m);
+
+                // grow from empty and drain again
+                m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &policies[p]);
+                start = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        mm_put(m, &i, &i);
+                }
+                for (int i = 0; i < limit; i++) {
+                        mm_delete(m, &i);
+                }
+                double cycle = (now_sec() - start) * 1e9 / (2 * limit);
+                delete_map(m);
+
+                printf("%-18s %14.1f %14.3f %14.1f\n", names[p], threshold,
+                       (double)resizes / churn_ops, cycle);
+        }
+}
+
+///////////////////////////////////////////////////
+//        writes during a snapshot dump          //
+///////////////////////////////////////////////////
+
+typedef struct dump_arg_s {
+        map_snapshot_t *snap;
+        int done;
+}dump_arg_t;
+
+static void *snapshot_dumper(void *arg)
+{
+        dump_arg_t *d = arg;
+        mm_snapshot_marshal("bench.map", d->snap, 0);
+        mm_snapshot_release(d->snap);
+        __atomic_store_n(&d->done, 1, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+static void bench_snapshot()
+{
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        for (int i = 0; i < limit; i++) {
+                mm_put(m, &i, &i);
+        }
+
+        // a plain dump holds every write back until it is done
+        double start = now_sec();
+        mm_marshal("bench.map", m);
+        printf("mm_marshal          %.6fs writes blocked\n", now_sec() - start);
+
+        start = now_sec();
+        dump_arg_t d = {
+                .snap = mm_snapshot(m),
+        };
+        double taken = now_sec() - start;
+        pthread_t dumper;
+        pthread_create(&dumper, NULL, snapshot_dumper, &d);
+        unsigned int seed = 1;
+        long puts = 0;
+        start = now_sec();
+        while (!__atomic_load_n(&d.done, __ATOMIC_ACQUIRE)) {
+                int k = rand_r(&seed) % limit, v = -k;
+                mm_put(m, &k, &v);
+                puts++;
+        }
+        double dumping = now_sec() - start;
+        pthread_join(dumper, NULL);
+        printf("mm_snapshot         %.6fs writes blocked, dumped in %.6fs\n", taken, dumping);
+        printf("puts meanwhile      %ld, %.0f puts/s\n", puts, puts / dumping);
+        delete_map(m);
+        unlink("bench.map");
+}
+
+///////////////////////////////////////////////////
+//       put throughput by log fsync policy      //
+///////////////////////////////////////////////////
+
+// an fsync per put takes this many puts only
+static const int always_puts = 10000;
+
+static void bench_wal()
+{
+        const char *names[] = {"none", "group", "always"};
+        wal_sync_t policies[] = {WAL_SYNC_NONE, WAL_SYNC_GROUP, WAL_SYNC_ALWAYS};
+
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        double start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                mm_put(m, &i, &i);
+        }
+        printf("policy   puts/s     close(s)\n");
+        printf("%-7s  %9.0f  %8.6f\n", "no log", limit / (now_sec() - start), 0.0);
+        delete_map(m);
+
+        for (int p = 0; p < 3; p++) {
+                int n = policies[p] == WAL_SYNC_ALWAYS ? always_puts : limit;
+                wal_opts_t opts = {
+                        .sync = policies[p],
+                };
+                unlink("bench.wal");
+                unlink("bench.wal.log");
+                m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+                mm_wal_open(m, "bench.wal", &opts);
+                start = now_sec();
+                for (int i = 0; i < n; i++) {
+                        mm_put(m, &i, &i);
+                }
+                double put = now_sec() - start;
+                start = now_sec();
+                mm_wal_close(m);
+                printf("%-7s  %9.0f  %8.6f\n", names[p], n / put, now_sec() - start);
+                delete_map(m);
+        }
+
+        // the log of the last policy above, then a million puts compacted
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        start = now_sec();
+        mm_wal_open(m, "bench.wal", NULL);
+        printf("recovery from a %d record log  %.6fs\n", always_puts, now_sec() - start);
+        for (int i = always_puts; i < limit; i++) {
+                mm_put(m, &i, &i);
+        }
+        start = now_sec();
+        mm_wal_compact(m, false);
+        double blocked = now_sec() - start;
+        mm_wal_compact(m, true);
+        printf("compaction     %.6fs writes blocked, %.6fs in all\n", blocked, now_sec() - start);
+        delete_map(m);
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        start = now_sec();
+        mm_wal_open(m, "bench.wal", NULL);
+        printf("recovery from the base image    %.6fs, %zu entries\n", now_sec() - start, m->used);
+        delete_map(m);
+        unlink("bench.wal");
+        unlink("bench.wal.log");
+}
+
+///////////////////////////////////////////////////
+//      generic map against MAP_DECLARE ones     //
+///////////////////////////////////////////////////
+
+typedef struct point_s {
+        int32_t x;
+        int32_t y;
+        int64_t z;
+}point_t;
+
+MAP_DECLARE(u64map, uint64_t, uint64_t, tm_hash_u64, TM_EQ)
+MAP_DECLARE(pointmap, uint32_t, point_t, tm_hash_u32, TM_EQ)
+
+static void print_typed(const char *name, double put, double get, double del)
+{
+        double n = (double)trial * limit;
+        printf("%-24s put %5.1fns  get %5.1fns  delete %5.1fns\n",
+               name, put * 1e9 / n, get * 1e9 / n, del * 1e9 / n);
+}
+
+static void bench_typed()
+{
+        uint64_t *keys = malloc(limit * sizeof(uint64_t));
+        int *s = malloc(limit * sizeof(int));
+        for (int i = 0; i < limit; i++) {
+                s[i] = i;
+        }
+        double put[4] = {0}, get[4] = {0}, del[4] = {0}, t;
+        for (int r = 0; r < trial; r++) {
+                shuffle(s, limit);
+                for (int i = 0; i < limit; i++) {
+                        keys[i] = (uint64_t)s[i] * 0x9e3779b97f4a7c15ULL;
+                }
+
+                map_t *m = make_map(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL);
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        mm_put(m, &keys[i], &keys[i]);
+                }
+                put[0] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        uint64_t v;
+                        mm_get(m, &keys[i], &v);
+                        assert(v == keys[i]);
+                }
+                get[0] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        mm_delete(m, &keys[i]);
+                }
+                del[0] += now_sec() - t;
+                delete_map(m);
+
+                u64map_t *um = make_u64map();
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        u64map_put(um, keys[i], keys[i]);
+                }
+                put[1] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        uint64_t v;
+                        u64map_get(um, keys[i], &v);
+                        assert(v == keys[i]);
+                }
+                get[1] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        u64map_delete(um, keys[i]);
+                }
+                del[1] += now_sec() - t;
+                delete_u64map(um);
+
+                m = make_map(sizeof(uint32_t), sizeof(point_t), NULL, NULL);
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        uint32_t k = s[i];
+                        point_t p = {s[i], -s[i], s[i]};
+                        mm_put(m, &k, &p);
+                }
+                put[2] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        uint32_t k = s[i];
+                        point_t p;
+                        mm_get(m, &k, &p);
+                        assert(p.x == s[i]);
+                }
+                get[2] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        uint32_t k = s[i];
+                        mm_delete(m, &k);
+                }
+                del[2] += now_sec() - t;
+                delete_map(m);
+
+                pointmap_t *pm = make_pointmap();
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        point_t p = {s[i], -s[i], s[i]};
+                        pointmap_put(pm, s[i], p);
+                }
+                put[3] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        point_t p;
+                        pointmap_get(pm, s[i], &p);
+                        assert(p.x == s[i]);
+                }
+                get[3] += now_sec() - t;
+                t = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        pointmap_delete(pm, s[i]);
+                }
+                del[3] += now_sec() - t;
+                delete_pointmap(pm);
+        }
+        print_typed("map_t u64 -> u64", put[0], get[0], del[0]);
+        print_typed("MAP_DECLARE u64 -> u64", put[1], get[1], del[1]);
+        print_typed("map_t u32 -> point", put[2], get[2], del[2]);
+        print_typed("MAP_DECLARE u32 -> point", put[3], get[3], del[3]);
+        free(keys);
+        free(s);
+}
+
+///////////////////////////////////////////////////
+//         map with no value against a set       //
+///////////////////////////////////////////////////
+
+static void bench_set()
+{
+        uint64_t *keys = malloc(limit * sizeof(uint64_t));
+        for (int i = 0; i < limit; i++) {
+                keys[i] = (uint64_t)i * 0x9e3779b97f4a7c15ULL;
+        }
+        map_t *m = make_map(sizeof(uint64_t), 0, NULL, NULL);
+        double start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                mm_put(m, &keys[i], NULL);
+        }
+        double map_add = now_sec() - start;
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                assert(mm_haskey(m, &keys[i]));
+        }
+        double map_has = now_sec() - start;
+
+        hash_set_t *a = make_hash_set(sizeof(uint64_t), NULL, NULL);
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                hs_add(a, &keys[i]);
+        }
+        double set_add = now_sec() - start;
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                assert(hs_contains(a, &keys[i]));
+        }
+        double set_has = now_sec() - start;
+
+        printf("%d u64 keys     entry MB   add ns  contains ns\n", limit);
+        printf("map_t, value 0  %8.1f %8.1f %12.1f\n", entry_bytes(m) / 1e6,
+               map_add * 1e9 / limit, map_has * 1e9 / limit);
+        printf("hash_set_t      %8.1f %8.1f %12.1f\n",
+               a->slab.nslabs * a->slab.slots_per_slab * a->slab.slot_size / 1e6,
+               set_add * 1e9 / limit, set_has * 1e9 / limit);
+        delete_map(m);
+
+        // every third key against every other one, the per key loops add
+        // or look up one key of b at a time
+        hash_set_t *b = make_hash_set(sizeof(uint64_t), NULL, NULL);
+        for (int i = 0; i < limit; i += 2) {
+                hs_add(b, &keys[i]);
+        }
+        hash_set_t *c = make_hash_set(sizeof(uint64_t), NULL, NULL);
+        for (int i = 0; i < limit; i += 3) {
+                hs_add(c, &keys[i]);
+        }
+        printf("%-14s %10s %10s\n", "", "bulk ms", "per key ms");
+
+        start = now_sec();
+        hash_set_t *r = hs_union(b, c);
+        double bulk = now_sec() - start;
+        start = now_sec();
+        hash_set_t *loop = make_hash_set(sizeof(uint64_t), NULL, NULL);
+        for (int i = 0; i < limit; i++) {
+                if (hs_contains(b, &keys[i]) || hs_contains(c, &keys[i])) {
+                        hs_add(loop, &keys[i]);
+                }
+        }
+        double per_key = now_sec() - start;
+        assert(hs_len(r) == hs_len(loop));
+        printf("%-14s %10.1f %10.1f\n", "union", bulk * 1e3, per_key * 1e3);
+        delete_hash_set(r);
+        delete_hash_set(loop);
+
+        start = now_sec();
+        r = hs_intersection(b, c);
+        bulk = now_sec() - start;
+        start = now_sec();
+        loop = make_hash_set(sizeof(uint64_t), NULL, NULL);
+        for (int i = 0; i < limit; i += 2) {
+                if (hs_contains(c, &keys[i])) {
+                        hs_add(loop, &keys[i]);
+                }
+        }
+        per_key = now_sec() - start;
+        assert(hs_len(r) == hs_len(loop));
+        printf("%-14s %10.1f %10.1f\n", "intersection", bulk * 1e3, per_key * 1e3);
+        delete_hash_set(r);
+        delete_hash_set(loop);
+
+        start = now_sec();
+        r = hs_difference(b, c);
+        bulk = now_sec() - start;
+        start = now_sec();
+        loop = make_hash_set(sizeof(uint64_t), NULL, NULL);
+        for (int i = 0; i < limit; i += 2) {
+                if (!hs_contains(c, &keys[i])) {
+                        hs_add(loop, &keys[i]);
+                }
+        }
+        per_key = now_sec() - start;
+        assert(hs_len(r) == hs_len(loop));
+        printf("%-14s %10.1f %10.1f\n", "difference", bulk * 1e3, per_key * 1e3);
+        delete_hash_set(r);
+        delete_hash_set(loop);
+
+        delete_hash_set(a);
+        delete_hash_set(b);
+        delete_hash_set(c);
+        free(keys);
+}
+
+///////////////////////////////////////////////////
+//        sorted export, hash map against tree   //
+///////////////////////////////////////////////////
+
+static int cmp_u64(const void *a, const void *b)
+{
+        return bt_cmp_u64(a, b, sizeof(uint64_t));
+}
+
+static void bench_btree()
+{
+        int *s = malloc(limit * sizeof(int));
+        uint64_t *sorted = malloc(limit * sizeof(uint64_t));
+        for (int i = 0; i < limit; i++) {
+                s[i] = i;
+                sorted[i] = i;
+        }
+        shuffle(s, limit);
+
+        map_t *m = make_map(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL);
+        btree_t *t = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        double start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                uint64_t k = s[i];
+                mm_put(m, &k, &k);
+        }
+        double map_put = now_sec() - start;
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                uint64_t k = s[i];
+                bt_put(t, &k, &k);
+        }
+        double tree_put = now_sec() - start;
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                uint64_t k = s[i], v;
+                mm_get(m, &k, &v);
+        }
+        double map_get = now_sec() - start;
+        start = now_sec();
+        for (int i = 0; i < limit; i++) {
+                uint64_t k = s[i], v;
+                bt_get(t, &k, &v);
+        }
+        double tree_get = now_sec() - start;
+
+        // every key in order
+        start = now_sec();
+        slice_t *keys = mm_keyset(m);
+        qsort(keys->array, keys->len, sizeof(uint64_t), cmp_u64);
+        double map_sorted = now_sec() - start;
+        delete_slice(keys);
+        start = now_sec();
+        keys = bt_keyset(t);
+        double tree_sorted = now_sec() - start;
+        delete_slice(keys);
+
+        printf("%d u64 keys  put ns  get ns  sorted keys ms\n", limit);
+        printf("map_t       %6.1f  %6.1f  %14.1f\n", map_put * 1e9 / limit,
+               map_get * 1e9 / limit, map_sorted * 1e3);
+        printf("btree_t     %6.1f  %6.1f  %14.1f\n", tree_put * 1e9 / limit,
+               tree_get * 1e9 / limit, tree_sorted * 1e3);
+
+        // ranges of 100 keys
+        bt_iter_t it;
+        void *key, *value;
+        uint64_t sum = 0;
+        start = now_sec();
+        for (int i = 0; i < limit / 100; i++) {
+                uint64_t lo = s[i], hi = lo + 100;
+                bt_lower_bound(t, &lo, &it);
+                while (bt_iter_next(&it, &key, &value) && *(uint64_t *)key < hi) {
+                        sum += *(uint64_t *)value;
+                }
+        }
+        printf("range of 100  %.1f ns/key\n", (now_sec() - start) * 1e9 / limit);
+        assert(sum > 0);
+
+        btree_t *b = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        start = now_sec();
+        bt_bulk_load(b, sorted, sorted, limit);
+        printf("bulk load     %.1f ms, %zu leaves against %zu\n",
+               (now_sec() - start) * 1e3, b->leaves, t->leaves);
+        delete_btree(b);
+
+        const char *path = "/tmp/benchmap.bt";
+        start = now_sec();
+        bt_marshal(path, t);
+        double marshal = now_sec() - start;
+        b = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        start = now_sec();
+        bt_unmarshal(path, b);
+        printf("marshal       %.1f ms, unmarshal %.1f ms\n", marshal * 1e3,
+               (now_sec() - start) * 1e3);
+        unlink(path);
+        delete_btree(b);
+        delete_btree(t);
+        delete_map(m);
+        free(sorted);
+        free(s);
+}
+
+///////////////////////////////////////////////////
+//       lookups mostly missing, bloom guard     //
+///////////////////////////////////////////////////
+
+static double time_lookups(map_t *m, const uint64_t *probe, size_t n)
+{
+        size_t found = 0;
+        double start = now_sec();
+        for (size_t i = 0; i < n; i++) {
+                uint64_t v;
+                found += mm_get(m, (void *)&probe[i], &v);
+        }
+        double t = now_sec() - start;
+        assert(found > 0);
+        return t * 1e9 / n;
+}
+
+static void bench_bloom()
+{
+        // 30% of the probes are keys of the map, the others are not
+        size_t nprobe = 2 * limit;
+        uint64_t *probe = malloc(nprobe * sizeof(uint64_t));
+        unsigned int seed = 1;
+        for (size_t i = 0; i < nprobe; i++) {
+                uint64_t r = rand_r(&seed);
+                probe[i] = r % 10 < 3 ? r % limit : limit + r;
+        }
+        map_t *m = make_map(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL);
+        for (uint64_t k = 0; k < (uint64_t)limit; k++) {
+                mm_put(m, &k, &k);
+        }
+        double plain = time_lookups(m, probe, nprobe);
+
+        printf("%d u64 keys, 70%% misses  get ns  false positives  filter MB\n", limit);
+        printf("no filter              %6.1f\n", plain);
+        unsigned bits[] = {8, 12, 16};
+        for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++) {
+                bloom_t *b = make_bloom(sizeof(uint64_t), NULL, limit, bits[i]);
+                double start = now_sec();
+                bloom_rebuild(b, m);
+                double rebuild = now_sec() - start;
+                size_t fp = 0;
+                for (uint64_t k = limit; k < 2 * (uint64_t)limit; k++) {
+                        fp += bloom_may_contain(b, &k);
+                }
+                mm_attach_bloom(m, b);
+                double guarded = time_lookups(m, probe, nprobe);
+                mm_attach_bloom(m, NULL);
+                printf("%2u bits per key        %6.1f  %15.4f  %9.1f  (rebuild %.1f ms)\n",
+                       bits[i], guarded, (double)fp / limit,
+                       b->nblocks * BLOOM_BLOCK_BYTES / 1048576.0, rebuild * 1e3);
+                delete_bloom(b);
+        }
+        delete_map(m);
+        free(probe);
+}
+
+///////////////////////////////////////////////////
+//    short-lived maps, libc against an arena    //
+///////////////////////////////////////////////////
+
+// a map per request, filled, read and dropped
+static double bench_requests(const allocator_t *al, arena_t *a, int requests, int keys)
+{
+        map_opts_t opts = {
+                .allocator = al,
+        };
+        double start = now_sec();
+        for (int r = 0; r < requests; r++) {
+                map_t *m = make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+                for (uint64_t k = 0; k < (uint64_t)keys; k++) {
+                        mm_put(m, &k, &k);
+                }
+                for (uint64_t k = 0; k < (uint64_t)keys; k++) {
+                        uint64_t v;
+                        mm_get(m, &k, &v);
+                }
+                if (a) {
+                        ar_reset(a);
+                } else {
+                        delete_map(m);
+                }
+        }
+        return (now_sec() - start) * 1e6 / requests;
+}
+
+static void bench_alloc()
+{
+        arena_t a;
+        allocator_t bump;
+        ar_init(&a, 1 << 20);
+        ar_allocator(&a, &bump);
+        printf("keys per map  libc us/request  arena us/request\n");
+        int sizes[] = {100, 1000, 10000};
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                int requests = limit / sizes[i];
+                double libc = bench_requests(NULL, NULL, requests, sizes[i]);
+                double arena = bench_requests(&bump, &a, requests, sizes[i]);
+                printf("%12d  %15.1f  %16.1f\n", sizes[i], libc, arena);
+        }
+        ar_deinit(&a);
+}
+
+///////////////////////////////////////////////////
+//          parallel walks by thread count       //
+///////////////////////////////////////////////////
+
+static void count_entry(void *key, void *value, void *ctx)
+{
+        __atomic_add_fetch((long *)ctx, *(int *)value == *(int *)key, __ATOMIC_RELAXED);
+}
+
+static void bench_parallel(int max_threads)
+{
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        for (int i = 0; i < limit; i++) {
+                mm_put(m, &i, &i);
+        }
+        double start = now_sec();
+        slice_t *keys = mm_keyset(m);
+        printf("mm_keyset %.6fs\n", now_sec() - start);
+        delete_slice(keys);
+
+        printf("threads  foreach(s)  keyset(s)\n");
+        for (int t = 1; t <= max_threads; t <<= 1) {
+                long n = 0;
+                start = now_sec();
+                mm_parallel_foreach(m, count_entry, &n, t);
+                double foreach = now_sec() - start;
+                assert(n == limit);
+                start = now_sec();
+                keys = mm_parallel_keyset(m, t);
+                double keyset = now_sec() - start;
+                delete_slice(keys);
+                printf("%7d  %10.6f  %9.6f\n", t, foreach, keyset);
+        }
+        delete_map(m);
+}
+
+///////////////////////////////////////////////////
+//       snapshot and restart by shard count     //
+///////////////////////////////////////////////////
+
+static void bench_shards(int max_shards)
+{
+        printf("shards  put(ops/s)  marshal(s)  unmarshal(s)  delete(s)\n");
+        for (int n = 1; n <= max_shards; n <<= 1) {
+                shard_map_t *sm = make_shard_map(n, sizeof(int), sizeof(int), NULL, NULL, NULL);
+                double start = now_sec();
+                for (int i = 0; i < limit; i++) {
+                        sm_put(sm, &i, &i);
+                }
+                double put = limit / (now_sec() - start);
+
+                start = now_sec();
+                sm_marshal("bench.shards", sm, MM_MARSHAL_HASH);
+                double marshal = now_sec() - start;
+                delete_shard_map(sm);
+
+                sm = make_shard_map(n, sizeof(int), sizeof(int), NULL, NULL, NULL);
+                start = now_sec();
+                assert(sm_unmarshal("bench.shards", sm) == 0);
+                double unmarshal = now_sec() - start;
+
+                start = now_sec();
+                delete_shard_map(sm);
+                double del = now_sec() - start;
+                printf("%6d  %10.0f  %10.6f  %12.6f  %9.6f\n", n, put, marshal, unmarshal, del);
+
+                for (int i = 0; i < n; i++) {
+                        char path[64];
+                        snprintf(path, sizeof(path), "bench.shards.%d", i);
+                        unlink(path);
+                }
+                unlink("bench.shards");
+        }
+}
+
+///////////////////////////////////////////////////
+//     latency percentiles of workload mixes     //
+///////////////////////////////////////////////////
+
+typedef struct workload_s {
+        map_engine_t engine;
+        size_t keys;
+        size_t ops;
+        size_t key_size;
+        size_t value_size;
+        // Zipf exponent of the key ranks, 0 draws keys uniformly
+        double theta;
+        // share of gets among the ops, the rest are puts over loaded
+        // keys, and share of gets that find their key
+        double read;
+        double hit;
+        uint64_t seed;
+}workload_t;
+
+enum { OP_LOAD, OP_GET, OP_PUT, OP_DELETE, NOPS };
+static const char *op_names[NOPS] = {"load", "get", "put", "delete"};
+
+typedef struct op_lat_s {
+        uint32_t *ns;
+        size_t n;
+        uint64_t total;
+}op_lat_t;
+
+// xorshift64*, cheap enough to stay out of the measurements
+static uint64_t next_rand(uint64_t *s)
+{
+        *s ^= *s >> 12;
+        *s ^= *s << 25;
+        *s ^= *s >> 27;
+        return *s * 2685821657736338717ull;
+}
+
+static double next_double(uint64_t *s)
+{
+        return (next_rand(s) >> 11) * 0x1.0p-53;
+}
+
+// Gray et al., Quickly Generating Billion-Record Synthetic Databases
+typedef struct zipf_s {
+        size_t n;
+        double theta, alpha, zetan, eta;
+}zipf_t;
+
+static void zipf_init(zipf_t *z, size_t n, double theta)
+{
+        z->n = n;
+        z->theta = theta;
+        z->zetan = 0;
+        for (size_t i = 1; i <= n; i++) {
+                z->zetan += 1 / pow(i, theta);
+        }
+        double zeta2 = 1 + pow(0.5, theta);
+        z->alpha = 1 / (1 - theta);
+        z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static size_t zipf_next(zipf_t *z, uint64_t *s)
+{
+        double u = next_double(s);
+        double uz = u * z->zetan;
+        if (uz < 1) {
+                return 0;
+        }
+        if (uz < 1 + pow(0.5, z->theta)) {
+                return 1;
+        }
+        size_t r = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+        return r < z->n ? r : z->n - 1;
+}
+
+static size_t draw_key(workload_t *w, zipf_t *z, uint64_t *s)
+{
+        if (w->theta == 0) {
+                return next_rand(s) % w->keys;
+        }
+        // scatter the hot ranks, so they do not share buckets
+        return (zipf_next(z, s) * 0x9e3779b97f4a7c15ull) % w->keys;
+}
+
+// the id in the first bytes, the same filler after it
+static void make_key(char *key, uint64_t id, size_t key_size)
+{
+        memcpy(key, &id, key_size < sizeof(id) ? key_size : sizeof(id));
+}
+
+static void shuffle_ids(uint64_t *ids, size_t n, uint64_t *s)
+{
+        for (size_t i = 0; i < n; i++) {
+                ids[i] = i;
+        }
+        for (size_t i = n; i > 1; i--) {
+                size_t r = next_rand(s) % i;
+                uint64_t tmp = ids[i - 1];
+                ids[i - 1] = ids[r];
+                ids[r] = tmp;
+        }
+}
+
+static void record(op_lat_t *lat, uint64_t ns)
+{
+        lat->ns[lat->n++] = ns < UINT32_MAX ? ns : UINT32_MAX;
+        lat->total += ns;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+        uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+static uint32_t percentile(op_lat_t *lat, double p)
+{
+        size_t i = ceil(p * lat->n);
+        return lat->ns[i > 0 ? i - 1 : 0];
+}
+
+// run the workload and print one JSON object, return 0
+static int bench_workload(workload_t *w)
+{
+        map_opts_t opts = {
+                .engine = w->engine,
+        };
+        map_t *m = make_map_opts(w->key_size, w->value_size, NULL, NULL, &opts);
+        char *key = calloc(1, w->key_size), *value = calloc(1, w->value_size);
+        char *out = malloc(w->value_size);
+        uint64_t *ids = malloc(w->keys * sizeof(uint64_t));
+        uint8_t *op_type = malloc(w->ops);
+        uint64_t *op_id = malloc(w->ops * sizeof(uint64_t));
+        op_lat_t lat[NOPS] = {{0}};
+        for (int t = 0; t < NOPS; t++) {
+                lat[t].ns = malloc((t == OP_GET || t == OP_PUT ? w->ops : w->keys) * sizeof(uint32_t));
+                if (!lat[t].ns) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+        if (!key || !value || !out || !ids || !op_type || !op_id) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        memset(key, 'k', w->key_size);
+        uint64_t seed = w->seed;
+
+        // the op sequence is drawn up front, misses use ids never loaded
+        zipf_t z;
+        if (w->theta > 0) {
+                zipf_init(&z, w->keys, w->theta);
+        }
+        for (size_t i = 0; i < w->ops; i++) {
+                op_type[i] = next_double(&seed) < w->read ? OP_GET : OP_PUT;
+                op_id[i] = draw_key(w, &z, &seed);
+                if (op_type[i] == OP_GET && next_double(&seed) >= w->hit) {
+                        op_id[i] = w->keys + next_rand(&seed) % w->keys;
+                }
+        }
+
+        // the timer itself, to judge the smallest latencies
+        uint64_t timer = now_ns();
+        for (int i = 0; i < 1000; i++) {
+                now_ns();
+        }
+        double timer_ns = (now_ns() - timer) / 1000.0;
+
+        shuffle_ids(ids, w->keys, &seed);
+        for (size_t i = 0; i < w->keys; i++) {
+                make_key(key, ids[i], w->key_size);
+                memcpy(value, &ids[i], w->value_size < 8 ? w->value_size : 8);
+                uint64_t start = now_ns();
+                mm_put(m, key, value);
+                record(&lat[OP_LOAD], now_ns() - start);
+        }
+        map_stats_t stats;
+        mm_stats(m, &stats);
+
+        size_t wrong = 0;
+        uint64_t mix_start = now_ns();
+        for (size_t i = 0; i < w->ops; i++) {
+                make_key(key, op_id[i], w->key_size);
+                uint64_t start;
+                if (op_type[i] == OP_GET) {
+                        start = now_ns();
+                        bool found = mm_get(m, key, out);
+                        record(&lat[OP_GET], now_ns() - start);
+                        wrong += found != (op_id[i] < w->keys);
+                } else {
+                        memcpy(value, &op_id[i], w->value_size < 8 ? w->value_size : 8);
+                        start = now_ns();
+                        mm_put(m, key, value);
+                        record(&lat[OP_PUT], now_ns() - start);
+                }
+        }
+        double mix_sec = (now_ns() - mix_start) / 1e9;
+
+        shuffle_ids(ids, w->keys, &seed);
+        for (size_t i = 0; i < w->keys; i++) {
+                make_key(key, ids[i], w->key_size);
+                uint64_t start = now_ns();
+                bool found = mm_delete(m, key);
+                record(&lat[OP_DELETE], now_ns() - start);
+                wrong += !found;
+        }
+        if (wrong) {
+                fprintf(stderr, "bench_workload: %zu operations gave wrong results\n", wrong);
+        }
+
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+
+        printf("{\n");
+        printf("  \"config\": {\"engine\": \"%s\", \"keys\": %zu, \"ops\": %zu, "
+               "\"key_size\": %zu, \"value_size\": %zu, \"dist\": \"%s\", "
+               "\"theta\": %g, \"read\": %g, \"hit\": %g, \"seed\": %llu},\n",
+               w->engine == MAP_ENGINE_FLAT ? "flat" : "linear", w->keys, w->ops,
+               w->key_size, w->value_size, w->theta > 0 ? "zipf" : "uniform",
+               w->theta, w->read, w->hit, (unsigned long long)w->seed);
+        printf("  \"timer_ns\": %.1f,\n", timer_ns);
+        printf("  \"mix_ops_per_sec\": %.0f,\n", w->ops / mix_sec);
+        printf("  \"ops\": {\n");
+        for (int t = 0; t < NOPS; t++) {
+                qsort(lat[t].ns, lat[t].n, sizeof(uint32_t), cmp_u32);
+                printf("    \"%s\": {\"count\": %zu", op_names[t], lat[t].n);
+                if (lat[t].n > 0) {
+                        printf(", \"ops_per_sec\": %.0f, \"mean_ns\": %.1f, \"p50_ns\": %u, "
+                               "\"p99_ns\": %u, \"p999_ns\": %u, \"max_ns\": %u",
+                               lat[t].n * 1e9 / lat[t].total, (double)lat[t].total / lat[t].n,
+                               percentile(&lat[t], 0.5), percentile(&lat[t], 0.99),
+                               percentile(&lat[t], 0.999), lat[t].ns[lat[t].n - 1]);
+                }
+                printf("}%s\n", t < NOPS - 1 ? "," : "");
+        }
+        printf("  },\n");
+        printf("  \"map\": {\"entries\": %zu, \"heap_bytes\": %zu, \"bytes_per_entry\": %.1f, "
+               "\"probes_per_hit\": %.3f, \"probes_per_miss\": %.3f, \"splits\": %llu},\n",
+               stats.entries, stats.heap_bytes, stats.bytes_per_entry, stats.probes_per_hit,
+               stats.probes_per_miss, (unsigned long long)stats.splits);
+        printf("  \"peak_rss_bytes\": %ld,\n", ru.ru_maxrss * 1024L);
+        printf("  \"wrong_results\": %zu\n", wrong);
+        printf("}\n");
+
+        for (int t = 0; t < NOPS; t++) {
+                free(lat[t].ns);
+        }
+        free(key);
+        free(value);
+        free(out);
+        free(ids);
+        free(op_type);
+        free(op_id);
+        delete_map(m);
+        return wrong ? 1 : 0;
+}
+
+// name=value arguments over the defaults, return 0, -1 on a bad one
+static int parse_workload(workload_t *w, int argc, char *argv[])
+{
+        for (int i = 0; i < argc; i++) {
+                char *eq = strchr(argv[i], '=');
+                if (!eq) {
+                        fprintf(stderr, "benchmap: %s: expected name=value\n", argv[i]);
+                        return -1;
+                }
+                size_t len = eq - argv[i];
+                const char *v = eq + 1;
+#define OPTION(name) (len == strlen(name) && strncmp(argv[i], name, len) == 0)
+                if (OPTION("engine") && strcmp(v, "linear") == 0) {
+                        w->engine = MAP_ENGINE_LINEAR;
+                } else if (OPTION("engine") && strcmp(v, "flat") == 0) {
+                        w->engine = MAP_ENGINE_FLAT;
+                } else if (OPTION("keys")) {
+                        w->keys = strtoull(v, NULL, 10);
+                } else if (OPTION("ops")) {
+                        w->ops = strtoull(v, NULL, 10);
+                } else if (OPTION("key_size")) {
+                        w->key_size = strtoull(v, NULL, 10);
+                } else if (OPTION("value_size")) {
+                        w->value_size = strtoull(v, NULL, 10);
+                } else if (OPTION("dist") && strcmp(v, "uniform") == 0) {
+                        w->theta = 0;
+                } else if (OPTION("dist") && strcmp(v, "zipf") == 0) {
+                        w->theta = w->theta > 0 ? w->theta : 0.99;
+                } else if (OPTION("theta")) {
+                        w->theta = atof(v);
+                } else if (OPTION("read")) {
+                        w->read = atof(v);
+                } else if (OPTION("hit")) {
+                        w->hit = atof(v);
+                } else if (OPTION("seed")) {
+                        w->seed = strtoull(v, NULL, 10);
+                } else {
+                        fprintf(stderr, "benchmap: %s: unknown option\n", argv[i]);
+                        return -1;
+                }
+#undef OPTION
+        }
+
+        const char *err = NULL;
+        if (w->keys == 0 || w->ops == 0) {
+                err = "keys and ops must be positive";
+        } else if (w->key_size < 8 && 2 * w->keys > (1ull << (8 * w->key_size))) {
+                err = "key_size too small for twice the keys";
+        } else if (w->value_size == 0) {
+                err = "value_size must be positive";
+        } else if (w->theta < 0 || w->theta >= 1) {
+                err = "theta must be in [0, 1)";
+        } else if (w->read < 0 || w->read > 1 || w->hit < 0 || w->hit > 1) {
+                err = "read and hit must be in [0, 1]";
+        } else if (w->seed == 0) {
+                err = "seed must not be 0";
+        }
+        if (err) {
+                fprintf(stderr, "benchmap: %s\n", err);
+                return -1;
+        }
+        return 0;
+}
+
+///////////////////////////////////////////////////
+//        read-through cache by eviction policy  //
+///////////////////////////////////////////////////
+
+static const int cache_ops = 4000000;
+
+// zipfian gets over limit keys with a cache of a tenth of them, a miss
+// puts the key
+static void bench_lru()
+{
+        const char *names[] = {"lru", "clock"};
+        zipf_t z;
+        zipf_init(&z, limit, 0.99);
+        printf("%d gets, %d keys, %d cached, zipf 0.99\n", cache_ops, limit, limit / 10);
+        printf("policy   hit rate   ns/get\n");
+        for (int p = LRU_POLICY_LRU; p <= LRU_POLICY_CLOCK; p++) {
+                lru_opts_t opts = {
+                        .max_entries = limit / 10,
+                        .policy = p,
+                };
+                lru_cache_t *c = make_lru_cache(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+                uint64_t seed = 1;
+                double start = now_sec();
+                for (int i = 0; i < cache_ops; i++) {
+                        uint64_t k = zipf_next(&z, &seed), v;
+                        if (!lru_get(c, &k, &v)) {
+                                lru_put(c, &k, &k);
+                        }
+                }
+                double t = now_sec() - start;
+                printf("%-8s %9.3f %8.1f\n", names[p],
+                       (double)c->hits / (c->hits + c->misses), t * 1e9 / cache_ops);
+                delete_lru_cache(c);
+        }
+}
 
 int main(int argc, char *argv[])
 {
-        map_t *m = make_map(sizeof(int), sizeof(int), toint, NULL);
+        // usage: benchmap [linear|flat [batch]|mapped|typed|set|lru|btree|bloom|alloc|marshal|snapshot|wal|varlen|churn|concurrent|readscale|parallel [max threads]|shards [max shards]]
+        //        benchmap workload [engine=linear|flat] [keys=N] [ops=N] [key_size=N]
+        //                 [value_size=N] [dist=uniform|zipf] [theta=T] [read=R] [hit=H] [seed=S]
+        if (argc > 1 && strcmp(argv[1], "workload") == 0) {
+                workload_t w = {
+                        .engine = MAP_ENGINE_LINEAR,
+                        .keys = limit,
+                        .ops = 2 * limit,
+                        .key_size = 16,
+                        .value_size = 16,
+                        .read = 0.9,
+                        .hit = 0.9,
+                        .seed = 1,
+                };
+                if (parse_workload(&w, argc - 2, argv + 2) != 0) {
+                        return 1;
+                }
+                return bench_workload(&w);
+        }
+        map_opts_t opts = {
+                .engine = MAP_ENGINE_LINEAR,
+        };
+        if (argc > 1 && strcmp(argv[1], "flat") == 0) {
+                opts.engine = MAP_ENGINE_FLAT;
+        }
+        if (argc > 1 && strcmp(argv[1], "concurrent") == 0) {
+                int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+                bench_concurrent(max_threads);
+                return 0;
+        }
+        if (argc > 2 && strcmp(argv[2], "batch") == 0) {
+                bench_batch(&opts);
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "marshal") == 0) {
+                bench_marshal();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "snapshot") == 0) {
+                bench_snapshot();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "typed") == 0) {
+                bench_typed();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "set") == 0) {
+                bench_set();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "lru") == 0) {
+                bench_lru();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "btree") == 0) {
+                bench_btree();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "bloom") == 0) {
+                bench_bloom();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "alloc") == 0) {
+                bench_alloc();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "wal") == 0) {
+                bench_wal();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "churn") == 0) {
+                bench_churn();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "varlen") == 0) {
+                bench_varlen();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "mapped") == 0) {
+                bench_mapped();
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "parallel") == 0) {
+                int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+                bench_parallel(max_threads);
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "shards") == 0) {
+                int max_shards = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+                bench_shards(max_shards);
+                return 0;
+        }
+        if (argc > 1 && strcmp(argv[1], "readscale") == 0) {
+                int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+                bench_read_scaling(max_threads);
+                return 0;
+        }
+
+        map_t *m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts);
         int *s = (int *)malloc(limit * sizeof(int));
         for (int i = 0; i < limit; i++) {
                 s[i] = i;
         }
 
-        uint64_t sum = 0;
+        double put = 0, get = 0, del = 0;
         for (int i = 0; i < trial; i++) {
                 shuffle(s, limit);
 
-                time_t now;
-                time(&now);
+                double start = now_sec();
                 for (int i = 0; i < limit; i++) {
                         mm_put(m, &s[i], &s[i]);
                 }
+                double t = now_sec();
+                put += t - start;
+                start = t;
                 for (int i = 0; i < limit; i++) {
                         int j;
                         mm_get(m, &s[i], &j);
                         assert(j == s[i]);
                 }
-                //mm_print_map(m, false);
-                //while(1);
+                t = now_sec();
+                get += t - start;
+                start = t;
                 for (int i = 0; i < limit; i++) {
                         mm_delete(m, &s[i]);
                 }
-                //mm_print_map(m, false);
-                time_t end;
-                time(&end);
-                sum += end - now;
+                del += now_sec() - start;
                 printf("trial %d\n", i);
         }
-        printf("time: %llus\n", sum);
+        double n = (double)trial * limit;
+        printf("put %.1fns, get %.1fns, delete %.1fns per op, %.3fs in all\n",
+               put * 1e9 / n, get * 1e9 / n, del * 1e9 / n, put + get + del);
 
         return 0;
 }
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blockfile.h"
+#include "hash.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+#define HEADER_SIZE sizeof(bf_block_header_t)
+
+static uint32_t block_crc(uint32_t index, uint32_t len, const void *payload)
+{
+        return crc32c(crc32c(index, &len, sizeof(len)), payload, len);
+}
+
+static char *new_block(size_t block_size)
+{
+        void *buf;
+        if (posix_memalign(&buf, BF_ALIGN, HEADER_SIZE + block_size) != 0) {
+                error_at_line(-1, ENOMEM, __FILE__, __LINE__, NULL);
+        }
+        return buf;
+}
+
+static void write_block(bf_writer_t *w, const char *block)
+{
+        if (w->err) {
+                return;
+        }
+        size_t left = HEADER_SIZE + ((const bf_block_header_t *)block)->len;
+        while (left > 0) {
+                ssize_t n = write(w->fd, block, left);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        w->err = errno;
+                        return;
+                }
+                block += n;
+                left -= n;
+        }
+}
+
+static void *writer_thread(void *arg)
+{
+        bf_writer_t *w = arg;
+        pthread_mutex_lock(&w->mu);
+        for (;;) {
+                while (!w->inflight && !w->done) {
+                        pthread_cond_wait(&w->cond, &w->mu);
+                }
+                if (!w->inflight) {
+                        break;
+                }
+                char *block = w->inflight;
+                pthread_mutex_unlock(&w->mu);
+
+                write_block(w, block);
+
+                pthread_mutex_lock(&w->mu);
+                w->inflight = NULL;
+                pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->mu);
+        return NULL;
+}
+
+bf_writer_t *bf_writer_new(int fd, size_t block_size, bool background)
+{
+        bf_writer_t *w;
+        NEW_INSTANCE(w, bf_writer_t);
+        w->fd = fd;
+        w->block_size = block_size ? block_size : BF_BLOCK_SIZE;
+        w->buf = new_block(w->block_size);
+        w->background = background;
+        if (background) {
+                w->spare = new_block(w->block_size);
+                pthread_mutex_init(&w->mu, NULL);
+                pthread_cond_init(&w->cond, NULL);
+                pthread_create(&w->thread, NULL, writer_thread, w);
+        }
+        return w;
+}
+
+// seal the current block and write it, or hand it to the writer thread
+static void emit_block(bf_writer_t *w)
+{
+        bf_block_header_t *h = (bf_block_header_t *)w->buf;
+        h->len = w->len;
+        h->crc = block_crc(w->index++, h->len, w->buf + HEADER_SIZE);
+        w->len = 0;
+
+        if (!w->background) {
+                write_block(w, w->buf);
+                return;
+        }
+        pthread_mutex_lock(&w->mu);
+        while (w->inflight) {
+                pthread_cond_wait(&w->cond, &w->mu);
+        }
+        w->inflight = w->buf;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mu);
+
+        // the spare was written out before inflight went back to NULL
+        char *tmp = w->buf;
+        w->buf = w->spare;
+        w->spare = tmp;
+}
+
+void *bf_reserve(bf_writer_t *w, size_t len)
+{
+        if (len > w->block_size) {
+                return NULL;
+        }
+        if (w->len + len > w->block_size) {
+                emit_block(w);
+        }
+        void *p = w->buf + HEADER_SIZE + w->len;
+        w->len += len;
+        return p;
+}
+
+void bf_flush(bf_writer_t *w)
+{
+        if (w->len > 0) {
+                emit_block(w);
+        }
+}
+
+int bf_writer_close(bf_writer_t *w)
+{
+        bf_flush(w);
+        // the empty block marks a complete stream
+        emit_block(w);
+
+        if (w->background) {
+                pthread_mutex_lock(&w->mu);
+                w->done = true;
+                pthread_cond_broadcast(&w->cond);
+                pthread_mutex_unlock(&w->mu);
+                pthread_join(w->thread, NULL);
+                pthread_mutex_destroy(&w->mu);
+                pthread_cond_destroy(&w->cond);
+                free(w->spare);
+        }
+
+        int err = w->err;
+        free(w->buf);
+        free(w);
+        if (err) {
+                errno = err;
+                return -1;
+        }
+        return 0;
+}
+
+bf_reader_t *bf_reader_new(FILE *fp)
+{
+        bf_reader_t *r;
+        NEW_INSTANCE(r, bf_reader_t);
+        struct stat st;
+        if (fstat(fileno(fp), &st) != 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        r->fp = fp;
+        r->start = ftell(fp);
+        r->size = st.st_size;
+        return r;
+}
+
+void bf_reader_delete(bf_reader_t *r)
+{
+        free(r->buf);
+        free(r);
+}
+
+long bf_next(bf_reader_t *r, void **payload)
+{
+        bf_block_header_t h;
+        if (fread(&h, HEADER_SIZE, 1, r->fp) != 1) {
+                return BF_TRUNCATED;
+        }
+        // a damaged len could ask for anything, the file size bounds it
+        if (h.len > r->size - ftell(r->fp)) {
+                return BF_TRUNCATED;
+        }
+        if (h.len > r->cap) {
+                free(r->buf);
+                r->cap = h.len;
+                r->buf = malloc(r->cap);
+                if (!r->buf) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+        if (h.len > 0 && fread(r->buf, h.len, 1, r->fp) != 1) {
+                return BF_TRUNCATED;
+        }
+        if (block_crc(r->index, h.len, r->buf) != h.crc) {
+                return BF_CORRUPT;
+        }
+        r->index++;
+        *payload = r->buf;
+        return h.len;
+}
+
+void bf_rewind(bf_reader_t *r)
+{
+        fseek(r->fp, r->start, SEEK_SET);
+        r->index = 0;
+}
+
+#ifdef TESTBLOCKFILE
+// testing
+#include <assert.h>
+#include <fcntl.h>
+
+#define NRECORDS 100000
+
+static void write_stream(const char *path, bool background)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        // small blocks, so there are plenty of them
+        bf_writer_t *w = bf_writer_new(fd, 4000, background);
+        assert(bf_reserve(w, 4001) == NULL);
+        for (uint64_t i = 0; i < NRECORDS; i++) {
+                uint64_t *rec = bf_reserve(w, 3 * sizeof(uint64_t));
+                rec[0] = i;
+                rec[1] = i * i;
+                rec[2] = ~i;
+        }
+        assert(bf_writer_close(w) == 0);
+        close(fd);
+}
+
+// return how many records were read before the stream ended or failed
+static long read_stream(const char *path, long *result)
+{
+        FILE *fp = fopen(path, "rb");
+        assert(fp);
+        bf_reader_t *r = bf_reader_new(fp);
+        long nrecords = 0, n;
+        void *payload;
+        while ((n = bf_next(r, &payload)) > 0) {
+                assert(n % (3 * sizeof(uint64_t)) == 0);
+                uint64_t *rec = payload;
+                for (long j = 0; j < n / (3 * sizeof(uint64_t)); j++, rec += 3) {
+                        assert(rec[0] == nrecords && rec[1] == rec[0] * rec[0] && rec[2] == ~rec[0]);
+                        nrecords++;
+                }
+        }
+        *result = n;
+        bf_reader_delete(r);
+        fclose(fp);
+        return nrecords;
+}
+
+int main(int argc, char *argv[])
+{
+        const char *path = "test.blocks";
+        long result;
+
+        for (int background = 0; background <= 1; background++) {
+                printf("=== RUN Round Trip Test (background %d) ===\n", background);
+                write_stream(path, background);
+                assert(read_stream(path, &result) == NRECORDS && result == 0);
+                printf("--- PASS ---\n");
+        }
+
+        printf("=== RUN Corrupt Test ===\n");
+        FILE *fp = fopen(path, "r+b");
+        fseek(fp, 123457, SEEK_SET);
+        int c = fgetc(fp);
+        fseek(fp, 123457, SEEK_SET);
+        fputc(c ^ 0x10, fp);
+        fclose(fp);
+        assert(read_stream(path, &result) < NRECORDS && result == BF_CORRUPT);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Truncate Test ===\n");
+        write_stream(path, false);
+        struct stat st;
+        stat(path, &st);
+        // without the end block, then in the middle of a block
+        assert(truncate(path, st.st_size - HEADER_SIZE) == 0);
+        assert(read_stream(path, &result) == NRECORDS && result == BF_TRUNCATED);
+        assert(truncate(path, st.st_size / 2) == 0);
+        assert(read_stream(path, &result) < NRECORDS && result == BF_TRUNCATED);
+        printf("--- PASS ---\n");
+
+        unlink(path);
+        return 0;
+}
+
+#endif
@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blockfile.h"
+#include "bloom.h"
+#include "hash.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+// first word of a filter file, followed by the version in the high half
+// of the next word
+#define BLOOM_MAGIC 0x314d4f4f4c424d4dULL
+#define BLOOM_VERSION 1
+
+typedef struct bloom_meta_s {
+        uint64_t key_size;
+        uint64_t nblocks;
+        uint64_t added;
+}bloom_meta_t;
+
+static bloom_t *new_bloom(size_t key_size, key2int_t k2int, size_t nblocks)
+{
+        bloom_t *b;
+        NEW_INSTANCE(b, bloom_t);
+        b->key_size = key_size;
+        b->k2int = k2int ? k2int : hash_default(key_size);
+        b->nblocks = nblocks;
+        if (posix_memalign((void **)&b->blocks, BLOOM_BLOCK_BYTES,
+                           nblocks * BLOOM_BLOCK_BYTES) != 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        bloom_clear(b);
+        return b;
+}
+
+bloom_t *make_bloom(size_t key_size, key2int_t k2int, size_t capacity, unsigned bits_per_key)
+{
+        size_t bits = capacity * (bits_per_key ? bits_per_key : BLOOM_DEFAULT_BITS);
+        size_t nblocks = (bits + 8 * BLOOM_BLOCK_BYTES - 1) / (8 * BLOOM_BLOCK_BYTES);
+        return new_bloom(key_size, k2int, nblocks ? nblocks : 1);
+}
+
+void delete_bloom(bloom_t *b)
+{
+        free(b->blocks);
+        free(b);
+}
+
+void bloom_add(bloom_t *b, const void *key)
+{
+        bloom_add_hash(b, b->k2int(key, b->key_size));
+}
+
+bool bloom_may_contain(bloom_t *b, const void *key)
+{
+        return bloom_may_contain_hash(b, b->k2int(key, b->key_size));
+}
+
+void bloom_clear(bloom_t *b)
+{
+        memset(b->blocks, 0, b->nblocks * BLOOM_BLOCK_BYTES);
+        b->added = 0;
+}
+
+int bloom_rebuild(bloom_t *b, map_t *m)
+{
+        if (m->key_size != b->key_size) {
+                fprintf(stderr, "bloom_rebuild: the map has keys of %zu bytes, the filter of %zu\n",
+                        m->key_size, b->key_size);
+                return -1;
+        }
+        slice_t *keys = mm_keyset(m);
+        if (!keys) {
+                return -1;
+        }
+        bloom_clear(b);
+        for (size_t i = 0; i < keys->len; i++) {
+                bloom_add(b, ss_getptr(keys, i));
+        }
+        delete_slice(keys);
+        return 0;
+}
+
+int mm_attach_bloom(map_t *m, bloom_t *b)
+{
+        bool linear = m->engine == MAP_ENGINE_LINEAR && !m->sync && !m->varlen;
+        if (!linear && m->engine != MAP_ENGINE_MAPPED) {
+                fprintf(stderr, "mm_attach_bloom: only plain linear and mapped maps take a filter\n");
+                return -1;
+        }
+        if (b && (b->key_size != m->key_size || b->k2int != m->k2int)) {
+                fprintf(stderr, "mm_attach_bloom: the filter has another key size or k2int\n");
+                return -1;
+        }
+        m->bloom = b;
+        return 0;
+}
+
+int bloom_marshal(const char *path, bloom_t *b)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        uint64_t head[2] = {BLOOM_MAGIC, (uint64_t)BLOOM_VERSION << 32};
+        if (write(fd, head, sizeof(head)) != sizeof(head)) {
+                close(fd);
+                return -1;
+        }
+        bf_writer_t *w = bf_writer_new(fd, 0, false);
+        bloom_meta_t meta = {
+                .key_size = b->key_size,
+                .nblocks = b->nblocks,
+                .added = b->added,
+        };
+        memcpy(bf_reserve(w, sizeof(meta)), &meta, sizeof(meta));
+        bf_flush(w);
+
+        // whole filter blocks, as many as a file block takes
+        size_t per = BF_BLOCK_SIZE / BLOOM_BLOCK_BYTES;
+        for (size_t i = 0; i < b->nblocks; i += per) {
+                size_t n = b->nblocks - i < per ? b->nblocks - i : per;
+                memcpy(bf_reserve(w, n * BLOOM_BLOCK_BYTES), b->blocks + i * BLOOM_LANES,
+                       n * BLOOM_BLOCK_BYTES);
+        }
+        int ret = bf_writer_close(w);
+        if (close(fd) != 0) {
+                ret = -1;
+        }
+        return ret;
+}
+
+static const char *block_error(long n)
+{
+        return n == BF_TRUNCATED ? "truncated" : "corrupt";
+}
+
+// fill a new filter from the blocks of r, NULL with err set on failure
+static bloom_t *load_blocks(bf_reader_t *r, key2int_t k2int, const char **err)
+{
+        void *payload;
+        bloom_meta_t meta;
+        long n = bf_next(r, &payload);
+        if (n != sizeof(meta)) {
+                *err = n < 0 ? block_error(n) : "corrupt";
+                return NULL;
+        }
+        memcpy(&meta, payload, sizeof(meta));
+        if (meta.nblocks == 0) {
+                *err = "corrupt";
+                return NULL;
+        }
+        bloom_t *b = new_bloom(meta.key_size, k2int, meta.nblocks);
+        b->added = meta.added;
+        size_t size = b->nblocks * BLOOM_BLOCK_BYTES, off = 0;
+        while ((n = bf_next(r, &payload)) > 0) {
+                if (off + n > size) {
+                        break;
+                }
+                memcpy((char *)b->blocks + off, payload, n);
+                off += n;
+        }
+        if (n != 0 || off != size) {
+                *err = n < 0 ? block_error(n) : "corrupt";
+                delete_bloom(b);
+                return NULL;
+        }
+        return b;
+}
+
+bloom_t *bloom_unmarshal(const char *path, key2int_t k2int)
+{
+        FILE *fp = fopen(path, "rb");
+        if (!fp) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        uint64_t head[2];
+        const char *err = NULL;
+        bloom_t *b = NULL;
+        if (fread(head, sizeof(head), 1, fp) != 1) {
+                err = "truncated";
+        } else if (head[0] != BLOOM_MAGIC) {
+                err = "not a marshaled filter";
+        } else if ((head[1] >> 32) != BLOOM_VERSION) {
+                err = "unsupported version";
+        } else {
+                bf_reader_t *r = bf_reader_new(fp);
+                b = load_blocks(r, k2int, &err);
+                bf_reader_delete(r);
+        }
+        fclose(fp);
+        if (err) {
+                fprintf(stderr, "bloom_unmarshal: %s: %s\n", path, err);
+        }
+        return b;
+}
+
+#ifdef TESTBLOOM
+// testing
+#include <assert.h>
+
+#define NKEYS 100000
+
+static void put_range(map_t *m, uint64_t from, uint64_t to)
+{
+        for (uint64_t k = from; k < to; k++) {
+                mm_put(m, &k, &k);
+        }
+}
+
+// the share of keys in [from, to) the filter lets through
+static double pass_rate(bloom_t *b, uint64_t from, uint64_t to)
+{
+        size_t n = 0;
+        for (uint64_t k = from; k < to; k++) {
+                n += bloom_may_contain(b, &k);
+        }
+        return (double)n / (to - from);
+}
+
+int main(int argc, char *argv[])
+{
+        printf("=== RUN Filter Test ===\n");
+        bloom_t *b = make_bloom(sizeof(uint64_t), NULL, NKEYS, 0);
+        assert(((uintptr_t)b->blocks & (BLOOM_BLOCK_BYTES - 1)) == 0);
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                bloom_add(b, &k);
+        }
+        assert(pass_rate(b, 0, NKEYS) == 1.0);
+        double fpr = pass_rate(b, NKEYS, 11 * NKEYS);
+        printf("false positives %.4f at %d bits per key\n", fpr, BLOOM_DEFAULT_BITS);
+        assert(fpr < 0.01);
+        bloom_clear(b);
+        assert(pass_rate(b, 0, NKEYS) == 0.0 && b->added == 0);
+        delete_bloom(b);
+
+        // fewer bits, more false positives, still no false negatives
+        b = make_bloom(sizeof(uint64_t), NULL, NKEYS, 4);
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                bloom_add(b, &k);
+        }
+        assert(pass_rate(b, 0, NKEYS) == 1.0 && pass_rate(b, NKEYS, 2 * NKEYS) > fpr);
+        delete_bloom(b);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Attach Test ===\n");
+        map_t *m = make_map(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL);
+        put_range(m, 0, NKEYS / 2);
+        b = make_bloom(sizeof(uint64_t), NULL, NKEYS, 0);
+        assert(bloom_rebuild(b, m) == 0 && b->added == NKEYS / 2);
+        assert(mm_attach_bloom(m, b) == 0);
+        // puts reach the filter
+        put_range(m, NKEYS / 2, NKEYS);
+        uint64_t keys[2] = {2 * NKEYS, 2 * NKEYS + 1};
+        mm_put_batch(m, keys, keys, 2);
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                uint64_t v;
+                assert(mm_get(m, &k, &v) && v == k && mm_haskey(m, &k));
+        }
+        assert(mm_haskey(m, &keys[1]));
+        for (uint64_t k = NKEYS; k < 2 * NKEYS; k++) {
+                uint64_t v;
+                assert(!mm_get(m, &k, &v) && !mm_haskey(m, &k));
+        }
+        // batches go through the filter as well, an empty one hides
+        // every key
+        uint64_t batch[64], values[64];
+        bool found[64];
+        for (uint64_t i = 0; i < 64; i++) {
+                batch[i] = NKEYS - 32 + i;
+        }
+        assert(mm_get_batch(m, batch, 64, values, found) == 32);
+        assert(found[31] && values[31] == NKEYS - 1 && !found[32]);
+        bloom_t *empty = make_bloom(sizeof(uint64_t), NULL, NKEYS, 0);
+        assert(mm_attach_bloom(m, empty) == 0);
+        assert(mm_get_batch(m, batch, 64, values, found) == 0 && !found[0]);
+        assert(mm_attach_bloom(m, b) == 0);
+        delete_bloom(empty);
+        // deleted keys pass until the filter is rebuilt
+        for (uint64_t k = 0; k < NKEYS; k += 2) {
+                mm_delete(m, &k);
+        }
+        assert(pass_rate(b, 0, NKEYS) == 1.0);
+        assert(bloom_rebuild(b, m) == 0 && pass_rate(b, 0, NKEYS) < 0.52);
+
+        // a filter of another hash or another kind of map is refused
+        bloom_t *other = make_bloom(sizeof(uint64_t), hash_bytes, NKEYS, 0);
+        assert(mm_attach_bloom(m, other) == -1);
+        delete_bloom(other);
+        map_opts_t flat = {
+                .engine = MAP_ENGINE_FLAT,
+        };
+        map_t *fm = make_map_opts(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &flat);
+        assert(mm_attach_bloom(fm, b) == -1);
+        delete_map(fm);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Marshal Test ===\n");
+        // a mapped map and its filter survive a restart together
+        const char *path = "/tmp/testbloom.map", *bpath = "/tmp/testbloom.map.bloom";
+        assert(mm_marshal_mapped(path, m) == 0);
+        assert(bloom_marshal(bpath, b) == 0);
+        size_t added = b->added;
+        mm_attach_bloom(m, NULL);
+        delete_map(m);
+        delete_bloom(b);
+
+        m = mm_open_mapped(path, NULL, NULL);
+        b = bloom_unmarshal(bpath, NULL);
+        assert(m && b && b->added == added);
+        assert(mm_attach_bloom(m, b) == 0);
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                uint64_t v;
+                assert(mm_get(m, &k, &v) == (k % 2 == 1));
+        }
+        for (uint64_t k = NKEYS; k < 2 * NKEYS; k++) {
+                assert(!mm_haskey(m, &k));
+        }
+        delete_map(m);
+        delete_bloom(b);
+
+        // a flipped byte
+        FILE *fp = fopen(bpath, "r+b");
+        fseek(fp, 100, SEEK_SET);
+        int byte = fgetc(fp);
+        fseek(fp, 100, SEEK_SET);
+        fputc(byte ^ 1, fp);
+        fclose(fp);
+        assert(bloom_unmarshal(bpath, NULL) == NULL);
+        assert(bloom_unmarshal(path, NULL) == NULL);
+        unlink(path);
+        unlink(bpath);
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif
@@ -0,0 +1,1051 @@
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blockfile.h"
+#include "btree.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+// nodes of a slab
+#define NODES_PER_SLAB 128
+
+// first word of a marshal file, followed by the version in the high
+// half of the next word
+#define BT_MARSHAL_MAGIC 0x3145455254424d4dULL
+#define BT_MARSHAL_VERSION 1
+
+typedef struct bt_meta_s {
+        uint64_t key_size;
+        uint64_t value_size;
+        uint64_t count;
+}bt_meta_t;
+
+#define NODE_HEADER offsetof(bt_node_t, data)
+
+int bt_cmp_u32(const void *key1, const void *key2, size_t keysize)
+{
+        uint32_t a = *(const uint32_t *)key1, b = *(const uint32_t *)key2;
+        return (a > b) - (a < b);
+}
+
+int bt_cmp_u64(const void *key1, const void *key2, size_t keysize)
+{
+        uint64_t a = *(const uint64_t *)key1, b = *(const uint64_t *)key2;
+        return (a > b) - (a < b);
+}
+
+int bt_cmp_i32(const void *key1, const void *key2, size_t keysize)
+{
+        int32_t a = *(const int32_t *)key1, b = *(const int32_t *)key2;
+        return (a > b) - (a < b);
+}
+
+int bt_cmp_i64(const void *key1, const void *key2, size_t keysize)
+{
+        int64_t a = *(const int64_t *)key1, b = *(const int64_t *)key2;
+        return (a > b) - (a < b);
+}
+
+static inline void *node_key(btree_t *t, bt_node_t *x, size_t i)
+{
+        return x->data + i * t->key_size;
+}
+
+static inline void *leaf_value(btree_t *t, bt_node_t *x, size_t i)
+{
+        return x->data + t->values_offset + i * t->value_size;
+}
+
+static inline bt_node_t **children(btree_t *t, bt_node_t *x)
+{
+        return (bt_node_t **)(x->data + t->children_offset);
+}
+
+static inline int cmp(btree_t *t, const void *a, const void *b)
+{
+        return t->kcmp(a, b, t->key_size);
+}
+
+static bt_node_t *new_leaf(btree_t *t)
+{
+        bt_node_t *x = sb_alloc(&t->leaf_slab);
+        memset(x, 0, NODE_HEADER);
+        x->leaf = true;
+        t->leaves++;
+        return x;
+}
+
+static bt_node_t *new_inner(btree_t *t)
+{
+        bt_node_t *x = sb_alloc(&t->inner_slab);
+        memset(x, 0, NODE_HEADER);
+        t->inners++;
+        return x;
+}
+
+static void free_node(btree_t *t, bt_node_t *x)
+{
+        if (x->leaf) {
+                sb_free(&t->leaf_slab, x);
+                t->leaves--;
+        } else {
+                sb_free(&t->inner_slab, x);
+                t->inners--;
+        }
+}
+
+static inline size_t min_keys(btree_t *t, bt_node_t *x)
+{
+        return (x->leaf ? t->leaf_cap : t->inner_cap) / 2;
+}
+
+btree_t *make_btree(size_t key_size, size_t value_size, keycmp_t kcmp)
+{
+        btree_t *t;
+        NEW_INSTANCE(t, btree_t);
+        t->key_size = key_size;
+        t->value_size = value_size;
+        t->kcmp = kcmp ? kcmp : memcmp;
+
+        // as many entries or keys as fit in BT_NODE_BYTES, 4 at the least
+        size_t room = BT_NODE_BYTES - NODE_HEADER;
+        size_t n = room / (key_size + value_size);
+        while (n > 4 && ALIGN8(n * key_size) + n * value_size > room) {
+                n--;
+        }
+        t->leaf_cap = n > 4 ? n : 4;
+        t->values_offset = ALIGN8(t->leaf_cap * key_size);
+        n = (room - sizeof(bt_node_t *)) / (key_size + sizeof(bt_node_t *));
+        while (n > 4 && ALIGN8(n * key_size) + (n + 1) * sizeof(bt_node_t *) > room) {
+                n--;
+        }
+        t->inner_cap = n > 4 ? n : 4;
+        t->children_offset = ALIGN8(t->inner_cap * key_size);
+        sb_init(&t->leaf_slab,
+                ALIGN8(NODE_HEADER + t->values_offset + t->leaf_cap * value_size), NODES_PER_SLAB);
+        sb_init(&t->inner_slab,
+                NODE_HEADER + t->children_offset + (t->inner_cap + 1) * sizeof(bt_node_t *),
+                NODES_PER_SLAB);
+
+        t->scratch = malloc(2 * key_size + 1);
+        if (!t->scratch) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        t->root = t->first = t->last = new_leaf(t);
+        t->height = 1;
+        return t;
+}
+
+void delete_btree(btree_t *t)
+{
+        sb_deinit(&t->leaf_slab);
+        sb_deinit(&t->inner_slab);
+        free(t->scratch);
+        free(t);
+}
+
+size_t bt_len(btree_t *t)
+{
+        return t->used;
+}
+
+// the first index of x whose key is >= key
+static size_t lower_index(btree_t *t, bt_node_t *x, const void *key)
+{
+        size_t lo = 0, hi = x->n;
+        while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (cmp(t, node_key(t, x, mid), key) < 0) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo;
+}
+
+// the first index of x whose key is > key, the child of an inner node
+// that holds key
+static size_t upper_index(btree_t *t, bt_node_t *x, const void *key)
+{
+        size_t lo = 0, hi = x->n;
+        while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (cmp(t, node_key(t, x, mid), key) <= 0) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo;
+}
+
+static bt_node_t *find_leaf(btree_t *t, const void *key)
+{
+        bt_node_t *x = t->root;
+        while (!x->leaf) {
+                x = children(t, x)[upper_index(t, x, key)];
+        }
+        return x;
+}
+
+// the entry of key in its leaf, -1 if not found
+static long find(btree_t *t, bt_node_t *x, const void *key)
+{
+        size_t i = lower_index(t, x, key);
+        if (i < x->n && cmp(t, node_key(t, x, i), key) == 0) {
+                return i;
+        }
+        return -1;
+}
+
+// move n entries of src from index from to index to of dst
+static void leaf_move(btree_t *t, bt_node_t *dst, size_t to, bt_node_t *src, size_t from, size_t n)
+{
+        memmove(node_key(t, dst, to), node_key(t, src, from), n * t->key_size);
+        memmove(leaf_value(t, dst, to), leaf_value(t, src, from), n * t->value_size);
+}
+
+// the same for the keys of inner nodes, the children move apart
+static void keys_move(btree_t *t, bt_node_t *dst, size_t to, bt_node_t *src, size_t from, size_t n)
+{
+        memmove(node_key(t, dst, to), node_key(t, src, from), n * t->key_size);
+}
+
+static void children_move(btree_t *t, bt_node_t *dst, size_t to, bt_node_t *src, size_t from,
+                          size_t n)
+{
+        memmove(children(t, dst) + to, children(t, src) + from, n * sizeof(bt_node_t *));
+}
+
+static void leaf_insert(btree_t *t, bt_node_t *x, size_t i, const void *key, const void *value)
+{
+        leaf_move(t, x, i + 1, x, i, x->n - i);
+        memcpy(node_key(t, x, i), key, t->key_size);
+        memcpy(leaf_value(t, x, i), value, t->value_size);
+        x->n++;
+}
+
+// key i and child i + 1
+static void inner_insert(btree_t *t, bt_node_t *x, size_t i, const void *key, bt_node_t *child)
+{
+        keys_move(t, x, i + 1, x, i, x->n - i);
+        children_move(t, x, i + 2, x, i + 1, x->n - i);
+        memcpy(node_key(t, x, i), key, t->key_size);
+        children(t, x)[i + 1] = child;
+        x->n++;
+}
+
+// move the upper half of x to a new leaf chained after it
+static bt_node_t *split_leaf(btree_t *t, bt_node_t *x)
+{
+        bt_node_t *r = new_leaf(t);
+        size_t half = x->n / 2;
+        leaf_move(t, r, 0, x, half, x->n - half);
+        r->n = x->n - half;
+        x->n = half;
+        r->prev = x;
+        r->next = x->next;
+        if (x->next) {
+                x->next->prev = r;
+        } else {
+                t->last = r;
+        }
+        x->next = r;
+        return r;
+}
+
+// move the keys and children above the middle key of x to a new node,
+// the middle key goes to up
+static bt_node_t *split_inner(btree_t *t, bt_node_t *x, void *up)
+{
+        bt_node_t *r = new_inner(t);
+        size_t mid = x->n / 2;
+        memcpy(up, node_key(t, x, mid), t->key_size);
+        r->n = x->n - mid - 1;
+        keys_move(t, r, 0, x, mid + 1, r->n);
+        children_move(t, r, 0, x, mid + 1, r->n + 1);
+        x->n = mid;
+        return r;
+}
+
+// put into the subtree of x, return true if the key is new. When x
+// splits, its new right sibling goes to *right and the lowest key of
+// that sibling to sep.
+static bool insert(btree_t *t, bt_node_t *x, const void *key, const void *value,
+                   bt_node_t **right, void *sep)
+{
+        *right = NULL;
+        if (x->leaf) {
+                size_t i = lower_index(t, x, key);
+                if (i < x->n && cmp(t, node_key(t, x, i), key) == 0) {
+                        memcpy(leaf_value(t, x, i), value, t->value_size);
+                        return false;
+                }
+                if (x->n == t->leaf_cap) {
+                        *right = split_leaf(t, x);
+                        memcpy(sep, node_key(t, *right, 0), t->key_size);
+                        if (i > x->n) {
+                                i -= x->n;
+                                x = *right;
+                        }
+                }
+                // a new key never goes first in the right half, sep holds
+                leaf_insert(t, x, i, key, value);
+                return true;
+        }
+
+        size_t c = upper_index(t, x, key);
+        bt_node_t *child_right;
+        bool added = insert(t, children(t, x)[c], key, value, &child_right, sep);
+        if (!child_right) {
+                return added;
+        }
+        if (x->n < t->inner_cap) {
+                inner_insert(t, x, c, sep, child_right);
+                return added;
+        }
+        char *up = t->scratch + t->key_size;
+        bt_node_t *r = split_inner(t, x, up);
+        if (c <= x->n) {
+                inner_insert(t, x, c, sep, child_right);
+        } else {
+                inner_insert(t, r, c - x->n - 1, sep, child_right);
+        }
+        memcpy(sep, up, t->key_size);
+        *right = r;
+        return added;
+}
+
+int bt_put(btree_t *t, const void *key, const void *value)
+{
+        bt_node_t *right;
+        if (!insert(t, t->root, key, value, &right, t->scratch)) {
+                return 0;
+        }
+        t->used++;
+        t->version++;
+        if (right) {
+                bt_node_t *root = new_inner(t);
+                root->n = 1;
+                memcpy(node_key(t, root, 0), t->scratch, t->key_size);
+                children(t, root)[0] = t->root;
+                children(t, root)[1] = right;
+                t->root = root;
+                t->height++;
+        }
+        return 0;
+}
+
+bool bt_get(btree_t *t, const void *key, void *value)
+{
+        bt_node_t *x = find_leaf(t, key);
+        long i = find(t, x, key);
+        if (i < 0) {
+                return false;
+        }
+        if (value) {
+                memcpy(value, leaf_value(t, x, i), t->value_size);
+        }
+        return true;
+}
+
+bool bt_haskey(btree_t *t, const void *key)
+{
+        return find(t, find_leaf(t, key), key) >= 0;
+}
+
+// child c of x takes the last entry of its left sibling
+static void borrow_left(btree_t *t, bt_node_t *x, size_t c)
+{
+        bt_node_t *l = children(t, x)[c - 1], *y = children(t, x)[c];
+        if (y->leaf) {
+                leaf_move(t, y, 1, y, 0, y->n);
+                leaf_move(t, y, 0, l, l->n - 1, 1);
+                memcpy(node_key(t, x, c - 1), node_key(t, y, 0), t->key_size);
+        } else {
+                keys_move(t, y, 1, y, 0, y->n);
+                children_move(t, y, 1, y, 0, y->n + 1);
+                memcpy(node_key(t, y, 0), node_key(t, x, c - 1), t->key_size);
+                children(t, y)[0] = children(t, l)[l->n];
+                memcpy(node_key(t, x, c - 1), node_key(t, l, l->n - 1), t->key_size);
+        }
+        y->n++;
+        l->n--;
+}
+
+// child c of x takes the first entry of its right sibling
+static void borrow_right(btree_t *t, bt_node_t *x, size_t c)
+{
+        bt_node_t *y = children(t, x)[c], *r = children(t, x)[c + 1];
+        if (y->leaf) {
+                leaf_move(t, y, y->n, r, 0, 1);
+                leaf_move(t, r, 0, r, 1, r->n - 1);
+                memcpy(node_key(t, x, c), node_key(t, r, 0), t->key_size);
+        } else {
+                memcpy(node_key(t, y, y->n), node_key(t, x, c), t->key_size);
+                children(t, y)[y->n + 1] = children(t, r)[0];
+                memcpy(node_key(t, x, c), node_key(t, r, 0), t->key_size);
+                keys_move(t, r, 0, r, 1, r->n - 1);
+                children_move(t, r, 0, r, 1, r->n);
+        }
+        y->n++;
+        r->n--;
+}
+
+// fold child s + 1 of x into child s
+static void merge(btree_t *t, bt_node_t *x, size_t s)
+{
+        bt_node_t *a = children(t, x)[s], *b = children(t, x)[s + 1];
+        if (a->leaf) {
+                leaf_move(t, a, a->n, b, 0, b->n);
+                a->n += b->n;
+                a->next = b->next;
+                if (b->next) {
+                        b->next->prev = a;
+                } else {
+                        t->last = a;
+                }
+        } else {
+                memcpy(node_key(t, a, a->n), node_key(t, x, s), t->key_size);
+                keys_move(t, a, a->n + 1, b, 0, b->n);
+                children_move(t, a, a->n + 1, b, 0, b->n + 1);
+                a->n += 1 + b->n;
+        }
+        free_node(t, b);
+        keys_move(t, x, s, x, s + 1, x->n - s - 1);
+        children_move(t, x, s + 1, x, s + 2, x->n - s - 1);
+        x->n--;
+}
+
+// child c of x fell below half full
+static void rebalance(btree_t *t, bt_node_t *x, size_t c)
+{
+        bt_node_t **ch = children(t, x);
+        if (c > 0 && ch[c - 1]->n > min_keys(t, ch[c - 1])) {
+                borrow_left(t, x, c);
+        } else if (c < x->n && ch[c + 1]->n > min_keys(t, ch[c + 1])) {
+                borrow_right(t, x, c);
+        } else if (c > 0) {
+                merge(t, x, c - 1);
+        } else {
+                merge(t, x, c);
+        }
+}
+
+static bool remove_key(btree_t *t, bt_node_t *x, const void *key)
+{
+        if (x->leaf) {
+                long i = find(t, x, key);
+                if (i < 0) {
+                        return false;
+                }
+                leaf_move(t, x, i, x, i + 1, x->n - i - 1);
+                x->n--;
+                return true;
+        }
+        size_t c = upper_index(t, x, key);
+        bt_node_t *y = children(t, x)[c];
+        if (!remove_key(t, y, key)) {
+                return false;
+        }
+        if (y->n < min_keys(t, y)) {
+                rebalance(t, x, c);
+        }
+        return true;
+}
+
+bool bt_delete(btree_t *t, const void *key)
+{
+        if (!remove_key(t, t->root, key)) {
+                return false;
+        }
+        t->used--;
+        t->version++;
+        if (!t->root->leaf && t->root->n == 0) {
+                bt_node_t *root = t->root;
+                t->root = children(t, root)[0];
+                free_node(t, root);
+                t->height--;
+        }
+        return true;
+}
+
+// entries go to the last leaf, a new one is chained once it holds fill
+static void bulk_add(btree_t *t, size_t fill, const void *key, const void *value)
+{
+        bt_node_t *x = t->last;
+        if (x->n == fill) {
+                bt_node_t *y = new_leaf(t);
+                x->next = y;
+                y->prev = x;
+                t->last = y;
+                x = y;
+        }
+        memcpy(node_key(t, x, x->n), key, t->key_size);
+        memcpy(leaf_value(t, x, x->n), value, t->value_size);
+        x->n++;
+        t->used++;
+}
+
+// even out the last two leaves, then build the inner levels bottom up,
+// every node taking an equal share of the level below
+static void bulk_end(btree_t *t)
+{
+        bt_node_t *x = t->last, *p = x->prev;
+        if (p && x->n < t->leaf_cap / 2) {
+                size_t keep = (p->n + x->n + 1) / 2, move = p->n - keep;
+                leaf_move(t, x, move, x, 0, x->n);
+                leaf_move(t, x, 0, p, keep, move);
+                x->n += move;
+                p->n = keep;
+        }
+        size_t count = t->leaves;
+        if (count == 1) {
+                t->version++;
+                return;
+        }
+        bt_node_t **nodes = malloc(count * sizeof(bt_node_t *));
+        const void **lows = malloc(count * sizeof(void *));
+        if (!nodes || !lows) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        size_t i = 0;
+        for (x = t->first; x; x = x->next, i++) {
+                nodes[i] = x;
+                lows[i] = node_key(t, x, 0);
+        }
+        size_t fanout = t->inner_cap - t->inner_cap / 8 + 1;
+        while (count > 1) {
+                size_t parents = (count + fanout - 1) / fanout, at = 0;
+                // parent p only reads the nodes from at >= p on
+                for (size_t p = 0; p < parents; p++) {
+                        size_t k = count / parents + (p < count % parents);
+                        bt_node_t *y = new_inner(t);
+                        const void *low = lows[at];
+                        for (size_t j = 0; j < k; j++) {
+                                children(t, y)[j] = nodes[at + j];
+                                if (j > 0) {
+                                        memcpy(node_key(t, y, j - 1), lows[at + j], t->key_size);
+                                }
+                        }
+                        y->n = k - 1;
+                        nodes[p] = y;
+                        lows[p] = low;
+                        at += k;
+                }
+                count = parents;
+                t->height++;
+        }
+        t->root = nodes[0];
+        t->version++;
+        free(nodes);
+        free(lows);
+}
+
+static inline size_t bulk_fill(btree_t *t)
+{
+        return t->leaf_cap - t->leaf_cap / 8;
+}
+
+int bt_bulk_load(btree_t *t, const void *keys, const void *values, size_t n)
+{
+        if (t->used) {
+                fprintf(stderr, "bt_bulk_load: the tree is not empty\n");
+                return -1;
+        }
+        const char *k = keys, *v = values;
+        for (size_t i = 1; i < n; i++) {
+                if (cmp(t, k + (i - 1) * t->key_size, k + i * t->key_size) >= 0) {
+                        fprintf(stderr, "bt_bulk_load: key %zu is not above the one before\n", i);
+                        return -1;
+                }
+        }
+        size_t fill = bulk_fill(t);
+        for (size_t i = 0; i < n; i++) {
+                bulk_add(t, fill, k + i * t->key_size, v + i * t->value_size);
+        }
+        bulk_end(t);
+        return 0;
+}
+
+slice_t *bt_keyset(btree_t *t)
+{
+        slice_t *s = make_slice(t->used, t->key_size, NULL);
+        for (bt_node_t *x = t->first; x; x = x->next) {
+                for (size_t i = 0; i < x->n; i++) {
+                        ss_append(s, node_key(t, x, i));
+                }
+        }
+        return s;
+}
+
+void bt_begin(btree_t *t, bt_iter_t *it)
+{
+        it->t = t;
+        it->leaf = t->first;
+        it->i = 0;
+        it->version = t->version;
+}
+
+void bt_end(btree_t *t, bt_iter_t *it)
+{
+        it->t = t;
+        it->leaf = t->last;
+        it->i = t->last->n;
+        it->version = t->version;
+}
+
+// a cursor at the end of a leaf moves to the start of the next one
+static bool seek(btree_t *t, bt_iter_t *it, bt_node_t *x, size_t i)
+{
+        if (i == x->n && x->next) {
+                x = x->next;
+                i = 0;
+        }
+        it->t = t;
+        it->leaf = x;
+        it->i = i;
+        it->version = t->version;
+        return i < x->n;
+}
+
+bool bt_lower_bound(btree_t *t, const void *key, bt_iter_t *it)
+{
+        bt_node_t *x = find_leaf(t, key);
+        return seek(t, it, x, lower_index(t, x, key));
+}
+
+bool bt_upper_bound(btree_t *t, const void *key, bt_iter_t *it)
+{
+        bt_node_t *x = find_leaf(t, key);
+        return seek(t, it, x, upper_index(t, x, key));
+}
+
+bool bt_iter_next(bt_iter_t *it, void **key, void **value)
+{
+        btree_t *t = it->t;
+        if (it->version != t->version) {
+                return false;
+        }
+        while (it->i == it->leaf->n) {
+                if (!it->leaf->next) {
+                        return false;
+                }
+                it->leaf = it->leaf->next;
+                it->i = 0;
+        }
+        *key = node_key(t, it->leaf, it->i);
+        *value = leaf_value(t, it->leaf, it->i);
+        it->i++;
+        return true;
+}
+
+bool bt_iter_prev(bt_iter_t *it, void **key, void **value)
+{
+        btree_t *t = it->t;
+        if (it->version != t->version) {
+                return false;
+        }
+        while (it->i == 0) {
+                if (!it->leaf->prev) {
+                        return false;
+                }
+                it->leaf = it->leaf->prev;
+                it->i = it->leaf->n;
+        }
+        it->i--;
+        *key = node_key(t, it->leaf, it->i);
+        *value = leaf_value(t, it->leaf, it->i);
+        return true;
+}
+
+int bt_marshal(const char *path, btree_t *t)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        uint64_t head[2] = {BT_MARSHAL_MAGIC, (uint64_t)BT_MARSHAL_VERSION << 32};
+        if (write(fd, head, sizeof(head)) != sizeof(head)) {
+                close(fd);
+                return -1;
+        }
+        size_t record_size = t->key_size + t->value_size;
+        bf_writer_t *w = bf_writer_new(fd, record_size > BF_BLOCK_SIZE ? record_size : 0, false);
+        bt_meta_t meta = {
+                .key_size = t->key_size,
+                .value_size = t->value_size,
+                .count = t->used,
+        };
+        memcpy(bf_reserve(w, sizeof(meta)), &meta, sizeof(meta));
+        bf_flush(w);
+
+        for (bt_node_t *x = t->first; x; x = x->next) {
+                for (size_t i = 0; i < x->n; i++) {
+                        char *rec = bf_reserve(w, record_size);
+                        memcpy(rec, node_key(t, x, i), t->key_size);
+                        memcpy(rec + t->key_size, leaf_value(t, x, i), t->value_size);
+                }
+        }
+        int ret = bf_writer_close(w);
+        if (close(fd) != 0) {
+                ret = -1;
+        }
+        return ret;
+}
+
+static const char *block_error(long n)
+{
+        return n == BF_TRUNCATED ? "truncated" : "corrupt";
+}
+
+// check every block, the records in order included, return NULL if the
+// file is good
+static const char *check_blocks(btree_t *t, bf_reader_t *r)
+{
+        void *payload;
+        bt_meta_t meta;
+        long n = bf_next(r, &payload);
+        if (n != sizeof(meta)) {
+                return n < 0 ? block_error(n) : "corrupt";
+        }
+        memcpy(&meta, payload, sizeof(meta));
+        if (meta.key_size != t->key_size || meta.value_size != t->value_size) {
+                return "key or value size does not match the tree";
+        }
+        size_t record_size = t->key_size + t->value_size;
+        char *prev = t->scratch;
+        uint64_t count = 0;
+        while ((n = bf_next(r, &payload)) > 0) {
+                if (n % record_size != 0) {
+                        return "corrupt";
+                }
+                for (const char *rec = payload; rec < (char *)payload + n; rec += record_size) {
+                        if (count > 0 && cmp(t, prev, rec) >= 0) {
+                                return "keys out of order";
+                        }
+                        memcpy(prev, rec, t->key_size);
+                        count++;
+                }
+        }
+        if (n < 0) {
+                return block_error(n);
+        }
+        return count == meta.count ? NULL : "corrupt";
+}
+
+int bt_unmarshal(const char *path, btree_t *t)
+{
+        FILE *fp = fopen(path, "rb");
+        if (!fp) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        uint64_t head[2];
+        const char *err = NULL;
+        if (fread(head, sizeof(head), 1, fp) != 1) {
+                err = "truncated";
+        } else if (head[0] != BT_MARSHAL_MAGIC) {
+                err = "not a marshaled btree";
+        } else if ((head[1] >> 32) != BT_MARSHAL_VERSION) {
+                fprintf(stderr, "bt_unmarshal: %s: unsupported version %llu\n",
+                        path, (unsigned long long)(head[1] >> 32));
+                fclose(fp);
+                return -1;
+        }
+        bf_reader_t *r = NULL;
+        if (!err) {
+                r = bf_reader_new(fp);
+                err = check_blocks(t, r);
+        }
+        if (err) {
+                fprintf(stderr, "bt_unmarshal: %s: %s\n", path, err);
+                if (r) {
+                        bf_reader_delete(r);
+                }
+                fclose(fp);
+                return -1;
+        }
+
+        // load data, an empty tree is built leaf by leaf
+        bool bulk = t->used == 0;
+        size_t record_size = t->key_size + t->value_size, fill = bulk_fill(t);
+        void *payload;
+        long n;
+        bf_rewind(r);
+        bf_next(r, &payload);
+        while ((n = bf_next(r, &payload)) > 0) {
+                for (const char *rec = payload; rec < (char *)payload + n; rec += record_size) {
+                        if (bulk) {
+                                bulk_add(t, fill, rec, rec + t->key_size);
+                        } else {
+                                bt_put(t, rec, rec + t->key_size);
+                        }
+                }
+        }
+        if (bulk) {
+                bulk_end(t);
+        }
+        bf_reader_delete(r);
+        fclose(fp);
+
+        // only if the file changed between the two passes
+        if (n < 0) {
+                fprintf(stderr, "bt_unmarshal: %s: %s\n", path, block_error(n));
+                return -1;
+        }
+        return 0;
+}
+
+#ifdef TESTBTREE
+// testing
+#include <assert.h>
+
+#define NKEYS 20000
+
+// the tree is ordered, balanced, chained and counted right
+static void check_node(btree_t *t, bt_node_t *x, unsigned depth, const uint64_t *lo,
+                       const uint64_t *hi, bt_node_t **leaf, size_t *count)
+{
+        if (x != t->root) {
+                assert(x->n >= 1);
+        }
+        for (size_t i = 0; i < x->n; i++) {
+                uint64_t k = *(uint64_t *)node_key(t, x, i);
+                assert(!lo || k >= *lo);
+                assert(!hi || k < *hi);
+                assert(i == 0 || k > *(uint64_t *)node_key(t, x, i - 1));
+        }
+        if (x->leaf) {
+                assert(depth == t->height);
+                assert(x->prev == *leaf);
+                *leaf = x;
+                *count += x->n;
+                return;
+        }
+        for (size_t c = 0; c <= x->n; c++) {
+                check_node(t, children(t, x)[c], depth + 1,
+                           c > 0 ? node_key(t, x, c - 1) : lo,
+                           c < x->n ? node_key(t, x, c) : hi, leaf, count);
+        }
+}
+
+static void check_tree(btree_t *t, const bool *in)
+{
+        bt_node_t *leaf = NULL;
+        size_t count = 0;
+        check_node(t, t->root, 1, NULL, NULL, &leaf, &count);
+        assert(leaf == t->last && count == t->used);
+
+        // both ways over the leaves
+        bt_iter_t it;
+        void *key, *value;
+        uint64_t want = 0;
+        bt_begin(t, &it);
+        while (bt_iter_next(&it, &key, &value)) {
+                while (!in[want]) {
+                        want++;
+                }
+                assert(*(uint64_t *)key == want && *(uint64_t *)value == want * 3);
+                want++;
+        }
+        size_t n = 0;
+        bt_end(t, &it);
+        while (bt_iter_prev(&it, &key, &value)) {
+                assert(in[*(uint64_t *)key]);
+                n++;
+        }
+        assert(n == t->used);
+}
+
+int main(int argc, char *argv[])
+{
+        bool *in = calloc(NKEYS, sizeof(bool));
+
+        printf("=== RUN Model Test ===\n");
+        btree_t *t = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        unsigned int seed = 1;
+        size_t n = 0;
+        for (int i = 0; i < 20 * NKEYS; i++) {
+                uint64_t k = rand_r(&seed) % NKEYS, v = k * 3, got;
+                // grow for the first half, shrink for the second
+                int op = rand_r(&seed) % (i < 10 * NKEYS ? 3 : 6);
+                if (op == 0) {
+                        n += !in[k];
+                        bt_put(t, &k, &v);
+                        in[k] = true;
+                } else if (op == 1) {
+                        assert(bt_get(t, &k, &got) == in[k]);
+                        assert(!in[k] || got == v);
+                } else {
+                        assert(bt_delete(t, &k) == in[k]);
+                        n -= in[k];
+                        in[k] = false;
+                }
+                assert(bt_len(t) == n);
+                if (i % NKEYS == 0) {
+                        check_tree(t, in);
+                }
+        }
+        check_tree(t, in);
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                if (in[k]) {
+                        assert(bt_delete(t, &k));
+                }
+        }
+        assert(bt_len(t) == 0 && t->height == 1 && t->leaves == 1 && t->inners == 0);
+        delete_btree(t);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Bound Test ===\n");
+        // the even keys
+        t = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        memset(in, 0, NKEYS * sizeof(bool));
+        for (uint64_t k = 0; k < NKEYS; k += 2) {
+                uint64_t v = k * 3;
+                bt_put(t, &k, &v);
+                in[k] = true;
+        }
+        assert(t->height > 2);
+        bt_iter_t it;
+        void *key, *value;
+        for (uint64_t k = 0; k < NKEYS - 2; k++) {
+                assert(bt_lower_bound(t, &k, &it));
+                assert(bt_iter_next(&it, &key, &value));
+                assert(*(uint64_t *)key == (k + 1) / 2 * 2);
+                assert(bt_upper_bound(t, &k, &it));
+                assert(bt_iter_next(&it, &key, &value));
+                assert(*(uint64_t *)key == k / 2 * 2 + 2);
+                // the key before the lower bound
+                bt_lower_bound(t, &k, &it);
+                assert(bt_iter_prev(&it, &key, &value) == (k > 0));
+                assert(k == 0 || *(uint64_t *)key == (k + 1) / 2 * 2 - 2);
+        }
+        uint64_t past = NKEYS;
+        assert(!bt_lower_bound(t, &past, &it) && !bt_iter_next(&it, &key, &value));
+        assert(bt_iter_prev(&it, &key, &value) && *(uint64_t *)key == NKEYS - 2);
+
+        // a range backwards, a change ends the walk
+        uint64_t lo = 1000, hi = 2000, want = 2000;
+        bt_upper_bound(t, &hi, &it);
+        while (bt_iter_prev(&it, &key, &value) && *(uint64_t *)key >= lo) {
+                assert(*(uint64_t *)key == want);
+                want -= 2;
+        }
+        assert(want == lo - 2);
+        bt_begin(t, &it);
+        bt_delete(t, &lo);
+        assert(!bt_iter_next(&it, &key, &value));
+        bt_put(t, &lo, &(uint64_t){lo * 3});
+
+        slice_t *keys = bt_keyset(t);
+        assert(keys->len == bt_len(t));
+        for (size_t i = 0; i < keys->len; i++) {
+                assert(*(uint64_t *)ss_getptr(keys, i) == 2 * i);
+        }
+        delete_slice(keys);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Bulk Test ===\n");
+        uint64_t *ks = malloc(NKEYS * sizeof(uint64_t)), *vs = malloc(NKEYS * sizeof(uint64_t));
+        for (size_t count = 0; count < NKEYS; count = count * 3 + 1) {
+                for (size_t i = 0; i < count; i++) {
+                        ks[i] = 2 * i;
+                        vs[i] = 6 * i;
+                }
+                btree_t *b = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+                assert(bt_bulk_load(b, ks, vs, count) == 0);
+                memset(in, 0, NKEYS * sizeof(bool));
+                for (size_t i = 0; i < count; i++) {
+                        in[2 * i] = true;
+                }
+                check_tree(b, in);
+                // the loaded tree takes changes like any other
+                for (uint64_t k = 1; k < 2 * count; k += 2) {
+                        bt_put(b, &k, &(uint64_t){k * 3});
+                        in[k] = true;
+                }
+                check_tree(b, in);
+                for (uint64_t k = 0; k < 2 * count; k += 4) {
+                        bt_delete(b, &k);
+                        in[k] = false;
+                }
+                check_tree(b, in);
+                delete_btree(b);
+        }
+        btree_t *b = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        ks[1] = ks[0];
+        assert(bt_bulk_load(b, ks, vs, 3) == -1 && bt_len(b) == 0);
+        assert(bt_bulk_load(t, ks, vs, 1) == -1);
+        delete_btree(b);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Marshal Test ===\n");
+        const char *path = "/tmp/testbtree.bt";
+        assert(bt_marshal(path, t) == 0);
+        b = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        assert(bt_unmarshal(path, b) == 0);
+        assert(bt_len(b) == bt_len(t));
+        memset(in, 0, NKEYS * sizeof(bool));
+        for (uint64_t k = 0; k < NKEYS; k += 2) {
+                in[k] = true;
+        }
+        check_tree(b, in);
+        // into a tree that has entries already
+        btree_t *c = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        uint64_t odd = 1;
+        bt_put(c, &odd, &(uint64_t){3});
+        assert(bt_unmarshal(path, c) == 0);
+        in[1] = true;
+        check_tree(c, in);
+        delete_btree(c);
+
+        // another value size, and a flipped byte
+        c = make_btree(sizeof(uint64_t), sizeof(uint32_t), bt_cmp_u64);
+        assert(bt_unmarshal(path, c) == -1 && bt_len(c) == 0);
+        delete_btree(c);
+        FILE *fp = fopen(path, "r+b");
+        fseek(fp, 100, SEEK_SET);
+        int byte = fgetc(fp);
+        fseek(fp, 100, SEEK_SET);
+        fputc(byte ^ 1, fp);
+        fclose(fp);
+        c = make_btree(sizeof(uint64_t), sizeof(uint64_t), bt_cmp_u64);
+        assert(bt_unmarshal(path, c) == -1 && bt_len(c) == 0);
+        delete_btree(c);
+        unlink(path);
+        delete_btree(b);
+        delete_btree(t);
+
+        // string keys in memcmp order
+        t = make_btree(12, sizeof(int), NULL);
+        char k12[12];
+        for (int i = NKEYS - 1; i >= 0; i--) {
+                memset(k12, 0, sizeof(k12));
+                snprintf(k12, sizeof(k12), "key%06d", i);
+                bt_put(t, k12, &i);
+        }
+        bt_begin(t, &it);
+        for (int i = 0; bt_iter_next(&it, &key, &value); i++) {
+                assert(*(int *)value == i);
+        }
+        delete_btree(t);
+        free(ks);
+        free(vs);
+        free(in);
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "slice.h"
+
+// retires between two attempts to advance the epoch
+#define EB_COLLECT_EVERY 64
+
+typedef struct eb_item_s {
+        void *ptr;
+        dtor_t dtor;
+}eb_item_t;
+
+/*
+ * Thread ids index the slots of every domain. They are handed out once per
+ * thread and given back when the thread exits, so a domain only ever needs
+ * EB_MAX_THREADS slots and scans the ones below the high water mark.
+ */
+static pthread_once_t tid_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tid_key;
+static pthread_mutex_t tid_mu = PTHREAD_MUTEX_INITIALIZER;
+static int free_tids[EB_MAX_THREADS];
+static int nfree_tids;
+static int max_tid;
+static __thread int my_tid = -1;
+
+static void release_tid(void *arg)
+{
+        pthread_mutex_lock(&tid_mu);
+        free_tids[nfree_tids++] = (int)(intptr_t)arg - 1;
+        pthread_mutex_unlock(&tid_mu);
+}
+
+static void make_tid_key()
+{
+        pthread_key_create(&tid_key, release_tid);
+}
+
+static int thread_id()
+{
+        if (my_tid >= 0) {
+                return my_tid;
+        }
+
+        pthread_once(&tid_once, make_tid_key);
+        pthread_mutex_lock(&tid_mu);
+        if (nfree_tids > 0) {
+                my_tid = free_tids[--nfree_tids];
+        } else if (max_tid < EB_MAX_THREADS) {
+                my_tid = max_tid;
+                __atomic_store_n(&max_tid, max_tid + 1, __ATOMIC_RELEASE);
+        } else {
+                error_at_line(-1, 0, __FILE__, __LINE__,
+                              "more than %d threads in an epoch domain", EB_MAX_THREADS);
+        }
+        pthread_mutex_unlock(&tid_mu);
+
+        // store id + 1, the destructor only runs for non-NULL values
+        pthread_setspecific(tid_key, (void *)(intptr_t)(my_tid + 1));
+        return my_tid;
+}
+
+epoch_t *eb_new()
+{
+        epoch_t *e;
+        if (posix_memalign((void **)&e, EB_CACHE_LINE, sizeof(epoch_t)) != 0) {
+                error_at_line(-1, ENOMEM, __FILE__, __LINE__, NULL);
+        }
+        memset(e, 0, sizeof(epoch_t));
+        return e;
+}
+
+static void free_items(slice_t *s)
+{
+        for (int i = 0; i < s->len; i++) {
+                eb_item_t *item = ss_getptr(s, i);
+                item->dtor(item->ptr);
+        }
+        s->len = 0;
+}
+
+void eb_delete(epoch_t *e)
+{
+        for (int i = 0; i < EB_MAX_THREADS; i++) {
+                for (int j = 0; j < 3; j++) {
+                        slice_t *s = e->slots[i].retired[j];
+                        if (s) {
+                                free_items(s);
+                                delete_slice(s);
+                        }
+                }
+        }
+        free(e);
+}
+
+void eb_enter(epoch_t *e)
+{
+        eb_slot_t *slot = &e->slots[thread_id()];
+        uint64_t g = __atomic_load_n(&e->global, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->local, (g << 1) | 1, __ATOMIC_RELAXED);
+        // the announcement has to be visible before any shared pointer is read
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void eb_exit(epoch_t *e)
+{
+        __atomic_store_n(&e->slots[thread_id()].local, 0, __ATOMIC_RELEASE);
+}
+
+// the epoch moves on once every thread inside has seen the current one
+static void try_advance(epoch_t *e)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint64_t g = __atomic_load_n(&e->global, __ATOMIC_ACQUIRE);
+        int n = __atomic_load_n(&max_tid, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < n; i++) {
+                uint64_t local = __atomic_load_n(&e->slots[i].local, __ATOMIC_ACQUIRE);
+                if ((local & 1) && (local >> 1) != g) {
+                        return;
+                }
+        }
+        __atomic_compare_exchange_n(&e->global, &g, g + 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+void eb_collect(epoch_t *e)
+{
+        eb_slot_t *slot = &e->slots[thread_id()];
+        try_advance(e);
+
+        uint64_t g = __atomic_load_n(&e->global, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < 3; i++) {
+                slice_t *s = slot->retired[i];
+                if (s && s->len > 0 && slot->retired_epoch[i] + 2 <= g) {
+                        free_items(s);
+                }
+        }
+        slot->pending = 0;
+}
+
+void eb_retire(epoch_t *e, void *ptr, dtor_t dtor)
+{
+        eb_slot_t *slot = &e->slots[thread_id()];
+        // the unlink of ptr has to be ordered before reading the epoch
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint64_t g = __atomic_load_n(&e->global, __ATOMIC_ACQUIRE);
+        int i = g % 3;
+
+        if (!slot->retired[i]) {
+                slot->retired[i] = make_slice(16, sizeof(eb_item_t), NULL);
+        }
+        if (slot->retired_epoch[i] != g) {
+                // whatever is left there is from three epochs ago or older
+                free_items(slot->retired[i]);
+                slot->retired_epoch[i] = g;
+        }
+        eb_item_t item = {
+                .ptr = ptr,
+                .dtor = dtor,
+        };
+        ss_append(slot->retired[i], &item);
+
+        if (++slot->pending >= EB_COLLECT_EVERY) {
+                eb_collect(e);
+        }
+}
+
+#ifdef TESTEPOCH
+// testing
+#include <assert.h>
+
+static int freed;
+static int reader_state; // 1 inside, 2 asked to leave, 3 left
+
+static void count_free(void *ptr)
+{
+        __atomic_add_fetch(&freed, 1, __ATOMIC_RELAXED);
+        free(ptr);
+}
+
+static void *reader(void *arg)
+{
+        epoch_t *e = arg;
+        eb_enter(e);
+        __atomic_store_n(&reader_state, 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&reader_state, __ATOMIC_ACQUIRE) != 2) {
+        }
+        eb_exit(e);
+        __atomic_store_n(&reader_state, 3, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+        epoch_t *e = eb_new();
+
+        printf("=== RUN Reclaim Test ===\n");
+        for (int i = 0; i < 10; i++) {
+                eb_retire(e, malloc(16), count_free);
+        }
+        for (int i = 0; i < 3; i++) {
+                eb_collect(e);
+        }
+        assert(freed == 10);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Reader Blocks Reclaim Test ===\n");
+        pthread_t t;
+        pthread_create(&t, NULL, reader, e);
+        while (__atomic_load_n(&reader_state, __ATOMIC_ACQUIRE) != 1) {
+        }
+        for (int i = 0; i < 10; i++) {
+                eb_retire(e, malloc(16), count_free);
+        }
+        for (int i = 0; i < 10; i++) {
+                eb_collect(e);
+        }
+        assert(freed == 10);
+
+        __atomic_store_n(&reader_state, 2, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&reader_state, __ATOMIC_ACQUIRE) != 3) {
+        }
+        for (int i = 0; i < 3; i++) {
+                eb_collect(e);
+        }
+        assert(freed == 20);
+        pthread_join(t, NULL);
+        printf("--- PASS ---\n");
+
+        // whatever is still pending goes away with the domain
+        eb_retire(e, malloc(16), count_free);
+        eb_delete(e);
+        assert(freed == 21);
+        return 0;
+}
+
+#endif
@@ -0,0 +1,356 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "flatmap.h"
+#include "map.h"
+
+#define NOT_FOUND ((size_t)-1)
+
+// keys of ft_find_batch whose groups are prefetched together, the hashes
+// stay on the stack
+#define FIND_BATCH_GROUP 16
+
+// one bit per slot of a group, lowest bit is the first slot
+typedef uint32_t group_mask_t;
+
+static inline group_mask_t match_byte(const uint8_t *group, uint8_t b)
+{
+#if defined(__AVX2__)
+        __m256i ctrl = _mm256_loadu_si256((const __m256i *)group);
+        return (group_mask_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)b)));
+#elif defined(__SSE2__)
+        __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+        return (group_mask_t)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+        group_mask_t mask = 0;
+        for (int i = 0; i < FT_GROUP_WIDTH; i++) {
+                if (group[i] == b) {
+                        mask |= (group_mask_t)1 << i;
+                }
+        }
+        return mask;
+#endif
+}
+
+// empty and deleted slots are the ones with the high bit set
+static inline group_mask_t match_non_full(const uint8_t *group)
+{
+#if defined(__AVX2__)
+        return (group_mask_t)_mm256_movemask_epi8(
+                _mm256_loadu_si256((const __m256i *)group));
+#elif defined(__SSE2__)
+        return (group_mask_t)_mm_movemask_epi8(
+                _mm_loadu_si128((const __m128i *)group));
+#else
+        group_mask_t mask = 0;
+        for (int i = 0; i < FT_GROUP_WIDTH; i++) {
+                if (group[i] & 0x80) {
+                        mask |= (group_mask_t)1 << i;
+                }
+        }
+        return mask;
+#endif
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+        // k2int is often weak (e.g. the identity), spread it before
+        // splitting it into the group index and the 7-bit tag
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+}
+
+static inline uint64_t ft_hash(map_t *m, const void *key)
+{
+        return mix(m->k2int(key, m->key_size));
+}
+
+static inline uint8_t h2(uint64_t h)
+{
+        return (uint8_t)(h & 0x7f);
+}
+
+static inline size_t group_mask(flat_table_t *ft)
+{
+        return ft->capacity / FT_GROUP_WIDTH - 1;
+}
+
+static size_t capacity_to_growth(size_t capacity)
+{
+        // keep the load factor under 7/8, so every probe sequence ends
+        return capacity - capacity / 8;
+}
+
+// slot_size can be 0 when the map is used as a set
+static inline size_t slots_bytes(flat_table_t *ft)
+{
+        return ft->slot_size * ft->capacity + 1;
+}
+
+flat_table_t *ft_new(size_t slot_size, size_t cap, const allocator_t *al)
+{
+        al = al_or_libc(al);
+        flat_table_t *ft = al_calloc(al, sizeof(flat_table_t));
+        ft->al = al;
+
+        size_t capacity = FT_GROUP_WIDTH;
+        while (capacity < cap) {
+                capacity <<= 1;
+        }
+        ft->capacity = capacity;
+        ft->slot_size = slot_size;
+        ft->growth_left = capacity_to_growth(capacity);
+
+        ft->ctrl = al_alloc(al, capacity);
+        memset(ft->ctrl, FT_EMPTY, capacity);
+
+        ft->slots = al_alloc(al, slots_bytes(ft));
+        return ft;
+}
+
+void ft_delete(flat_table_t *ft)
+{
+        al_free(ft->al, ft->ctrl, ft->capacity);
+        al_free(ft->al, ft->slots, slots_bytes(ft));
+        al_free(ft->al, ft, sizeof(flat_table_t));
+}
+
+// groups is set to the number of groups scanned if not NULL
+static size_t find_index(map_t *m, flat_table_t *ft, const void *key, uint64_t h,
+                         size_t *groups)
+{
+        size_t mask = group_mask(ft);
+        size_t g = (h >> 7) & mask;
+        uint8_t tag = h2(h);
+
+        // triangular probing visits every group once
+        for (size_t step = 1; ; step++) {
+                const uint8_t *group = ft->ctrl + g * FT_GROUP_WIDTH;
+                group_mask_t match = match_byte(group, tag);
+                while (match) {
+                        size_t i = g * FT_GROUP_WIDTH + __builtin_ctz(match);
+                        if (m->kcmp(ft_slot(ft, i), key, m->key_size) == 0) {
+                                if (groups) {
+                                        *groups = step;
+                                }
+                                return i;
+                        }
+                        match &= match - 1;
+                }
+                if (match_byte(group, FT_EMPTY)) {
+                        if (groups) {
+                                *groups = step;
+                        }
+                        return NOT_FOUND;
+                }
+                g = (g + step) & mask;
+        }
+}
+
+static size_t find_non_full(flat_table_t *ft, uint64_t h)
+{
+        size_t mask = group_mask(ft);
+        size_t g = (h >> 7) & mask;
+
+        for (size_t step = 1; ; step++) {
+                group_mask_t match = match_non_full(ft->ctrl + g * FT_GROUP_WIDTH);
+                if (match) {
+                        return g * FT_GROUP_WIDTH + __builtin_ctz(match);
+                }
+                g = (g + step) & mask;
+        }
+}
+
+static void rehash(map_t *m, size_t cap)
+{
+        flat_table_t *old = m->ft;
+        flat_table_t *ft = ft_new(old->slot_size, cap, old->al);
+
+        for (size_t i = 0; i < old->capacity; i++) {
+                if (!ft_is_full(old, i)) {
+                        continue;
+                }
+                void *slot = ft_slot(old, i);
+                uint64_t h = ft_hash(m, slot);
+                size_t j = find_non_full(ft, h);
+                ft->ctrl[j] = h2(h);
+                memcpy(ft_slot(ft, j), slot, ft->slot_size);
+                ft->growth_left--;
+        }
+        ft_delete(old);
+
+        m->ft = ft;
+        m->cap = ft->capacity;
+        m->version++;
+        m->splits++;
+}
+
+void *ft_find(map_t *m, const void *key)
+{
+        flat_table_t *ft = m->ft;
+        size_t groups;
+        size_t i = find_index(m, ft, key, ft_hash(m, key), &groups);
+        MM_COUNT_LOOKUP(m, groups, i != NOT_FOUND);
+        if (i == NOT_FOUND) {
+                return NULL;
+        }
+        return ft_slot(ft, i);
+}
+
+void ft_find_batch(map_t *m, const void *keys, size_t n, void **slots)
+{
+        flat_table_t *ft = m->ft;
+        size_t mask = group_mask(ft);
+        uint64_t h[FIND_BATCH_GROUP];
+
+        for (size_t start = 0; start < n; start += FIND_BATCH_GROUP) {
+                size_t len = n - start < FIND_BATCH_GROUP ? n - start : FIND_BATCH_GROUP;
+                const char *group_keys = (const char *)keys + start * m->key_size;
+                for (size_t i = 0; i < len; i++) {
+                        h[i] = ft_hash(m, group_keys + i * m->key_size);
+                        size_t g = (h[i] >> 7) & mask;
+                        __builtin_prefetch(ft->ctrl + g * FT_GROUP_WIDTH);
+                        __builtin_prefetch(ft_slot(ft, g * FT_GROUP_WIDTH));
+                }
+                for (size_t i = 0; i < len; i++) {
+                        size_t groups;
+                        size_t j = find_index(m, ft, group_keys + i * m->key_size, h[i], &groups);
+                        MM_COUNT_LOOKUP(m, groups, j != NOT_FOUND);
+                        slots[start + i] = j == NOT_FOUND ? NULL : ft_slot(ft, j);
+                }
+        }
+}
+
+int ft_put(map_t *m, const void *key, const void *value)
+{
+        return ft_put_hash(m, key, value, m->k2int(key, m->key_size));
+}
+
+int ft_put_hash(map_t *m, const void *key, const void *value, uint64_t hash)
+{
+        flat_table_t *ft = m->ft;
+        uint64_t h = mix(hash);
+
+        // update the old value if it exists
+        size_t i = find_index(m, ft, key, h, NULL);
+        if (i != NOT_FOUND) {
+                memcpy((char *)ft_slot(ft, i) + m->key_size, value, m->value_size);
+                return 0;
+        }
+
+        i = find_non_full(ft, h);
+        if (ft->growth_left == 0 && ft->ctrl[i] == FT_EMPTY) {
+                // grow if the table is really full, otherwise it is just
+                // tombstones and rehashing at the same size purges them
+                size_t cap = ft->capacity;
+                if (m->used >= capacity_to_growth(cap) / 2) {
+                        cap <<= 1;
+                }
+                rehash(m, cap);
+                ft = m->ft;
+                i = find_non_full(ft, h);
+        }
+        // reusing a tombstone does not consume growth
+        if (ft->ctrl[i] == FT_EMPTY) {
+                ft->growth_left--;
+        }
+        ft->ctrl[i] = h2(h);
+
+        void *slot = ft_slot(ft, i);
+        memcpy(slot, key, m->key_size);
+        memcpy((char *)slot + m->key_size, value, m->value_size);
+
+        m->used++;
+        return 0;
+}
+
+int ft_reserve(map_t *m, size_t n)
+{
+        flat_table_t *ft = m->ft;
+        if (n <= m->used + ft->growth_left) {
+                return 0;
+        }
+
+        size_t cap = ft->capacity;
+        while (capacity_to_growth(cap) < n) {
+                cap <<= 1;
+        }
+        rehash(m, cap);
+        return 0;
+}
+
+bool ft_remove(map_t *m, const void *key)
+{
+        flat_table_t *ft = m->ft;
+        size_t i = find_index(m, ft, key, ft_hash(m, key), NULL);
+        if (i == NOT_FOUND) {
+                return false;
+        }
+
+        // probes stop at the first group that has an empty slot, so if
+        // this group already has one the slot can go back to empty,
+        // otherwise leave a tombstone to keep probe sequences intact
+        const uint8_t *group = ft->ctrl + (i & ~(size_t)(FT_GROUP_WIDTH - 1));
+        if (match_byte(group, FT_EMPTY)) {
+                ft->ctrl[i] = FT_EMPTY;
+                ft->growth_left++;
+        } else {
+                ft->ctrl[i] = FT_DELETED;
+        }
+
+        m->used--;
+        return true;
+}
+
+void ft_stats(map_t *m, map_stats_t *stats)
+{
+        flat_table_t *ft = m->ft;
+        size_t mask = group_mask(ft);
+        size_t ngroups = mask + 1;
+        uint64_t hit_probes = 0, miss_probes = 0;
+
+        // an entry is found after walking the probe sequence from its home
+        // group to the group it sits in
+        for (size_t i = 0; i < ft->capacity; i++) {
+                if (!ft_is_full(ft, i)) {
+                        continue;
+                }
+                size_t g = (ft_hash(m, ft_slot(ft, i)) >> 7) & mask;
+                size_t groups = 1;
+                for (size_t step = 1; g != i / FT_GROUP_WIDTH; step++) {
+                        g = (g + step) & mask;
+                        groups++;
+                }
+                hit_probes += groups;
+                stats->chain_hist[groups < MM_CHAIN_HIST ? groups : MM_CHAIN_HIST - 1]++;
+                if (groups > stats->max_chain) {
+                        stats->max_chain = groups;
+                }
+        }
+        // a miss stops at the first group with an empty slot
+        for (size_t g0 = 0; g0 < ngroups; g0++) {
+                size_t g = g0;
+                for (size_t step = 1; ; step++) {
+                        miss_probes++;
+                        if (match_byte(ft->ctrl + g * FT_GROUP_WIDTH, FT_EMPTY)) {
+                                break;
+                        }
+                        g = (g + step) & mask;
+                }
+        }
+
+        stats->buckets = ft->capacity;
+        stats->probes_per_hit = m->used ? (double)hit_probes / m->used : 0;
+        stats->probes_per_miss = (double)miss_probes / ngroups;
+        stats->heap_bytes = sizeof(map_t) + sizeof(flat_table_t)
+                + ft->capacity * (1 + ft->slot_size);
+}
@@ -0,0 +1,273 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "hash.h"
+
+// wyhash style mixing: a 64x64->128 multiply folded back to 64 bits
+static const uint64_t secret[4] = {
+        0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+        0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL,
+};
+
+static inline void mum(uint64_t *a, uint64_t *b)
+{
+        __uint128_t r = (__uint128_t)*a * *b;
+        *a = (uint64_t)r;
+        *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+        mum(&a, &b);
+        return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+// 1 to 3 bytes
+static inline uint64_t read_small(const uint8_t *p, size_t k)
+{
+        return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t hash_int32(const void *key, size_t key_size)
+{
+        return mix(read32(key) ^ secret[0], secret[1]);
+}
+
+uint64_t hash_int64(const void *key, size_t key_size)
+{
+        // one round leaves the low bits weak for keys that only differ
+        // in their high half (e.g. i << 32), a second round fixes it
+        return mix(mix(read64(key) ^ secret[0], secret[1]), secret[2]);
+}
+
+uint64_t hash_bytes(const void *key, size_t key_size)
+{
+        const uint8_t *p = key;
+        size_t len = key_size;
+        uint64_t seed = secret[0] ^ mix(secret[0], secret[1]);
+        uint64_t a, b;
+
+        if (len <= 16) {
+                if (len >= 4) {
+                        // two overlapping 4-byte reads from each end
+                        size_t off = (len >> 3) << 2;
+                        a = (read32(p) << 32) | read32(p + off);
+                        b = (read32(p + len - 4) << 32) | read32(p + len - 4 - off);
+                } else if (len > 0) {
+                        a = read_small(p, len);
+                        b = 0;
+                } else {
+                        a = b = 0;
+                }
+        } else {
+                size_t i = len;
+                if (i > 48) {
+                        // three independent lanes to keep the multipliers busy
+                        uint64_t see1 = seed, see2 = seed;
+                        do {
+                                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                                see1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ see1);
+                                see2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ see2);
+                                p += 48;
+                                i -= 48;
+                        } while (i > 48);
+                        seed ^= see1 ^ see2;
+                }
+                while (i > 16) {
+                        seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                        p += 16;
+                        i -= 16;
+                }
+                a = read64(p + i - 16);
+                b = read64(p + i - 8);
+        }
+
+        a ^= secret[1];
+        b ^= seed;
+        mum(&a, &b);
+        return mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+key2int_t hash_default(size_t key_size)
+{
+        switch (key_size) {
+        case 4:
+                return hash_int32;
+        case 8:
+                return hash_int64;
+        default:
+                return hash_bytes;
+        }
+}
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t);
+
+// slicing-by-8, eight table lookups per 8 input bytes
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+        while (len >= 8) {
+                uint64_t v = read64(p) ^ crc;
+                crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff]
+                        ^ crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff]
+                        ^ crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff]
+                        ^ crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+                p += 8;
+                len -= 8;
+        }
+        while (len--) {
+                crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+        uint64_t c = crc;
+        while (len >= 8) {
+                c = _mm_crc32_u64(c, read64(p));
+                p += 8;
+                len -= 8;
+        }
+        while (len--) {
+                c = _mm_crc32_u8((uint32_t)c, *p++);
+        }
+        return (uint32_t)c;
+}
+#endif
+
+__attribute__((constructor))
+static void crc32c_init()
+{
+        for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                        c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+                }
+                crc32c_table[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+                for (int t = 1; t < 8; t++) {
+                        uint32_t c = crc32c_table[t - 1][i];
+                        crc32c_table[t][i] = crc32c_table[0][c & 0xff] ^ (c >> 8);
+                }
+        }
+
+        crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) {
+                crc32c_impl = crc32c_hw;
+        }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+        return ~crc32c_impl(~crc, buf, len);
+}
+
+#ifdef TESTHASH
+// testing
+#include <assert.h>
+
+#define NBUCKETS 1024
+#define NKEYS (NBUCKETS * 8)
+
+// the longest chain when NKEYS keys are masked into NBUCKETS buckets
+static int max_load(key2int_t k2int, size_t key_size, void *keys)
+{
+        int load[NBUCKETS] = {0};
+        int max = 0;
+        for (int i = 0; i < NKEYS; i++) {
+                uint64_t h = k2int((char *)keys + i * key_size, key_size);
+                int b = h & (NBUCKETS - 1);
+                if (++load[b] > max) {
+                        max = load[b];
+                }
+        }
+        return max;
+}
+
+int main(int argc, char *argv[])
+{
+        static int ints[NKEYS];
+        static uint64_t longs[NKEYS];
+        static char strs[NKEYS][24];
+
+        // strided keys are the worst case for the identity hash
+        for (int i = 0; i < NKEYS; i++) {
+                ints[i] = i * NBUCKETS;
+                longs[i] = (uint64_t)i << 32;
+                memset(strs[i], 'x', sizeof(strs[i]));
+                snprintf(strs[i], sizeof(strs[i]), "key-%d", i);
+        }
+
+        int m32 = max_load(hash_int32, sizeof(int), ints);
+        int m64 = max_load(hash_int64, sizeof(uint64_t), longs);
+        int mstr = max_load(hash_bytes, sizeof(strs[0]), strs);
+        printf("max bucket load (mean 8): int32 %d, int64 %d, bytes %d\n", m32, m64, mstr);
+        assert(m32 < 32 && m64 < 32 && mstr < 32);
+
+        // every length path is deterministic and sensitive to each byte
+        char buf[100];
+        memset(buf, 'a', sizeof(buf));
+        for (size_t len = 1; len <= sizeof(buf); len++) {
+                uint64_t h = hash_bytes(buf, len);
+                assert(h == hash_bytes(buf, len));
+                assert(h != hash_bytes(buf, len - 1));
+                for (size_t i = 0; i < len; i++) {
+                        buf[i] = 'b';
+                        assert(hash_bytes(buf, len) != h);
+                        buf[i] = 'a';
+                }
+        }
+
+        assert(hash_default(4) == hash_int32);
+        assert(hash_default(8) == hash_int64);
+        assert(hash_default(24) == hash_bytes);
+
+        // check value from the iSCSI spec, then the table and the
+        // instruction agree on every length and alignment
+        assert(crc32c(0, "123456789", 9) == 0xe3069283);
+        uint8_t data[300];
+        for (size_t i = 0; i < sizeof(data); i++) {
+                data[i] = (uint8_t)(i * 131 + 7);
+        }
+        for (size_t off = 0; off < 8; off++) {
+                for (size_t len = 0; len + off <= sizeof(data); len++) {
+                        uint32_t c = ~crc32c_sw(~0u, data + off, len);
+                        assert(crc32c(0, data + off, len) == c);
+                        // chaining two halves gives the crc of the whole
+                        assert(crc32c(crc32c(0, data + off, len / 2),
+                                      data + off + len / 2, len - len / 2) == c);
+                }
+        }
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif
@@ -0,0 +1,443 @@
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "hashset.h"
+#include "typedmap.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+static inline size_t nbuckets(hash_set_t *s)
+{
+        return s->cap + s->pos;
+}
+
+// the bucket of a hash. Given the index of a bucket of a set with at
+// least as many buckets, the bucket of s that all its keys fall in
+static inline size_t addr(hash_set_t *s, uint64_t h)
+{
+        uint64_t b = h & (s->cap - 1);
+        if (b < s->pos) {
+                return h & ((s->cap << 1) - 1);
+        }
+        return b;
+}
+
+static inline void thresholds(hash_set_t *s)
+{
+        s->grow_at = tm_grow_at(nbuckets(s));
+        s->shrink_below = tm_shrink_below(s->cap, nbuckets(s));
+}
+
+// an empty set with cap + pos buckets
+static hash_set_t *new_set(size_t key_size, key2int_t k2int, keycmp_t kcmp,
+                           size_t cap, size_t pos)
+{
+        hash_set_t *s;
+        NEW_INSTANCE(s, hash_set_t);
+        s->cap = cap;
+        s->pos = pos;
+        s->key_size = key_size;
+        s->k2int = k2int;
+        s->kcmp = kcmp;
+        s->size = pos ? cap << 1 : cap;
+        s->buckets = calloc(s->size, sizeof(hs_entry_t *));
+        if (!s->buckets) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        size_t slot_size = ALIGN8(sizeof(hs_entry_t) + key_size);
+        sb_init(&s->slab, slot_size, TM_SLAB_BYTES / slot_size);
+        thresholds(s);
+        return s;
+}
+
+hash_set_t *make_hash_set(size_t key_size, key2int_t k2int, keycmp_t kcmp)
+{
+        return new_set(key_size, k2int ? k2int : hash_default(key_size),
+                       kcmp ? kcmp : memcmp, DEFAULT_INIT_CAP, 0);
+}
+
+void delete_hash_set(hash_set_t *s)
+{
+        sb_deinit(&s->slab);
+        free(s->buckets);
+        free(s);
+}
+
+size_t hs_len(hash_set_t *s)
+{
+        return s->used;
+}
+
+static hs_entry_t *find(hash_set_t *s, hs_entry_t *chain, const void *key, uint64_t hash)
+{
+        for (hs_entry_t *e = chain; e; e = e->next) {
+                if (e->hash == hash && s->kcmp(e->key, key, s->key_size) == 0) {
+                        return e;
+                }
+        }
+        return NULL;
+}
+
+// add a key known to be missing to bucket b, without resizing
+static void link_new(hash_set_t *s, size_t b, const void *key, uint64_t hash)
+{
+        hs_entry_t *e = sb_alloc(&s->slab);
+        e->hash = hash;
+        memcpy(e->key, key, s->key_size);
+        e->next = s->buckets[b];
+        s->buckets[b] = e;
+        s->used++;
+}
+
+static void split(hash_set_t *s)
+{
+        size_t len = nbuckets(s);
+        if (len == s->size) {
+                s->buckets = (hs_entry_t **)tm_grow_dir((void **)s->buckets, &s->size);
+        }
+        // the entries that hash to the new bucket move there
+        hs_entry_t **from = &s->buckets[s->pos], **to = &s->buckets[len];
+        uint64_t mask = (s->cap << 1) - 1;
+        while (*from) {
+                hs_entry_t *e = *from;
+                if ((e->hash & mask) == s->pos) {
+                        from = &e->next;
+                        continue;
+                }
+                *from = e->next;
+                e->next = NULL;
+                *to = e;
+                to = &e->next;
+        }
+        if (++s->pos == s->cap) {
+                s->cap <<= 1;
+                s->pos = 0;
+        }
+        s->splits++;
+        thresholds(s);
+}
+
+static void shrink(hash_set_t *s)
+{
+        if (s->pos == 0) {
+                s->cap >>= 1;
+                s->pos = s->cap;
+        }
+        s->pos--;
+        // the last bucket goes back into the one it was split from
+        hs_entry_t **last = &s->buckets[s->cap + s->pos];
+        hs_entry_t **into = &s->buckets[s->pos];
+        while (*into) {
+                into = &(*into)->next;
+        }
+        *into = *last;
+        *last = NULL;
+        s->shrinks++;
+        thresholds(s);
+}
+
+// resize until the load is within the ratios, after a bulk operation
+static void settle(hash_set_t *s)
+{
+        while (s->used > s->grow_at) {
+                split(s);
+        }
+        while (s->used < s->shrink_below) {
+                shrink(s);
+        }
+}
+
+bool hs_add(hash_set_t *s, const void *key)
+{
+        uint64_t hash = s->k2int(key, s->key_size);
+        size_t b = addr(s, hash);
+        if (find(s, s->buckets[b], key, hash)) {
+                return false;
+        }
+        link_new(s, b, key, hash);
+        while (s->used > s->grow_at) {
+                split(s);
+        }
+        return true;
+}
+
+bool hs_contains(hash_set_t *s, const void *key)
+{
+        uint64_t hash = s->k2int(key, s->key_size);
+        return find(s, s->buckets[addr(s, hash)], key, hash) != NULL;
+}
+
+bool hs_remove(hash_set_t *s, const void *key)
+{
+        uint64_t hash = s->k2int(key, s->key_size);
+        hs_entry_t **p = &s->buckets[addr(s, hash)];
+        while (*p && !((*p)->hash == hash && s->kcmp((*p)->key, key, s->key_size) == 0)) {
+                p = &(*p)->next;
+        }
+        hs_entry_t *e = *p;
+        if (!e) {
+                return false;
+        }
+        *p = e->next;
+        sb_free(&s->slab, e);
+        if (--s->used < s->shrink_below) {
+                shrink(s);
+        }
+        return true;
+}
+
+void hs_foreach(hash_set_t *s, hs_visit_t fn, void *ctx)
+{
+        for (size_t i = 0; i < nbuckets(s); i++) {
+                for (hs_entry_t *e = s->buckets[i]; e; e = e->next) {
+                        fn(e->key, ctx);
+                }
+        }
+}
+
+static bool compatible(hash_set_t *a, hash_set_t *b, const char *op)
+{
+        if (a->key_size == b->key_size && a->k2int == b->k2int && a->kcmp == b->kcmp) {
+                return true;
+        }
+        fprintf(stderr, "%s: the sets differ in key size, k2int or kcmp\n", op);
+        return false;
+}
+
+// an empty set laid out as s
+static hash_set_t *same_layout(hash_set_t *s)
+{
+        return new_set(s->key_size, s->k2int, s->kcmp, s->cap, s->pos);
+}
+
+// true if each bucket of w falls inside one bucket of o, so a whole
+// chain of w is matched against a single chain of o
+static inline bool covers(hash_set_t *w, hash_set_t *o)
+{
+        return nbuckets(o) <= nbuckets(w);
+}
+
+// the bucket of o holding the key of e, from bucket b of w, by cached
+// hash when the keys of b spread over several buckets of o
+static inline size_t other_bucket(hash_set_t *o, bool covered, size_t b, hs_entry_t *e)
+{
+        return addr(o, covered ? b : e->hash);
+}
+
+hash_set_t *hs_union(hash_set_t *a, hash_set_t *b)
+{
+        if (!compatible(a, b, "hs_union")) {
+                return NULL;
+        }
+        hash_set_t *r = same_layout(a);
+        for (size_t i = 0; i < nbuckets(a); i++) {
+                for (hs_entry_t *e = a->buckets[i]; e; e = e->next) {
+                        link_new(r, i, e->key, e->hash);
+                }
+        }
+        // r keeps the layout of a until every key of b is in
+        bool covered = covers(b, r);
+        for (size_t i = 0; i < nbuckets(b); i++) {
+                for (hs_entry_t *e = b->buckets[i]; e; e = e->next) {
+                        size_t j = other_bucket(r, covered, i, e);
+                        if (!find(r, r->buckets[j], e->key, e->hash)) {
+                                link_new(r, j, e->key, e->hash);
+                        }
+                }
+        }
+        settle(r);
+        return r;
+}
+
+hash_set_t *hs_intersection(hash_set_t *a, hash_set_t *b)
+{
+        if (!compatible(a, b, "hs_intersection")) {
+                return NULL;
+        }
+        // walk the longer directory, each of its buckets meets one chain
+        // of the other set
+        hash_set_t *w = covers(a, b) ? a : b, *o = w == a ? b : a;
+        hash_set_t *r = same_layout(w);
+        for (size_t i = 0; i < nbuckets(w); i++) {
+                hs_entry_t *chain = o->buckets[addr(o, i)];
+                for (hs_entry_t *e = w->buckets[i]; e; e = e->next) {
+                        hs_entry_t *m = find(o, chain, e->key, e->hash);
+                        if (m) {
+                                link_new(r, i, w == a ? e->key : m->key, e->hash);
+                        }
+                }
+        }
+        settle(r);
+        return r;
+}
+
+hash_set_t *hs_difference(hash_set_t *a, hash_set_t *b)
+{
+        if (!compatible(a, b, "hs_difference")) {
+                return NULL;
+        }
+        hash_set_t *r = same_layout(a);
+        bool covered = covers(a, b);
+        for (size_t i = 0; i < nbuckets(a); i++) {
+                for (hs_entry_t *e = a->buckets[i]; e; e = e->next) {
+                        size_t j = other_bucket(b, covered, i, e);
+                        if (!find(b, b->buckets[j], e->key, e->hash)) {
+                                link_new(r, i, e->key, e->hash);
+                        }
+                }
+        }
+        settle(r);
+        return r;
+}
+
+#ifdef TESTHASHSET
+// testing
+#include <assert.h>
+
+#define NKEYS 100000
+
+typedef struct key_s {
+        uint64_t id;
+        uint64_t pad;
+}key_t;
+
+static key_t make_key(uint64_t id)
+{
+        key_t k = {id, ~id};
+        return k;
+}
+
+// the members as a bitmap over [0, NKEYS)
+static void check(hash_set_t *s, const char *want)
+{
+        size_t n = 0;
+        for (uint64_t i = 0; i < NKEYS; i++) {
+                key_t k = make_key(i);
+                assert(hs_contains(s, &k) == !!want[i]);
+                n += !!want[i];
+        }
+        assert(hs_len(s) == n);
+        assert(s->used <= s->grow_at && s->used >= s->shrink_below);
+}
+
+static void count_key(const void *key, void *ctx)
+{
+        const key_t *k = key;
+        assert(k->pad == ~k->id);
+        (*(size_t *)ctx)++;
+}
+
+// the members of a fresh set with step apart ids from from
+static hash_set_t *fill(char *bits, uint64_t from, uint64_t step)
+{
+        hash_set_t *s = make_hash_set(sizeof(key_t), NULL, NULL);
+        memset(bits, 0, NKEYS);
+        for (uint64_t i = from; i < NKEYS; i += step) {
+                key_t k = make_key(i);
+                assert(hs_add(s, &k));
+                bits[i] = 1;
+        }
+        return s;
+}
+
+int main(int argc, char *argv[])
+{
+        char *want = calloc(NKEYS, 1);
+
+        printf("=== RUN Basic Test ===\n");
+        hash_set_t *s = make_hash_set(sizeof(key_t), NULL, NULL);
+        unsigned int seed = 1;
+        for (int i = 0; i < 8 * NKEYS; i++) {
+                uint64_t id = rand_r(&seed) % NKEYS;
+                key_t k = make_key(id);
+                // grow for the first half, shrink for the second
+                bool add = rand_r(&seed) % (i < 4 * NKEYS ? 2 : 8) == 0;
+                if (add) {
+                        assert(hs_add(s, &k) == !want[id]);
+                        want[id] = 1;
+                } else {
+                        assert(hs_remove(s, &k) == !!want[id]);
+                        want[id] = 0;
+                }
+        }
+        assert(s->splits > 0 && s->shrinks > 0);
+        check(s, want);
+        size_t n = 0;
+        hs_foreach(s, count_key, &n);
+        assert(n == hs_len(s));
+        delete_hash_set(s);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Bulk Test ===\n");
+        // sizes far apart, so both sets take turns having the longer
+        // directory
+        char *in_a = calloc(NKEYS, 1), *in_b = calloc(NKEYS, 1);
+        uint64_t steps[][2] = {{2, 3}, {3, 2}, {1, 97}, {97, 1}, {5, 5}};
+        for (int t = 0; t < 5; t++) {
+                hash_set_t *a = fill(in_a, 0, steps[t][0]);
+                hash_set_t *b = fill(in_b, 1, steps[t][1]);
+
+                hash_set_t *r = hs_union(a, b);
+                for (int i = 0; i < NKEYS; i++) {
+                        want[i] = in_a[i] || in_b[i];
+                }
+                check(r, want);
+                delete_hash_set(r);
+
+                r = hs_intersection(a, b);
+                for (int i = 0; i < NKEYS; i++) {
+                        want[i] = in_a[i] && in_b[i];
+                }
+                check(r, want);
+                delete_hash_set(r);
+
+                r = hs_difference(a, b);
+                for (int i = 0; i < NKEYS; i++) {
+                        want[i] = in_a[i] && !in_b[i];
+                }
+                check(r, want);
+                delete_hash_set(r);
+
+                delete_hash_set(a);
+                delete_hash_set(b);
+        }
+        // with themselves and with an empty set
+        hash_set_t *a = fill(in_a, 0, 3);
+        hash_set_t *e = make_hash_set(sizeof(key_t), NULL, NULL);
+        memset(want, 0, NKEYS);
+        hash_set_t *r = hs_union(a, a);
+        check(r, in_a);
+        delete_hash_set(r);
+        r = hs_difference(a, a);
+        check(r, want);
+        delete_hash_set(r);
+        r = hs_intersection(e, a);
+        check(r, want);
+        delete_hash_set(r);
+        r = hs_union(e, a);
+        check(r, in_a);
+        delete_hash_set(r);
+
+        hash_set_t *other = make_hash_set(sizeof(uint64_t), NULL, NULL);
+        assert(hs_union(a, other) == NULL);
+        assert(hs_intersection(other, a) == NULL);
+        delete_hash_set(other);
+        delete_hash_set(e);
+        delete_hash_set(a);
+        free(in_a);
+        free(in_b);
+        free(want);
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif
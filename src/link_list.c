@@ -1,26 +1,14 @@
-#include <errno.h>
-#include <error.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "link_list.h"
 
-#define NEW_INSTANCE(ret, structure)                                    \
-        if (((ret) = malloc(sizeof(structure))) == NULL) {              \
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
-        }
-
-static node_t *new_node(void *item, size_t item_size)
+static node_t *new_node(list_t *list, void *item)
 {
-        node_t *node;
-        NEW_INSTANCE(node, node_t);
-
-        node->item = malloc(item_size);
-        if (!node->item) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
-        }
-        memcpy(node->item, item, item_size);
+        node_t *node = al_alloc(list->al, sizeof(node_t));
+        node->item = al_alloc(list->al, list->item_size);
+        memcpy(node->item, item, list->item_size);
 
         node->prev = NULL;
         node->next = NULL;
@@ -30,9 +18,14 @@ static node_t *new_node(void *item, size_t item_size)
 
 void ll_init_list(list_t *list, size_t item_size, dtor_t dtor)
 {
-        node_t *head_node, *tail_node;
-        NEW_INSTANCE(head_node, node_t);
-        NEW_INSTANCE(tail_node, node_t);
+        ll_init_list_alloc(list, item_size, dtor, NULL);
+}
+
+void ll_init_list_alloc(list_t *list, size_t item_size, dtor_t dtor, const allocator_t *al)
+{
+        al = al_or_libc(al);
+        node_t *head_node = al_alloc(al, sizeof(node_t));
+        node_t *tail_node = al_alloc(al, sizeof(node_t));
 
         list->head = head_node;
         head_node->next = tail_node;
@@ -47,29 +40,36 @@ void ll_init_list(list_t *list, size_t item_size, dtor_t dtor)
         list->len = 0;
         list->item_size = item_size;
         list->dtor = dtor;
+        list->al = al;
 }
 
 list_t *ll_new_list(size_t item_size, dtor_t dtor)
 {
-        list_t *list;
-        NEW_INSTANCE(list, list_t);
-        ll_init_list(list, item_size, dtor);
+        return ll_new_list_alloc(item_size, dtor, NULL);
+}
+
+list_t *ll_new_list_alloc(size_t item_size, dtor_t dtor, const allocator_t *al)
+{
+        al = al_or_libc(al);
+        list_t *list = al_alloc(al, sizeof(list_t));
+        ll_init_list_alloc(list, item_size, dtor, al);
         return list;
 }
 
 static void ll_clean_node(list_t *list, node_t *node)
 {
-        if (!list->dtor) {
-                list->dtor = free;
+        if (list->dtor) {
+                list->dtor(node->item);
+        } else {
+                al_free(list->al, node->item, list->item_size);
         }
-        list->dtor(node->item);
-        free(node);
+        al_free(list->al, node, sizeof(node_t));
 }
 
 // append to the tail
 int ll_append(list_t *list, void *item)
 {
-        node_t *node = new_node(item, list->item_size);
+        node_t *node = new_node(list, item);
         node_t *tail = list->tail;
 
         node->next = tail;
@@ -83,9 +83,8 @@ int ll_append(list_t *list, void *item)
 
 int ll_append_ref(list_t *list, void *item)
 {
-        node_t *node;
+        node_t *node = al_alloc(list->al, sizeof(node_t));
         node_t *tail = list->tail;
-        NEW_INSTANCE(node, node_t);
         node->item = item;
 
         node->next = tail;
@@ -102,7 +101,8 @@ int ll_append_node(list_t *list, node_t *node)
         node_t *tail = list->tail;
         node->next = tail;
         node->prev = tail->prev;
-        tail->prev->next = node;
+        // a lock-free reader may follow the link as soon as it is stored
+        __atomic_store_n(&tail->prev->next, node, __ATOMIC_RELEASE);
         tail->prev = node;
 
         list->len++;
@@ -131,7 +131,7 @@ int ll_remove(list_t *list, void *item)
 // push item to the head
 int ll_push(list_t *list, void *item)
 {
-        node_t *node = new_node(item, list->item_size);
+        node_t *node = new_node(list, item);
         node_t *head = list->head;
 
         node->prev = head;
@@ -145,9 +145,8 @@ int ll_push(list_t *list, void *item)
 
 int ll_push_ref(list_t *list, void *item)
 {
-        node_t *node;
+        node_t *node = al_alloc(list->al, sizeof(node_t));
         node_t *head = list->head;
-        NEW_INSTANCE(node, node_t);
         node->item = item;
 
         node->prev = head;
@@ -166,7 +165,7 @@ int ll_push_node(list_t *list, node_t *node)
         node->prev = head;
         node->next = head->next;
         head->next->prev = node;
-        head->next = node;
+        __atomic_store_n(&head->next, node, __ATOMIC_RELEASE);
 
         list->len++;
         return list->len;
@@ -203,26 +202,44 @@ int ll_free_node(list_t *list, node_t *node)
 
 int ll_remove_node(list_t *list, node_t *node)
 {
-        node->prev->next = node->next;
+        // node->next is left alone, a reader standing on node can go on
+        __atomic_store_n(&node->prev->next, node->next, __ATOMIC_RELEASE);
         node->next->prev = node->prev;
 
         list->len--;
         return list->len;
 }
 
+int ll_replace_node(list_t *list, node_t *old, node_t *node)
+{
+        node->prev = old->prev;
+        node->next = old->next;
+        __atomic_store_n(&old->prev->next, node, __ATOMIC_RELEASE);
+        old->next->prev = node;
+        return list->len;
+}
+
 int ll_get_node_item(list_t *list, node_t *node, void *item)
 {
         memcpy(item, node->item, list->item_size);
         return 0;
 }
 
+int ll_reset_list(list_t *list)
+{
+        list->head->next = list->tail;
+        list->tail->prev = list->head;
+        list->len = 0;
+        return 0;
+}
+
 int ll_deinit_list(list_t *list)
 {
         node_t *node, *next_node;
 
         if (list->len == 0) {
-                free(list->head);
-                free(list->tail);
+                al_free(list->al, list->head, sizeof(node_t));
+                al_free(list->al, list->tail, sizeof(node_t));
                 return 0;
         }
 
@@ -236,8 +253,8 @@ int ll_deinit_list(list_t *list)
         }
         ll_free_node(list, node);
 
-        free(list->head);
-        free(list->tail);
+        al_free(list->al, list->head, sizeof(node_t));
+        al_free(list->al, list->tail, sizeof(node_t));
         return 0;
 }
 
@@ -245,7 +262,7 @@ int ll_deinit_list(list_t *list)
 int ll_delete_list(list_t *list)
 {
         ll_deinit_list(list);
-        free(list);
+        al_free(list->al, list, sizeof(list_t));
         return 0;
 }
 
@@ -311,6 +328,20 @@ int main(int argc, char *argv[])
                 printf("item %d\n", item);
         }
 
+        printf("replace the first node with 42:\n");
+        int answer = 42;
+        node_t *first = list->head->next;
+        ll_push(list, &answer);
+        node = list->head->next;
+        ll_remove_node(list, node);
+        ll_replace_node(list, first, node);
+        ll_push_node(list, first);
+        ll_free_node(list, first);
+        for (ll_traverse(list, node)) {
+                int item = *(int *)node->item;
+                printf("item %d\n", item);
+        }
+
         ll_delete_list(list);
 
         return 0;
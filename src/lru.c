@@ -0,0 +1,329 @@
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lru.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+#define ENTRY_KEY_OFFSET ALIGN8(sizeof(lru_entry_t))
+
+// aim for slabs of about 64KB
+#define SLAB_BYTES (64 << 10)
+
+static inline void *entry_key(lru_entry_t *e)
+{
+        return (char *)e + ENTRY_KEY_OFFSET;
+}
+
+static inline void *entry_value(lru_cache_t *c, lru_entry_t *e)
+{
+        return (char *)e + ENTRY_KEY_OFFSET + ALIGN8(c->key_size);
+}
+
+lru_cache_t *make_lru_cache(size_t key_size, size_t value_size, key2int_t k2int, keycmp_t kcmp,
+                            const lru_opts_t *opts)
+{
+        if (!opts || (opts->max_entries == 0 && opts->max_bytes == 0)) {
+                fprintf(stderr, "make_lru_cache: neither max_entries nor max_bytes is set\n");
+                return NULL;
+        }
+        lru_cache_t *c;
+        NEW_INSTANCE(c, lru_cache_t);
+        // evicting and adding one entry must not merge and split a bucket
+        // of the index every time
+        map_opts_t index_opts = {
+                .never_shrink = true,
+        };
+        c->index = make_map_opts(key_size, sizeof(lru_entry_t *), k2int, kcmp, &index_opts);
+        ll_init_list(&c->order, 0, NULL);
+        size_t slot_size = ENTRY_KEY_OFFSET + ALIGN8(key_size) + ALIGN8(value_size);
+        sb_init(&c->slab, slot_size, SLAB_BYTES / slot_size + 1);
+        c->key_size = key_size;
+        c->value_size = value_size;
+        c->policy = opts->policy;
+        c->on_evict = opts->on_evict;
+        c->evict_ctx = opts->evict_ctx;
+
+        // a bucket of the index per entry at the least
+        c->entry_bytes = slot_size + c->index->slab.slot_size
+                + sizeof(list_t *) + sizeof(list_t) + 2 * sizeof(node_t);
+        c->cap = opts->max_entries ? opts->max_entries : SIZE_MAX;
+        if (opts->max_bytes && opts->max_bytes / c->entry_bytes < c->cap) {
+                c->cap = opts->max_bytes / c->entry_bytes;
+        }
+        if (c->cap == 0) {
+                fprintf(stderr, "make_lru_cache: max_bytes %zu is less than one entry of %zu bytes\n",
+                        opts->max_bytes, c->entry_bytes);
+                delete_lru_cache(c);
+                return NULL;
+        }
+        return c;
+}
+
+void delete_lru_cache(lru_cache_t *c)
+{
+        // the nodes live in the slab
+        ll_reset_list(&c->order);
+        ll_deinit_list(&c->order);
+        delete_map(c->index);
+        sb_deinit(&c->slab);
+        free(c);
+}
+
+size_t lru_len(lru_cache_t *c)
+{
+        return c->order.len;
+}
+
+size_t lru_bytes(lru_cache_t *c)
+{
+        return c->order.len * c->entry_bytes;
+}
+
+static inline lru_entry_t *lookup(lru_cache_t *c, const void *key)
+{
+        lru_entry_t *e;
+        if (!mm_get(c->index, (void *)key, &e)) {
+                return NULL;
+        }
+        return e;
+}
+
+static inline void touch(lru_cache_t *c, lru_entry_t *e)
+{
+        if (c->policy == LRU_POLICY_CLOCK) {
+                // a hot entry is only read, its line stays clean
+                if (!e->referenced) {
+                        e->referenced = true;
+                }
+                return;
+        }
+        if (c->order.head->next != &e->node) {
+                ll_remove_node(&c->order, &e->node);
+                ll_push_node(&c->order, &e->node);
+        }
+}
+
+// the entry to evict, the tail for LRU. CLOCK moves the referenced
+// entries at the tail to the front and clears their bit, so this takes
+// at most one pass over the list.
+static lru_entry_t *victim(lru_cache_t *c)
+{
+        lru_entry_t *e = c->order.tail->prev->item;
+        while (c->policy == LRU_POLICY_CLOCK && e->referenced) {
+                e->referenced = false;
+                ll_remove_node(&c->order, &e->node);
+                ll_push_node(&c->order, &e->node);
+                e = c->order.tail->prev->item;
+        }
+        return e;
+}
+
+int lru_put(lru_cache_t *c, const void *key, const void *value)
+{
+        lru_entry_t *e = lookup(c, key);
+        if (e) {
+                memcpy(entry_value(c, e), value, c->value_size);
+                touch(c, e);
+                return 0;
+        }
+        if (c->order.len >= c->cap) {
+                e = victim(c);
+                ll_remove_node(&c->order, &e->node);
+                mm_delete(c->index, entry_key(e));
+                c->evictions++;
+                if (c->on_evict) {
+                        c->on_evict(entry_key(e), entry_value(c, e), c->evict_ctx);
+                }
+        } else {
+                e = sb_alloc(&c->slab);
+                e->node.item = e;
+        }
+        e->referenced = false;
+        memcpy(entry_key(e), key, c->key_size);
+        memcpy(entry_value(c, e), value, c->value_size);
+        mm_put(c->index, entry_key(e), &e);
+        ll_push_node(&c->order, &e->node);
+        return 0;
+}
+
+bool lru_get(lru_cache_t *c, const void *key, void *value)
+{
+        lru_entry_t *e = lookup(c, key);
+        if (!e) {
+                c->misses++;
+                return false;
+        }
+        c->hits++;
+        touch(c, e);
+        if (value) {
+                memcpy(value, entry_value(c, e), c->value_size);
+        }
+        return true;
+}
+
+bool lru_peek(lru_cache_t *c, const void *key, void *value)
+{
+        lru_entry_t *e = lookup(c, key);
+        if (!e) {
+                return false;
+        }
+        if (value) {
+                memcpy(value, entry_value(c, e), c->value_size);
+        }
+        return true;
+}
+
+bool lru_delete(lru_cache_t *c, const void *key)
+{
+        lru_entry_t *e = lookup(c, key);
+        if (!e) {
+                return false;
+        }
+        ll_remove_node(&c->order, &e->node);
+        mm_delete(c->index, entry_key(e));
+        sb_free(&c->slab, e);
+        return true;
+}
+
+#ifdef TESTLRU
+// testing
+#include <assert.h>
+
+#define NKEYS 200
+#define CAP 50
+
+typedef struct evicted_s {
+        uint64_t n;
+        uint64_t last;
+}evicted_t;
+
+static void count_evict(const void *key, const void *value, void *ctx)
+{
+        evicted_t *ev = ctx;
+        assert(*(uint64_t *)value == *(uint64_t *)key * 7);
+        ev->n++;
+        ev->last = *(uint64_t *)key;
+}
+
+int main(int argc, char *argv[])
+{
+        printf("=== RUN LRU Test ===\n");
+        // the reference keeps the time of the last use of every key and
+        // evicts the oldest
+        uint64_t used_at[NKEYS] = {0}, clock = 0;
+        bool in[NKEYS] = {false};
+        size_t n = 0;
+        evicted_t ev = {0};
+        lru_opts_t opts = {
+                .max_entries = CAP,
+                .on_evict = count_evict,
+                .evict_ctx = &ev,
+        };
+        lru_cache_t *c = make_lru_cache(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+        unsigned int seed = 1;
+        for (int i = 0; i < 200000; i++) {
+                uint64_t k = rand_r(&seed) % NKEYS, v = k * 7, got;
+                int op = rand_r(&seed) % 8;
+                clock++;
+                if (op < 4) {
+                        assert(lru_get(c, &k, &got) == in[k]);
+                        assert(!in[k] || got == v);
+                        if (in[k]) {
+                                used_at[k] = clock;
+                        }
+                } else if (op < 7) {
+                        if (!in[k] && n == CAP) {
+                                uint64_t oldest = 0;
+                                for (uint64_t j = 0; j < NKEYS; j++) {
+                                        if (in[j] && (!in[oldest] || used_at[j] < used_at[oldest])) {
+                                                oldest = j;
+                                        }
+                                }
+                                uint64_t before = ev.n;
+                                lru_put(c, &k, &v);
+                                assert(ev.n == before + 1 && ev.last == oldest);
+                                in[oldest] = false;
+                        } else {
+                                n += !in[k];
+                                lru_put(c, &k, &v);
+                        }
+                        in[k] = true;
+                        used_at[k] = clock;
+                } else {
+                        assert(lru_delete(c, &k) == in[k]);
+                        n -= in[k];
+                        in[k] = false;
+                }
+                assert(lru_len(c) == n);
+        }
+        assert(ev.n == c->evictions && c->evictions > 0);
+        for (uint64_t k = 0; k < NKEYS; k++) {
+                assert(lru_peek(c, &k, NULL) == in[k]);
+        }
+        delete_lru_cache(c);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Clock Test ===\n");
+        opts.policy = LRU_POLICY_CLOCK;
+        opts.on_evict = NULL;
+        c = make_lru_cache(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL, &opts);
+        for (uint64_t k = 0; k < CAP; k++) {
+                uint64_t v = k * 7;
+                lru_put(c, &k, &v);
+        }
+        // the even keys are used, a stream of new keys evicts the odd ones
+        // first
+        for (uint64_t k = 0; k < CAP; k += 2) {
+                assert(lru_get(c, &k, NULL));
+        }
+        for (uint64_t k = CAP; k < CAP + CAP / 2; k++) {
+                uint64_t v = k * 7;
+                lru_put(c, &k, &v);
+        }
+        for (uint64_t k = 0; k < CAP; k++) {
+                assert(lru_peek(c, &k, NULL) == (k % 2 == 0));
+        }
+        // no bit is left, so the next ones go in insertion order
+        uint64_t k = CAP + CAP / 2, v = k * 7;
+        lru_put(c, &k, &v);
+        assert(!lru_peek(c, &(uint64_t){0}, NULL));
+        assert(lru_len(c) == CAP && c->hits == CAP / 2 && c->evictions == CAP / 2 + 1);
+        delete_lru_cache(c);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Bytes Test ===\n");
+        lru_opts_t by_bytes = {
+                .max_bytes = 1 << 16,
+        };
+        c = make_lru_cache(16, 100, NULL, NULL, &by_bytes);
+        char key[16] = {0}, value[100];
+        for (int i = 0; i < 10000; i++) {
+                snprintf(key, sizeof(key), "%d", i);
+                memset(value, i, sizeof(value));
+                lru_put(c, key, value);
+                assert(lru_bytes(c) <= by_bytes.max_bytes);
+        }
+        assert(lru_len(c) == c->cap && c->cap == (1 << 16) / c->entry_bytes);
+        // the newest entries stayed
+        snprintf(key, sizeof(key), "%d", 9999);
+        assert(lru_get(c, key, value) && value[0] == (char)9999);
+        delete_lru_cache(c);
+
+        by_bytes.max_bytes = 8;
+        assert(make_lru_cache(16, 100, NULL, NULL, &by_bytes) == NULL);
+        lru_opts_t unbounded = {0};
+        assert(make_lru_cache(16, 100, NULL, NULL, &unbounded) == NULL);
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif
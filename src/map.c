@@ -1,13 +1,27 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "blockfile.h"
+#include "bloom.h"
+#include "epoch.h"
+#include "flatmap.h"
+#include "hash.h"
+#include "link_list.h"
 #include "map.h"
+#include "mapfile.h"
+#include "slab.h"
 #include "slice.h"
-#include "link_list.h"
+#include "threadpool.h"
+#include "wal.h"
 
 void mm_print_map(map_t *m, bool verbose);
 
@@ -15,35 +29,129 @@ int unused  __attribute__((unused));
 #define DUMP_ITEM(fp, item) fwrite((item), sizeof(item), 1, (fp))
 #define LOAD_ITEM(fp, item) unused = fread((item), sizeof(item), 1, (fp))
 
+// records inserted per mm_put_batch call while unmarshaling
+#define UNMARSHAL_BATCH 4096
+
+// buckets, slots or records a parallel walk takes at a time
+#define PARALLEL_GRAIN 1024
+
+// first word of a marshal file, followed by the version in the high
+// half of the next word and the MM_MARSHAL_* flags in the low half
+#define MARSHAL_MAGIC 0x314d4c4e494c4d4dULL
+#define MARSHAL_VERSION 2
+
+// file flag of a variable-length map, its records are
+// [hash] var_lens_t key value
+#define MARSHAL_VARLEN 0x100
+
 #define NEW_INSTANCE(ret, structure)                                    \
         if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
         }
 
-static inline uint64_t h0(map_t *m, void *key) {
-        return m->k2int(key, m->key_size) % (m->cap);
+static inline uint64_t hash_key(map_t *m, const void *key)
+{
+        return m->k2int(key, m->key_size);
+}
+
+// cap is always a power of two, so the modulo is a mask
+static inline uint64_t h0(map_t *m, uint64_t hash) {
+        return hash & (m->cap - 1);
 }
 
-static inline uint64_t h1(map_t *m, void *key) {
-        return m->k2int(key, m->key_size) % (m->cap << 1);
+static inline uint64_t h1(map_t *m, uint64_t hash) {
+        return hash & ((m->cap << 1) - 1);
 }
 
-static inline uint64_t getpos(map_t *m, void *key)
+static inline uint64_t getpos(map_t *m, uint64_t hash)
 {
-        uint64_t ret = h0(m, key);
+        uint64_t ret = h0(m, hash);
         if (ret >= m->pos) {
                 return ret;
         }
-        return h1(m, key);
+        return h1(m, hash);
 }
 
-static inline float get_usage(map_t *m)
+/*
+ * Concurrent mode: buckets are guarded by a fixed set of striped locks and
+ * the directory is never freed under a reader, retired arrays are kept
+ * until delete_map. The bucket count is published in a single word, cap
+ * and pos are derived from it, so a lookup gets a consistent pair from
+ * one load. A split or shrink holds the locks of the buckets it touches
+ * while it moves entries and publishes the new count, so after locking a
+ * bucket a caller only has to check that the key still maps to it.
+ *
+ * Lookups take no lock at all. A published entry is never changed: an
+ * update links a copy in its place, and a split or shrink links copies
+ * into the target bucket before it unlinks the originals. Unlinked
+ * entries and buckets go through epoch-based reclamation, so a reader
+ * can always finish the walk it started. Resizes also bump seq, a miss
+ * that raced with one is retried.
+ */
+#define MAP_LOCK_STRIPES 1024
+#define CACHE_LINE 64
+
+typedef struct bucket_lock_s {
+        pthread_mutex_t mu;
+}__attribute__((aligned(CACHE_LINE))) bucket_lock_t;
+
+typedef struct map_sync_s {
+        bucket_lock_t locks[MAP_LOCK_STRIPES];
+
+        // len of the directory as seen by lookups
+        uint64_t nbuckets __attribute__((aligned(CACHE_LINE)));
+        // odd while a resize moves entries between buckets
+        uint64_t seq;
+        epoch_t *epoch;
+
+        // one split, shrink or whole-table operation at a time
+        pthread_mutex_t resize_mu;
+        // directory arrays replaced by a bigger one
+        slice_t *retired_dirs;
+}map_sync_t;
+
+static inline uint64_t pow2_floor(uint64_t n)
+{
+        return (uint64_t)1 << (63 - __builtin_clzll(n));
+}
+
+// same as getpos with cap = pow2_floor(n) and pos = n - cap
+static inline uint64_t addr_of(uint64_t n, uint64_t hash)
+{
+        uint64_t cap = pow2_floor(n);
+        uint64_t addr = hash & ((cap << 1) - 1);
+        return addr < n ? addr : addr - cap;
+}
+
+static inline size_t bucket_count(map_t *m)
 {
-        return ((float)m->used
-                / (float)m->s->len
+        if (m->sync) {
+                return __atomic_load_n(&m->sync->nbuckets, __ATOMIC_ACQUIRE);
+        }
+        return m->s->len;
+}
+
+static inline size_t used_count(map_t *m)
+{
+        return __atomic_load_n(&m->used, __ATOMIC_RELAXED);
+}
+
+// load of the linear engine with nbuckets buckets
+static inline float usage_with(map_t *m, size_t nbuckets)
+{
+        return ((float)used_count(m)
+                / (float)nbuckets
                 / (float)m->bucket_cap);
 }
 
+static inline float get_usage(map_t *m)
+{
+        if (m->engine != MAP_ENGINE_LINEAR) {
+                return (float)m->used / (float)m->cap;
+        }
+        return usage_with(m, bucket_count(m));
+}
+
 static inline bool need_split(map_t *m)
 {
         return get_usage(m) > m->split_ratio;
@@ -51,65 +159,268 @@ static inline bool need_split(map_t *m)
 
 static inline bool need_shrink(map_t *m)
 {
-        return m->cap > DEFAULT_INIT_CAP && get_usage(m) <= m->split_ratio;
+        return !m->never_shrink
+                && pow2_floor(bucket_count(m)) > DEFAULT_INIT_CAP
+                && get_usage(m) <= m->shrink_ratio;
 }
 
-static kv_pair_t *new_kv_pair(void *key, size_t key_size,
-                              void *value, size_t value_size)
+// buckets to split now: enough to bring the load down to split_ratio,
+// then more up to resize_step as long as it stays above shrink_ratio
+static size_t splits_wanted(map_t *m)
 {
-        kv_pair_t *kv;
-        NEW_INSTANCE(kv, kv_pair_t);
-        kv->key = calloc(key_size, 1);
-        if (!kv->key) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        size_t len = bucket_count(m), n = 0;
+        while (usage_with(m, len + n) > m->split_ratio
+               || (n > 0 && n < m->resize_step
+                   && usage_with(m, len + n + 1) > m->shrink_ratio)) {
+                n++;
         }
-        memcpy(kv->key, key, key_size);
+        return n;
+}
 
-        kv->value = calloc(value_size, 1);
-        if (!kv->value) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+// buckets to merge now, one and then more up to resize_step as long as
+// the load stays at or below split_ratio. Merges never catch up at once,
+// a table presized by mm_reserve only gives back resize_step buckets per
+// delete.
+static size_t shrinks_wanted(map_t *m)
+{
+        size_t len = bucket_count(m), n = 0;
+        if (!need_shrink(m)) {
+                return 0;
+        }
+        do {
+                n++;
+        } while (n < m->resize_step && pow2_floor(len - n) > DEFAULT_INIT_CAP
+                 && usage_with(m, len - n - 1) <= m->split_ratio);
+        return n;
+}
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+// an entry is one slab slot: node_t | kv_pair_t | key | value
+#define ENTRY_KV_OFFSET ALIGN8(sizeof(node_t))
+#define ENTRY_KEY_OFFSET (ENTRY_KV_OFFSET + ALIGN8(sizeof(kv_pair_t)))
+
+// aim for slabs of about 64KB
+#define SLAB_BYTES (64 << 10)
+
+static inline size_t entry_size(size_t key_size, size_t value_size)
+{
+        return ENTRY_KEY_OFFSET + ALIGN8(key_size) + ALIGN8(value_size);
+}
+
+static node_t *new_entry(map_t *m, void *key, uint64_t hash, void *value)
+{
+        char *slot;
+        if (m->sync) {
+                // the slab free list is single threaded, malloc has per-thread caches
+                slot = malloc(m->slab.slot_size);
+                if (!slot) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        } else {
+                slot = sb_alloc(&m->slab);
+        }
+        node_t *node = (node_t *)slot;
+        kv_pair_t *kv = (kv_pair_t *)(slot + ENTRY_KV_OFFSET);
+
+        kv->key = slot + ENTRY_KEY_OFFSET;
+        kv->value = (char *)kv->key + ALIGN8(m->key_size);
+        kv->hash = hash;
+        memcpy(kv->key, key, m->key_size);
+        memcpy(kv->value, value, m->value_size);
+
+        node->item = kv;
+        node->prev = NULL;
+        node->next = NULL;
+        return node;
+}
+
+static inline void free_entry(map_t *m, node_t *node)
+{
+        if (m->sync) {
+                free(node);
+                return;
+        }
+        sb_free(&m->slab, node);
+}
+
+/*
+ * Variable-length mode: an entry is node_t | kv_pair_t | var_lens_t |
+ * key room | value room, the rooms are key_size and value_size bytes.
+ * A key or value that fits is stored in its room, a longer one in the
+ * arena. Arena bytes of deleted or overwritten entries are only counted,
+ * the live ones are copied to a fresh arena once most of it is garbage.
+ */
+typedef struct var_lens_s {
+        uint32_t key_len;
+        uint32_t value_len;
+}var_lens_t;
+
+#define ENTRY_VAR_KEY_OFFSET (ENTRY_KEY_OFFSET + ALIGN8(sizeof(var_lens_t)))
+
+// arena chunks, also the least garbage worth a compaction
+#define ARENA_BYTES (64 << 10)
+
+static inline var_lens_t *var_lens(kv_pair_t *kv)
+{
+        return (var_lens_t *)((char *)kv + ALIGN8(sizeof(kv_pair_t)));
+}
+
+static inline char *var_key_room(kv_pair_t *kv)
+{
+        return (char *)kv + ALIGN8(sizeof(kv_pair_t)) + ALIGN8(sizeof(var_lens_t));
+}
+
+static inline char *var_value_room(map_t *m, kv_pair_t *kv)
+{
+        return var_key_room(kv) + ALIGN8(m->key_size);
+}
+
+// store len bytes in room if they fit in its size, in the arena otherwise
+static void *var_store(map_t *m, void *room, size_t size, const void *data, size_t len)
+{
+        void *p = len <= size ? room : ar_alloc(&m->arena, len);
+        if (len > 0) {
+                memmove(p, data, len);
+        }
+        return p;
+}
+
+static inline void var_release(map_t *m, size_t size, size_t len)
+{
+        if (len > size) {
+                m->arena_garbage += ALIGN8(len);
+        }
+}
+
+static node_t *new_var_entry(map_t *m, const void *key, size_t key_len, uint64_t hash,
+                             const void *value, size_t value_len)
+{
+        char *slot = sb_alloc(&m->slab);
+        node_t *node = (node_t *)slot;
+        kv_pair_t *kv = (kv_pair_t *)(slot + ENTRY_KV_OFFSET);
+        var_lens_t *lens = var_lens(kv);
+
+        kv->key = var_store(m, var_key_room(kv), m->key_size, key, key_len);
+        kv->value = var_store(m, var_value_room(m, kv), m->value_size, value, value_len);
+        kv->hash = hash;
+        lens->key_len = key_len;
+        lens->value_len = value_len;
+        if (key_len + value_len > m->var_max) {
+                m->var_max = key_len + value_len;
+        }
+
+        node->item = kv;
+        node->prev = NULL;
+        node->next = NULL;
+        return node;
+}
+
+// move the live arena bytes to a new arena, the entries stay in place
+static void var_compact(map_t *m)
+{
+        arena_t old = m->arena;
+        ar_init(&m->arena, ARENA_BYTES);
+        for (int i = 0; i < m->s->len; i++) {
+                list_t *bucket = *(list_t **)ss_getptr(m->s, i);
+                node_t *node;
+                for (ll_traverse(bucket, node)) {
+                        kv_pair_t *kv = (kv_pair_t *)node->item;
+                        var_lens_t *lens = var_lens(kv);
+                        if (lens->key_len > m->key_size) {
+                                kv->key = var_store(m, NULL, 0, kv->key, lens->key_len);
+                        }
+                        if (lens->value_len > m->value_size) {
+                                kv->value = var_store(m, NULL, 0, kv->value, lens->value_len);
+                        }
+                }
+        }
+        ar_deinit(&old);
+        m->arena_garbage = 0;
+}
+
+static inline void var_maybe_compact(map_t *m)
+{
+        if (m->arena_garbage > ARENA_BYTES && m->arena_garbage > m->arena.allocated / 2) {
+                var_compact(m);
         }
-        memcpy(kv->value, value, value_size);
-        return kv;
 }
 
-static void free_kv_pair(kv_pair_t *kv)
+static node_t *var_find(map_t *m, list_t *bucket, const void *key, size_t key_len,
+                        uint64_t hash)
 {
-        free(kv->key);
-        free(kv->value);
-        free(kv);
+        node_t *node;
+        for (ll_traverse(bucket, node)) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                if (kv->hash == hash && var_lens(kv)->key_len == key_len
+                    && m->kcmp(kv->key, key, key_len) == 0) {
+                        return node;
+                }
+        }
+        return NULL;
 }
 
-static kv_pair_t *get_kv_from_bucket(list_t *bucket, void *key, size_t key_size, keycmp_t kcmp)
+static kv_pair_t *get_kv_from_bucket(list_t *bucket, void *key, uint64_t hash,
+                                     size_t key_size, keycmp_t kcmp)
 {
         node_t *node;
         for (ll_traverse(bucket, node)) {
                 kv_pair_t *kv = (kv_pair_t *)node->item;
-                if (kcmp(kv->key, key, key_size) == 0) {
+                // only compare the keys when the cached hashes match
+                if (kv->hash == hash && kcmp(kv->key, key, key_size) == 0) {
                         return kv;
                 }
         }
         return NULL;
 }
 
-static inline list_t *get_bucket(map_t *m, void *key)
+static node_t *get_node_from_bucket(map_t *m, list_t *bucket, void *key, uint64_t hash)
+{
+        node_t *node;
+        for (ll_traverse(bucket, node)) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                if (kv->hash == hash && m->kcmp(kv->key, key, m->key_size) == 0) {
+                        return node;
+                }
+        }
+        return NULL;
+}
+
+static inline list_t *get_bucket(map_t *m, uint64_t hash)
 {
-        uint64_t offset = getpos(m, key);
+        uint64_t offset = getpos(m, hash);
         return *(list_t **)ss_getptr(m->s, offset);
 }
 
 static kv_pair_t *get_kv(map_t *m, void *key)
 {
-        list_t * bucket = get_bucket(m, key);
-        return get_kv_from_bucket(bucket, key, m->key_size, m->kcmp);
+        uint64_t hash = hash_key(m, key);
+        if (m->bloom && !bloom_may_contain_hash(m->bloom, hash)) {
+                MM_COUNT_LOOKUP(m, 0, false);
+                return NULL;
+        }
+        list_t * bucket = get_bucket(m, hash);
+        uint64_t probes = 0;
+        node_t *node;
+        for (ll_traverse(bucket, node)) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                probes++;
+                if (kv->hash == hash && m->kcmp(kv->key, key, m->key_size) == 0) {
+                        MM_COUNT_LOOKUP(m, probes, true);
+                        return kv;
+                }
+        }
+        MM_COUNT_LOOKUP(m, probes, false);
+        return NULL;
 }
 
 static bool get_and_update(map_t *m,
                            list_t *bucket,
                            void *key,
+                           uint64_t hash,
                            void *value)
 {
-        kv_pair_t *kv = get_kv_from_bucket(bucket, key, m->key_size, m->kcmp);
+        kv_pair_t *kv = get_kv_from_bucket(bucket, key, hash, m->key_size, m->kcmp);
         if (kv) {
                 //kv->value = realloc(kv->value, m->value_size);
                 //if (!kv->value) {
@@ -121,10 +432,160 @@ static bool get_and_update(map_t *m,
         return false;
 }
 
+static inline list_t *make_bucket(map_t *m)
+{
+        return ll_new_list_alloc(sizeof(kv_pair_t), NULL, m->al);
+}
+
+// a spare bucket, or a new one
+static list_t *take_bucket(map_t *m)
+{
+        slice_t *spares = m->spare_buckets;
+        if (spares && spares->len > 0) {
+                list_t *list = *(list_t **)ss_getptr(spares, spares->len - 1);
+                ss_shrink(spares, spares->len - 1);
+                return list;
+        }
+        return make_bucket(m);
+}
+
+// keep an emptied bucket for the next split, up to a few resize steps
+static void give_bucket(map_t *m, list_t *list)
+{
+        if (!m->spare_buckets) {
+                m->spare_buckets = make_slice_alloc(m->resize_step, sizeof(list_t *), NULL, m->al);
+        }
+        if (m->spare_buckets->len >= 2 * m->resize_step) {
+                ll_delete_list(list);
+                return;
+        }
+        ss_append(m->spare_buckets, &list);
+}
+
+/*
+ * Snapshots. A saved bucket is its entries as records: hash | key |
+ * value, key and value 8-aligned. Every change of a bucket below the
+ * snapshot length goes through snap_cow first, so the snapshot reads
+ * either a saved copy or a bucket the map has not touched since.
+ */
+typedef struct snap_bucket_s {
+        size_t n;
+        char records[];
+}snap_bucket_t;
+
+// saved for buckets that were empty
+static snap_bucket_t no_entries;
+
+static inline size_t snap_record_size(map_t *m)
+{
+        return sizeof(uint64_t) + ALIGN8(m->key_size) + ALIGN8(m->value_size);
+}
+
+static void copy_bucket(map_t *m, list_t *list, char *records)
+{
+        size_t rs = snap_record_size(m);
+        node_t *node;
+        for (ll_traverse(list, node)) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                memcpy(records, &kv->hash, sizeof(uint64_t));
+                memcpy(records + sizeof(uint64_t), kv->key, m->key_size);
+                memcpy(records + sizeof(uint64_t) + ALIGN8(m->key_size), kv->value, m->value_size);
+                records += rs;
+        }
+}
+
+static void free_snapshot(map_t *m)
+{
+        map_snapshot_t *snap = m->snap;
+        for (size_t b = 0; b < snap->len; b++) {
+                if (snap->saved[b] != &no_entries) {
+                        free(snap->saved[b]);
+                }
+        }
+        free(snap->saved);
+        pthread_mutex_destroy(&snap->mu);
+        free(snap);
+        m->snap = NULL;
+}
+
+// the open snapshot, NULL if there is none or it was released
+static inline map_snapshot_t *live_snapshot(map_t *m)
+{
+        if (!m->snap) {
+                return NULL;
+        }
+        if (__atomic_load_n(&m->snap->released, __ATOMIC_ACQUIRE)) {
+                free_snapshot(m);
+                return NULL;
+        }
+        return m->snap;
+}
+
+// keep bucket b as it is for the snapshot, called with snap->mu held
+static void snap_save(map_t *m, map_snapshot_t *snap, uint64_t b)
+{
+        if (b >= snap->len || snap->saved[b]) {
+                return;
+        }
+        list_t *list = *(list_t **)ss_getptr(m->s, b);
+        snap_bucket_t *sb = &no_entries;
+        if (list->len > 0) {
+                size_t size = sizeof(snap_bucket_t) + list->len * snap_record_size(m);
+                sb = malloc(size);
+                if (!sb) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                sb->n = list->len;
+                copy_bucket(m, list, sb->records);
+                snap->saved_bytes += size;
+        }
+        snap->saved[b] = sb;
+}
+
+// before the bucket of hash changes
+static inline void snap_cow(map_t *m, uint64_t hash)
+{
+        map_snapshot_t *snap = live_snapshot(m);
+        if (!snap) {
+                return;
+        }
+        // only the map writes saved, it can read it unlocked
+        uint64_t b = getpos(m, hash);
+        if (b >= snap->len || snap->saved[b]) {
+                return;
+        }
+        pthread_mutex_lock(&snap->mu);
+        snap_save(m, snap, b);
+        pthread_mutex_unlock(&snap->mu);
+}
+
+// before the directory changes, walks must not read it meanwhile,
+// return the snapshot to pass to snap_unlock
+static inline map_snapshot_t *snap_lock(map_t *m)
+{
+        map_snapshot_t *snap = live_snapshot(m);
+        if (snap) {
+                pthread_mutex_lock(&snap->mu);
+        }
+        return snap;
+}
+
+static inline void snap_unlock(map_snapshot_t *snap)
+{
+        if (snap) {
+                pthread_mutex_unlock(&snap->mu);
+        }
+}
+
 static int split(map_t *m)
 {
+        map_snapshot_t *snap = snap_lock(m);
+        if (snap) {
+                snap_save(m, snap, m->pos);
+        }
+
         // allocate a new bucket to the tail of the slice
-        list_t *new_bucket = ll_new_list(sizeof(kv_pair_t), (dtor_t)free_kv_pair);
+        list_t *new_bucket = take_bucket(m);
         ss_append(m->s, &new_bucket);
 
         // split the target bucket
@@ -133,7 +594,7 @@ static int split(map_t *m)
         for (ll_traverse(split_bucket, node)) {
                 kv_pair_t *kv;
                 kv = (kv_pair_t *)node->item;
-                uint64_t new_offset = h1(m, kv->key);
+                uint64_t new_offset = h1(m, kv->hash);
                 //printf("key %s, keyhash %llu, old %llu, new_offset %llu\n",
                 //       (const char *) kv->key, m->k2int(kv->key, m->key_size), m->pos, new_offset);
                 if (m->pos == new_offset) {
@@ -154,6 +615,9 @@ static int split(map_t *m)
                 m->cap <<= 1;
                 m->pos = 0;
         }
+        m->version++;
+        m->splits++;
+        snap_unlock(snap);
         return 0;
 }
 
@@ -169,6 +633,11 @@ static int shrink(map_t *m)
 {
         // compute original position
         uint64_t original_offset = get_orig_pos(m);
+        map_snapshot_t *snap = snap_lock(m);
+        if (snap) {
+                snap_save(m, snap, original_offset);
+                snap_save(m, snap, m->s->len - 1);
+        }
         list_t * original_bucket = *(list_t **)ss_getptr(m->s, original_offset);
 
         // re-arrange items in the last bucket
@@ -180,7 +649,7 @@ static int shrink(map_t *m)
                 ll_append_node(original_bucket, node);
                 node = prev;
         }
-        ll_delete_list(last_bucket);
+        give_bucket(m, last_bucket);
 
         // update len, pos, cap
         ss_shrink(m->s, m->s->len-1);
@@ -190,236 +659,2351 @@ static int shrink(map_t *m)
         } else {
                 m->pos--;
         }
+        m->version++;
+        m->shrinks++;
+        snap_unlock(snap);
         return 0;
 }
 
-static bool find_and_remove_from_bucket(list_t *bucket, void *key, size_t key_size, keycmp_t kcmp)
+// split or merge as many buckets as the policy asks for
+static void resize(map_t *m)
 {
-        node_t *node;
-        for (ll_traverse(bucket, node)) {
-                kv_pair_t *kv = (kv_pair_t *)node->item;
-                if (kcmp(kv->key, key, key_size) == 0) {
-                        ll_free_node(bucket, node);
-                        return true;
-                }
+        for (size_t n = splits_wanted(m); n > 0; n--) {
+                split(m);
+        }
+        for (size_t n = shrinks_wanted(m); n > 0; n--) {
+                shrink(m);
         }
-        return false;
 }
 
-map_t *make_map(size_t key_size, size_t value_size, key2int_t k2int, keycmp_t kcmp)
+static bool find_and_remove_from_bucket(map_t *m, list_t *bucket, void *key, uint64_t hash)
 {
-        map_t *m;
-        NEW_INSTANCE(m, map_t);
-        m->cap = DEFAULT_INIT_CAP;
-        m->bucket_cap = DEFAULT_BUCKET_CAP;
-        m->split_ratio = SPLIT_RATIO;
-        m->pos = 0;
-        m->key_size = key_size;
-        m->value_size = value_size;
-        m->k2int = k2int;
-        m->kcmp = kcmp;
-        if (m->kcmp == NULL) {
-                m->kcmp = memcmp;
-        }
-
-        slice_t *s = make_slice(m->cap, sizeof(list_t *), NULL);
-        for (int i = 0; i < s->cap; i++) {
-                list_t *list = ll_new_list(sizeof(kv_pair_t), (dtor_t)free_kv_pair);
-                ss_append(s, &list);
+        node_t *node = get_node_from_bucket(m, bucket, key, hash);
+        if (!node) {
+                return false;
         }
+        ll_remove_node(bucket, node);
+        free_entry(m, node);
+        // the entries behind it moved up one place in the bucket
+        m->version++;
+        return true;
+}
 
-        m->s = s;
-        return m;
+static inline bucket_lock_t *stripe_of(map_sync_t *sync, uint64_t addr)
+{
+        return &sync->locks[addr & (MAP_LOCK_STRIPES - 1)];
 }
 
-bool mm_get(map_t *m, void *key, void *value)
+static inline list_t *dir_bucket(map_t *m, uint64_t addr)
 {
-        kv_pair_t *kv = get_kv(m, key);
-        if (kv) {
-                memcpy(value, kv->value, m->value_size);
-                return true;
-        }
-        return false;
+        list_t **dir = __atomic_load_n((list_t ***)&m->s->array, __ATOMIC_ACQUIRE);
+        // a reader with a stale count may see a slot reused after a shrink
+        return __atomic_load_n(&dir[addr], __ATOMIC_ACQUIRE);
 }
 
-bool mm_haskey(map_t *m, void *key)
+static inline node_t *copy_entry(map_t *m, node_t *node)
 {
-        return get_kv(m, key) != NULL;
+        kv_pair_t *kv = (kv_pair_t *)node->item;
+        return new_entry(m, kv->key, kv->hash, kv->value);
 }
 
-int mm_put(map_t *m, void *key, void *value)
+// a bucket dropped by a shrink, with the entries it still links
+static void free_bucket(void *ptr)
 {
-        // update the old value if it exists
-        list_t *bucket = get_bucket(m, key);
-        if (get_and_update(m, bucket, key, value)) {
-                return 0;
+        list_t *list = ptr;
+        node_t *node = list->head->next;
+        while (node != list->tail) {
+                node_t *next = node->next;
+                free(node);
+                node = next;
         }
+        ll_reset_list(list);
+        ll_delete_list(list);
+}
 
-        // otherwise, allocate a kv-pair and append it to the tail
-        kv_pair_t *kv = new_kv_pair(key, m->key_size, value, m->value_size);
-        ll_append_ref(bucket, kv);
+static inline void seq_begin(map_sync_t *sync)
+{
+        __atomic_store_n(&sync->seq, sync->seq + 1, __ATOMIC_RELAXED);
+        // the odd value is visible before any link the resize changes
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-        m->used++;
-        if (need_split(m)) {
-                split(m);
-        }
-        return 0;
+static inline void seq_end(map_sync_t *sync)
+{
+        __atomic_store_n(&sync->seq, sync->seq + 1, __ATOMIC_RELEASE);
 }
 
-bool mm_delete(map_t *m, void *key)
+// lock the bucket the hash maps to, return its address
+static uint64_t lock_bucket(map_t *m, uint64_t hash)
 {
-        list_t *bucket = get_bucket(m, key);
-        if (!find_and_remove_from_bucket(bucket, key, m->key_size, m->kcmp)) {
-                return false;
-        }
-        m->used--;
-        if (need_shrink(m)) {
-                shrink(m);
+        map_sync_t *sync = m->sync;
+        uint64_t n = __atomic_load_n(&sync->nbuckets, __ATOMIC_ACQUIRE);
+        for (;;) {
+                uint64_t addr = addr_of(n, hash);
+                pthread_mutex_lock(&stripe_of(sync, addr)->mu);
+                n = __atomic_load_n(&sync->nbuckets, __ATOMIC_ACQUIRE);
+                if (addr_of(n, hash) == addr) {
+                        return addr;
+                }
+                // a split or shrink moved the key meanwhile
+                pthread_mutex_unlock(&stripe_of(sync, addr)->mu);
         }
-        return true;
 }
 
-int delete_map(map_t *m)
+static inline void unlock_bucket(map_t *m, uint64_t addr)
 {
-        for (int i = 0; i < m->s->len; i++) {
-                list_t *list = *(list_t **)ss_getptr(m->s, i);
-                ll_delete_list(list);
-        }
-        delete_slice(m->s);
-        free(m);
-        return 0;
+        pthread_mutex_unlock(&stripe_of(m->sync, addr)->mu);
 }
 
-int mm_marshal(const char *path, map_t *m)
+// lock the two buckets touched by a split or shrink, in stripe order
+static void lock_pair(map_sync_t *sync, uint64_t a, uint64_t b)
 {
-        FILE *fp = fopen(path, "wb+");
-        if (!fp) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        bucket_lock_t *la = stripe_of(sync, a), *lb = stripe_of(sync, b);
+        if (la == lb) {
+                pthread_mutex_lock(&la->mu);
+        } else if (la < lb) {
+                pthread_mutex_lock(&la->mu);
+                pthread_mutex_lock(&lb->mu);
+        } else {
+                pthread_mutex_lock(&lb->mu);
+                pthread_mutex_lock(&la->mu);
         }
-        // dump metadata
-        DUMP_ITEM(fp, &m->bucket_cap);
-        DUMP_ITEM(fp, &m->split_ratio);
-        DUMP_ITEM(fp, &m->key_size);
-        DUMP_ITEM(fp, &m->value_size);
+}
 
-        // dump the table
-        for (int i = 0; i < m->s->len; i++) {
-                list_t *list = *(list_t **)ss_getptr(m->s, i);
-                node_t *node;
-                if (list->len ==  0) {
-                        continue;
-                }
-                for (ll_traverse(list, node)) {
-                        kv_pair_t *kv = (kv_pair_t *)node->item;
-                        fwrite(kv->key, m->key_size, 1, fp);
-                        fwrite(kv->value, m->value_size, 1, fp);
-                }
+static void unlock_pair(map_sync_t *sync, uint64_t a, uint64_t b)
+{
+        bucket_lock_t *la = stripe_of(sync, a), *lb = stripe_of(sync, b);
+        pthread_mutex_unlock(&la->mu);
+        if (la != lb) {
+                pthread_mutex_unlock(&lb->mu);
         }
-        fclose(fp);
-        return 0;
 }
 
-int mm_unmarshal(const char *path, map_t *m)
+// grow the directory to cap, lookups may still be reading the old array
+static void dir_reserve(map_t *m, size_t cap)
 {
-        FILE *fp = fopen(path, "rb");
-        if (!fp) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        slice_t *s = m->s;
+        if (!m->sync) {
+                ss_reserve(s, cap);
+                return;
+        }
+        if (cap <= s->cap) {
+                return;
         }
-        // load metadata
-        LOAD_ITEM(fp, &m->bucket_cap);
-        LOAD_ITEM(fp, &m->split_ratio);
-        LOAD_ITEM(fp, &m->key_size);
-        LOAD_ITEM(fp, &m->value_size);
 
-        // load data
-        void *key = malloc(m->key_size);
-        if (!key) {
+        void *array = malloc(s->item_size * cap);
+        if (!array) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
-        void *val = malloc(m->value_size);
-        if (!val) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        memcpy(array, s->array, s->item_size * s->len);
+        ss_append(m->sync->retired_dirs, &s->array);
+        __atomic_store_n(&s->array, array, __ATOMIC_RELEASE);
+        s->cap = cap;
+}
+
+// callers hold resize_mu
+static void dir_append(map_t *m, list_t *list)
+{
+        slice_t *s = m->s;
+        if (!m->sync) {
+                ss_append(s, &list);
+                return;
+        }
+        if (s->len == s->cap) {
+                dir_reserve(m, s->cap << 1);
+        }
+        __atomic_store_n((list_t **)s->array + s->len, list, __ATOMIC_RELEASE);
+        s->len++;
+}
+
+static void cm_split(map_t *m)
+{
+        map_sync_t *sync = m->sync;
+        uint64_t n = sync->nbuckets;
+        uint64_t cap = pow2_floor(n);
+        uint64_t pos = n - cap;
+
+        // the new bucket is invisible until nbuckets is published
+        list_t *new_bucket = make_bucket(m);
+        dir_append(m, new_bucket);
+
+        lock_pair(sync, pos, n);
+        list_t *split_bucket = dir_bucket(m, pos);
+        node_t *node;
+        // readers still find the originals until the new count is out
+        for (ll_traverse(split_bucket, node)) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                if ((kv->hash & ((cap << 1) - 1)) != pos) {
+                        ll_append_node(new_bucket, copy_entry(m, node));
+                }
+        }
+
+        seq_begin(sync);
+        m->cap = pow2_floor(n + 1);
+        m->pos = n + 1 - m->cap;
+        m->splits++;
+        __atomic_store_n(&sync->nbuckets, n + 1, __ATOMIC_RELEASE);
+        for (ll_traverse(split_bucket, node)) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                if ((kv->hash & ((cap << 1) - 1)) == pos) {
+                        continue;
+                }
+                node_t *prev = node->prev; // need to keep this for iteration
+                ll_remove_node(split_bucket, node);
+                eb_retire(sync->epoch, node, free);
+                node = prev;
+        }
+        seq_end(sync);
+        unlock_pair(sync, pos, n);
+}
+
+static void cm_shrink(map_t *m)
+{
+        map_sync_t *sync = m->sync;
+        uint64_t last = sync->nbuckets - 1;
+        uint64_t orig = last - pow2_floor(last);
+
+        lock_pair(sync, orig, last);
+        list_t *orig_bucket = dir_bucket(m, orig);
+        list_t *last_bucket = dir_bucket(m, last);
+        node_t *node;
+        for (ll_traverse(last_bucket, node)) {
+                ll_append_node(orig_bucket, copy_entry(m, node));
+        }
+
+        // the last bucket stays intact, but its slot can be reused by the
+        // next split before a reader with the old count looks at it
+        seq_begin(sync);
+        ss_shrink(m->s, last);
+        m->cap = pow2_floor(last);
+        m->pos = last - m->cap;
+        m->shrinks++;
+        __atomic_store_n(&sync->nbuckets, last, __ATOMIC_RELEASE);
+        seq_end(sync);
+        unlock_pair(sync, orig, last);
+
+        // anyone still waiting on the old address revalidates and retries
+        eb_retire(sync->epoch, last_bucket, free_bucket);
+}
+
+static void cm_resize(map_t *m)
+{
+        bool shrink = need_shrink(m);
+        while (need_split(m) || shrink) {
+                // whoever holds the resize lock will catch up with the load
+                if (pthread_mutex_trylock(&m->sync->resize_mu) != 0) {
+                        return;
+                }
+                // puts made meanwhile raise the load again, split until it
+                // is under split_ratio
+                while (need_split(m)) {
+                        for (size_t n = splits_wanted(m); n > 0; n--) {
+                                cm_split(m);
+                        }
+                }
+                if (shrink) {
+                        for (size_t n = shrinks_wanted(m); n > 0; n--) {
+                                cm_shrink(m);
+                        }
+                        shrink = false;
+                }
+                pthread_mutex_unlock(&m->sync->resize_mu);
+                // puts whose trylock failed before the unlock are checked
+                // again here
+        }
+}
+
+// stop every other operation, for whole-table work
+static void lock_all(map_t *m)
+{
+        if (!m->sync) {
+                return;
+        }
+        pthread_mutex_lock(&m->sync->resize_mu);
+        for (int i = 0; i < MAP_LOCK_STRIPES; i++) {
+                pthread_mutex_lock(&m->sync->locks[i].mu);
         }
-        while (1) {
-                unused = fread(key, m->key_size, 1, fp);
-                if (feof(fp)) {
+}
+
+static void unlock_all(map_t *m)
+{
+        if (!m->sync) {
+                return;
+        }
+        for (int i = MAP_LOCK_STRIPES - 1; i >= 0; i--) {
+                pthread_mutex_unlock(&m->sync->locks[i].mu);
+        }
+        pthread_mutex_unlock(&m->sync->resize_mu);
+        // puts made meanwhile found resize_mu taken and left the load to
+        // its holder
+        cm_resize(m);
+}
+
+// same as get_kv_from_bucket, without holding the bucket lock
+static kv_pair_t *lf_get_kv(map_t *m, list_t *bucket, void *key, uint64_t hash)
+{
+        node_t *node = __atomic_load_n(&bucket->head->next, __ATOMIC_ACQUIRE);
+        uint64_t probes = 0;
+        while (node != bucket->tail) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                probes++;
+                if (kv->hash == hash && m->kcmp(kv->key, key, m->key_size) == 0) {
+                        MM_COUNT_LOOKUP(m, probes, true);
+                        return kv;
+                }
+                node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        }
+        MM_COUNT_LOOKUP(m, probes, false);
+        return NULL;
+}
+
+static bool cm_get(map_t *m, void *key, void *value)
+{
+        map_sync_t *sync = m->sync;
+        uint64_t hash = hash_key(m, key);
+        kv_pair_t *kv;
+
+        eb_enter(sync->epoch);
+        for (;;) {
+                uint64_t seq = __atomic_load_n(&sync->seq, __ATOMIC_ACQUIRE);
+                uint64_t n = __atomic_load_n(&sync->nbuckets, __ATOMIC_ACQUIRE);
+                kv = lf_get_kv(m, dir_bucket(m, addr_of(n, hash)), key, hash);
+                if (kv) {
+                        if (value) {
+                                memcpy(value, kv->value, m->value_size);
+                        }
                         break;
                 }
-                unused = fread(val, m->value_size, 1, fp);
-                if (feof(fp)) {
+                // a miss only counts if no resize ran meanwhile
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (!(seq & 1) && __atomic_load_n(&sync->seq, __ATOMIC_RELAXED) == seq) {
                         break;
                 }
-                mm_put(m, key, val);
+                sched_yield();
+        }
+        eb_exit(sync->epoch);
+        return kv != NULL;
+}
+
+static int cm_put_hash(map_t *m, void *key, uint64_t hash, void *value)
+{
+        uint64_t addr = lock_bucket(m, hash);
+        list_t *bucket = dir_bucket(m, addr);
+        node_t *old = get_node_from_bucket(m, bucket, key, hash);
+        if (old) {
+                // readers may be copying the old value, swap in a new entry
+                ll_replace_node(bucket, old, new_entry(m, key, hash, value));
+                unlock_bucket(m, addr);
+                eb_retire(m->sync->epoch, old, free);
+                return 0;
+        }
+        ll_append_node(bucket, new_entry(m, key, hash, value));
+        __atomic_add_fetch(&m->used, 1, __ATOMIC_RELAXED);
+        unlock_bucket(m, addr);
+
+        cm_resize(m);
+        return 0;
+}
+
+static bool cm_delete(map_t *m, void *key)
+{
+        uint64_t hash = hash_key(m, key);
+        uint64_t addr = lock_bucket(m, hash);
+        list_t *bucket = dir_bucket(m, addr);
+        node_t *node = get_node_from_bucket(m, bucket, key, hash);
+        if (!node) {
+                unlock_bucket(m, addr);
+                return false;
+        }
+        ll_remove_node(bucket, node);
+        __atomic_sub_fetch(&m->used, 1, __ATOMIC_RELAXED);
+        unlock_bucket(m, addr);
+
+        eb_retire(m->sync->epoch, node, free);
+        cm_resize(m);
+        return true;
+}
+
+static map_sync_t *new_sync(size_t nbuckets)
+{
+        map_sync_t *sync;
+        if (posix_memalign((void **)&sync, CACHE_LINE, sizeof(map_sync_t)) != 0) {
+                error_at_line(-1, ENOMEM, __FILE__, __LINE__, NULL);
+        }
+        for (int i = 0; i < MAP_LOCK_STRIPES; i++) {
+                pthread_mutex_init(&sync->locks[i].mu, NULL);
+        }
+        pthread_mutex_init(&sync->resize_mu, NULL);
+        sync->nbuckets = nbuckets;
+        sync->seq = 0;
+        sync->epoch = eb_new();
+        sync->retired_dirs = make_slice(4, sizeof(void *), NULL);
+        return sync;
+}
+
+static void delete_sync(map_sync_t *sync)
+{
+        for (int i = 0; i < sync->retired_dirs->len; i++) {
+                free(*(void **)ss_getptr(sync->retired_dirs, i));
+        }
+        delete_slice(sync->retired_dirs);
+        eb_delete(sync->epoch);
+        for (int i = 0; i < MAP_LOCK_STRIPES; i++) {
+                pthread_mutex_destroy(&sync->locks[i].mu);
+        }
+        pthread_mutex_destroy(&sync->resize_mu);
+        free(sync);
+}
+
+map_t *make_map(size_t key_size, size_t value_size, key2int_t k2int, keycmp_t kcmp)
+{
+        return make_map_opts(key_size, value_size, k2int, kcmp, NULL);
+}
+
+map_t *make_map_opts(size_t key_size, size_t value_size, key2int_t k2int, keycmp_t kcmp,
+                     const map_opts_t *opts)
+{
+        const allocator_t *al = al_or_libc(opts ? opts->allocator : NULL);
+        map_t *m = al_calloc(al, sizeof(map_t));
+        m->al = al;
+        m->cap = DEFAULT_INIT_CAP;
+        m->bucket_cap = DEFAULT_BUCKET_CAP;
+        m->split_ratio = SPLIT_RATIO;
+        m->shrink_ratio = SHRINK_RATIO;
+        m->resize_step = 1;
+        m->pos = 0;
+        m->key_size = key_size;
+        m->value_size = value_size;
+        m->k2int = k2int;
+        m->kcmp = kcmp;
+        if (m->k2int == NULL) {
+                m->k2int = hash_default(key_size);
+        }
+        if (m->kcmp == NULL) {
+                m->kcmp = memcmp;
+        }
+        if (opts) {
+                m->engine = opts->engine;
+                m->varlen = opts->varlen;
+                m->never_shrink = opts->never_shrink;
+                if (opts->split_ratio > 0) {
+                        m->split_ratio = opts->split_ratio;
+                }
+                if (opts->shrink_ratio > 0) {
+                        m->shrink_ratio = opts->shrink_ratio;
+                } else if (m->shrink_ratio > m->split_ratio) {
+                        m->shrink_ratio = m->split_ratio / 2;
+                }
+                if (opts->resize_step > 0) {
+                        m->resize_step = opts->resize_step;
+                }
+        }
+        if (m->shrink_ratio > m->split_ratio) {
+                fprintf(stderr, "make_map_opts: shrink_ratio is above split_ratio\n");
+                al_free(al, m, sizeof(map_t));
+                return NULL;
+        }
+        if (opts && opts->concurrent && m->engine != MAP_ENGINE_LINEAR) {
+                fprintf(stderr, "make_map_opts: concurrent mode needs the linear engine\n");
+                al_free(al, m, sizeof(map_t));
+                return NULL;
+        }
+        if (m->varlen && (m->engine != MAP_ENGINE_LINEAR || opts->concurrent)) {
+                fprintf(stderr, "make_map_opts: variable-length mode needs the "
+                        "linear engine without concurrency\n");
+                al_free(al, m, sizeof(map_t));
+                return NULL;
+        }
+        if (al != &al_libc && (m->engine == MAP_ENGINE_MAPPED || opts->concurrent || m->varlen)) {
+                // entries of concurrent maps are retired to other threads,
+                // and the arena of varlen maps has chunks of its own
+                fprintf(stderr, "make_map_opts: an allocator needs the linear or flat "
+                        "engine without concurrency or variable-length mode\n");
+                al_free(al, m, sizeof(map_t));
+                return NULL;
+        }
+        if (m->varlen && k2int == NULL) {
+                // hash_default picks by key size, which varies here
+                m->k2int = hash_bytes;
+        }
+
+        if (m->engine == MAP_ENGINE_FLAT) {
+                m->ft = ft_new(key_size + value_size, m->cap, al);
+                m->cap = m->ft->capacity;
+                return m;
+        }
+
+        size_t slot_size = entry_size(key_size, value_size);
+        if (m->varlen) {
+                slot_size += ALIGN8(sizeof(var_lens_t));
+                ar_init(&m->arena, ARENA_BYTES);
+        }
+        sb_init_alloc(&m->slab, slot_size, SLAB_BYTES / slot_size, al);
+
+        slice_t *s = make_slice_alloc(m->cap, sizeof(list_t *), NULL, al);
+        for (int i = 0; i < s->cap; i++) {
+                list_t *list = make_bucket(m);
+                ss_append(s, &list);
+        }
+
+        m->s = s;
+        if (opts && opts->concurrent) {
+                m->sync = new_sync(s->len);
+        }
+        return m;
+}
+
+// mapped maps reject every change
+static bool read_only(map_t *m, const char *op)
+{
+        if (m->engine != MAP_ENGINE_MAPPED) {
+                return false;
+        }
+        fprintf(stderr, "%s: the map is read-only\n", op);
+        return true;
+}
+
+// the fixed-size calls and the _var ones each take their kind of map
+static bool wrong_mode(map_t *m, bool varlen, const char *op)
+{
+        if (m->varlen == varlen) {
+                return false;
+        }
+        fprintf(stderr, "%s: the map has %s keys\n", op,
+                m->varlen ? "variable-length" : "fixed-size");
+        return true;
+}
+
+bool mm_get(map_t *m, void *key, void *value)
+{
+        if (wrong_mode(m, false, "mm_get")) {
+                return false;
+        }
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                const char *rec = mf_find(m, key);
+                if (rec) {
+                        memcpy(value, mf_record_value(m->mf, rec), m->value_size);
+                        return true;
+                }
+                return false;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                void *slot = ft_find(m, key);
+                if (slot) {
+                        memcpy(value, (char *)slot + m->key_size, m->value_size);
+                        return true;
+                }
+                return false;
+        }
+        if (m->sync) {
+                return cm_get(m, key, value);
+        }
+
+        kv_pair_t *kv = get_kv(m, key);
+        if (kv) {
+                memcpy(value, kv->value, m->value_size);
+                return true;
+        }
+        return false;
+}
+
+// keys handled together by mm_get_batch, enough to hide the latency of
+// one stage behind the others without flooding the line fill buffers
+#define GET_BATCH_GROUP 16
+
+/*
+ * Group prefetching: each stage issues the loads of all keys in the
+ * group before the next stage touches any of them, so the cache misses
+ * of one lookup overlap with those of the other ones instead of being
+ * taken one after the other.
+ */
+static void get_group_linear(map_t *m, char *keys, size_t n, kv_pair_t **kvs)
+{
+        list_t **dir = m->s->array;
+        uint64_t hashes[GET_BATCH_GROUP];
+        uint64_t pos[GET_BATCH_GROUP];
+        node_t *nodes[GET_BATCH_GROUP];
+        bool maybe[GET_BATCH_GROUP];
+
+        // the directory slots, for the keys the filter lets through
+        for (size_t i = 0; i < n; i++) {
+                hashes[i] = hash_key(m, keys + i * m->key_size);
+                maybe[i] = !m->bloom || bloom_may_contain_hash(m->bloom, hashes[i]);
+                if (maybe[i]) {
+                        pos[i] = getpos(m, hashes[i]);
+                        __builtin_prefetch(&dir[pos[i]]);
+                }
+        }
+        // the list headers
+        for (size_t i = 0; i < n; i++) {
+                if (maybe[i]) {
+                        __builtin_prefetch(dir[pos[i]]);
+                }
+        }
+        // the head sentinels
+        for (size_t i = 0; i < n; i++) {
+                if (maybe[i]) {
+                        __builtin_prefetch(dir[pos[i]]->head);
+                }
+        }
+        // the first entries, node, kv, key and value share one slot
+        for (size_t i = 0; i < n; i++) {
+                if (maybe[i]) {
+                        nodes[i] = dir[pos[i]]->head->next;
+                        __builtin_prefetch(nodes[i]);
+                        __builtin_prefetch((char *)nodes[i] + ENTRY_KEY_OFFSET);
+                }
+        }
+        for (size_t i = 0; i < n; i++) {
+                kvs[i] = NULL;
+                if (!maybe[i]) {
+                        MM_COUNT_LOOKUP(m, 0, false);
+                        continue;
+                }
+                list_t *bucket = dir[pos[i]];
+                uint64_t probes = 0;
+                for (node_t *node = nodes[i]; node != bucket->tail; node = node->next) {
+                        kv_pair_t *kv = (kv_pair_t *)node->item;
+                        probes++;
+                        if (kv->hash == hashes[i]
+                            && m->kcmp(kv->key, keys + i * m->key_size, m->key_size) == 0) {
+                                kvs[i] = kv;
+                                break;
+                        }
+                }
+                MM_COUNT_LOOKUP(m, probes, kvs[i] != NULL);
+        }
+}
+
+size_t mm_get_batch(map_t *m, void *keys, size_t n, void *values, bool *found)
+{
+        size_t nfound = 0;
+        if (wrong_mode(m, false, "mm_get_batch")) {
+                return 0;
+        }
+
+        // the concurrent and mapped paths keep their own lookup protocol
+        if (m->sync || m->engine == MAP_ENGINE_MAPPED) {
+                for (size_t i = 0; i < n; i++) {
+                        bool ok = mm_get(m, (char *)keys + i * m->key_size,
+                                         (char *)values + i * m->value_size);
+                        if (found) {
+                                found[i] = ok;
+                        }
+                        nfound += ok;
+                }
+                return nfound;
+        }
+
+        void *slots[GET_BATCH_GROUP];
+        for (size_t base = 0; base < n; base += GET_BATCH_GROUP) {
+                size_t g = n - base < GET_BATCH_GROUP ? n - base : GET_BATCH_GROUP;
+                char *group_keys = (char *)keys + base * m->key_size;
+                if (m->engine == MAP_ENGINE_FLAT) {
+                        ft_find_batch(m, group_keys, g, slots);
+                        for (size_t i = 0; i < g; i++) {
+                                if (slots[i]) {
+                                        slots[i] = (char *)slots[i] + m->key_size;
+                                }
+                        }
+                } else {
+                        kv_pair_t *kvs[GET_BATCH_GROUP];
+                        get_group_linear(m, group_keys, g, kvs);
+                        for (size_t i = 0; i < g; i++) {
+                                slots[i] = kvs[i] ? kvs[i]->value : NULL;
+                        }
+                }
+
+                for (size_t i = 0; i < g; i++) {
+                        if (slots[i]) {
+                                memcpy((char *)values + (base + i) * m->value_size,
+                                       slots[i], m->value_size);
+                                nfound++;
+                        }
+                        if (found) {
+                                found[base + i] = slots[i] != NULL;
+                        }
+                }
+        }
+        return nfound;
+}
+
+bool mm_haskey(map_t *m, void *key)
+{
+        if (wrong_mode(m, false, "mm_haskey")) {
+                return false;
+        }
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                return mf_find(m, key) != NULL;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                return ft_find(m, key) != NULL;
+        }
+        if (m->sync) {
+                return cm_get(m, key, NULL);
+        }
+        return get_kv(m, key) != NULL;
+}
+
+static int put_unlogged(map_t *m, void *key, void *value)
+{
+        if (read_only(m, "mm_put") || wrong_mode(m, false, "mm_put")) {
+                return -1;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                return ft_put(m, key, value);
+        }
+
+        // update the old value if it exists
+        uint64_t hash = hash_key(m, key);
+        if (m->sync) {
+                return cm_put_hash(m, key, hash, value);
+        }
+        snap_cow(m, hash);
+        list_t *bucket = get_bucket(m, hash);
+        if (get_and_update(m, bucket, key, hash, value)) {
+                return 0;
+        }
+        if (m->bloom) {
+                bloom_add_hash(m->bloom, hash);
+        }
+
+        // otherwise, allocate an entry and append it to the tail
+        ll_append_node(bucket, new_entry(m, key, hash, value));
+
+        m->used++;
+        if (need_split(m)) {
+                resize(m);
         }
-        free(key);
-        free(val);
-        fclose(fp);
         return 0;
 }
 
-slice_t *mm_keyset(map_t *m)
+// same moves as reserve_locked, but copies first as in cm_split
+static void reserve_concurrent(map_t *m, size_t old_len, size_t len)
+{
+        map_sync_t *sync = m->sync;
+        node_t *node;
+        for (size_t i = 0; i < old_len; i++) {
+                list_t *bucket = dir_bucket(m, i);
+                for (ll_traverse(bucket, node)) {
+                        uint64_t new_offset = getpos(m, ((kv_pair_t *)node->item)->hash);
+                        if (new_offset != i) {
+                                ll_append_node(dir_bucket(m, new_offset), copy_entry(m, node));
+                        }
+                }
+        }
+
+        seq_begin(sync);
+        __atomic_store_n(&sync->nbuckets, len, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < old_len; i++) {
+                list_t *bucket = dir_bucket(m, i);
+                for (ll_traverse(bucket, node)) {
+                        if (getpos(m, ((kv_pair_t *)node->item)->hash) == i) {
+                                continue;
+                        }
+                        node_t *prev = node->prev; // need to keep this for iteration
+                        ll_remove_node(bucket, node);
+                        eb_retire(sync->epoch, node, free);
+                        node = prev;
+                }
+        }
+        seq_end(sync);
+}
+
+static void reserve_locked(map_t *m, size_t n)
+{
+        size_t len = (size_t)((float)n / m->split_ratio / (float)m->bucket_cap) + 1;
+        size_t old_len = m->s->len;
+        if (len <= old_len) {
+                return;
+        }
+
+        // every old bucket may lose entries
+        map_snapshot_t *snap = snap_lock(m);
+        for (size_t i = 0; snap && i < old_len; i++) {
+                snap_save(m, snap, i);
+        }
+
+        // jump straight to the final linear hashing state: len = cap + pos
+        dir_reserve(m, len);
+        for (size_t i = old_len; i < len; i++) {
+                dir_append(m, make_bucket(m));
+        }
+        while ((m->cap << 1) <= len) {
+                m->cap <<= 1;
+        }
+        m->pos = len - m->cap;
+        m->version++;
+        m->splits += len - old_len;
+
+        snap_unlock(snap);
+        if (m->sync) {
+                reserve_concurrent(m, old_len, len);
+                return;
+        }
+
+        // an entry can only move to a higher bucket, so entries that land in
+        // a bucket not visited yet are simply seen again in their right place
+        for (size_t i = 0; i < old_len; i++) {
+                list_t *bucket = *(list_t **)ss_getptr(m->s, i);
+                node_t *node;
+                for (ll_traverse(bucket, node)) {
+                        kv_pair_t *kv = (kv_pair_t *)node->item;
+                        uint64_t new_offset = getpos(m, kv->hash);
+                        if (new_offset == i) {
+                                continue;
+                        }
+
+                        node_t *prev = node->prev; // need to keep this for iteration
+                        ll_remove_node(bucket, node);
+                        ll_append_node(*(list_t **)ss_getptr(m->s, new_offset), node);
+                        node = prev;
+                }
+        }
+}
+
+int mm_reserve(map_t *m, size_t n)
+{
+        if (read_only(m, "mm_reserve")) {
+                return -1;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                return ft_reserve(m, n);
+        }
+
+        lock_all(m);
+        reserve_locked(m, n);
+        unlock_all(m);
+        return 0;
+}
+
+typedef struct batch_item_s {
+        uint64_t pos;
+        size_t idx;
+}batch_item_t;
+
+static int cmp_batch_item(const void *a, const void *b)
+{
+        const batch_item_t *x = a, *y = b;
+        if (x->pos != y->pos) {
+                return x->pos < y->pos ? -1 : 1;
+        }
+        // keep the input order inside a bucket, so later duplicates win
+        return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+// hashes[i] is the k2int result of the i-th key
+static int put_batch_hashed(map_t *m, void *keys, void *values, uint64_t *hashes, size_t n)
+{
+        mm_reserve(m, used_count(m) + n);
+
+        if (m->sync) {
+                for (size_t i = 0; i < n; i++) {
+                        cm_put_hash(m, (char *)keys + i * m->key_size, hashes[i],
+                                    (char *)values + i * m->value_size);
+                }
+                return 0;
+        }
+
+        if (m->engine == MAP_ENGINE_FLAT) {
+                for (size_t i = 0; i < n; i++) {
+                        ft_put_hash(m, (char *)keys + i * m->key_size,
+                                    (char *)values + i * m->value_size, hashes[i]);
+                }
+                return 0;
+        }
+
+        batch_item_t *items = malloc(n * sizeof(batch_item_t) + 1);
+        if (!items) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        for (size_t i = 0; i < n; i++) {
+                items[i].pos = getpos(m, hashes[i]);
+                items[i].idx = i;
+        }
+        qsort(items, n, sizeof(batch_item_t), cmp_batch_item);
+
+        // the table is already big enough, no need to check for splits
+        for (size_t i = 0; i < n; i++) {
+                void *key = (char *)keys + items[i].idx * m->key_size;
+                void *value = (char *)values + items[i].idx * m->value_size;
+                uint64_t hash = hashes[items[i].idx];
+                snap_cow(m, hash);
+                list_t *bucket = *(list_t **)ss_getptr(m->s, items[i].pos);
+                if (get_and_update(m, bucket, key, hash, value)) {
+                        continue;
+                }
+                if (m->bloom) {
+                        bloom_add_hash(m->bloom, hash);
+                }
+                ll_append_node(bucket, new_entry(m, key, hash, value));
+                m->used++;
+        }
+        free(items);
+        return 0;
+}
+
+int mm_put_batch(map_t *m, void *keys, void *values, size_t n)
+{
+        if (read_only(m, "mm_put_batch") || wrong_mode(m, false, "mm_put_batch")) {
+                return -1;
+        }
+        uint64_t *hashes = malloc(n * sizeof(uint64_t) + 1);
+        if (!hashes) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        for (size_t i = 0; i < n; i++) {
+                hashes[i] = hash_key(m, (char *)keys + i * m->key_size);
+        }
+        int ret = put_batch_hashed(m, keys, values, hashes, n);
+        free(hashes);
+        for (size_t i = 0; ret == 0 && m->wal && i < n; i++) {
+                ret = wal_log(m->wal, WAL_PUT, (char *)keys + i * m->key_size,
+                              (char *)values + i * m->value_size);
+        }
+        return ret;
+}
+
+static bool delete_unlogged(map_t *m, void *key)
+{
+        if (read_only(m, "mm_delete") || wrong_mode(m, false, "mm_delete")) {
+                return false;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                return ft_remove(m, key);
+        }
+        if (m->sync) {
+                return cm_delete(m, key);
+        }
+
+        uint64_t hash = hash_key(m, key);
+        snap_cow(m, hash);
+        list_t *bucket = get_bucket(m, hash);
+        if (!find_and_remove_from_bucket(m, bucket, key, hash)) {
+                return false;
+        }
+        m->used--;
+        if (need_shrink(m)) {
+                resize(m);
+        }
+        return true;
+}
+
+// changes reach the log once they are made, the maps that take a log
+// have a single writer so the log keeps their order
+int mm_put(map_t *m, void *key, void *value)
+{
+        if (put_unlogged(m, key, value) != 0) {
+                return -1;
+        }
+        return m->wal ? wal_log(m->wal, WAL_PUT, key, value) : 0;
+}
+
+// a failed log write shows in the next mm_put, mm_wal_sync or
+// mm_wal_close
+bool mm_delete(map_t *m, void *key)
+{
+        if (!delete_unlogged(m, key)) {
+                return false;
+        }
+        if (m->wal) {
+                wal_log(m->wal, WAL_DELETE, key, NULL);
+        }
+        return true;
+}
+
+// hash is the k2int result of the key
+static int var_put_hash(map_t *m, const void *key, size_t key_len, uint64_t hash,
+                        const void *value, size_t value_len)
+{
+        list_t *bucket = get_bucket(m, hash);
+        node_t *node = var_find(m, bucket, key, key_len, hash);
+        if (node) {
+                kv_pair_t *kv = (kv_pair_t *)node->item;
+                var_lens_t *lens = var_lens(kv);
+                var_release(m, m->value_size, lens->value_len);
+                kv->value = var_store(m, var_value_room(m, kv), m->value_size, value, value_len);
+                lens->value_len = value_len;
+                if (key_len + value_len > m->var_max) {
+                        m->var_max = key_len + value_len;
+                }
+                var_maybe_compact(m);
+                return 0;
+        }
+
+        ll_append_node(bucket, new_var_entry(m, key, key_len, hash, value, value_len));
+        m->used++;
+        if (need_split(m)) {
+                resize(m);
+        }
+        return 0;
+}
+
+int mm_put_var(map_t *m, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+        if (wrong_mode(m, true, "mm_put_var")) {
+                return -1;
+        }
+        if (key_len > UINT32_MAX || value_len > UINT32_MAX) {
+                fprintf(stderr, "mm_put_var: keys and values are limited to 4GB\n");
+                return -1;
+        }
+        return var_put_hash(m, key, key_len, m->k2int(key, key_len), value, value_len);
+}
+
+bool mm_get_var(map_t *m, const void *key, size_t key_len, void **value, size_t *value_len)
+{
+        if (wrong_mode(m, true, "mm_get_var")) {
+                return false;
+        }
+        uint64_t hash = m->k2int(key, key_len);
+        node_t *node = var_find(m, get_bucket(m, hash), key, key_len, hash);
+        if (!node) {
+                return false;
+        }
+        kv_pair_t *kv = (kv_pair_t *)node->item;
+        if (value) {
+                *value = kv->value;
+        }
+        if (value_len) {
+                *value_len = var_lens(kv)->value_len;
+        }
+        return true;
+}
+
+bool mm_delete_var(map_t *m, const void *key, size_t key_len)
+{
+        if (wrong_mode(m, true, "mm_delete_var")) {
+                return false;
+        }
+        uint64_t hash = m->k2int(key, key_len);
+        list_t *bucket = get_bucket(m, hash);
+        node_t *node = var_find(m, bucket, key, key_len, hash);
+        if (!node) {
+                return false;
+        }
+        var_lens_t *lens = var_lens((kv_pair_t *)node->item);
+        var_release(m, m->key_size, lens->key_len);
+        var_release(m, m->value_size, lens->value_len);
+        ll_remove_node(bucket, node);
+        sb_free(&m->slab, node);
+        m->version++;
+        m->used--;
+
+        var_maybe_compact(m);
+        if (need_shrink(m)) {
+                resize(m);
+        }
+        return true;
+}
+
+int delete_map(map_t *m)
+{
+        // the compaction of the log holds a snapshot until it is over
+        mm_wal_close(m);
+        if (live_snapshot(m)) {
+                fprintf(stderr, "delete_map: the map has a snapshot not released yet\n");
+                return -1;
+        }
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                mf_close(m->mf);
+                al_free(m->al, m, sizeof(map_t));
+                return 0;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                ft_delete(m->ft);
+                al_free(m->al, m, sizeof(map_t));
+                return 0;
+        }
+
+        // the entries live in the slabs, only the bucket heads are freed one by one
+        for (int i = 0; i < m->s->len; i++) {
+                list_t *list = *(list_t **)ss_getptr(m->s, i);
+                if (m->sync) {
+                        // concurrent maps allocate every entry on its own
+                        node_t *node = list->head->next;
+                        while (node != list->tail) {
+                                node_t *next = node->next;
+                                free_entry(m, node);
+                                node = next;
+                        }
+                }
+                ll_reset_list(list);
+                ll_delete_list(list);
+        }
+        delete_slice(m->s);
+        if (m->spare_buckets) {
+                for (int i = 0; i < m->spare_buckets->len; i++) {
+                        ll_delete_list(*(list_t **)ss_getptr(m->spare_buckets, i));
+                }
+                delete_slice(m->spare_buckets);
+        }
+        sb_deinit(&m->slab);
+        if (m->varlen) {
+                ar_deinit(&m->arena);
+        }
+        if (m->sync) {
+                delete_sync(m->sync);
+        }
+        al_free(m->al, m, sizeof(map_t));
+        return 0;
+}
+
+int mm_marshal(const char *path, map_t *m)
+{
+        return mm_marshal_flags(path, m, 0);
+}
+
+// what follows the magic and version in a file, the first block
+typedef struct marshal_meta_s {
+        uint64_t flags;
+        uint64_t bucket_cap;
+        uint64_t key_size;
+        uint64_t value_size;
+        uint64_t count;
+        float split_ratio;
+        // 0 in files from before the resize policy
+        float shrink_ratio;
+}marshal_meta_t;
+
+// a loaded split_ratio may be below the shrink_ratio of the map
+static inline void fix_shrink_ratio(map_t *m)
+{
+        if (m->shrink_ratio > m->split_ratio) {
+                m->shrink_ratio = m->split_ratio / 2;
+        }
+}
+
+static inline size_t marshal_hash_size(uint64_t flags)
+{
+        return (flags & MM_MARSHAL_HASH) ? sizeof(uint64_t) : 0;
+}
+
+static void put_record(bf_writer_t *w, map_t *m, size_t hash_size,
+                       uint64_t hash, const void *key, const void *value)
+{
+        char *rec = bf_reserve(w, hash_size + m->key_size + m->value_size);
+        // marshal_writer sized the blocks for the largest record
+        assert(rec);
+        memcpy(rec, &hash, hash_size);
+        memcpy(rec + hash_size, key, m->key_size);
+        memcpy(rec + hash_size + m->key_size, value, m->value_size);
+}
+
+static void put_var_record(bf_writer_t *w, size_t hash_size, kv_pair_t *kv)
+{
+        var_lens_t *lens = var_lens(kv);
+        char *rec = bf_reserve(w, hash_size + sizeof(var_lens_t)
+                               + lens->key_len + lens->value_len);
+        // var_max only grows, so the blocks fit every record
+        assert(rec);
+        memcpy(rec, &kv->hash, hash_size);
+        rec += hash_size;
+        memcpy(rec, lens, sizeof(var_lens_t));
+        rec += sizeof(var_lens_t);
+        memcpy(rec, kv->key, lens->key_len);
+        memcpy(rec + lens->key_len, kv->value, lens->value_len);
+}
+
+// return the length of the variable-length record at rec, 0 if it does
+// not fit in the len bytes left
+static size_t var_record_size(const char *rec, size_t len, size_t hash_size)
+{
+        var_lens_t lens;
+        if (len < hash_size + sizeof(lens)) {
+                return 0;
+        }
+        memcpy(&lens, rec + hash_size, sizeof(lens));
+        size_t size = hash_size + sizeof(lens) + (size_t)lens.key_len + lens.value_len;
+        return size <= len ? size : 0;
+}
+
+// put the records of a block into a variable-length map
+static void unpack_var_records(map_t *m, const char *block, size_t len, size_t hash_size)
+{
+        size_t size;
+        for (; (size = var_record_size(block, len, hash_size)) > 0; block += size, len -= size) {
+                var_lens_t lens;
+                uint64_t hash;
+                memcpy(&lens, block + hash_size, sizeof(lens));
+                const char *key = block + hash_size + sizeof(lens);
+                if (hash_size) {
+                        memcpy(&hash, block, hash_size);
+                } else {
+                        hash = m->k2int(key, lens.key_len);
+                }
+                var_put_hash(m, key, lens.key_len, hash, key + lens.key_len, lens.value_len);
+        }
+}
+
+// open path and write the file header, return the descriptor, -1 on a
+// write error
+static int marshal_open(const char *path, map_t *m, int flags, uint64_t *file_flags)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        *file_flags = flags & MM_MARSHAL_HASH;
+        if (m->varlen) {
+                *file_flags |= MARSHAL_VARLEN;
+        }
+        uint64_t head[2] = {MARSHAL_MAGIC, ((uint64_t)MARSHAL_VERSION << 32) | *file_flags};
+        if (write(fd, head, sizeof(head)) != sizeof(head)) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+// a block writer for the records of m, starting with the meta block
+static bf_writer_t *marshal_writer(int fd, map_t *m, uint64_t file_flags, int flags,
+                                   uint64_t count)
+{
+        size_t hash_size = marshal_hash_size(file_flags);
+        size_t record_size = hash_size + m->key_size + m->value_size;
+        if (m->varlen) {
+                record_size = hash_size + sizeof(var_lens_t) + m->var_max;
+        }
+        // blocks hold the largest record, so bf_reserve never returns NULL
+        // for one
+        bf_writer_t *w = bf_writer_new(fd, record_size > BF_BLOCK_SIZE ? record_size : 0,
+                                       flags & MM_MARSHAL_BACKGROUND);
+        marshal_meta_t meta = {
+                .flags = file_flags,
+                .bucket_cap = m->bucket_cap,
+                .key_size = m->key_size,
+                .value_size = m->value_size,
+                .count = count,
+                .split_ratio = m->split_ratio,
+                .shrink_ratio = m->shrink_ratio,
+        };
+        memcpy(bf_reserve(w, sizeof(meta)), &meta, sizeof(meta));
+        bf_flush(w);
+        return w;
+}
+
+static int marshal_close(bf_writer_t *w, int fd, int flags)
+{
+        int ret = bf_writer_close(w);
+        if (ret == 0 && (flags & MM_MARSHAL_FSYNC) && fsync(fd) != 0) {
+                ret = -1;
+        }
+        if (close(fd) != 0) {
+                ret = -1;
+        }
+        return ret;
+}
+
+int mm_marshal_flags(const char *path, map_t *m, int flags)
+{
+        uint64_t file_flags;
+        int fd = marshal_open(path, m, flags, &file_flags);
+        if (fd < 0) {
+                return -1;
+        }
+        size_t hash_size = marshal_hash_size(file_flags);
+
+        lock_all(m);
+        bf_writer_t *w = marshal_writer(fd, m, file_flags, flags, m->used);
+
+        // dump the table
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                for (uint64_t i = 0; i < m->mf->count; i++) {
+                        const char *rec = mf_record(m->mf, i);
+                        put_record(w, m, hash_size, mf_record_hash(rec),
+                                   mf_record_key(rec), mf_record_value(m->mf, rec));
+                }
+        } else if (m->engine == MAP_ENGINE_FLAT) {
+                flat_table_t *ft = m->ft;
+                for (size_t i = 0; i < ft->capacity; i++) {
+                        if (!ft_is_full(ft, i)) {
+                                continue;
+                        }
+                        void *slot = ft_slot(ft, i);
+                        uint64_t hash = hash_size ? hash_key(m, slot) : 0;
+                        put_record(w, m, hash_size, hash, slot, (char *)slot + m->key_size);
+                }
+        } else {
+                for (int i = 0; i < m->s->len; i++) {
+                        list_t *list = *(list_t **)ss_getptr(m->s, i);
+                        node_t *node;
+                        for (ll_traverse(list, node)) {
+                                kv_pair_t *kv = (kv_pair_t *)node->item;
+                                if (m->varlen) {
+                                        put_var_record(w, hash_size, kv);
+                                } else {
+                                        put_record(w, m, hash_size, kv->hash, kv->key, kv->value);
+                                }
+                        }
+                }
+        }
+        unlock_all(m);
+
+        return marshal_close(w, fd, flags);
+}
+
+// split a block of records into the batch arrays, return the record count
+static size_t unpack_records(map_t *m, const char *block, size_t len, size_t hash_size,
+                             void *keys, void *vals, uint64_t *hashes)
+{
+        size_t record_size = hash_size + m->key_size + m->value_size;
+        size_t n = len / record_size;
+        for (size_t i = 0; i < n; i++) {
+                const char *rec = block + i * record_size;
+                if (hash_size) {
+                        memcpy(&hashes[i], rec, hash_size);
+                        rec += hash_size;
+                }
+                memcpy((char *)keys + i * m->key_size, rec, m->key_size);
+                memcpy((char *)vals + i * m->value_size, rec + m->key_size, m->value_size);
+                if (!hash_size) {
+                        hashes[i] = hash_key(m, rec);
+                }
+        }
+        return n;
+}
+
+static const char *block_error(long n)
+{
+        return n == BF_TRUNCATED ? "truncated" : "corrupt";
+}
+
+// the checksummed format, nothing is inserted unless the whole file checks out
+static int unmarshal_blocks(const char *path, FILE *fp, map_t *m)
+{
+        bf_reader_t *r = bf_reader_new(fp);
+        const char *err = NULL;
+        marshal_meta_t meta;
+        void *payload;
+        size_t record_size = 0;
+        uint64_t count = 0;
+
+        long n = bf_next(r, &payload);
+        if (n == sizeof(meta)) {
+                memcpy(&meta, payload, sizeof(meta));
+                record_size = marshal_hash_size(meta.flags) + meta.key_size + meta.value_size;
+                if (!(meta.flags & MARSHAL_VARLEN) != !m->varlen) {
+                        err = m->varlen ? "fixed-size keys" : "variable-length keys";
+                } else if (!m->varlen && (meta.key_size != m->key_size ||
+                                          meta.value_size != m->value_size)) {
+                        err = "key or value size does not match the map";
+                }
+        } else {
+                err = n < 0 ? block_error(n) : "corrupt";
+        }
+        while (!err && (n = bf_next(r, &payload)) > 0) {
+                if (m->varlen) {
+                        // the records have to cover the block exactly
+                        const char *rec = payload;
+                        size_t left = n, size;
+                        while ((size = var_record_size(rec, left, marshal_hash_size(meta.flags))) > 0) {
+                                rec += size;
+                                left -= size;
+                                count++;
+                        }
+                        if (left != 0) {
+                                err = "corrupt";
+                        }
+                        continue;
+                }
+                if (n % record_size != 0) {
+                        err = "corrupt";
+                }
+                count += n / record_size;
+        }
+        if (!err && n < 0) {
+                err = block_error(n);
+        }
+        if (!err && count != meta.count) {
+                err = "corrupt";
+        }
+        if (err) {
+                fprintf(stderr, "mm_unmarshal: %s: %s\n", path, err);
+                bf_reader_delete(r);
+                return -1;
+        }
+
+        // load metadata, the room in the entries of a variable-length map
+        // is up to the map
+        m->bucket_cap = meta.bucket_cap;
+        m->split_ratio = meta.split_ratio;
+        if (meta.shrink_ratio > 0) {
+                m->shrink_ratio = meta.shrink_ratio;
+        }
+        fix_shrink_ratio(m);
+        if (!m->varlen) {
+                m->key_size = meta.key_size;
+                m->value_size = meta.value_size;
+        }
+        mm_reserve(m, m->used + count);
+
+        // load data, one block per batch
+        size_t hash_size = marshal_hash_size(meta.flags);
+        size_t batch = 0;
+        void *keys = NULL, *vals = NULL;
+        uint64_t *hashes = NULL;
+        bf_rewind(r);
+        bf_next(r, &payload);
+        while ((n = bf_next(r, &payload)) > 0) {
+                if (m->varlen) {
+                        unpack_var_records(m, payload, n, hash_size);
+                        continue;
+                }
+                if (n / record_size > batch) {
+                        batch = n / record_size;
+                        keys = realloc(keys, batch * m->key_size + 1);
+                        vals = realloc(vals, batch * m->value_size + 1);
+                        hashes = realloc(hashes, batch * sizeof(uint64_t));
+                        if (!keys || !vals || !hashes) {
+                                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                        }
+                }
+                size_t nrec = unpack_records(m, payload, n, hash_size, keys, vals, hashes);
+                put_batch_hashed(m, keys, vals, hashes, nrec);
+        }
+        free(keys);
+        free(vals);
+        free(hashes);
+        bf_reader_delete(r);
+
+        // only if the file changed between the two passes
+        if (n < 0) {
+                fprintf(stderr, "mm_unmarshal: %s: %s\n", path, block_error(n));
+                return -1;
+        }
+        return 0;
+}
+
+// files from before the checksummed format, records follow the metadata
+static int unmarshal_legacy(const char *path, FILE *fp, map_t *m, uint64_t flags)
+{
+        if (m->varlen) {
+                fprintf(stderr, "mm_unmarshal: %s: fixed-size keys\n", path);
+                return -1;
+        }
+
+        // load metadata, every item was written as wide as a pointer, so
+        // split_ratio is followed by padding. These files have no shrink
+        // ratio, the map keeps its own.
+        // The slots were sized when the map was made, so the sizes have to
+        // match before anything goes into it.
+        size_t bucket_cap = 0, key_size = 0, value_size = 0;
+        float split_ratio = 0;
+        LOAD_ITEM(fp, &bucket_cap);
+        unused = fread(&split_ratio, sizeof(split_ratio), 1, fp);
+        fseek(fp, sizeof(void *) - sizeof(split_ratio), SEEK_CUR);
+        LOAD_ITEM(fp, &key_size);
+        LOAD_ITEM(fp, &value_size);
+        if (key_size != m->key_size || value_size != m->value_size) {
+                fprintf(stderr, "mm_unmarshal: %s: key or value size does not match the map\n", path);
+                return -1;
+        }
+        m->bucket_cap = bucket_cap;
+        m->split_ratio = split_ratio;
+        fix_shrink_ratio(m);
+
+        // the file size tells how many records follow the metadata
+        long data_start = ftell(fp);
+        fseek(fp, 0, SEEK_END);
+        size_t hash_size = marshal_hash_size(flags);
+        size_t record_size = hash_size + m->key_size + m->value_size;
+        size_t count = (size_t)(ftell(fp) - data_start) / record_size;
+        fseek(fp, data_start, SEEK_SET);
+        mm_reserve(m, m->used + count);
+
+        // load data
+        void *records = malloc(UNMARSHAL_BATCH * record_size);
+        void *keys = malloc(UNMARSHAL_BATCH * m->key_size + 1);
+        void *vals = malloc(UNMARSHAL_BATCH * m->value_size + 1);
+        uint64_t *hashes = malloc(UNMARSHAL_BATCH * sizeof(uint64_t));
+        if (!records || !keys || !vals || !hashes) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        while (count > 0) {
+                size_t n = count < UNMARSHAL_BATCH ? count : UNMARSHAL_BATCH;
+                n = fread(records, record_size, n, fp);
+                if (n == 0) {
+                        break;
+                }
+                n = unpack_records(m, records, n * record_size, hash_size, keys, vals, hashes);
+                put_batch_hashed(m, keys, vals, hashes, n);
+                count -= n;
+        }
+        free(records);
+        free(keys);
+        free(vals);
+        free(hashes);
+        return 0;
+}
+
+int mm_unmarshal(const char *path, map_t *m)
+{
+        if (read_only(m, "mm_unmarshal")) {
+                return -1;
+        }
+        FILE *fp = fopen(path, "rb");
+        if (!fp) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        // files without the magic come from before the header existed,
+        // files with version 0 from before the checksummed blocks
+        uint64_t magic = 0, word = 0;
+        int ret;
+        unused = fread(&magic, sizeof(magic), 1, fp);
+        if (magic != MARSHAL_MAGIC) {
+                rewind(fp);
+                ret = unmarshal_legacy(path, fp, m, 0);
+        } else if (fread(&word, sizeof(word), 1, fp) != 1) {
+                fprintf(stderr, "mm_unmarshal: %s: truncated\n", path);
+                ret = -1;
+        } else if ((word >> 32) == 0) {
+                ret = unmarshal_legacy(path, fp, m, word);
+        } else if ((word >> 32) == MARSHAL_VERSION) {
+                ret = unmarshal_blocks(path, fp, m);
+        } else {
+                fprintf(stderr, "mm_unmarshal: %s: unsupported version %llu\n",
+                        path, (unsigned long long)(word >> 32));
+                ret = -1;
+        }
+        fclose(fp);
+        return ret;
+}
+
+int mm_marshal_mapped(const char *path, map_t *m)
+{
+        if (wrong_mode(m, false, "mm_marshal_mapped")) {
+                return -1;
+        }
+        // only pointers are gathered, the entries stay where they are.
+        // The count is read once every writer is stopped, puts racing
+        // with the call would otherwise walk past the arrays.
+        lock_all(m);
+        size_t n = used_count(m);
+        uint64_t *hashes = malloc(n * sizeof(uint64_t) + 1);
+        const void **keys = malloc(n * sizeof(void *) + 1);
+        const void **values = malloc(n * sizeof(void *) + 1);
+        if (!hashes || !keys || !values) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        size_t i = 0;
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                for (; i < n; i++) {
+                        const char *rec = mf_record(m->mf, i);
+                        hashes[i] = mf_record_hash(rec);
+                        keys[i] = mf_record_key(rec);
+                        values[i] = mf_record_value(m->mf, rec);
+                }
+        } else if (m->engine == MAP_ENGINE_FLAT) {
+                flat_table_t *ft = m->ft;
+                for (size_t j = 0; j < ft->capacity; j++) {
+                        if (!ft_is_full(ft, j)) {
+                                continue;
+                        }
+                        keys[i] = ft_slot(ft, j);
+                        values[i] = (char *)keys[i] + m->key_size;
+                        hashes[i] = hash_key(m, keys[i]);
+                        i++;
+                }
+        } else {
+                for (int j = 0; j < m->s->len; j++) {
+                        list_t *list = *(list_t **)ss_getptr(m->s, j);
+                        node_t *node;
+                        for (ll_traverse(list, node)) {
+                                kv_pair_t *kv = (kv_pair_t *)node->item;
+                                hashes[i] = kv->hash;
+                                keys[i] = kv->key;
+                                values[i] = kv->value;
+                                i++;
+                        }
+                }
+        }
+        int ret = mf_write(path, m->key_size, m->value_size, i, hashes, keys, values);
+        unlock_all(m);
+
+        free(hashes);
+        free(keys);
+        free(values);
+        return ret;
+}
+
+map_t *mm_open_mapped(const char *path, key2int_t k2int, keycmp_t kcmp)
+{
+        mapped_file_t *mf = mf_open(path);
+        if (!mf) {
+                return NULL;
+        }
+
+        map_t *m;
+        NEW_INSTANCE(m, map_t);
+        m->al = &al_libc;
+        m->engine = MAP_ENGINE_MAPPED;
+        m->mf = mf;
+        m->cap = mf->nbuckets;
+        m->used = mf->count;
+        m->bucket_cap = DEFAULT_BUCKET_CAP;
+        m->split_ratio = SPLIT_RATIO;
+        m->shrink_ratio = SHRINK_RATIO;
+        m->resize_step = 1;
+        m->key_size = mf->key_size;
+        m->value_size = mf->value_size;
+        m->k2int = k2int ? k2int : hash_default(m->key_size);
+        m->kcmp = kcmp ? kcmp : memcmp;
+
+        // a different hash would make every lookup miss, catch it early
+        if (mf->count > 0) {
+                const char *rec = mf_record(mf, 0);
+                if (hash_key(m, mf_record_key(rec)) != mf_record_hash(rec)) {
+                        fprintf(stderr, "mm_open_mapped: %s: k2int does not match the file\n", path);
+                        delete_map(m);
+                        return NULL;
+                }
+        }
+        return m;
+}
+
+// reverse the bits of a word
+static inline uint64_t rev64(uint64_t v)
+{
+        v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+        v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+        v = ((v >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((v & 0x0f0f0f0f0f0f0f0fULL) << 4);
+        return __builtin_bswap64(v);
+}
+
+/*
+ * Next class of the linear engine, counting from the highest bit under
+ * mask down. Class b holds the hashes with hash & (cap - 1) == b, so it
+ * splits into b and b + cap when cap doubles, and both come after every
+ * class already visited. Halving cap merges them back into b, which may
+ * then be visited twice but never skipped.
+ */
+static inline uint64_t rev_increment(uint64_t v, uint64_t mask)
+{
+        v |= ~mask;
+        return rev64(rev64(v) + 1);
+}
+
+// i-th entry of the class b, in bucket b then in b + cap once b is split
+static kv_pair_t *class_entry(map_t *m, uint64_t b, size_t i)
+{
+        list_t *bucket = *(list_t **)ss_getptr(m->s, b);
+        if (i >= bucket->len && b < m->pos) {
+                i -= bucket->len;
+                bucket = *(list_t **)ss_getptr(m->s, b + m->cap);
+        }
+        if (i >= bucket->len) {
+                return NULL;
+        }
+        node_t *node;
+        for (ll_traverse(bucket, node)) {
+                if (i-- == 0) {
+                        break;
+                }
+        }
+        return (kv_pair_t *)node->item;
+}
+
+static bool iter_next_linear(map_iter_t *it, void **key, void **value)
+{
+        map_t *m = it->m;
+        for (;;) {
+                uint64_t mask = m->cap - 1;
+                kv_pair_t *kv = class_entry(m, it->cursor & mask, it->skip);
+                if (kv) {
+                        it->skip++;
+                        *key = kv->key;
+                        *value = kv->value;
+                        if (m->varlen) {
+                                it->key_len = var_lens(kv)->key_len;
+                                it->value_len = var_lens(kv)->value_len;
+                        }
+                        return true;
+                }
+                it->skip = 0;
+                it->cursor = rev_increment(it->cursor, mask);
+                if (it->cursor == 0) {
+                        return false;
+                }
+        }
+}
+
+static bool iter_next_flat(map_iter_t *it, void **key, void **value)
+{
+        map_t *m = it->m;
+        flat_table_t *ft = m->ft;
+        for (; it->cursor < ft->capacity; it->cursor++) {
+                if (ft_is_full(ft, it->cursor)) {
+                        char *slot = ft_slot(ft, it->cursor++);
+                        *key = slot;
+                        *value = slot + m->key_size;
+                        return true;
+                }
+        }
+        return false;
+}
+
+static bool iter_next_mapped(map_iter_t *it, void **key, void **value)
+{
+        mapped_file_t *mf = it->m->mf;
+        if (it->cursor >= mf->count) {
+                return false;
+        }
+        const char *rec = mf_record(mf, it->cursor++);
+        *key = (void *)mf_record_key(rec);
+        *value = (void *)mf_record_value(mf, rec);
+        return true;
+}
+
+// mm_iter_begin without the check, for callers holding every lock
+static void iter_init(map_t *m, map_iter_t *it)
+{
+        it->m = m;
+        it->cursor = 0;
+        it->skip = 0;
+        it->version = m->version;
+        it->done = false;
+}
+
+void mm_iter_begin(map_t *m, map_iter_t *it)
+{
+        iter_init(m, it);
+        if (m->sync) {
+                fprintf(stderr, "mm_iter_begin: not supported on concurrent maps, use mm_keyset\n");
+                it->done = true;
+        }
+}
+
+bool mm_iter_next(map_iter_t *it, void **key, void **value)
+{
+        if (it->done) {
+                return false;
+        }
+        map_t *m = it->m;
+        if (it->version != m->version) {
+                // entries moved since the last call, go over the current
+                // class again, or the whole table once it was rehashed
+                it->version = m->version;
+                it->skip = 0;
+                if (m->engine == MAP_ENGINE_FLAT) {
+                        it->cursor = 0;
+                }
+        }
+
+        bool found;
+        it->key_len = m->key_size;
+        it->value_len = m->value_size;
+        switch (m->engine) {
+        case MAP_ENGINE_FLAT:
+                found = iter_next_flat(it, key, value);
+                break;
+        case MAP_ENGINE_MAPPED:
+                found = iter_next_mapped(it, key, value);
+                break;
+        default:
+                found = iter_next_linear(it, key, value);
+                break;
+        }
+        it->done = !found;
+        return found;
+}
+
+// flat cursors carry the low byte of the version, a cursor from before a
+// rehash starts over
+#define FLAT_CURSOR_SHIFT 56
+
+uint64_t mm_iter_cursor(map_iter_t *it)
+{
+        if (it->done) {
+                return MAP_ITER_END;
+        }
+        if (it->m->engine == MAP_ENGINE_FLAT) {
+                return (it->version & 0xff) << FLAT_CURSOR_SHIFT | it->cursor;
+        }
+        return it->cursor;
+}
+
+void mm_iter_seek(map_t *m, map_iter_t *it, uint64_t cursor)
+{
+        mm_iter_begin(m, it);
+        if (it->done) {
+                return;
+        }
+        if (cursor == MAP_ITER_END) {
+                it->done = true;
+                return;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                uint64_t slot = cursor & (((uint64_t)1 << FLAT_CURSOR_SHIFT) - 1);
+                if (cursor >> FLAT_CURSOR_SHIFT == (m->version & 0xff)) {
+                        it->cursor = slot;
+                }
+                return;
+        }
+        it->cursor = cursor;
+}
+
+slice_t *mm_keyset(map_t *m)
+{
+        if (wrong_mode(m, false, "mm_keyset")) {
+                return NULL;
+        }
+        slice_t *s = make_slice(used_count(m), m->key_size, NULL);
+        map_iter_t it;
+        void *key, *value;
+
+        // nothing moves while every lock is held
+        lock_all(m);
+        iter_init(m, &it);
+        while (mm_iter_next(&it, &key, &value)) {
+                ss_append(s, key);
+        }
+        unlock_all(m);
+        return s;
+}
+
+typedef struct parallel_ctx_s {
+        map_t *m;
+        mm_visit_t visit;
+        mm_fold_t fold;
+        void *ctx;
+        // one accumulator or key slice per worker
+        char *accs;
+        size_t acc_stride;
+        slice_t *keys[TP_MAX_THREADS];
+}parallel_ctx_t;
+
+// what the walk is cut into: buckets, slots or records
+static size_t parallel_domain(map_t *m)
+{
+        switch (m->engine) {
+        case MAP_ENGINE_FLAT:
+                return m->ft->capacity;
+        case MAP_ENGINE_MAPPED:
+                return m->mf->count;
+        default:
+                return m->s->len;
+        }
+}
+
+static inline void parallel_entry(parallel_ctx_t *pc, size_t worker, void *key, void *value)
+{
+        if (pc->visit) {
+                pc->visit(key, value, pc->ctx);
+        } else if (pc->fold) {
+                pc->fold(pc->accs + worker * pc->acc_stride, key, value, pc->ctx);
+        } else {
+                ss_append(pc->keys[worker], key);
+        }
+}
+
+static void parallel_range(void *arg, size_t lo, size_t hi, size_t worker)
+{
+        parallel_ctx_t *pc = arg;
+        map_t *m = pc->m;
+        if (m->engine == MAP_ENGINE_FLAT) {
+                for (size_t i = lo; i < hi; i++) {
+                        if (ft_is_full(m->ft, i)) {
+                                char *slot = ft_slot(m->ft, i);
+                                parallel_entry(pc, worker, slot, slot + m->key_size);
+                        }
+                }
+                return;
+        }
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                for (size_t i = lo; i < hi; i++) {
+                        const char *rec = mf_record(m->mf, i);
+                        parallel_entry(pc, worker, (void *)mf_record_key(rec),
+                                       (void *)mf_record_value(m->mf, rec));
+                }
+                return;
+        }
+        for (size_t b = lo; b < hi; b++) {
+                list_t *bucket = *(list_t **)ss_getptr(m->s, b);
+                node_t *node;
+                for (ll_traverse(bucket, node)) {
+                        kv_pair_t *kv = node->item;
+                        parallel_entry(pc, worker, kv->key, kv->value);
+                }
+        }
+}
+
+// nothing moves while every lock is held
+static void parallel_walk(map_t *m, parallel_ctx_t *pc, size_t nthreads)
+{
+        lock_all(m);
+        tp_for(tp_default(), parallel_domain(m), PARALLEL_GRAIN, nthreads, parallel_range, pc);
+        unlock_all(m);
+}
+
+int mm_parallel_foreach(map_t *m, mm_visit_t fn, void *ctx, size_t nthreads)
+{
+        if (wrong_mode(m, false, "mm_parallel_foreach")) {
+                return -1;
+        }
+        parallel_ctx_t pc = {
+                .m = m,
+                .visit = fn,
+                .ctx = ctx,
+        };
+        parallel_walk(m, &pc, nthreads);
+        return 0;
+}
+
+int mm_parallel_reduce(map_t *m, size_t acc_size, mm_fold_t fold, mm_combine_t combine,
+                       void *result, void *ctx, size_t nthreads)
+{
+        if (wrong_mode(m, false, "mm_parallel_reduce")) {
+                return -1;
+        }
+        // accumulators on lines of their own
+        parallel_ctx_t pc = {
+                .m = m,
+                .fold = fold,
+                .ctx = ctx,
+                .acc_stride = (acc_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE,
+        };
+        if (posix_memalign((void **)&pc.accs, CACHE_LINE, TP_MAX_THREADS * pc.acc_stride) != 0) {
+                error_at_line(-1, ENOMEM, __FILE__, __LINE__, NULL);
+        }
+        for (int i = 0; i < TP_MAX_THREADS; i++) {
+                memcpy(pc.accs + i * pc.acc_stride, result, acc_size);
+        }
+        parallel_walk(m, &pc, nthreads);
+        // workers that got nothing still hold the identity
+        for (int i = 0; i < TP_MAX_THREADS; i++) {
+                combine(result, pc.accs + i * pc.acc_stride, ctx);
+        }
+        free(pc.accs);
+        return 0;
+}
+
+slice_t *mm_parallel_keyset(map_t *m, size_t nthreads)
+{
+        if (wrong_mode(m, false, "mm_parallel_keyset")) {
+                return NULL;
+        }
+        parallel_ctx_t pc = {
+                .m = m,
+        };
+        for (int i = 0; i < TP_MAX_THREADS; i++) {
+                pc.keys[i] = make_slice(16, m->key_size, NULL);
+        }
+        lock_all(m);
+        size_t n = used_count(m);
+        tp_for(tp_default(), parallel_domain(m), PARALLEL_GRAIN, nthreads, parallel_range, &pc);
+        unlock_all(m);
+
+        slice_t *s = make_slice(n, m->key_size, NULL);
+        for (int i = 0; i < TP_MAX_THREADS; i++) {
+                if (pc.keys[i]->len > 0) {
+                        memcpy((char *)s->array + s->len * s->item_size, pc.keys[i]->array,
+                               pc.keys[i]->len * s->item_size);
+                        s->len += pc.keys[i]->len;
+                }
+                delete_slice(pc.keys[i]);
+        }
+        return s;
+}
+
+map_snapshot_t *mm_snapshot(map_t *m)
+{
+        if (m->engine != MAP_ENGINE_LINEAR || m->sync || m->varlen) {
+                fprintf(stderr, "mm_snapshot: only linear maps that are neither "
+                        "concurrent nor variable-length\n");
+                return NULL;
+        }
+        if (live_snapshot(m)) {
+                fprintf(stderr, "mm_snapshot: the map has a snapshot not released yet\n");
+                return NULL;
+        }
+        map_snapshot_t *snap;
+        NEW_INSTANCE(snap, map_snapshot_t);
+        snap->m = m;
+        snap->len = m->s->len;
+        snap->used = m->used;
+        // zeroed pages, nothing is touched until a bucket is saved
+        snap->saved = calloc(snap->len, sizeof(snap_bucket_t *));
+        if (!snap->saved) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        pthread_mutex_init(&snap->mu, NULL);
+        m->snap = snap;
+        return snap;
+}
+
+void mm_snapshot_release(map_snapshot_t *snap)
+{
+        __atomic_store_n(&snap->released, true, __ATOMIC_RELEASE);
+}
+
+typedef void (*snap_record_fn_t)(map_t *m, const char *rec, void *ctx);
+
+// call fn for the records of every bucket, the buckets the map still
+// holds are copied out while the directory cannot change
+static void snap_walk(map_snapshot_t *snap, snap_record_fn_t fn, void *ctx)
+{
+        map_t *m = snap->m;
+        size_t rs = snap_record_size(m);
+        slice_t *scratch = make_slice(16, rs, NULL);
+        for (size_t b = 0; b < snap->len; b++) {
+                const char *records;
+                size_t n;
+                pthread_mutex_lock(&snap->mu);
+                snap_bucket_t *sb = snap->saved[b];
+                if (sb) {
+                        // saved buckets never change
+                        records = sb->records;
+                        n = sb->n;
+                } else {
+                        list_t *list = *(list_t **)ss_getptr(m->s, b);
+                        ss_reserve(scratch, list->len);
+                        copy_bucket(m, list, scratch->array);
+                        records = scratch->array;
+                        n = list->len;
+                }
+                pthread_mutex_unlock(&snap->mu);
+
+                for (size_t i = 0; i < n; i++) {
+                        fn(m, records + i * rs, ctx);
+                }
+        }
+        delete_slice(scratch);
+}
+
+static inline void *record_key(const char *rec)
+{
+        return (char *)rec + sizeof(uint64_t);
+}
+
+static inline void *record_value(map_t *m, const char *rec)
+{
+        return (char *)rec + sizeof(uint64_t) + ALIGN8(m->key_size);
+}
+
+typedef struct snap_visit_s {
+        mm_visit_t fn;
+        void *ctx;
+}snap_visit_t;
+
+static void visit_record(map_t *m, const char *rec, void *arg)
+{
+        snap_visit_t *v = arg;
+        v->fn(record_key(rec), record_value(m, rec), v->ctx);
+}
+
+int mm_snapshot_foreach(map_snapshot_t *snap, mm_visit_t fn, void *ctx)
+{
+        snap_visit_t v = {
+                .fn = fn,
+                .ctx = ctx,
+        };
+        snap_walk(snap, visit_record, &v);
+        return 0;
+}
+
+typedef struct snap_marshal_s {
+        bf_writer_t *w;
+        size_t hash_size;
+}snap_marshal_t;
+
+static void marshal_record(map_t *m, const char *rec, void *arg)
+{
+        snap_marshal_t *sm = arg;
+        uint64_t hash;
+        memcpy(&hash, rec, sizeof(hash));
+        put_record(sm->w, m, sm->hash_size, hash, record_key(rec), record_value(m, rec));
+}
+
+int mm_snapshot_marshal(const char *path, map_snapshot_t *snap, int flags)
+{
+        uint64_t file_flags;
+        int fd = marshal_open(path, snap->m, flags, &file_flags);
+        if (fd < 0) {
+                return -1;
+        }
+        snap_marshal_t sm = {
+                .w = marshal_writer(fd, snap->m, file_flags, flags, snap->used),
+                .hash_size = marshal_hash_size(file_flags),
+        };
+        snap_walk(snap, marshal_record, &sm);
+        return marshal_close(sm.w, fd, flags);
+}
+
+static inline void add_chain(map_stats_t *stats, size_t n)
+{
+        stats->chain_hist[n < MM_CHAIN_HIST ? n : MM_CHAIN_HIST - 1]++;
+        if (n > stats->max_chain) {
+                stats->max_chain = n;
+        }
+}
+
+static void linear_stats(map_t *m, map_stats_t *stats)
+{
+        size_t len = m->s->len;
+        uint64_t hit_probes = 0;
+        double miss_probes = 0;
+        for (size_t b = 0; b < len; b++) {
+                size_t n = (*(list_t **)ss_getptr(m->s, b))->len;
+                add_chain(stats, n);
+                hit_probes += n * (n + 1) / 2;
+                // a split bucket holds half the hash space of the others
+                miss_probes += (b < m->pos || b >= m->cap) ? n / 2.0 : n;
+        }
+        stats->buckets = len;
+        stats->probes_per_hit = stats->entries ? (double)hit_probes / stats->entries : 0;
+        stats->probes_per_miss = miss_probes / m->cap;
+
+        size_t nspares = m->spare_buckets ? m->spare_buckets->len : 0;
+        stats->heap_bytes = sizeof(map_t) + sizeof(slice_t)
+                + m->s->cap * sizeof(list_t *)
+                + (len + nspares) * (sizeof(list_t) + 2 * sizeof(node_t))
+                + m->arena.size;
+        if (m->sync) {
+                // every entry is a malloc of its own
+                stats->heap_bytes += sizeof(map_sync_t) + stats->entries * m->slab.slot_size;
+        } else {
+                stats->heap_bytes += m->slab.nslabs * m->slab.slots_per_slab * m->slab.slot_size;
+        }
+}
+
+static void mapped_stats(map_t *m, map_stats_t *stats)
+{
+        mapped_file_t *mf = m->mf;
+        uint64_t hit_probes = 0, miss_probes = 0;
+        for (uint64_t b = 0; b < mf->nbuckets; b++) {
+                uint64_t n = mf->offsets[b + 1] - mf->offsets[b];
+                add_chain(stats, n);
+                hit_probes += n * (n + 1) / 2;
+                miss_probes += n;
+        }
+        stats->buckets = mf->nbuckets;
+        stats->probes_per_hit = mf->count ? (double)hit_probes / mf->count : 0;
+        stats->probes_per_miss = (double)miss_probes / mf->nbuckets;
+        stats->heap_bytes = sizeof(map_t) + sizeof(mapped_file_t);
+        stats->mapped_bytes = mf->size;
+}
+
+int mm_stats(map_t *m, map_stats_t *stats)
+{
+        memset(stats, 0, sizeof(*stats));
+        stats->engine = m->engine;
+
+        lock_all(m);
+        stats->entries = used_count(m);
+        stats->load = get_usage(m);
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                mapped_stats(m, stats);
+        } else if (m->engine == MAP_ENGINE_FLAT) {
+                ft_stats(m, stats);
+        } else {
+                linear_stats(m, stats);
+        }
+        stats->splits = m->splits;
+        stats->shrinks = m->shrinks;
+        unlock_all(m);
+
+        // lookups keep counting meanwhile
+        map_counters_t *c = &m->counters;
+        stats->counters.hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+        stats->counters.misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+        stats->counters.hit_probes = __atomic_load_n(&c->hit_probes, __ATOMIC_RELAXED);
+        stats->counters.miss_probes = __atomic_load_n(&c->miss_probes, __ATOMIC_RELAXED);
+        if (stats->counters.hits) {
+                stats->measured_probes_per_hit =
+                        (double)stats->counters.hit_probes / stats->counters.hits;
+        }
+        if (stats->counters.misses) {
+                stats->measured_probes_per_miss =
+                        (double)stats->counters.miss_probes / stats->counters.misses;
+        }
+        if (stats->entries) {
+                stats->bytes_per_entry = (double)(stats->heap_bytes + stats->mapped_bytes)
+                        / stats->entries;
+        }
+        return 0;
+}
+
+// the first bytes in hex, keys and values can be anything
+static void print_bytes(const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        for (size_t i = 0; i < len && i < 8; i++) {
+                printf("%02x", p[i]);
+        }
+        if (len > 8) {
+                printf("..");
+        }
+}
+
+static void print_entry(const void *key, size_t key_len, const void *value, size_t value_len)
+{
+        printf("[");
+        print_bytes(key, key_len);
+        printf("] => ");
+        print_bytes(value, value_len);
+        printf(" ");
+}
+
+static void print_entries(map_t *m)
+{
+        printf("content:\n");
+        if (m->engine == MAP_ENGINE_MAPPED) {
+                mapped_file_t *mf = m->mf;
+                for (uint64_t b = 0; b < mf->nbuckets; b++) {
+                        if (mf->offsets[b] == mf->offsets[b + 1]) {
+                                continue;
+                        }
+                        printf("bucket[%2llu]: ", (unsigned long long)b);
+                        for (uint64_t i = mf->offsets[b]; i < mf->offsets[b + 1]; i++) {
+                                const char *rec = mf_record(mf, i);
+                                print_entry(mf_record_key(rec), m->key_size,
+                                            mf_record_value(mf, rec), m->value_size);
+                        }
+                        printf("\n");
+                }
+                return;
+        }
+        if (m->engine == MAP_ENGINE_FLAT) {
+                flat_table_t *ft = m->ft;
+                for (size_t i = 0; i < ft->capacity; i++) {
+                        if (!ft_is_full(ft, i)) {
+                                continue;
+                        }
+                        char *slot = ft_slot(ft, i);
+                        printf("slot[%2zu]: ", i);
+                        print_entry(slot, m->key_size, slot + m->key_size, m->value_size);
+                        printf("\n");
+                }
+                return;
+        }
+
+        lock_all(m);
+        for (int i = 0; i < m->s->len; i++) {
+                list_t *list = *(list_t **)ss_getptr(m->s, i);
+                node_t *node;
+                if (list->len == 0) {
+                        continue;
+                }
+                printf("index[%2d]: ", i);
+                for (ll_traverse(list, node)) {
+                        kv_pair_t *kv = (kv_pair_t *)node->item;
+                        if (m->varlen) {
+                                print_entry(kv->key, var_lens(kv)->key_len,
+                                            kv->value, var_lens(kv)->value_len);
+                        } else {
+                                print_entry(kv->key, m->key_size, kv->value, m->value_size);
+                        }
+                }
+                printf("\n");
+        }
+        unlock_all(m);
+}
+
+void mm_print_map(map_t *m, bool verbose)
+{
+        map_stats_t stats;
+        mm_stats(m, &stats);
+
+        printf("map statistics:\n");
+        printf("cap: %zu, used: %zu, bucket_cap: %zu, usage: %.2f, split_ratio: %.2f, pos: %llu\n",
+               m->cap, stats.entries, m->bucket_cap, stats.load, m->split_ratio,
+               (unsigned long long)m->pos);
+        printf("buckets: %zu, max chain: %zu, probes per hit: %.2f, per miss: %.2f\n",
+               stats.buckets, stats.max_chain, stats.probes_per_hit, stats.probes_per_miss);
+        printf("chains:");
+        for (int i = 0; i < MM_CHAIN_HIST; i++) {
+                if (stats.chain_hist[i]) {
+                        printf(" %d%s: %zu", i, i == MM_CHAIN_HIST - 1 ? "+" : "",
+                               stats.chain_hist[i]);
+                }
+        }
+        printf("\n");
+        printf("splits: %llu, shrinks: %llu, heap bytes: %zu, mapped bytes: %zu, bytes per entry: %.1f\n",
+               (unsigned long long)stats.splits, (unsigned long long)stats.shrinks,
+               stats.heap_bytes, stats.mapped_bytes, stats.bytes_per_entry);
+        if (verbose) {
+                print_entries(m);
+        }
+        printf("\n");
+}
+
+#ifdef TESTMAP
+// testing
+#include <sys/stat.h>
+
+static int toint_calls;
+
+uint64_t toint(const void *key, size_t key_size)
+{
+        toint_calls++;
+        return (uint64_t)*(int *)key;
+}
+
+// the worst k2int
+static uint64_t same_hash(const void *key, size_t key_size)
 {
-        slice_t *s = make_slice(m->used, m->key_size, NULL);
-        kv_pair_t kv;
+        return 42;
+}
 
-        for (int i = 0; i < m->s->len; i++) {
-                node_t *node;
-                list_t *list = *(list_t **)ss_getptr(m->s, i);
-                for (ll_traverse(list, node)) {
-                        ll_get_node_item(list, node, &kv);
-                        ss_append(s, kv.key);
+// splits and shrinks over 100 deletes and puts of the same key, right
+// after a split
+static int churn_resizes(map_opts_t *opts)
+{
+        map_t *m = make_map_opts(sizeof(int), sizeof(int), toint, NULL, opts);
+        int k = 0;
+        while (bucket_count(m) < 4 * DEFAULT_INIT_CAP) {
+                mm_put(m, &k, &k);
+                k++;
+        }
+        k--;
+        int resizes = 0;
+        for (int i = 0; i < 100; i++) {
+                size_t len = bucket_count(m);
+                if (i % 2 == 0) {
+                        mm_delete(m, &k);
+                } else {
+                        mm_put(m, &k, &k);
                 }
+                resizes += bucket_count(m) != len;
         }
-        return s;
+        delete_map(m);
+        return resizes;
 }
 
-void mm_print_map(map_t *m, bool verbose)
+// parallel walks: add up the keys, and double the values in place
+static void sum_keys(void *key, void *value, void *ctx)
 {
-        printf("map statistics:\n");
-        printf("cap: %zu, used: %zu, bucket_cap: %zu, usage: %.2f, split_ratio: %.2f, pos: %llu\n",
-               m->cap, m->used, m->bucket_cap, get_usage(m), m->split_ratio, m->pos);
-        printf("underlying slice statistics:\n");
-        printf("len: %zu, cap: %zu\n",
-               m->s->len, m->s->cap);
-
-        if (verbose) {
-                printf("content:\n");
-
-                for (int i = 0; i < m->s->len; i++) {
-                        list_t *list = *(list_t **)ss_getptr(m->s, i);
-                        node_t *node;
-                        if (list->len > 0) {
-                                printf("index[%2d]: ", i);
-                        }
-                        for (ll_traverse(list, node)) {
-                                kv_pair_t *kv = (kv_pair_t *)node->item;
-                                printf("[%d] => %d ",
-                                       *(int *)kv->key, *(int *)kv->value);
-                        }
-                        if (list->len > 0) {
-                                printf("\n");
-                        }
-                }
-        }
-        printf("\n");
+        __atomic_add_fetch((int64_t *)ctx, *(int *)key, __ATOMIC_RELAXED);
+        *(int *)value *= 2;
 }
 
-#ifdef TESTMAP
-// testing
+static void fold_sum(void *acc, void *key, void *value, void *ctx)
+{
+        ((int64_t *)acc)[0] += *(int *)key;
+        ((int64_t *)acc)[1] += *(int *)value;
+}
 
-uint64_t toint(const void *key, size_t key_size)
+static void combine_sum(void *acc, const void *other, void *ctx)
 {
-        return (uint64_t)*(int *)key;
+        ((int64_t *)acc)[0] += ((const int64_t *)other)[0];
+        ((int64_t *)acc)[1] += ((const int64_t *)other)[1];
 }
 
-int main(int argc, char *argv[])
+static void test_engine(map_engine_t engine, bool concurrent)
 {
+        map_opts_t opts = {
+                .engine = engine,
+                .concurrent = concurrent,
+        };
+
         ///////////////////////////////////////////////////
         //                 simple test                   //
         ///////////////////////////////////////////////////
 
         printf("=== RUN Simple Test\n");
-        map_t *m = make_map(sizeof(int), sizeof(int), toint, NULL);
+        map_t *m = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
         //printf("after make:\n");
         //mm_print_map(m);
 
@@ -531,6 +3115,10 @@ int main(int argc, char *argv[])
                         assert(!mm_haskey(m, &k));
                         assert(!mm_get(m, &k, &getValue));
                 }
+                // every deleted entry went back to the slab
+                if (engine == MAP_ENGINE_LINEAR) {
+                        assert(m->slab.used == m->used);
+                }
                 printf("--- PASS ---\n");
 
                 printf("=== RUN Get Test ===\n");
@@ -569,7 +3157,7 @@ int main(int argc, char *argv[])
         mm_marshal("test.txt", m);
         delete_map(m);
 
-        map_t *mm = make_map(sizeof(int), sizeof(int), toint, NULL);
+        map_t *mm = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
         mm_unmarshal("test.txt", mm);
         //mm_print_map(mm, true);
         for (ll_traverse(queue, node)) {
@@ -578,11 +3166,148 @@ int main(int argc, char *argv[])
                 ll_get_node_item(queue, node, &v);
                 k = v;
 
-                assert(mm_haskey(m, &k));
+                assert(mm_haskey(mm, &k));
                 assert(mm_get(mm, &k, &getValue));
                 assert(getValue == v);
         }
 
+        // with the hashes persisted, loading never calls k2int
+        mm_marshal_flags("test.txt", mm, MM_MARSHAL_HASH);
+        map_t *mh = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        toint_calls = 0;
+        mm_unmarshal("test.txt", mh);
+        assert(toint_calls == 0);
+        assert(mh->used == mm->used);
+        for (ll_traverse(queue, node)) {
+                int k;
+                int v, getValue;
+                ll_get_node_item(queue, node, &v);
+                k = v;
+
+                assert(mm_get(mh, &k, &getValue));
+                assert(getValue == v);
+        }
+        delete_map(mh);
+
+        // the background writer produces the same file
+        assert(mm_marshal_flags("test.txt", mm, MM_MARSHAL_BACKGROUND | MM_MARSHAL_FSYNC) == 0);
+        mh = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        assert(mm_unmarshal("test.txt", mh) == 0);
+        assert(mh->used == mm->used);
+        delete_map(mh);
+
+        // a flipped byte or a cut file loads nothing
+        FILE *fp = fopen("test.txt", "r+b");
+        fseek(fp, -12, SEEK_END);
+        int c = fgetc(fp);
+        fseek(fp, -12, SEEK_END);
+        fputc(c ^ 1, fp);
+        fclose(fp);
+        mh = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        assert(mm_unmarshal("test.txt", mh) == -1);
+        assert(mh->used == 0);
+        mm_marshal("test.txt", mm);
+        struct stat st;
+        stat("test.txt", &st);
+        assert(truncate("test.txt", st.st_size - 1) == 0);
+        assert(mm_unmarshal("test.txt", mh) == -1);
+        assert(mh->used == 0);
+        delete_map(mh);
+
+        // files from before the checksummed format still load. Every
+        // item was written 8 bytes wide, split_ratio with 4 bytes of zero
+        // padding, and there is no shrink ratio.
+        fp = fopen("test.txt", "wb");
+        uint64_t legacy[4] = {mm->bucket_cap, 0, mm->key_size, mm->value_size};
+        float legacy_split = 0.5;
+        memcpy(&legacy[1], &legacy_split, sizeof(legacy_split));
+        fwrite(legacy, sizeof(legacy), 1, fp);
+        for (int k = 0; k < 10000; k++) {
+                fwrite(&k, sizeof(k), 1, fp);
+                fwrite(&k, sizeof(k), 1, fp);
+        }
+        fclose(fp);
+        mh = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        float own_shrink = mh->shrink_ratio;
+        assert(mm_unmarshal("test.txt", mh) == 0);
+        assert(mh->used == 10000 && mh->split_ratio == legacy_split);
+        assert(mh->shrink_ratio == own_shrink && mh->shrink_ratio > 0);
+        if (engine == MAP_ENGINE_LINEAR) {
+                // and the map still shrinks
+                for (int k = 0; k < 9990; k++) {
+                        assert(mm_delete(mh, &k));
+                }
+                assert(mh->shrinks > 0);
+        }
+        delete_map(mh);
+
+        // but not into a map of other sizes, nor with empty records
+        mh = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        uint64_t sizes[][2] = {{256, 256}, {0, 0}};
+        for (int i = 0; i < 2; i++) {
+                fp = fopen("test.txt", "wb");
+                legacy[2] = sizes[i][0];
+                legacy[3] = sizes[i][1];
+                fwrite(legacy, sizeof(legacy), 1, fp);
+                char big[512] = {0};
+                for (int k = 0; k < 100; k++) {
+                        fwrite(big, sizeof(big), 1, fp);
+                }
+                fclose(fp);
+                assert(mm_unmarshal("test.txt", mh) == -1);
+                assert(mh->used == 0 && mh->split_ratio != legacy_split);
+        }
+        delete_map(mh);
+
+        printf("--- PASS ---\n");
+
+        ///////////////////////////////////////////////////
+        //                mapped file test               //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Mapped File Test ===\n");
+        assert(mm_marshal_mapped("test.mapped", mm) == 0);
+        map_t *mp = mm_open_mapped("test.mapped", toint, NULL);
+        assert(mp && mp->used == mm->used);
+        for (ll_traverse(queue, node)) {
+                int k;
+                int v, getValue;
+                ll_get_node_item(queue, node, &v);
+                k = v;
+
+                assert(mm_haskey(mp, &k));
+                assert(mm_get(mp, &k, &getValue));
+                assert(getValue == v);
+        }
+        int absent = -1;
+        assert(!mm_haskey(mp, &absent));
+        assert(mm_put(mp, &absent, &absent) == -1);
+        assert(!mm_delete(mp, &absent));
+
+        slice_t *mkeys = mm_keyset(mp);
+        assert(mkeys->len == mm->used);
+        delete_slice(mkeys);
+
+        map_stats_t mst;
+        mm_stats(mp, &mst);
+        assert(mst.entries == mm->used && mst.mapped_bytes > mst.entries * 2 * sizeof(int));
+
+        // a mapped map marshals back to the regular format
+        mm_marshal_flags("test.txt", mp, MM_MARSHAL_HASH);
+        mh = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        mm_unmarshal("test.txt", mh);
+        assert(mh->used == mm->used);
+        delete_map(mh);
+        delete_map(mp);
+
+        // the wrong hash or a cut file are refused
+        assert(mm_open_mapped("test.mapped", hash_int32, NULL) == NULL);
+        assert(truncate("test.mapped", sizeof(mf_header_t) + 8) == 0);
+        assert(mm_open_mapped("test.mapped", toint, NULL) == NULL);
+        unlink("test.mapped");
+        // so are a missing file and one that cannot be mapped
+        assert(mm_open_mapped("test.mapped", toint, NULL) == NULL);
+        assert(mm_open_mapped(".", toint, NULL) == NULL);
         printf("--- PASS ---\n");
 
         //mm = make_map(sizeof(int), sizeof(int), toint, NULL);
@@ -592,6 +3317,706 @@ int main(int argc, char *argv[])
 
         delete_map(mm);
         ll_delete_list(queue);
+
+        ///////////////////////////////////////////////////
+        //             reserve/batch test                //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Reserve/Batch Test ===\n");
+        const int nbatch = 10000;
+        int *keys = malloc(nbatch * sizeof(int));
+        int *vals = malloc(nbatch * sizeof(int));
+        for (int i = 0; i < nbatch; i++) {
+                // every key shows up twice, the later value has to win
+                keys[i] = i % (nbatch / 2);
+                vals[i] = i;
+        }
+
+        m = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        for (int i = 0; i < 100; i++) {
+                mm_put(m, &i, &i);
+        }
+        assert(mm_reserve(m, nbatch) == 0);
+        size_t reserved_cap = m->cap;
+        assert(mm_put_batch(m, keys, vals, nbatch) == 0);
+        assert(m->cap == reserved_cap);
+        assert(m->used == nbatch / 2);
+        for (int i = 0; i < nbatch / 2; i++) {
+                int v;
+                assert(mm_get(m, &i, &v));
+                assert(v == i + nbatch / 2);
+        }
+
+        // keys past nbatch / 2 are missing, their values stay untouched
+        bool *found = malloc(nbatch * sizeof(bool));
+        for (int i = 0; i < nbatch; i++) {
+                keys[i] = nbatch - 1 - i;
+                vals[i] = -1;
+        }
+        assert(mm_get_batch(m, keys, nbatch, vals, found) == nbatch / 2);
+        for (int i = 0; i < nbatch; i++) {
+                bool hit = keys[i] < nbatch / 2;
+                assert(found[i] == hit);
+                assert(vals[i] == (hit ? keys[i] + nbatch / 2 : -1));
+        }
+        if (engine == MAP_ENGINE_FLAT) {
+                // any batch length, the hashes are not kept for all keys
+                void **slots = malloc(nbatch * sizeof(void *));
+                ft_find_batch(m, keys, nbatch, slots);
+                for (int i = 0; i < nbatch; i++) {
+                        assert((slots[i] != NULL) == (keys[i] < nbatch / 2));
+                        assert(!slots[i] || *(int *)slots[i] == keys[i]);
+                }
+                free(slots);
+        }
+        free(found);
+        delete_map(m);
+        free(keys);
+        free(vals);
+        printf("--- PASS ---\n");
+
+        ///////////////////////////////////////////////////
+        //                 iterator test                 //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Iterator Test ===\n");
+        const int niter = 5000;
+        char *seen = calloc(3 * niter, 1);
+        map_iter_t it;
+        void *ik, *iv;
+        m = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &opts);
+        for (int i = 0; i < niter; i++) {
+                mm_put(m, &i, &i);
+        }
+        mm_iter_begin(m, &it);
+        if (concurrent) {
+                assert(!mm_iter_next(&it, &ik, &iv));
+        } else {
+                // a quiet map: every entry exactly once, in place
+                int n = 0;
+                while (mm_iter_next(&it, &ik, &iv)) {
+                        assert(*(int *)ik == *(int *)iv);
+                        assert(seen[*(int *)ik]++ == 0);
+                        n++;
+                }
+                assert(n == niter);
+                assert(mm_iter_cursor(&it) == MAP_ITER_END);
+
+                // delete odd keys as they come, insert enough to split and rehash
+                memset(seen, 0, 3 * niter);
+                int next_key = niter;
+                mm_iter_begin(m, &it);
+                while (mm_iter_next(&it, &ik, &iv)) {
+                        int k = *(int *)ik;
+                        seen[k] = 1;
+                        if (k < niter && k % 2) {
+                                assert(mm_delete(m, &k));
+                        } else if (next_key < 3 * niter) {
+                                mm_put(m, &next_key, &next_key);
+                                next_key++;
+                        }
+                }
+                for (int i = 0; i < niter; i++) {
+                        assert(seen[i]);
+                }
+                assert(m->used == niter / 2 + next_key - niter);
+
+                // scan in chunks, each from a fresh iterator
+                memset(seen, 0, 3 * niter);
+                uint64_t cursor = 0;
+                do {
+                        mm_iter_seek(m, &it, cursor);
+                        for (int j = 0; j < 100 && mm_iter_next(&it, &ik, &iv); j++) {
+                                seen[*(int *)ik] = 1;
+                        }
+                        cursor = mm_iter_cursor(&it);
+                } while (cursor != MAP_ITER_END);
+                for (int i = 0; i < 3 * niter; i++) {
+                        assert(seen[i] == mm_haskey(m, &i));
+                }
+        }
+        free(seen);
+        delete_map(m);
+        printf("--- PASS ---\n");
+
+        ///////////////////////////////////////////////////
+        //              variable-length test             //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Variable-length Test ===\n");
+        opts.varlen = true;
+        m = make_map_opts(16, 8, NULL, NULL, &opts);
+        if (engine != MAP_ENGINE_LINEAR || concurrent) {
+                assert(m == NULL);
+        } else {
+                const int nvar = 5000;
+                char key[128], val[128];
+                void *vp;
+                size_t vlen;
+                for (int i = 0; i < nvar; i++) {
+                        // keys from 5 to 96 bytes, values from 0 to 63
+                        int klen = snprintf(key, sizeof(key), "%d-", i);
+                        memset(key + klen, 'k', i % 92);
+                        memset(val, 'a' + i % 26, i % 64);
+                        assert(mm_put_var(m, key, klen + i % 92, val, i % 64) == 0);
+                }
+                assert(m->used == nvar && m->arena.allocated > 0);
+
+                // a key is its bytes and its length, a prefix is another key
+                for (int i = 0; i < nvar; i++) {
+                        int klen = snprintf(key, sizeof(key), "%d-", i);
+                        memset(key + klen, 'k', i % 92);
+                        assert(mm_get_var(m, key, klen + i % 92, &vp, &vlen));
+                        assert(vlen == i % 64);
+                        for (size_t j = 0; j < vlen; j++) {
+                                assert(((char *)vp)[j] == 'a' + i % 26);
+                        }
+                        if (i % 92) {
+                                assert(!mm_get_var(m, key, klen + i % 92 - 1, NULL, NULL));
+                        }
+                }
+
+                // the fixed-size calls refuse the map
+                int k = 1;
+                assert(mm_put(m, &k, &k) == -1);
+                assert(!mm_haskey(m, &k));
+                assert(mm_keyset(m) == NULL);
+
+                // iterate with the lengths
+                map_iter_t vit;
+                void *vk;
+                size_t total = 0;
+                int nseen = 0;
+                mm_iter_begin(m, &vit);
+                while (mm_iter_next(&vit, &vk, &vp)) {
+                        assert(mm_get_var(m, vk, vit.key_len, NULL, &vlen));
+                        assert(vlen == vit.value_len);
+                        total += vit.key_len + vit.value_len;
+                        nseen++;
+                }
+                assert(nseen == nvar);
+
+                // marshal and back, with and without the hashes
+                for (int flags = 0; flags <= MM_MARSHAL_HASH; flags += MM_MARSHAL_HASH) {
+                        assert(mm_marshal_flags("test.txt", m, flags) == 0);
+                        map_t *mv = make_map_opts(16, 8, NULL, NULL, &opts);
+                        assert(mm_unmarshal("test.txt", mv) == 0);
+                        assert(mv->used == nvar);
+                        size_t vtotal = 0;
+                        mm_iter_begin(mv, &vit);
+                        while (mm_iter_next(&vit, &vk, &vp)) {
+                                void *orig;
+                                assert(mm_get_var(m, vk, vit.key_len, &orig, &vlen));
+                                assert(vlen == vit.value_len && memcmp(orig, vp, vlen) == 0);
+                                vtotal += vit.key_len + vit.value_len;
+                        }
+                        assert(vtotal == total);
+                        delete_map(mv);
+                }
+                // a fixed-size map does not load it
+                map_t *mf = make_map(sizeof(int), sizeof(int), toint, NULL);
+                assert(mm_unmarshal("test.txt", mf) == -1 && mf->used == 0);
+                delete_map(mf);
+
+                // delete half and overwrite the rest until the arena gets compacted
+                for (int round = 0; round < 4; round++) {
+                        for (int i = 0; i < nvar; i++) {
+                                int klen = snprintf(key, sizeof(key), "%d-", i);
+                                memset(key + klen, 'k', i % 92);
+                                if (i % 2 && round == 0) {
+                                        assert(mm_delete_var(m, key, klen + i % 92));
+                                } else if (!(i % 2)) {
+                                        memset(val, 'z' - round, 100);
+                                        assert(mm_put_var(m, key, klen + i % 92, val, 100) == 0);
+                                }
+                        }
+                }
+                // at most as much garbage as live bytes, plus what a compaction waits for
+                size_t live = 0;
+                mm_iter_begin(m, &vit);
+                while (mm_iter_next(&vit, &vk, &vp)) {
+                        live += vit.key_len > 16 ? ALIGN8(vit.key_len) : 0;
+                        live += vit.value_len > 8 ? ALIGN8(vit.value_len) : 0;
+                }
+                assert(m->arena.allocated <= 2 * live + ARENA_BYTES);
+                assert(m->used == nvar / 2);
+                for (int i = 0; i < nvar; i++) {
+                        int klen = snprintf(key, sizeof(key), "%d-", i);
+                        memset(key + klen, 'k', i % 92);
+                        bool found = mm_get_var(m, key, klen + i % 92, &vp, &vlen);
+                        assert(found == !(i % 2));
+                        assert(!found || (vlen == 100 && ((char *)vp)[99] == 'z' - 3));
+                }
+                delete_map(m);
+        }
+        opts.varlen = false;
+        printf("--- PASS ---\n");
+
+        ///////////////////////////////////////////////////
+        //               resize policy test              //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Resize Policy Test ===\n");
+        if (engine == MAP_ENGINE_LINEAR) {
+                map_opts_t popts = opts;
+                popts.shrink_ratio = 0.9;
+                assert(make_map_opts(sizeof(int), sizeof(int), toint, NULL, &popts) == NULL);
+
+                // a delete and a put right after a split: the old policy
+                // resizes on both, the default one on neither
+                popts.shrink_ratio = popts.split_ratio = SPLIT_RATIO;
+                assert(churn_resizes(&popts) > 90);
+                popts.shrink_ratio = 0;
+                assert(churn_resizes(&popts) == 0);
+
+                // never shrink keeps every bucket
+                popts.never_shrink = true;
+                m = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &popts);
+                for (int i = 0; i < 1000; i++) {
+                        mm_put(m, &i, &i);
+                }
+                size_t grown = bucket_count(m);
+                for (int i = 0; i < 1000; i++) {
+                        assert(mm_delete(m, &i));
+                }
+                assert(bucket_count(m) == grown);
+                delete_map(m);
+
+                // several buckets per resize, the load stays between the ratios
+                popts.never_shrink = false;
+                popts.resize_step = 8;
+                m = make_map_opts(sizeof(int), sizeof(int), toint, NULL, &popts);
+                for (int i = 0; i < 1000; i++) {
+                        size_t before = bucket_count(m);
+                        mm_put(m, &i, &i);
+                        assert(bucket_count(m) == before || bucket_count(m) == before + 8);
+                        assert(get_usage(m) <= m->split_ratio);
+                }
+                grown = bucket_count(m);
+                for (int i = 0; i < 1000; i++) {
+                        int v;
+                        assert(mm_get(m, &i, &v) && v == i);
+                }
+                for (int i = 0; i < 1000; i++) {
+                        assert(mm_delete(m, &i));
+                        assert(get_usage(m) <= m->split_ratio);
+                }
+                assert(bucket_count(m) < grown);
+                delete_map(m);
+        }
+        printf("--- PASS ---\n");
+
+        ///////////////////////////////////////////////////
+        //                  stats test                   //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Stats Test ===\n");
+        key2int_t hashes[] = {hash_int32, same_hash};
+        for (int h = 0; h < 2; h++) {
+                const int nstats = h ? 200 : 5000;
+                map_stats_t st;
+                m = make_map_opts(sizeof(int), sizeof(int), hashes[h], NULL, &opts);
+                for (int i = 0; i < nstats; i++) {
+                        mm_put(m, &i, &i);
+                }
+                for (int i = 0; i < 2 * nstats; i++) {
+                        mm_haskey(m, &i);
+                }
+                assert(mm_stats(m, &st) == 0);
+                assert(st.engine == engine && st.entries == nstats && st.splits > 0);
+                assert(st.heap_bytes > nstats * 2 * sizeof(int));
+                assert(st.bytes_per_entry == (double)st.heap_bytes / nstats);
+
+                size_t chains = 0, total = 0;
+                for (int i = 0; i < MM_CHAIN_HIST; i++) {
+                        chains += st.chain_hist[i];
+                        total += i * st.chain_hist[i];
+                }
+                if (engine == MAP_ENGINE_FLAT) {
+                        // one chain per entry, as long as its probe sequence
+                        assert(chains == nstats && st.buckets == m->cap);
+                } else {
+                        assert(chains == st.buckets && st.buckets == m->s->len);
+                }
+                if (h == 0) {
+                        assert(st.max_chain < 16 && st.probes_per_hit < 2);
+                        if (engine != MAP_ENGINE_FLAT) {
+                                assert(total == nstats);
+                        }
+                } else if (engine == MAP_ENGINE_FLAT) {
+                        // all in the same home group
+                        assert(st.probes_per_hit > 2 && st.max_chain > 2);
+                } else {
+                        // one bucket holds everything
+                        assert(st.max_chain == nstats);
+                        assert(st.probes_per_hit == (nstats + 1) / 2.0);
+                }
+#ifdef MM_STATS_COUNTERS
+                assert(st.counters.hits == nstats && st.counters.misses == nstats);
+                assert(st.measured_probes_per_hit >= 1);
+                // batches count every key
+                int batch[64], values[64];
+                for (int i = 0; i < 64; i++) {
+                        batch[i] = nstats - 32 + i;
+                }
+                assert(mm_get_batch(m, batch, 64, values, NULL) == 32);
+                assert(mm_stats(m, &st) == 0);
+                assert(st.counters.hits == nstats + 32 && st.counters.misses == nstats + 32);
+                assert(st.counters.hit_probes >= nstats + 32);
+#else
+                assert(st.counters.hits == 0 && st.measured_probes_per_hit == 0);
+#endif
+                delete_map(m);
+        }
+        printf("--- PASS ---\n");
+
+        ///////////////////////////////////////////////////
+        //               parallel walk test              //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Parallel Walk Test ===\n");
+        const int npar = 50000;
+        m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts);
+        for (int i = 0; i < npar; i++) {
+                mm_put(m, &i, &i);
+        }
+        int64_t want = (int64_t)npar * (npar - 1) / 2;
+        size_t thread_counts[] = {1, 3, 0};
+        for (int t = 0; t < 3; t++) {
+                int64_t sum = 0, sums[2] = {0, 0};
+                assert(mm_parallel_foreach(m, sum_keys, &sum, thread_counts[t]) == 0);
+                assert(sum == want);
+                assert(mm_parallel_reduce(m, sizeof(sums), fold_sum, combine_sum, sums,
+                                          NULL, thread_counts[t]) == 0);
+                assert(sums[0] == want && sums[1] == want << (t + 1));
+
+                slice_t *keys = mm_parallel_keyset(m, thread_counts[t]);
+                assert(keys->len == npar);
+                char *seen = calloc(npar, 1);
+                for (size_t i = 0; i < keys->len; i++) {
+                        int k = *(int *)ss_getptr(keys, i);
+                        assert(k >= 0 && k < npar && !seen[k]);
+                        seen[k] = 1;
+                }
+                free(seen);
+                delete_slice(keys);
+        }
+        delete_map(m);
+        printf("--- PASS ---\n");
+
+        ///////////////////////////////////////////////////
+        //               default hash test               //
+        ///////////////////////////////////////////////////
+
+        printf("=== RUN Default Hash Test ===\n");
+        m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts);
+        for (int i = 0; i < 4096; i++) {
+                int k = i * 4096;
+                assert(mm_put(m, &k, &i) == 0);
+        }
+        for (int i = 0; i < 4096; i++) {
+                int k = i * 4096, v;
+                assert(mm_get(m, &k, &v));
+                assert(v == i);
+                assert(mm_delete(m, &k));
+        }
+        assert(m->used == 0);
+        delete_map(m);
+        printf("--- PASS ---\n");
+}
+
+///////////////////////////////////////////////////
+//               concurrent test                 //
+///////////////////////////////////////////////////
+
+#define STRESS_THREADS 8
+#define STRESS_KEYS 20000
+#define SHARED_KEYS 64
+
+typedef struct stress_arg_s {
+        map_t *m;
+        int id;
+}stress_arg_t;
+
+// every thread owns a key range and also fights over a few shared keys
+static void *stress_worker(void *arg)
+{
+        map_t *m = ((stress_arg_t *)arg)->m;
+        int id = ((stress_arg_t *)arg)->id;
+        int base = (id + 1) * STRESS_KEYS;
+        unsigned int seed = id;
+
+        for (int i = base; i < base + STRESS_KEYS; i++) {
+                int v;
+                assert(mm_put(m, &i, &i) == 0);
+                assert(mm_get(m, &i, &v) && v == i);
+
+                int shared = rand_r(&seed) % SHARED_KEYS;
+                if (rand_r(&seed) & 1) {
+                        mm_put(m, &shared, &shared);
+                } else {
+                        mm_delete(m, &shared);
+                }
+                if (mm_get(m, &shared, &v)) {
+                        assert(v == shared);
+                }
+        }
+        // delete the odd keys, the table shrinks while others still grow
+        for (int i = base + 1; i < base + STRESS_KEYS; i += 2) {
+                assert(mm_delete(m, &i));
+                assert(!mm_haskey(m, &i));
+        }
+        for (int i = base; i < base + STRESS_KEYS; i += 2) {
+                int v;
+                assert(mm_get(m, &i, &v) && v == i);
+        }
+        return NULL;
+}
+
+static void test_concurrent()
+{
+        printf("=== RUN Concurrent Stress Test ===\n");
+        map_opts_t opts = {
+                .engine = MAP_ENGINE_LINEAR,
+                .concurrent = true,
+        };
+        map_t *m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts);
+        pthread_t threads[STRESS_THREADS];
+        stress_arg_t args[STRESS_THREADS];
+
+        for (int i = 0; i < STRESS_THREADS; i++) {
+                args[i].m = m;
+                args[i].id = i;
+                pthread_create(&threads[i], NULL, stress_worker, &args[i]);
+        }
+        // files written while the workers insert hold what was there
+        for (int i = 0; i < 5; i++) {
+                assert(mm_marshal_mapped("test.mapped", m) == 0);
+                map_t *mapped = mm_open_mapped("test.mapped", NULL, NULL);
+                assert(mapped && mapped->used <= STRESS_THREADS * STRESS_KEYS + SHARED_KEYS);
+                delete_map(mapped);
+        }
+        unlink("test.mapped");
+        for (int i = 0; i < STRESS_THREADS; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        size_t shared = 0;
+        for (int i = 0; i < SHARED_KEYS; i++) {
+                shared += mm_haskey(m, &i);
+        }
+        assert(m->used == STRESS_THREADS * STRESS_KEYS / 2 + shared);
+        // no put left the table over its load
+        assert(get_usage(m) <= m->split_ratio);
+
+        slice_t *keys = mm_keyset(m);
+        assert(keys->len == m->used);
+        delete_slice(keys);
+        delete_map(m);
+
+        opts.engine = MAP_ENGINE_FLAT;
+        assert(make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts) == NULL);
+        printf("--- PASS ---\n");
+}
+
+#define STABLE_KEYS 2000
+#define CHURN_KEYS 20000
+#define READERS 4
+
+typedef struct rw_arg_s {
+        map_t *m;
+        int id;
+        int *done;
+}rw_arg_t;
+
+// the stable keys are never deleted, their value is key + n * STABLE_KEYS
+static void *rw_reader(void *arg)
+{
+        rw_arg_t *a = arg;
+        unsigned int seed = a->id;
+        while (!__atomic_load_n(a->done, __ATOMIC_ACQUIRE)) {
+                long k = rand_r(&seed) % STABLE_KEYS, v;
+                assert(mm_get(a->m, &k, &v));
+                assert(v % STABLE_KEYS == k);
+        }
+        return NULL;
+}
+
+// updates the stable keys while the table grows and shrinks around them
+static void *rw_writer(void *arg)
+{
+        rw_arg_t *a = arg;
+        for (long round = 1; round <= 5; round++) {
+                for (long k = 0; k < STABLE_KEYS; k++) {
+                        long v = k + round * STABLE_KEYS;
+                        mm_put(a->m, &k, &v);
+                }
+                for (long k = STABLE_KEYS; k < STABLE_KEYS + CHURN_KEYS; k++) {
+                        mm_put(a->m, &k, &k);
+                }
+                for (long k = STABLE_KEYS; k < STABLE_KEYS + CHURN_KEYS; k++) {
+                        assert(mm_delete(a->m, &k));
+                }
+        }
+        return NULL;
+}
+
+static void test_lockfree_reads()
+{
+        printf("=== RUN Lock-free Read Test ===\n");
+        map_opts_t opts = {
+                .engine = MAP_ENGINE_LINEAR,
+                .concurrent = true,
+        };
+        map_t *m = make_map_opts(sizeof(long), sizeof(long), NULL, NULL, &opts);
+        for (long k = 0; k < STABLE_KEYS; k++) {
+                mm_put(m, &k, &k);
+        }
+
+        int done = 0;
+        pthread_t readers[READERS], writer;
+        rw_arg_t args[READERS + 1];
+        for (int i = 0; i <= READERS; i++) {
+                args[i].m = m;
+                args[i].id = i;
+                args[i].done = &done;
+        }
+        for (int i = 0; i < READERS; i++) {
+                pthread_create(&readers[i], NULL, rw_reader, &args[i]);
+        }
+        pthread_create(&writer, NULL, rw_writer, &args[READERS]);
+        pthread_join(writer, NULL);
+        __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+        for (int i = 0; i < READERS; i++) {
+                pthread_join(readers[i], NULL);
+        }
+
+        assert(m->used == STABLE_KEYS);
+        for (long k = 0; k < STABLE_KEYS; k++) {
+                long v;
+                assert(mm_get(m, &k, &v) && v == k + 5 * STABLE_KEYS);
+        }
+        delete_map(m);
+        printf("--- PASS ---\n");
+}
+
+#define SNAP_KEYS 20000
+
+typedef struct snap_check_s {
+        char seen[SNAP_KEYS];
+        size_t n;
+}snap_check_t;
+
+// every entry of the snapshot as it was: value == key, once
+static void check_snap_entry(void *key, void *value, void *ctx)
+{
+        snap_check_t *c = ctx;
+        int k = *(int *)key;
+        assert(k >= 0 && k < SNAP_KEYS && *(int *)value == k && !c->seen[k]);
+        c->seen[k] = 1;
+        c->n++;
+}
+
+typedef struct snap_dump_s {
+        map_snapshot_t *snap;
+        snap_check_t check;
+        int ret;
+}snap_dump_t;
+
+static void *dump_snapshot(void *arg)
+{
+        snap_dump_t *d = arg;
+        d->ret = mm_snapshot_marshal("test.snap", d->snap, MM_MARSHAL_HASH);
+        mm_snapshot_foreach(d->snap, check_snap_entry, &d->check);
+        mm_snapshot_release(d->snap);
+        return NULL;
+}
+
+static void test_snapshot()
+{
+        printf("=== RUN Snapshot Test ===\n");
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        for (int i = 0; i < SNAP_KEYS; i++) {
+                mm_put(m, &i, &i);
+        }
+        map_snapshot_t *snap = mm_snapshot(m);
+        assert(snap && snap->used == SNAP_KEYS);
+        assert(mm_snapshot(m) == NULL);
+        assert(delete_map(m) == -1);
+
+        // dump it while every bucket changes, the table grows and shrinks
+        snap_dump_t *d = calloc(1, sizeof(snap_dump_t));
+        d->snap = snap;
+        pthread_t dumper;
+        pthread_create(&dumper, NULL, dump_snapshot, d);
+        for (int i = 0; i < SNAP_KEYS; i++) {
+                int v = -i;
+                if (i % 3 == 0) {
+                        assert(mm_delete(m, &i));
+                } else {
+                        mm_put(m, &i, &v);
+                }
+        }
+        for (int i = SNAP_KEYS; i < 3 * SNAP_KEYS; i++) {
+                mm_put(m, &i, &i);
+        }
+        for (int i = SNAP_KEYS; i < 3 * SNAP_KEYS; i++) {
+                mm_delete(m, &i);
+        }
+        mm_reserve(m, 4 * SNAP_KEYS);
+        pthread_join(dumper, NULL);
+
+        assert(d->ret == 0 && d->check.n == SNAP_KEYS);
+        map_t *loaded = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_unmarshal("test.snap", loaded) == 0);
+        assert(loaded->used == SNAP_KEYS);
+        for (int i = 0; i < SNAP_KEYS; i++) {
+                int v;
+                assert(mm_get(loaded, &i, &v) && v == i);
+        }
+        delete_map(loaded);
+        free(d);
+        unlink("test.snap");
+
+        // released, the map frees it on its next change
+        for (int i = 0; i < SNAP_KEYS; i++) {
+                mm_put(m, &i, &i);
+        }
+        assert(m->snap == NULL);
+        snap = mm_snapshot(m);
+        assert(snap);
+        snap_check_t *c = calloc(1, sizeof(snap_check_t));
+        for (int i = 0; i < SNAP_KEYS; i++) {
+                mm_delete(m, &i);
+        }
+        mm_snapshot_foreach(snap, check_snap_entry, c);
+        assert(c->n == SNAP_KEYS && m->used == 0);
+        free(c);
+        mm_snapshot_release(snap);
+        assert(delete_map(m) == 0);
+
+        map_opts_t opts = {
+                .engine = MAP_ENGINE_FLAT,
+        };
+        m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &opts);
+        assert(mm_snapshot(m) == NULL);
+        delete_map(m);
+        printf("--- PASS ---\n");
+}
+
+int main(int argc, char *argv[])
+{
+        printf("##### linear hashing engine #####\n");
+        test_engine(MAP_ENGINE_LINEAR, false);
+        test_snapshot();
+
+        printf("##### flat engine #####\n");
+        test_engine(MAP_ENGINE_FLAT, false);
+
+        printf("##### concurrent linear hashing engine #####\n");
+        test_engine(MAP_ENGINE_LINEAR, true);
+        test_concurrent();
+        test_lockfree_reads();
         return 0;
 }
 
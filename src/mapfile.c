@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bloom.h"
+#include "map.h"
+#include "mapfile.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+// stdio buffer of the writer, records are small and written one by one
+#define MF_WRITE_BUFFER (1 << 20)
+
+static uint64_t bucket_count_for(size_t n)
+{
+        // about one record per bucket
+        uint64_t nbuckets = 1;
+        while (nbuckets < n) {
+                nbuckets <<= 1;
+        }
+        return nbuckets;
+}
+
+int mf_write(const char *path, size_t key_size, size_t value_size, size_t n,
+             const uint64_t *hashes, const void **keys, const void **values)
+{
+        uint64_t nbuckets = bucket_count_for(n);
+        uint64_t mask = nbuckets - 1;
+
+        // counting sort of the records by bucket
+        uint64_t *offsets = calloc(nbuckets + 1, sizeof(uint64_t));
+        size_t *order = malloc(n * sizeof(size_t) + 1);
+        if (!offsets || !order) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        for (size_t i = 0; i < n; i++) {
+                offsets[(hashes[i] & mask) + 1]++;
+        }
+        for (uint64_t b = 0; b < nbuckets; b++) {
+                offsets[b + 1] += offsets[b];
+        }
+        uint64_t *next = malloc(nbuckets * sizeof(uint64_t));
+        if (!next) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        memcpy(next, offsets, nbuckets * sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++) {
+                order[next[hashes[i] & mask]++] = i;
+        }
+        free(next);
+
+        FILE *fp = fopen(path, "wb");
+        if (!fp) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        setvbuf(fp, NULL, _IOFBF, MF_WRITE_BUFFER);
+
+        mf_header_t header = {
+                .magic = MF_MAGIC,
+                .version = MF_VERSION,
+                .key_size = key_size,
+                .value_size = value_size,
+                .nbuckets = nbuckets,
+                .count = n,
+                .table_off = sizeof(mf_header_t),
+                .data_off = sizeof(mf_header_t) + (nbuckets + 1) * sizeof(uint64_t),
+        };
+        fwrite(&header, sizeof(header), 1, fp);
+        fwrite(offsets, sizeof(uint64_t), nbuckets + 1, fp);
+        for (size_t i = 0; i < n; i++) {
+                size_t j = order[i];
+                fwrite(&hashes[j], sizeof(uint64_t), 1, fp);
+                fwrite(keys[j], key_size, 1, fp);
+                fwrite(values[j], value_size, 1, fp);
+        }
+        free(offsets);
+        free(order);
+
+        int ret = ferror(fp) ? -1 : 0;
+        if (fclose(fp) != 0) {
+                ret = -1;
+        }
+        return ret;
+}
+
+mapped_file_t *mf_open(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "mf_open: %s: %s\n", path, strerror(errno));
+                return NULL;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+                fprintf(stderr, "mf_open: %s: %s\n", path, strerror(errno));
+                close(fd);
+                return NULL;
+        }
+        size_t size = st.st_size;
+        if (size < sizeof(mf_header_t)) {
+                fprintf(stderr, "mf_open: %s: too short for a mapped map\n", path);
+                close(fd);
+                return NULL;
+        }
+
+        // the mapping keeps the file referenced, the descriptor is not needed
+        void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+                fprintf(stderr, "mf_open: %s: %s\n", path, strerror(errno));
+                close(fd);
+                return NULL;
+        }
+        close(fd);
+
+        const mf_header_t *h = base;
+        const char *err = NULL;
+        size_t record_size = sizeof(uint64_t) + h->key_size + h->value_size;
+        if (h->magic != MF_MAGIC) {
+                err = "not a mapped map";
+        } else if (h->version != MF_VERSION) {
+                err = "unsupported version";
+        } else if (h->nbuckets == 0 || (h->nbuckets & (h->nbuckets - 1)) != 0
+                   || h->nbuckets >= size / sizeof(uint64_t)) {
+                err = "bad bucket count";
+        } else if (h->key_size > size || h->value_size > size
+                   || h->table_off > size || h->data_off > size
+                   || h->table_off + (h->nbuckets + 1) * sizeof(uint64_t) > h->data_off
+                   || h->count > (size - h->data_off) / record_size) {
+                err = "truncated";
+        } else if ((h->table_off & 7) != 0
+                   || ((const uint64_t *)((const char *)base + h->table_off))[h->nbuckets]
+                   != h->count) {
+                err = "bad bucket table";
+        }
+        if (err) {
+                fprintf(stderr, "mf_open: %s: %s\n", path, err);
+                munmap(base, size);
+                return NULL;
+        }
+        // lookups jump around, read-ahead would only waste the page cache
+        madvise(base, size, MADV_RANDOM);
+
+        mapped_file_t *mf;
+        NEW_INSTANCE(mf, mapped_file_t);
+        mf->base = base;
+        mf->size = size;
+        mf->key_size = h->key_size;
+        mf->value_size = h->value_size;
+        mf->record_size = record_size;
+        mf->nbuckets = h->nbuckets;
+        mf->count = h->count;
+        mf->offsets = (const uint64_t *)((const char *)base + h->table_off);
+        mf->records = (const char *)base + h->data_off;
+        return mf;
+}
+
+void mf_close(mapped_file_t *mf)
+{
+        munmap(mf->base, mf->size);
+        free(mf);
+}
+
+const char *mf_find(map_t *m, const void *key)
+{
+        mapped_file_t *mf = m->mf;
+        uint64_t hash = m->k2int(key, m->key_size);
+        if (m->bloom && !bloom_may_contain_hash(m->bloom, hash)) {
+                MM_COUNT_LOOKUP(m, 0, false);
+                return NULL;
+        }
+        uint64_t b = hash & (mf->nbuckets - 1);
+        uint64_t start = mf->offsets[b], end = mf->offsets[b + 1];
+
+        // only the last entry of the table is checked on open
+        if (end > mf->count || start > end) {
+                return NULL;
+        }
+        for (uint64_t i = start; i < end; i++) {
+                const char *rec = mf_record(mf, i);
+                if (mf_record_hash(rec) == hash
+                    && m->kcmp(mf_record_key(rec), key, m->key_size) == 0) {
+                        MM_COUNT_LOOKUP(m, i - start + 1, true);
+                        return rec;
+                }
+        }
+        MM_COUNT_LOOKUP(m, end - start, false);
+        return NULL;
+}
@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shardmap.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+static inline map_shard_t *shard_of(shard_map_t *sm, const void *key)
+{
+        if (sm->nshards == 1) {
+                return &sm->shards[0];
+        }
+        return &sm->shards[sm->k2int(key, sm->key_size) >> sm->shift];
+}
+
+/*
+ * Whole-map work: fn(sm, shard, ctx) for every shard, from as many
+ * threads as there are shards or cores, whichever is fewer.
+ */
+typedef int (*shard_fn_t)(shard_map_t *sm, size_t shard, void *ctx);
+
+typedef struct shard_job_s {
+        shard_map_t *sm;
+        shard_fn_t fn;
+        void *ctx;
+        size_t next;
+        int failed;
+}shard_job_t;
+
+static void *shard_worker(void *arg)
+{
+        shard_job_t *job = arg;
+        size_t i;
+        while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->sm->nshards) {
+                if (job->fn(job->sm, i, job->ctx) != 0) {
+                        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                }
+        }
+        return NULL;
+}
+
+// return 0 if fn returned 0 for every shard, -1 otherwise
+static int run_shards(shard_map_t *sm, shard_fn_t fn, void *ctx)
+{
+        shard_job_t job = {
+                .sm = sm,
+                .fn = fn,
+                .ctx = ctx,
+        };
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t nthreads = ncpu > 0 && (size_t)ncpu < sm->nshards ? ncpu : sm->nshards;
+        pthread_t threads[nthreads];
+
+        // the calling thread is one of the workers
+        for (size_t i = 1; i < nthreads; i++) {
+                if (pthread_create(&threads[i], NULL, shard_worker, &job) != 0) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+        shard_worker(&job);
+        for (size_t i = 1; i < nthreads; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        return job.failed ? -1 : 0;
+}
+
+shard_map_t *make_shard_map(size_t nshards, size_t key_size, size_t value_size,
+                            key2int_t k2int, keycmp_t kcmp, const map_opts_t *opts)
+{
+        if (opts && (opts->concurrent || opts->varlen)) {
+                fprintf(stderr, "make_shard_map: shards are neither concurrent "
+                        "nor variable-length\n");
+                return NULL;
+        }
+        if (opts && opts->engine == MAP_ENGINE_MAPPED) {
+                fprintf(stderr, "make_shard_map: shards cannot be mapped files\n");
+                return NULL;
+        }
+
+        shard_map_t *sm;
+        NEW_INSTANCE(sm, shard_map_t);
+        sm->nshards = 1;
+        sm->shift = 64;
+        while (sm->nshards < nshards) {
+                sm->nshards <<= 1;
+                sm->shift--;
+        }
+        sm->key_size = key_size;
+        sm->value_size = value_size;
+        if (opts) {
+                sm->opts = *opts;
+        }
+        if (posix_memalign((void **)&sm->shards, SM_CACHE_LINE,
+                           sm->nshards * sizeof(map_shard_t)) != 0) {
+                error_at_line(-1, ENOMEM, __FILE__, __LINE__, NULL);
+        }
+        for (size_t i = 0; i < sm->nshards; i++) {
+                map_shard_t *sh = &sm->shards[i];
+                pthread_mutex_init(&sh->mu, NULL);
+                sh->m = make_map_opts(key_size, value_size, k2int, kcmp, &sm->opts);
+                if (!sh->m) {
+                        // every shard has the same options, so it is the first
+                        pthread_mutex_destroy(&sh->mu);
+                        free(sm->shards);
+                        free(sm);
+                        return NULL;
+                }
+        }
+        // the defaults as resolved by make_map
+        sm->k2int = sm->shards[0].m->k2int;
+        sm->kcmp = sm->shards[0].m->kcmp;
+        return sm;
+}
+
+static int delete_shard(shard_map_t *sm, size_t i, void *ctx)
+{
+        delete_map(sm->shards[i].m);
+        pthread_mutex_destroy(&sm->shards[i].mu);
+        return 0;
+}
+
+int delete_shard_map(shard_map_t *sm)
+{
+        run_shards(sm, delete_shard, NULL);
+        free(sm->shards);
+        free(sm);
+        return 0;
+}
+
+int sm_put(shard_map_t *sm, void *key, void *value)
+{
+        map_shard_t *sh = shard_of(sm, key);
+        pthread_mutex_lock(&sh->mu);
+        int ret = mm_put(sh->m, key, value);
+        pthread_mutex_unlock(&sh->mu);
+        return ret;
+}
+
+bool sm_get(shard_map_t *sm, void *key, void *value)
+{
+        map_shard_t *sh = shard_of(sm, key);
+        pthread_mutex_lock(&sh->mu);
+        bool found = mm_get(sh->m, key, value);
+        pthread_mutex_unlock(&sh->mu);
+        return found;
+}
+
+bool sm_haskey(shard_map_t *sm, void *key)
+{
+        map_shard_t *sh = shard_of(sm, key);
+        pthread_mutex_lock(&sh->mu);
+        bool found = mm_haskey(sh->m, key);
+        pthread_mutex_unlock(&sh->mu);
+        return found;
+}
+
+bool sm_delete(shard_map_t *sm, void *key)
+{
+        map_shard_t *sh = shard_of(sm, key);
+        pthread_mutex_lock(&sh->mu);
+        bool found = mm_delete(sh->m, key);
+        pthread_mutex_unlock(&sh->mu);
+        return found;
+}
+
+size_t sm_len(shard_map_t *sm)
+{
+        size_t n = 0;
+        for (size_t i = 0; i < sm->nshards; i++) {
+                map_shard_t *sh = &sm->shards[i];
+                pthread_mutex_lock(&sh->mu);
+                n += sh->m->used;
+                pthread_mutex_unlock(&sh->mu);
+        }
+        return n;
+}
+
+slice_t *sm_keyset(shard_map_t *sm)
+{
+        slice_t *s = make_slice(sm_len(sm), sm->key_size, NULL);
+        for (size_t i = 0; i < sm->nshards; i++) {
+                map_shard_t *sh = &sm->shards[i];
+                map_iter_t it;
+                void *key, *value;
+                pthread_mutex_lock(&sh->mu);
+                mm_iter_begin(sh->m, &it);
+                while (mm_iter_next(&it, &key, &value)) {
+                        ss_append(s, key);
+                }
+                pthread_mutex_unlock(&sh->mu);
+        }
+        return s;
+}
+
+int sm_shard_stats(shard_map_t *sm, size_t shard, map_stats_t *stats)
+{
+        if (shard >= sm->nshards) {
+                return -1;
+        }
+        map_shard_t *sh = &sm->shards[shard];
+        pthread_mutex_lock(&sh->mu);
+        mm_stats(sh->m, stats);
+        pthread_mutex_unlock(&sh->mu);
+        return 0;
+}
+
+static char *shard_path(const char *path, size_t shard)
+{
+        char *p;
+        if (asprintf(&p, "%s.%zu", path, shard) < 0) {
+                error_at_line(-1, ENOMEM, __FILE__, __LINE__, NULL);
+        }
+        return p;
+}
+
+typedef struct marshal_ctx_s {
+        const char *path;
+        int flags;
+        // unmarshal: the maps loaded, swapped in once all of them are
+        map_t **loaded;
+}marshal_ctx_t;
+
+static int marshal_shard(shard_map_t *sm, size_t i, void *arg)
+{
+        marshal_ctx_t *ctx = arg;
+        map_shard_t *sh = &sm->shards[i];
+        char *p = shard_path(ctx->path, i);
+        pthread_mutex_lock(&sh->mu);
+        int ret = mm_marshal_flags(p, sh->m, ctx->flags);
+        pthread_mutex_unlock(&sh->mu);
+        free(p);
+        return ret;
+}
+
+int sm_marshal(const char *path, shard_map_t *sm, int flags)
+{
+        // a manifest left from an older snapshot would vouch for this one
+        if (unlink(path) != 0 && errno != ENOENT) {
+                return -1;
+        }
+        marshal_ctx_t ctx = {
+                .path = path,
+                .flags = flags,
+        };
+        if (run_shards(sm, marshal_shard, &ctx) != 0) {
+                return -1;
+        }
+
+        sm_manifest_t mf = {
+                .magic = SM_MAGIC,
+                .version = SM_VERSION,
+                .nshards = sm->nshards,
+                .key_size = sm->key_size,
+                .value_size = sm->value_size,
+        };
+        FILE *fp = fopen(path, "wb");
+        if (!fp) {
+                return -1;
+        }
+        int ret = fwrite(&mf, sizeof(mf), 1, fp) == 1 ? 0 : -1;
+        if ((flags & MM_MARSHAL_FSYNC) && ret == 0) {
+                ret = fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+        }
+        if (fclose(fp) != 0) {
+                ret = -1;
+        }
+        return ret;
+}
+
+static int unmarshal_shard(shard_map_t *sm, size_t i, void *arg)
+{
+        marshal_ctx_t *ctx = arg;
+        char *p = shard_path(ctx->path, i);
+        // mm_unmarshal gives up on the whole process for a missing file
+        if (access(p, R_OK) != 0) {
+                fprintf(stderr, "sm_unmarshal: %s: %s\n", p, strerror(errno));
+                free(p);
+                return -1;
+        }
+        map_t *m = make_map_opts(sm->key_size, sm->value_size, sm->k2int, sm->kcmp, &sm->opts);
+        int ret = mm_unmarshal(p, m);
+        free(p);
+        if (ret != 0) {
+                delete_map(m);
+                return -1;
+        }
+        ctx->loaded[i] = m;
+        return 0;
+}
+
+// move the loaded entries into the shard, or the loaded map itself
+static int merge_shard(shard_map_t *sm, size_t i, void *arg)
+{
+        marshal_ctx_t *ctx = arg;
+        map_shard_t *sh = &sm->shards[i];
+        map_t *m = ctx->loaded[i];
+        pthread_mutex_lock(&sh->mu);
+        if (sh->m->used == 0) {
+                ctx->loaded[i] = sh->m;
+                sh->m = m;
+        } else {
+                map_iter_t it;
+                void *key, *value;
+                mm_iter_begin(m, &it);
+                while (mm_iter_next(&it, &key, &value)) {
+                        mm_put(sh->m, key, value);
+                }
+        }
+        pthread_mutex_unlock(&sh->mu);
+        delete_map(ctx->loaded[i]);
+        return 0;
+}
+
+int sm_unmarshal(const char *path, shard_map_t *sm)
+{
+        FILE *fp = fopen(path, "rb");
+        if (!fp) {
+                fprintf(stderr, "sm_unmarshal: %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+        sm_manifest_t mf;
+        size_t n = fread(&mf, sizeof(mf), 1, fp);
+        fclose(fp);
+        const char *err = NULL;
+        if (n != 1 || mf.magic != SM_MAGIC) {
+                err = "not a sharded map manifest";
+        } else if (mf.version != SM_VERSION) {
+                err = "unsupported version";
+        } else if (mf.nshards != sm->nshards) {
+                err = "shard count does not match";
+        } else if (mf.key_size != sm->key_size || mf.value_size != sm->value_size) {
+                err = "key or value size does not match";
+        }
+        if (err) {
+                fprintf(stderr, "sm_unmarshal: %s: %s\n", path, err);
+                return -1;
+        }
+
+        marshal_ctx_t ctx = {
+                .path = path,
+        };
+        ctx.loaded = calloc(sm->nshards, sizeof(map_t *));
+        if (!ctx.loaded) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        int ret = run_shards(sm, unmarshal_shard, &ctx);
+        if (ret == 0) {
+                run_shards(sm, merge_shard, &ctx);
+        } else {
+                for (size_t i = 0; i < sm->nshards; i++) {
+                        if (ctx.loaded[i]) {
+                                delete_map(ctx.loaded[i]);
+                        }
+                }
+        }
+        free(ctx.loaded);
+        return ret;
+}
+
+#ifdef TESTSHARDMAP
+// testing
+#include <assert.h>
+
+#define NKEYS 200000
+#define NTHREADS 8
+
+typedef struct put_arg_s {
+        shard_map_t *sm;
+        int from;
+        int to;
+}put_arg_t;
+
+static void *put_range(void *arg)
+{
+        put_arg_t *a = arg;
+        for (int i = a->from; i < a->to; i++) {
+                int v = -i;
+                assert(sm_put(a->sm, &i, &v) == 0);
+        }
+        for (int i = a->from; i < a->to; i += 2) {
+                assert(sm_delete(a->sm, &i));
+        }
+        return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+        const char *path = "test.shards";
+
+        printf("=== RUN Basic Test ===\n");
+        shard_map_t *sm = make_shard_map(5, sizeof(int), sizeof(int), NULL, NULL, NULL);
+        assert(sm->nshards == 8);
+        for (int i = 0; i < NKEYS; i++) {
+                assert(sm_put(sm, &i, &i) == 0);
+        }
+        assert(sm_len(sm) == NKEYS);
+        for (int i = 0; i < NKEYS; i++) {
+                int v;
+                assert(sm_get(sm, &i, &v) && v == i);
+        }
+        int missing = NKEYS;
+        assert(!sm_haskey(sm, &missing) && !sm_delete(sm, &missing));
+        slice_t *keys = sm_keyset(sm);
+        assert(keys->len == NKEYS);
+        char *seen = calloc(NKEYS, 1);
+        for (size_t i = 0; i < keys->len; i++) {
+                int k = *(int *)ss_getptr(keys, i);
+                assert(k >= 0 && k < NKEYS && !seen[k]);
+                seen[k] = 1;
+        }
+        free(seen);
+        delete_slice(keys);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Shard Stats Test ===\n");
+        size_t total = 0;
+        map_stats_t stats;
+        for (size_t i = 0; i < sm->nshards; i++) {
+                assert(sm_shard_stats(sm, i, &stats) == 0);
+                // the top bits of the default hash spread the keys evenly
+                assert(stats.entries > NKEYS / sm->nshards / 2);
+                total += stats.entries;
+        }
+        assert(total == NKEYS && sm_shard_stats(sm, sm->nshards, &stats) == -1);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Marshal Test ===\n");
+        assert(sm_marshal(path, sm, MM_MARSHAL_HASH) == 0);
+        map_opts_t opts = {
+                .engine = MAP_ENGINE_FLAT,
+        };
+        shard_map_t *loaded = make_shard_map(8, sizeof(int), sizeof(int), NULL, NULL, &opts);
+        assert(sm_unmarshal(path, loaded) == 0);
+        assert(sm_len(loaded) == NKEYS);
+        for (int i = 0; i < NKEYS; i++) {
+                int v;
+                assert(sm_get(loaded, &i, &v) && v == i);
+        }
+        // entries already there are kept
+        for (int i = 0; i < NKEYS; i += 2) {
+                assert(sm_delete(loaded, &i));
+        }
+        int extra = -1;
+        sm_put(loaded, &extra, &extra);
+        assert(sm_unmarshal(path, loaded) == 0);
+        assert(sm_len(loaded) == NKEYS + 1 && sm_haskey(loaded, &extra));
+        delete_shard_map(loaded);
+
+        shard_map_t *other = make_shard_map(4, sizeof(int), sizeof(int), NULL, NULL, NULL);
+        assert(sm_unmarshal(path, other) == -1 && sm_len(other) == 0);
+        delete_shard_map(other);
+
+        // a missing shard file fails the load, nothing is added
+        char *p = shard_path(path, 3);
+        unlink(p);
+        free(p);
+        other = make_shard_map(8, sizeof(int), sizeof(int), NULL, NULL, NULL);
+        assert(sm_unmarshal(path, other) == -1 && sm_len(other) == 0);
+        delete_shard_map(other);
+        delete_shard_map(sm);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Concurrent Test ===\n");
+        sm = make_shard_map(64, sizeof(int), sizeof(int), NULL, NULL, NULL);
+        pthread_t threads[NTHREADS];
+        put_arg_t args[NTHREADS];
+        for (int t = 0; t < NTHREADS; t++) {
+                args[t].sm = sm;
+                args[t].from = t * NKEYS / NTHREADS;
+                args[t].to = (t + 1) * NKEYS / NTHREADS;
+                pthread_create(&threads[t], NULL, put_range, &args[t]);
+        }
+        for (int t = 0; t < NTHREADS; t++) {
+                pthread_join(threads[t], NULL);
+        }
+        assert(sm_len(sm) == NKEYS / 2);
+        for (int i = 0; i < NKEYS; i++) {
+                int v;
+                bool found = sm_get(sm, &i, &v);
+                assert(found == (i % 2 == 1) && (!found || v == -i));
+        }
+        delete_shard_map(sm);
+        printf("--- PASS ---\n");
+
+        opts.concurrent = true;
+        assert(make_shard_map(4, sizeof(int), sizeof(int), NULL, NULL, &opts) == NULL);
+
+        for (size_t i = 0; i < 8; i++) {
+                p = shard_path(path, i);
+                unlink(p);
+                free(p);
+        }
+        unlink(path);
+        return 0;
+}
+
+#endif
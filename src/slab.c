@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+// a slab starts with a header so the slots stay aligned
+typedef struct slab_header_s {
+        struct slab_header_s *next;
+}slab_header_t;
+
+#define SLAB_HEADER_SIZE ALIGN_UP(sizeof(slab_header_t), SLAB_ALIGN)
+
+void sb_init(slab_t *sb, size_t slot_size, size_t slots_per_slab)
+{
+        sb_init_alloc(sb, slot_size, slots_per_slab, NULL);
+}
+
+void sb_init_alloc(slab_t *sb, size_t slot_size, size_t slots_per_slab, const allocator_t *al)
+{
+        if (slot_size < sizeof(void *)) {
+                slot_size = sizeof(void *);
+        }
+        sb->slot_size = ALIGN_UP(slot_size, sizeof(void *));
+        sb->slots_per_slab = slots_per_slab > 0 ? slots_per_slab : 1;
+        sb->free_list = NULL;
+        sb->slabs = NULL;
+        sb->bump = NULL;
+        sb->bump_end = NULL;
+        sb->nslabs = 0;
+        sb->used = 0;
+        sb->al = al_or_libc(al);
+}
+
+static inline size_t slab_bytes(slab_t *sb)
+{
+        return SLAB_HEADER_SIZE + sb->slot_size * sb->slots_per_slab;
+}
+
+static void new_slab(slab_t *sb)
+{
+        slab_header_t *slab = al_alloc(sb->al, slab_bytes(sb));
+        slab->next = sb->slabs;
+        sb->slabs = slab;
+        sb->nslabs++;
+
+        // slots are handed out lazily, so a new slab is never walked
+        sb->bump = (char *)slab + SLAB_HEADER_SIZE;
+        sb->bump_end = sb->bump + sb->slot_size * sb->slots_per_slab;
+}
+
+void *sb_alloc(slab_t *sb)
+{
+        void *slot;
+
+        if (sb->free_list) {
+                slot = sb->free_list;
+                sb->free_list = *(void **)slot;
+        } else {
+                if (sb->bump == sb->bump_end) {
+                        new_slab(sb);
+                }
+                slot = sb->bump;
+                sb->bump += sb->slot_size;
+        }
+        sb->used++;
+        return slot;
+}
+
+void sb_free(slab_t *sb, void *slot)
+{
+        *(void **)slot = sb->free_list;
+        sb->free_list = slot;
+        sb->used--;
+}
+
+void sb_deinit(slab_t *sb)
+{
+        slab_header_t *slab = sb->slabs;
+        while (slab) {
+                slab_header_t *next = slab->next;
+                al_free(sb->al, slab, slab_bytes(sb));
+                slab = next;
+        }
+        sb_init_alloc(sb, sb->slot_size, sb->slots_per_slab, sb->al);
+}
+
+#ifdef TESTSLAB
+// testing
+#include <assert.h>
+
+int main(int argc, char *argv[])
+{
+        slab_t sb;
+        void *slots[100];
+
+        sb_init(&sb, 20, 8);
+        printf("slot_size %zu, slots_per_slab %zu\n", sb.slot_size, sb.slots_per_slab);
+
+        for (int i = 0; i < 100; i++) {
+                slots[i] = sb_alloc(&sb);
+                memset(slots[i], i, 20);
+        }
+        printf("used %zu, nslabs %zu\n", sb.used, sb.nslabs);
+        assert(sb.used == 100);
+        assert(sb.nslabs == 13);
+
+        for (int i = 0; i < 100; i++) {
+                for (int j = 0; j < 20; j++) {
+                        assert(((unsigned char *)slots[i])[j] == i);
+                }
+        }
+
+        // freed slots are reused before a new slab is allocated
+        for (int i = 0; i < 50; i++) {
+                sb_free(&sb, slots[i]);
+        }
+        for (int i = 0; i < 50; i++) {
+                slots[i] = sb_alloc(&sb);
+        }
+        printf("used %zu, nslabs %zu\n", sb.used, sb.nslabs);
+        assert(sb.used == 100);
+        assert(sb.nslabs == 13);
+
+        sb_deinit(&sb);
+        assert(sb.used == 0 && sb.nslabs == 0);
+        return 0;
+}
+
+#endif
@@ -1,5 +1,3 @@
-#include <errno.h>
-#include <error.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,24 +5,21 @@
 
 #include "slice.h"
 
-#define NEW_INSTANCE(ret, structure)                                    \
-        if (((ret) = malloc(sizeof(structure))) == NULL) {              \
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
-        }
-
 slice_t *make_slice(size_t cap, size_t item_size, dtor_t dtor)
 {
-        slice_t *s;
-        NEW_INSTANCE(s, slice_t);
+        return make_slice_alloc(cap, item_size, dtor, NULL);
+}
+
+slice_t *make_slice_alloc(size_t cap, size_t item_size, dtor_t dtor, const allocator_t *al)
+{
+        al = al_or_libc(al);
+        slice_t *s = al_alloc(al, sizeof(slice_t));
         s->item_size = item_size;
         s->cap = cap;
         s->len = 0;
         s->dtor = dtor;
-
-        s->array = malloc(item_size * cap);
-        if (!s->array) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
-        }
+        s->al = al;
+        s->array = al_alloc(al, item_size * cap);
 
         return s;
 }
@@ -38,15 +33,24 @@ size_t ss_append(slice_t *s, void *item)
         }
 
         // realloc
-        s->cap <<= 1;
-        s->array = realloc(s->array, s->item_size * s->cap);
-        if (!s->array) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
-        }
+        size_t old_cap = s->cap;
+        s->cap = s->cap ? s->cap << 1 : 1;
+        s->array = al_realloc(s->al, s->array, s->item_size * old_cap, s->item_size * s->cap);
 
         return ss_append(s, item);
 }
 
+int ss_reserve(slice_t *s, size_t cap)
+{
+        if (cap <= s->cap) {
+                return 0;
+        }
+
+        s->array = al_realloc(s->al, s->array, s->item_size * s->cap, s->item_size * cap);
+        s->cap = cap;
+        return 0;
+}
+
 int ss_get(slice_t *s, uint64_t i, void *item)
 {
         if (i >= s->len) {
@@ -95,9 +99,9 @@ void delete_slice(slice_t *s)
                         s->dtor(s->array+i*s->item_size);
                 }
         }
-        
-        free(s->array);
-        free(s);
+
+        al_free(s->al, s->array, s->item_size * s->cap);
+        al_free(s->al, s, sizeof(slice_t));
 }
 
 #ifdef TESTSLICE
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+// take up to grain indexes from the front of the worker's own range
+static bool take(tp_job_t *job, size_t id, size_t *lo, size_t *hi)
+{
+        tp_range_t *r = &job->ranges[id];
+        pthread_mutex_lock(&r->mu);
+        bool found = r->lo < r->hi;
+        if (found) {
+                *lo = r->lo;
+                *hi = r->hi - r->lo > job->grain ? r->lo + job->grain : r->hi;
+                __atomic_store_n(&r->lo, *hi, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&r->mu);
+        return found;
+}
+
+// move the back half of the biggest range left into the worker's own,
+// false once every range is empty
+static bool steal(tp_job_t *job, size_t id)
+{
+        for (;;) {
+                size_t victim = id, most = 0;
+                for (size_t i = 0; i < job->nworkers; i++) {
+                        tp_range_t *r = &job->ranges[i];
+                        // a racy peek, the victim is checked under its lock
+                        size_t left = __atomic_load_n(&r->hi, __ATOMIC_RELAXED)
+                                - __atomic_load_n(&r->lo, __ATOMIC_RELAXED);
+                        if (i != id && (ssize_t)left > (ssize_t)most) {
+                                victim = i;
+                                most = left;
+                        }
+                }
+                if (victim == id) {
+                        return false;
+                }
+
+                tp_range_t *v = &job->ranges[victim];
+                pthread_mutex_lock(&v->mu);
+                if (v->lo >= v->hi) {
+                        pthread_mutex_unlock(&v->mu);
+                        continue;
+                }
+                // a last grain goes whole, the owner may be stuck in it
+                size_t left = v->hi - v->lo;
+                size_t mid = left > job->grain ? v->lo + left / 2 : v->lo;
+                size_t hi = v->hi;
+                __atomic_store_n(&v->hi, mid, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&v->mu);
+
+                tp_range_t *own = &job->ranges[id];
+                pthread_mutex_lock(&own->mu);
+                __atomic_store_n(&own->lo, mid, __ATOMIC_RELAXED);
+                __atomic_store_n(&own->hi, hi, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&own->mu);
+                __atomic_add_fetch(&job->steals, 1, __ATOMIC_RELAXED);
+                return true;
+        }
+}
+
+static void run_worker(tp_job_t *job, size_t id)
+{
+        size_t lo, hi;
+        do {
+                while (take(job, id, &lo, &hi)) {
+                        job->fn(job->ctx, lo, hi, id);
+                }
+        } while (steal(job, id));
+}
+
+static void *pool_thread(void *arg)
+{
+        tp_thread_t *t = arg;
+        tp_pool_t *p = t->pool;
+        pthread_mutex_lock(&p->mu);
+        for (;;) {
+                while (!p->stop && p->generation == t->seen) {
+                        pthread_cond_wait(&p->wake, &p->mu);
+                }
+                if (p->stop) {
+                        break;
+                }
+                t->seen = p->generation;
+                // a thread that wakes late only sees the current job, if any
+                if (t->id >= p->job_workers) {
+                        continue;
+                }
+                tp_job_t *job = p->job;
+                pthread_mutex_unlock(&p->mu);
+
+                run_worker(job, t->id);
+
+                pthread_mutex_lock(&p->mu);
+                if (--job->running == 0) {
+                        pthread_cond_broadcast(&p->idle);
+                }
+        }
+        pthread_mutex_unlock(&p->mu);
+        return NULL;
+}
+
+// start helper threads up to n, called with run_mu held
+static void grow(tp_pool_t *p, size_t n)
+{
+        pthread_mutex_lock(&p->mu);
+        for (; p->nthreads < n; p->nthreads++) {
+                tp_thread_t *t = &p->threads[p->nthreads];
+                t->pool = p;
+                t->id = p->nthreads + 1;
+                t->seen = p->generation;
+                if (pthread_create(&t->thread, NULL, pool_thread, t) != 0) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+        pthread_mutex_unlock(&p->mu);
+}
+
+tp_pool_t *tp_new(size_t nthreads)
+{
+        tp_pool_t *p;
+        NEW_INSTANCE(p, tp_pool_t);
+        pthread_mutex_init(&p->mu, NULL);
+        pthread_mutex_init(&p->run_mu, NULL);
+        pthread_cond_init(&p->wake, NULL);
+        pthread_cond_init(&p->idle, NULL);
+        grow(p, nthreads < TP_MAX_THREADS ? nthreads : TP_MAX_THREADS - 1);
+        return p;
+}
+
+void tp_delete(tp_pool_t *p)
+{
+        pthread_mutex_lock(&p->mu);
+        p->stop = true;
+        pthread_cond_broadcast(&p->wake);
+        pthread_mutex_unlock(&p->mu);
+        for (size_t i = 0; i < p->nthreads; i++) {
+                pthread_join(p->threads[i].thread, NULL);
+        }
+        pthread_mutex_destroy(&p->mu);
+        pthread_mutex_destroy(&p->run_mu);
+        pthread_cond_destroy(&p->wake);
+        pthread_cond_destroy(&p->idle);
+        free(p);
+}
+
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+static tp_pool_t *default_pool;
+
+static void make_default()
+{
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        default_pool = tp_new(ncpu > 1 ? ncpu - 1 : 0);
+}
+
+tp_pool_t *tp_default()
+{
+        pthread_once(&default_once, make_default);
+        return default_pool;
+}
+
+size_t tp_for(tp_pool_t *p, size_t n, size_t grain, size_t nthreads,
+              tp_range_fn_t fn, void *ctx)
+{
+        if (nthreads == 0) {
+                long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = ncpu > 0 ? ncpu : 1;
+        }
+        if (nthreads > TP_MAX_THREADS) {
+                nthreads = TP_MAX_THREADS;
+        }
+        // no point in workers without a grain of their own
+        grain = grain ? grain : 1;
+        if (nthreads > (n + grain - 1) / grain) {
+                nthreads = n > 0 ? (n + grain - 1) / grain : 1;
+        }
+
+        tp_job_t job = {
+                .fn = fn,
+                .ctx = ctx,
+                .grain = grain,
+                .nworkers = nthreads,
+                .running = nthreads - 1,
+        };
+        for (size_t i = 0; i < nthreads; i++) {
+                pthread_mutex_init(&job.ranges[i].mu, NULL);
+                job.ranges[i].lo = n * i / nthreads;
+                job.ranges[i].hi = n * (i + 1) / nthreads;
+        }
+        if (nthreads == 1) {
+                run_worker(&job, 0);
+                pthread_mutex_destroy(&job.ranges[0].mu);
+                return 0;
+        }
+
+        pthread_mutex_lock(&p->run_mu);
+        grow(p, nthreads - 1);
+        pthread_mutex_lock(&p->mu);
+        p->job = &job;
+        p->job_workers = nthreads;
+        p->generation++;
+        pthread_cond_broadcast(&p->wake);
+        pthread_mutex_unlock(&p->mu);
+
+        run_worker(&job, 0);
+
+        pthread_mutex_lock(&p->mu);
+        while (job.running > 0) {
+                pthread_cond_wait(&p->idle, &p->mu);
+        }
+        p->job = NULL;
+        p->job_workers = 0;
+        pthread_mutex_unlock(&p->mu);
+        pthread_mutex_unlock(&p->run_mu);
+
+        for (size_t i = 0; i < nthreads; i++) {
+                pthread_mutex_destroy(&job.ranges[i].mu);
+        }
+        return job.steals;
+}
+
+#ifdef TESTTHREADPOOL
+// testing
+#include <assert.h>
+
+#define N 100000
+
+typedef struct count_ctx_s {
+        unsigned char *hits;
+        uint64_t sum[TP_MAX_THREADS];
+        // indexes below slow take this long each
+        size_t slow;
+}count_ctx_t;
+
+static void count_range(void *arg, size_t lo, size_t hi, size_t worker)
+{
+        count_ctx_t *c = arg;
+        assert(worker < TP_MAX_THREADS);
+        for (size_t i = lo; i < hi; i++) {
+                __atomic_add_fetch(&c->hits[i], 1, __ATOMIC_RELAXED);
+                c->sum[worker] += i;
+                if (i < c->slow) {
+                        usleep(200);
+                }
+        }
+}
+
+static void check(size_t n, count_ctx_t *c)
+{
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++) {
+                assert(c->hits[i] == 1);
+        }
+        for (int w = 0; w < TP_MAX_THREADS; w++) {
+                sum += c->sum[w];
+        }
+        assert(sum == (uint64_t)n * (n - 1) / 2);
+}
+
+int main(int argc, char *argv[])
+{
+        tp_pool_t *p = tp_new(2);
+        count_ctx_t c;
+
+        printf("=== RUN Cover Test ===\n");
+        size_t threads[] = {1, 2, 3, 8, 100};
+        size_t sizes[] = {0, 1, 7, 1000, N};
+        for (int t = 0; t < 5; t++) {
+                for (int s = 0; s < 5; s++) {
+                        memset(&c, 0, sizeof(c));
+                        c.hits = calloc(N, 1);
+                        tp_for(p, sizes[s], 16, threads[t], count_range, &c);
+                        check(sizes[s], &c);
+                        free(c.hits);
+                }
+        }
+        assert(p->nthreads == TP_MAX_THREADS - 1);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Skew Test ===\n");
+        // the first worker's slice is all slow, the others steal it
+        memset(&c, 0, sizeof(c));
+        c.hits = calloc(N, 1);
+        c.slow = 400;
+        assert(tp_for(p, 1600, 4, 4, count_range, &c) > 0);
+        check(1600, &c);
+        free(c.hits);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Default Pool Test ===\n");
+        assert(tp_default() == tp_default());
+        memset(&c, 0, sizeof(c));
+        c.hits = calloc(N, 1);
+        tp_for(tp_default(), N, 64, 0, count_range, &c);
+        check(N, &c);
+        free(c.hits);
+        printf("--- PASS ---\n");
+
+        tp_delete(p);
+        return 0;
+}
+
+#endif
@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "typedmap.h"
+
+void **tm_grow_dir(void **dir, size_t *size)
+{
+        size_t old = *size;
+        dir = realloc(dir, 2 * old * sizeof(void *));
+        if (!dir) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        memset(dir + old, 0, old * sizeof(void *));
+        *size = 2 * old;
+        return dir;
+}
+
+// the load as map.c computes it, in float
+static inline float load(size_t used, size_t len)
+{
+        return (float)used / (float)len / (float)DEFAULT_BUCKET_CAP;
+}
+
+size_t tm_grow_at(size_t len)
+{
+        size_t n = SPLIT_RATIO * len;
+        while (n > 0 && load(n, len) > SPLIT_RATIO) {
+                n--;
+        }
+        while (load(n + 1, len) <= SPLIT_RATIO) {
+                n++;
+        }
+        return n;
+}
+
+size_t tm_shrink_below(size_t cap, size_t len)
+{
+        if (cap <= DEFAULT_INIT_CAP) {
+                return 0;
+        }
+        size_t n = SHRINK_RATIO * len;
+        while (n > 0 && load(n - 1, len) > SHRINK_RATIO) {
+                n--;
+        }
+        while (load(n, len) <= SHRINK_RATIO) {
+                n++;
+        }
+        return n;
+}
+
+#ifdef TESTTYPEDMAP
+// testing
+#include <assert.h>
+#include <stdio.h>
+
+#include "hash.h"
+
+#define NKEYS 100000
+
+typedef struct point_s {
+        int x;
+        int y;
+}point_t;
+
+typedef struct name_s {
+        char s[12];
+}name_t;
+
+static uint64_t hash_name(name_t key)
+{
+        return hash_bytes(key.s, sizeof(key.s));
+}
+
+static bool name_eq(name_t a, name_t b)
+{
+        return memcmp(a.s, b.s, sizeof(a.s)) == 0;
+}
+
+MAP_DECLARE(u64map, uint64_t, uint64_t, tm_hash_u64, TM_EQ)
+MAP_DECLARE(pointmap, uint32_t, point_t, tm_hash_u32, TM_EQ)
+MAP_DECLARE(namemap, name_t, int, hash_name, name_eq)
+
+static void sum_values(uint64_t *key, uint64_t *value, void *ctx)
+{
+        assert(*value == *key * 3);
+        *(uint64_t *)ctx += *value;
+}
+
+int main(int argc, char *argv[])
+{
+        printf("=== RUN Hash Test ===\n");
+        for (uint64_t i = 0; i < 1000; i++) {
+                uint64_t k = i * 0x9e3779b97f4a7c15ULL;
+                uint32_t k32 = (uint32_t)k;
+                assert(tm_hash_u64(k) == hash_int64(&k, sizeof(k)));
+                assert(tm_hash_u32(k32) == hash_int32(&k32, sizeof(k32)));
+        }
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Model Test ===\n");
+        // the generic map is the reference
+        u64map_t *m = make_u64map();
+        map_t *ref = make_map(sizeof(uint64_t), sizeof(uint64_t), NULL, NULL);
+        unsigned int seed = 1;
+        for (int i = 0; i < 8 * NKEYS; i++) {
+                uint64_t k = rand_r(&seed) % NKEYS, v = rand_r(&seed), got, want;
+                // grow for the first half, shrink for the second
+                int op = rand_r(&seed) % 4;
+                if (i > 4 * NKEYS) {
+                        op = op == 0 && rand_r(&seed) % 4 == 0 ? 0 : 3;
+                }
+                if (op == 0) {
+                        assert(u64map_put(m, k, v) == 0);
+                        mm_put(ref, &k, &v);
+                } else if (op == 3) {
+                        assert(u64map_delete(m, k) == mm_delete(ref, &k));
+                } else {
+                        bool found = mm_get(ref, &k, &want);
+                        assert(u64map_get(m, k, &got) == found);
+                        assert(!found || got == want);
+                        assert(u64map_haskey(m, k) == found);
+                }
+                assert(u64map_len(m) == ref->used);
+        }
+        // both tables grew and shrank by the same rules
+        assert(m->splits > 0 && m->shrinks > 0);
+        assert(m->cap + m->pos == ref->s->len);
+        assert(m->splits == ref->splits && m->shrinks == ref->shrinks);
+        delete_map(ref);
+        delete_u64map(m);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Foreach Test ===\n");
+        m = make_u64map();
+        uint64_t want = 0, sum = 0;
+        for (uint64_t i = 0; i < NKEYS; i++) {
+                u64map_put(m, i, i);
+                *u64map_find(m, i) *= 3;
+                want += i * 3;
+        }
+        assert(u64map_find(m, NKEYS) == NULL);
+        u64map_foreach(m, sum_values, &sum);
+        assert(sum == want);
+        for (uint64_t i = 0; i < NKEYS; i++) {
+                assert(u64map_delete(m, i));
+        }
+        assert(u64map_len(m) == 0 && m->shrinks > 0);
+        delete_u64map(m);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Struct Test ===\n");
+        pointmap_t *pm = make_pointmap();
+        for (uint32_t i = 0; i < NKEYS; i++) {
+                point_t p = {i, -(int)i};
+                pointmap_put(pm, i, p);
+        }
+        for (uint32_t i = 0; i < NKEYS; i++) {
+                point_t p;
+                assert(pointmap_get(pm, i, &p) && p.x == (int)i && p.y == -(int)i);
+        }
+        delete_pointmap(pm);
+
+        namemap_t *nm = make_namemap();
+        for (int i = 0; i < NKEYS; i++) {
+                name_t key = {{0}};
+                snprintf(key.s, sizeof(key.s), "key%d", i);
+                namemap_put(nm, key, i);
+        }
+        for (int i = 0; i < NKEYS; i++) {
+                name_t key = {{0}};
+                int v;
+                snprintf(key.s, sizeof(key.s), "key%d", i);
+                assert(namemap_get(nm, key, &v) && v == i);
+        }
+        name_t missing = {"nokey"};
+        assert(!namemap_get(nm, missing, NULL) && !namemap_delete(nm, missing));
+        delete_namemap(nm);
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif
@@ -0,0 +1,800 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "map.h"
+#include "wal.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = calloc(1, sizeof(structure))) == NULL) {           \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+// groups buffered before a change waits for the disk
+#define WAL_MAX_GROUPS 4
+
+static char *suffixed(const char *path, const char *suffix)
+{
+        char *p;
+        if (asprintf(&p, "%s%s", path, suffix) < 0) {
+                error_at_line(-1, ENOMEM, __FILE__, __LINE__, NULL);
+        }
+        return p;
+}
+
+// return 0, or the errno of the failed write
+static int write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return errno;
+                }
+                buf += n;
+                len -= n;
+        }
+        return 0;
+}
+
+// make the renames and creations in the directory of path durable
+static int sync_dir(const char *path)
+{
+        char *copy = strdup(path);
+        if (!copy) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+        free(copy);
+        if (fd < 0) {
+                return -1;
+        }
+        int ret = fsync(fd);
+        close(fd);
+        return ret;
+}
+
+static uint32_t record_crc(uint32_t type, const void *payload, size_t len)
+{
+        return crc32c(crc32c(0, &type, sizeof(type)), payload, len);
+}
+
+/*
+ * Write out the records buffered, and fsync the log if sync is set even
+ * with nothing buffered. Called with mu held, which is let go during the
+ * write so changes keep coming into the other buffer.
+ */
+static int flush(map_wal_t *w, bool sync)
+{
+        while (w->flushing) {
+                pthread_cond_wait(&w->flushed, &w->mu);
+        }
+        if (w->err) {
+                return -1;
+        }
+        if (w->len == 0 && !sync) {
+                return 0;
+        }
+        char *buf = w->buf;
+        size_t cap = w->cap, len = w->len;
+        w->buf = w->spare;
+        w->cap = w->spare_cap;
+        w->spare = buf;
+        w->spare_cap = cap;
+        w->len = 0;
+        w->flushing = true;
+        int fd = w->fd;
+        pthread_mutex_unlock(&w->mu);
+
+        int err = write_all(fd, buf, len);
+        if (err == 0 && sync && fdatasync(fd) != 0) {
+                err = errno;
+        }
+
+        pthread_mutex_lock(&w->mu);
+        w->flushing = false;
+        if (err && !w->err) {
+                fprintf(stderr, "mm_wal: %s: %s\n", w->log_path, strerror(err));
+                w->err = err;
+        }
+        pthread_cond_broadcast(&w->flushed);
+        return w->err ? -1 : 0;
+}
+
+static void *flusher_thread(void *arg)
+{
+        map_wal_t *w = arg;
+        pthread_mutex_lock(&w->mu);
+        while (!w->stop) {
+                if (w->len < w->opts.group_bytes) {
+                        struct timespec t;
+                        clock_gettime(CLOCK_REALTIME, &t);
+                        t.tv_nsec += (long)(w->opts.interval_ms % 1000) * 1000000;
+                        t.tv_sec += w->opts.interval_ms / 1000 + t.tv_nsec / 1000000000;
+                        t.tv_nsec %= 1000000000;
+                        pthread_cond_timedwait(&w->wake, &w->mu, &t);
+                }
+                if (w->len > 0) {
+                        flush(w, w->opts.sync == WAL_SYNC_GROUP);
+                }
+        }
+        pthread_mutex_unlock(&w->mu);
+        return NULL;
+}
+
+// start the log over if end is 0, otherwise cut it back to end and
+// append from there
+static int open_log(map_wal_t *w, off_t end)
+{
+        w->fd = open(w->log_path, O_WRONLY | O_CREAT, 0644);
+        if (w->fd < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        int err = 0;
+        if (end == 0) {
+                wal_header_t head = {
+                        .magic = WAL_MAGIC,
+                        .version = WAL_VERSION,
+                        .key_size = w->m->key_size,
+                        .value_size = w->m->value_size,
+                };
+                end = sizeof(head);
+                if (ftruncate(w->fd, 0) != 0) {
+                        err = errno;
+                } else {
+                        err = write_all(w->fd, (const char *)&head, sizeof(head));
+                }
+        } else if (ftruncate(w->fd, end) != 0 || lseek(w->fd, end, SEEK_SET) != end) {
+                err = errno;
+        }
+        if (err == 0 && (fdatasync(w->fd) != 0 || sync_dir(w->log_path) != 0)) {
+                err = errno;
+        }
+        if (err) {
+                fprintf(stderr, "mm_wal: %s: %s\n", w->log_path, strerror(err));
+                w->err = err;
+                return -1;
+        }
+        w->log_bytes = end;
+        return 0;
+}
+
+// apply the records of the log at path to the map, up to the first one
+// torn or corrupt, whose offset goes to end. A missing log is empty.
+static int replay(map_wal_t *w, const char *path, off_t *end)
+{
+        map_t *m = w->m;
+        *end = 0;
+        FILE *fp = fopen(path, "rb");
+        if (!fp) {
+                if (errno == ENOENT) {
+                        return 0;
+                }
+                fprintf(stderr, "mm_wal_open: %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+        // a log cut before the end of its header has no record
+        wal_header_t head;
+        if (fread(&head, sizeof(head), 1, fp) != 1) {
+                fclose(fp);
+                return 0;
+        }
+        if (head.magic != WAL_MAGIC || head.version != WAL_VERSION) {
+                fprintf(stderr, "mm_wal_open: %s: not a log\n", path);
+                fclose(fp);
+                return -1;
+        }
+        if (head.key_size != m->key_size || head.value_size != m->value_size) {
+                fprintf(stderr, "mm_wal_open: %s: key or value size does not match the map\n",
+                        path);
+                fclose(fp);
+                return -1;
+        }
+
+        char *payload = malloc(m->key_size + m->value_size);
+        if (!payload) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        off_t good = sizeof(head);
+        wal_record_t rec;
+        while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+                if (rec.type != WAL_PUT && rec.type != WAL_DELETE) {
+                        break;
+                }
+                size_t len = m->key_size + (rec.type == WAL_PUT ? m->value_size : 0);
+                if (fread(payload, len, 1, fp) != 1 || record_crc(rec.type, payload, len) != rec.crc) {
+                        break;
+                }
+                if (rec.type == WAL_PUT) {
+                        mm_put(m, payload, payload + m->key_size);
+                } else {
+                        mm_delete(m, payload);
+                }
+                good += sizeof(rec) + len;
+        }
+        free(payload);
+
+        if (fseeko(fp, 0, SEEK_END) == 0 && ftello(fp) > good) {
+                fprintf(stderr, "mm_wal_open: %s: dropped %lld bytes after the last whole record\n",
+                        path, (long long)(ftello(fp) - good));
+        }
+        fclose(fp);
+        *end = good;
+        return 0;
+}
+
+// the base now written to tmp_path takes over, the old log goes
+static int install_base(map_wal_t *w)
+{
+        const char *failed = NULL;
+        if (rename(w->tmp_path, w->path) != 0) {
+                failed = w->tmp_path;
+        } else if (unlink(w->old_path) != 0 && errno != ENOENT) {
+                failed = w->old_path;
+        } else if (sync_dir(w->path) != 0) {
+                failed = w->path;
+        }
+        if (failed) {
+                fprintf(stderr, "mm_wal_compact: %s: %s\n", failed, strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+// a base image of the whole map, which holds both logs
+static int write_base(map_wal_t *w)
+{
+        if (mm_marshal_flags(w->tmp_path, w->m, MM_MARSHAL_FSYNC) != 0) {
+                fprintf(stderr, "mm_wal_compact: %s: write failed\n", w->tmp_path);
+                return -1;
+        }
+        return install_base(w);
+}
+
+static void *compactor_thread(void *arg)
+{
+        map_wal_t *w = arg;
+        int ret = mm_snapshot_marshal(w->tmp_path, w->snap, MM_MARSHAL_FSYNC);
+        mm_snapshot_release(w->snap);
+        if (ret != 0) {
+                fprintf(stderr, "mm_wal_compact: %s: write failed\n", w->tmp_path);
+        } else {
+                ret = install_base(w);
+        }
+        w->compact_err = ret;
+        __atomic_store_n(&w->compact_done, 1, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+static int join_compactor(map_wal_t *w)
+{
+        if (!w->compacting) {
+                return 0;
+        }
+        pthread_join(w->compactor, NULL);
+        w->compacting = false;
+        w->snap = NULL;
+        return w->compact_err;
+}
+
+static void free_wal(map_wal_t *w)
+{
+        if (w->fd >= 0) {
+                close(w->fd);
+        }
+        pthread_mutex_destroy(&w->mu);
+        pthread_cond_destroy(&w->wake);
+        pthread_cond_destroy(&w->flushed);
+        free(w->buf);
+        free(w->spare);
+        free(w->path);
+        free(w->log_path);
+        free(w->old_path);
+        free(w->tmp_path);
+        free(w);
+}
+
+int mm_wal_open(map_t *m, const char *path, const wal_opts_t *opts)
+{
+        if (m->engine == MAP_ENGINE_MAPPED || m->sync || m->varlen) {
+                fprintf(stderr, "mm_wal_open: only maps that are neither concurrent, "
+                        "variable-length nor mapped\n");
+                return -1;
+        }
+        if (m->wal) {
+                fprintf(stderr, "mm_wal_open: the map already has a log\n");
+                return -1;
+        }
+        map_wal_t *w;
+        NEW_INSTANCE(w, map_wal_t);
+        w->m = m;
+        w->fd = -1;
+        w->path = suffixed(path, "");
+        w->log_path = suffixed(path, ".log");
+        w->old_path = suffixed(path, ".log.old");
+        w->tmp_path = suffixed(path, ".tmp");
+        if (opts) {
+                w->opts = *opts;
+        } else {
+                w->opts.sync = WAL_SYNC_GROUP;
+        }
+        if (w->opts.interval_ms == 0) {
+                w->opts.interval_ms = WAL_DEFAULT_INTERVAL_MS;
+        }
+        if (w->opts.group_bytes == 0) {
+                w->opts.group_bytes = WAL_DEFAULT_GROUP_BYTES;
+        }
+        pthread_mutex_init(&w->mu, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        pthread_cond_init(&w->flushed, NULL);
+
+        // the old log outlives its compaction only if a crash cut it short
+        bool interrupted = access(w->old_path, F_OK) == 0;
+        off_t end = 0;
+        int ret = 0;
+        if (access(w->path, F_OK) == 0) {
+                ret = mm_unmarshal(w->path, m);
+        }
+        if (ret == 0 && interrupted) {
+                ret = replay(w, w->old_path, &end);
+        }
+        if (ret == 0) {
+                ret = replay(w, w->log_path, &end);
+        }
+        if (ret == 0) {
+                ret = open_log(w, end);
+        }
+        if (ret == 0 && interrupted) {
+                ret = write_base(w);
+        }
+        if (ret != 0) {
+                free_wal(w);
+                return -1;
+        }
+
+        if (w->opts.sync != WAL_SYNC_ALWAYS) {
+                if (pthread_create(&w->flusher, NULL, flusher_thread, w) != 0) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                w->has_flusher = true;
+        }
+        m->wal = w;
+        return 0;
+}
+
+int wal_log(map_wal_t *w, uint32_t type, const void *key, const void *value)
+{
+        map_t *m = w->m;
+        size_t len = m->key_size + (type == WAL_PUT ? m->value_size : 0);
+        size_t n = sizeof(wal_record_t) + len;
+
+        pthread_mutex_lock(&w->mu);
+        if (w->err) {
+                pthread_mutex_unlock(&w->mu);
+                return -1;
+        }
+        if (w->len + n > w->cap) {
+                w->cap = w->len + n > 2 * w->cap ? w->len + n : 2 * w->cap;
+                w->buf = realloc(w->buf, w->cap);
+                if (!w->buf) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+        char *p = w->buf + w->len;
+        wal_record_t rec = {
+                .type = type,
+        };
+        memcpy(p + sizeof(rec), key, m->key_size);
+        if (type == WAL_PUT) {
+                memcpy(p + sizeof(rec) + m->key_size, value, m->value_size);
+        }
+        rec.crc = record_crc(type, p + sizeof(rec), len);
+        memcpy(p, &rec, sizeof(rec));
+        w->len += n;
+        w->log_bytes += n;
+
+        int ret = 0;
+        if (w->opts.sync == WAL_SYNC_ALWAYS) {
+                ret = flush(w, true);
+        } else if (w->len >= w->opts.group_bytes) {
+                pthread_cond_signal(&w->wake);
+                // the disk is behind, hold the changes back before the
+                // buffer grows without bound
+                while (w->len >= WAL_MAX_GROUPS * w->opts.group_bytes && !w->err) {
+                        pthread_cond_wait(&w->flushed, &w->mu);
+                }
+                ret = w->err ? -1 : 0;
+        }
+        bool compact = ret == 0 && w->opts.compact_bytes && w->log_bytes >= w->opts.compact_bytes;
+        pthread_mutex_unlock(&w->mu);
+
+        // a compaction still running is left alone, the log is checked
+        // again on the next change
+        if (compact && (!w->compacting || __atomic_load_n(&w->compact_done, __ATOMIC_ACQUIRE))) {
+                ret = mm_wal_compact(m, false);
+        }
+        return ret;
+}
+
+int mm_wal_sync(map_t *m)
+{
+        map_wal_t *w = m->wal;
+        if (!w) {
+                fprintf(stderr, "mm_wal_sync: the map has no log\n");
+                return -1;
+        }
+        pthread_mutex_lock(&w->mu);
+        int ret = flush(w, true);
+        pthread_mutex_unlock(&w->mu);
+        return ret;
+}
+
+int mm_wal_compact(map_t *m, bool wait)
+{
+        map_wal_t *w = m->wal;
+        if (!w) {
+                fprintf(stderr, "mm_wal_compact: the map has no log\n");
+                return -1;
+        }
+        // a failed compaction left the old log, the next base must hold
+        // it, so it is written from the map and the log is kept
+        if (join_compactor(w) != 0 || access(w->old_path, F_OK) == 0) {
+                return write_base(w);
+        }
+
+        pthread_mutex_lock(&w->mu);
+        int ret = flush(w, true);
+        if (ret == 0 && rename(w->log_path, w->old_path) != 0) {
+                fprintf(stderr, "mm_wal_compact: %s: %s\n", w->log_path, strerror(errno));
+                ret = -1;
+        }
+        if (ret == 0) {
+                close(w->fd);
+                ret = open_log(w, 0);
+        }
+        pthread_mutex_unlock(&w->mu);
+        if (ret != 0) {
+                return -1;
+        }
+
+        // the snapshot holds the map as the old log left it
+        w->snap = m->engine == MAP_ENGINE_LINEAR ? mm_snapshot(m) : NULL;
+        if (!w->snap) {
+                return write_base(w);
+        }
+        w->compacting = true;
+        w->compact_done = 0;
+        if (pthread_create(&w->compactor, NULL, compactor_thread, w) != 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        return wait ? join_compactor(w) : 0;
+}
+
+int mm_wal_close(map_t *m)
+{
+        map_wal_t *w = m->wal;
+        if (!w) {
+                return 0;
+        }
+        int ret = join_compactor(w);
+        pthread_mutex_lock(&w->mu);
+        w->stop = true;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->mu);
+        if (w->has_flusher) {
+                pthread_join(w->flusher, NULL);
+        }
+        pthread_mutex_lock(&w->mu);
+        if (flush(w, true) != 0) {
+                ret = -1;
+        }
+        pthread_mutex_unlock(&w->mu);
+        m->wal = NULL;
+        free_wal(w);
+        return ret;
+}
+
+#ifdef TESTWAL
+// testing
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define NKEYS 20000
+
+static const char *path = "test.wal";
+
+// the value of every key, -1 for the absent ones
+static int expect[NKEYS];
+
+static void remove_files(const char *p)
+{
+        const char *suffixes[] = {"", ".log", ".log.old", ".tmp"};
+        for (int i = 0; i < 4; i++) {
+                char *f = suffixed(p, suffixes[i]);
+                unlink(f);
+                free(f);
+        }
+}
+
+static bool exists(const char *p, const char *suffix)
+{
+        char *f = suffixed(p, suffix);
+        bool ret = access(f, F_OK) == 0;
+        free(f);
+        return ret;
+}
+
+static off_t file_size(const char *p, const char *suffix)
+{
+        char *f = suffixed(p, suffix);
+        struct stat st;
+        assert(stat(f, &st) == 0);
+        free(f);
+        return st.st_size;
+}
+
+// puts, overwrites and deletes of the keys in [from, to)
+static void change(map_t *m, int from, int to, int round)
+{
+        for (int i = from; i < to; i++) {
+                int v = i + round;
+                assert(mm_put(m, &i, &v) == 0);
+                expect[i] = v;
+        }
+        for (int i = from + round % 3; i < to; i += 3) {
+                assert(mm_delete(m, &i));
+                expect[i] = -1;
+        }
+        int batch_keys[4] = {from, from + 1, from + 2, from};
+        int batch_values[4] = {round, round, round, round + 1};
+        assert(mm_put_batch(m, batch_keys, batch_values, 4) == 0);
+        expect[from] = round + 1;
+        expect[from + 1] = expect[from + 2] = round;
+}
+
+static void check(map_t *m)
+{
+        size_t n = 0;
+        for (int i = 0; i < NKEYS; i++) {
+                int v;
+                if (expect[i] < 0) {
+                        assert(!mm_haskey(m, &i));
+                        continue;
+                }
+                assert(mm_get(m, &i, &v) && v == expect[i]);
+                n++;
+        }
+        assert(m->used == n);
+}
+
+// a new map from the files at p, checked against expect
+static void reopen(const char *p, const map_opts_t *opts)
+{
+        map_t *m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, opts);
+        assert(mm_wal_open(m, p, NULL) == 0);
+        check(m);
+        assert(delete_map(m) == 0);
+}
+
+static void reset()
+{
+        remove_files(path);
+        memset(expect, 0xff, sizeof(expect));
+}
+
+int main(int argc, char *argv[])
+{
+        printf("=== RUN Recovery Test ===\n");
+        wal_sync_t policies[] = {WAL_SYNC_NONE, WAL_SYNC_GROUP, WAL_SYNC_ALWAYS};
+        for (int p = 0; p < 3; p++) {
+                reset();
+                wal_opts_t opts = {
+                        .sync = policies[p],
+                        .group_bytes = 4096,
+                };
+                // an fsync per change is slow, fewer of them
+                int n = policies[p] == WAL_SYNC_ALWAYS ? NKEYS / 20 : NKEYS;
+                map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+                assert(mm_wal_open(m, path, &opts) == 0);
+                change(m, 0, n, 1);
+                change(m, n / 2, n, 2);
+                assert(mm_wal_sync(m) == 0);
+                assert(delete_map(m) == 0);
+                assert(!exists(path, "") && exists(path, ".log"));
+                reopen(path, NULL);
+        }
+        // replaying left the log as it was, a second recovery agrees
+        reopen(path, NULL);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Crash Test ===\n");
+        for (int p = 1; p < 3; p++) {
+                reset();
+                wal_opts_t opts = {
+                        .sync = policies[p],
+                };
+                int n = policies[p] == WAL_SYNC_ALWAYS ? NKEYS / 20 : NKEYS;
+                // what the child is going to do
+                map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+                change(m, 0, n, 1);
+                delete_map(m);
+                pid_t pid = fork();
+                if (pid == 0) {
+                        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+                        assert(mm_wal_open(m, path, &opts) == 0);
+                        change(m, 0, n, 1);
+                        if (policies[p] == WAL_SYNC_GROUP) {
+                                mm_wal_sync(m);
+                        }
+                        // no close, nothing more is flushed
+                        _exit(0);
+                }
+                int status;
+                assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status));
+                reopen(path, NULL);
+        }
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Torn Log Test ===\n");
+        reset();
+        map_t *m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_wal_open(m, path, NULL) == 0);
+        change(m, 0, NKEYS, 1);
+        assert(delete_map(m) == 0);
+        off_t whole = file_size(path, ".log");
+        // half a record, as a crash in the middle of a write leaves it
+        char *log_path = suffixed(path, ".log");
+        FILE *fp = fopen(log_path, "ab");
+        wal_record_t rec = {
+                .crc = 1,
+                .type = WAL_PUT,
+        };
+        fwrite(&rec, sizeof(rec), 1, fp);
+        fwrite(&rec, 2, 1, fp);
+        fclose(fp);
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_wal_open(m, path, NULL) == 0);
+        check(m);
+        assert(file_size(path, ".log") == whole);
+        change(m, NKEYS / 2, NKEYS, 2);
+        assert(delete_map(m) == 0);
+        reopen(path, NULL);
+        // a flipped bit ends the replay at its record
+        fp = fopen(log_path, "r+b");
+        fseek(fp, whole - 1, SEEK_SET);
+        int last = fgetc(fp);
+        fseek(fp, whole - 1, SEEK_SET);
+        fputc(last ^ 1, fp);
+        fclose(fp);
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_wal_open(m, path, NULL) == 0);
+        // deleted by the first changes, put back by the lost ones
+        int k = NKEYS / 2;
+        assert(!mm_haskey(m, &k));
+        assert(file_size(path, ".log") == whole - sizeof(rec) - 2 * sizeof(int));
+        assert(delete_map(m) == 0);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Compaction Test ===\n");
+        map_opts_t flat = {
+                .engine = MAP_ENGINE_FLAT,
+        };
+        map_opts_t *engines[] = {NULL, &flat};
+        for (int e = 0; e < 2; e++) {
+                reset();
+                m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, engines[e]);
+                assert(mm_wal_open(m, path, NULL) == 0);
+                change(m, 0, NKEYS, 1);
+                assert(mm_wal_compact(m, false) == 0);
+                // changes go on while the snapshot is written
+                change(m, 0, NKEYS / 2, 2);
+                assert(mm_wal_compact(m, true) == 0);
+                assert(exists(path, "") && !exists(path, ".log.old") && !exists(path, ".tmp"));
+                assert(file_size(path, ".log") == sizeof(wal_header_t));
+                change(m, NKEYS / 4, NKEYS, 3);
+                assert(mm_wal_compact(m, false) == 0);
+                change(m, 0, NKEYS / 4, 4);
+                assert(delete_map(m) == 0);
+                assert(!exists(path, ".log.old"));
+                reopen(path, engines[e]);
+        }
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Auto Compaction Test ===\n");
+        // the log the same changes leave without compaction
+        reset();
+        wal_opts_t small = {
+                .sync = WAL_SYNC_NONE,
+        };
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_wal_open(m, path, &small) == 0);
+        for (int round = 1; round < 5; round++) {
+                change(m, 0, NKEYS, round);
+        }
+        assert(delete_map(m) == 0);
+        off_t full = file_size(path, ".log");
+
+        // how far the log gets past the threshold depends on how fast
+        // the snapshots are written, but the first compaction starts
+        // right at it
+        reset();
+        small.compact_bytes = 64 << 10;
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_wal_open(m, path, &small) == 0);
+        for (int round = 1; round < 5; round++) {
+                change(m, 0, NKEYS, round);
+        }
+        assert(delete_map(m) == 0);
+        assert(exists(path, "") && file_size(path, ".log") <= full - (off_t)small.compact_bytes);
+        reopen(path, NULL);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Interrupted Compaction Test ===\n");
+        // a crash after the log was set aside, before the base took it
+        // in: base, old log and a newer log all count
+        reset();
+        const char *other = "test.wal2";
+        remove_files(other);
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_wal_open(m, path, NULL) == 0);
+        change(m, 0, NKEYS, 1);
+        assert(mm_wal_compact(m, true) == 0);
+        change(m, 0, NKEYS / 2, 2);
+        assert(delete_map(m) == 0);
+        char *old_path = suffixed(path, ".log.old");
+        assert(rename(log_path, old_path) == 0);
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        for (int i = 0; i < NKEYS; i++) {
+                if (expect[i] >= 0) {
+                        mm_put(m, &i, &expect[i]);
+                }
+        }
+        assert(mm_wal_open(m, other, NULL) == 0);
+        change(m, NKEYS / 4, NKEYS, 3);
+        assert(delete_map(m) == 0);
+        char *other_log = suffixed(other, ".log");
+        assert(rename(other_log, log_path) == 0);
+        remove_files(other);
+        reopen(path, NULL);
+        assert(!exists(path, ".log.old"));
+        // the new base holds the log as well, which replays over it
+        reopen(path, NULL);
+        free(other_log);
+        free(old_path);
+        printf("--- PASS ---\n");
+
+        printf("=== RUN Bad Log Test ===\n");
+        map_opts_t conc = {
+                .concurrent = true,
+        };
+        m = make_map_opts(sizeof(int), sizeof(int), NULL, NULL, &conc);
+        assert(mm_wal_open(m, path, NULL) == -1);
+        delete_map(m);
+        m = make_map(sizeof(int), sizeof(long), NULL, NULL);
+        assert(mm_wal_open(m, path, NULL) == -1);
+        assert(mm_wal_sync(m) == -1 && mm_wal_compact(m, true) == -1);
+        delete_map(m);
+        m = make_map(sizeof(int), sizeof(int), NULL, NULL);
+        assert(mm_wal_open(m, path, NULL) == 0);
+        assert(mm_wal_open(m, path, NULL) == -1);
+        assert(mm_wal_close(m) == 0 && m->wal == NULL);
+        delete_map(m);
+        free(log_path);
+        reset();
+        printf("--- PASS ---\n");
+        return 0;
+}
+
+#endif